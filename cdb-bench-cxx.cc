@@ -0,0 +1,204 @@
+/* cdb-bench-cxx.cc: lookups through the C API and through cdb.hpp
+ *
+ * Builds a database of random records with tinycdb::builder, then
+ * measures the same random lookups done by cdb_find() + cdb_read(),
+ * by cdb_find() + cdb_getdata(), and by tinycdb::reader with either
+ * backend.  When built as C++20, the same lookups are also done by
+ * cdb_findv() and by tinycdb::interleaver with fixed and adaptive group
+ * sizes.  Results are printed like cdb-bench does, one per line, as
+ *   name<TAB>value<TAB>unit
+ *
+ * This file is a part of tinycdb package by Michael Tokarev, mjt@corpit.ru.
+ * Public domain.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <unistd.h>
+#include "cdb.hpp"
+
+static unsigned nrec = 1000000, nq = 2000000;
+static unsigned long long seed = 1;
+static const char *dbname = "cdb-bench-cxx.cdb";
+
+static unsigned long long
+rnd(unsigned long long *s)
+{
+  unsigned long long z = (*s += 0x9e3779b97f4a7c15ULL);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+static double
+now()
+{
+  return std::chrono::duration<double>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void
+result(const char *name, double value, const char *unit)
+{
+  printf("%s\t%.*f\t%s\n", name, value < 100 ? 2 : 0, value, unit);
+  fflush(stdout);
+}
+
+static std::string
+key(unsigned i)
+{
+  char b[32];
+  return std::string(b, sprintf(b, "key-%08x-%u", i * 2654435761u, i));
+}
+
+/* every lookup adds up value bytes, so none can be optimized away */
+template <class F>
+static void
+bench(const char *name, const std::vector<std::string> &qv, F lookup)
+{
+  unsigned long long sum = 0;
+  double t = now();
+  for (const std::string &k : qv)
+    sum += lookup(k);
+  t = now() - t;
+  result(name, qv.size() / t, "ops/s");
+  if (!sum)
+    fprintf(stderr, "%s: nothing found\n", name);
+}
+
+int
+main(int argc, char **argv)
+{
+  unsigned long long s = seed;
+  std::vector<std::string> hits, misses;
+  unsigned i;
+  int opt;
+
+  while((opt = getopt(argc, argv, "n:q:f:h")) != EOF)
+    switch(opt) {
+    case 'n': nrec = strtoul(optarg, NULL, 0); break;
+    case 'q': nq = strtoul(optarg, NULL, 0); break;
+    case 'f': dbname = optarg; break;
+    default:
+      printf("cdb-bench-cxx: Usage is: cdb-bench-cxx [-n records] [-q queries] [-f dbfile]\n");
+      return opt == 'h' ? 0 : 2;
+    }
+  if (!nrec || !nq) {
+    fprintf(stderr, "cdb-bench-cxx: invalid number of records or queries\n");
+    return 2;
+  }
+
+  printf("# cdb-bench-cxx version %g\n", TINYCDB_VERSION);
+  printf("# options -n %u -q %u\n", nrec, nq);
+
+  try {
+    {
+      std::string val;
+      tinycdb::builder b{std::string(dbname)};
+      double t = now();
+      for (i = 0; i < nrec; ++i) {
+        val.assign(rnd(&s) % 100, 'a' + i % 26);
+        b.add(key(i), val);
+      }
+      b.finish();
+      result("cxx.build", nrec / (now() - t), "records/s");
+    }
+    for (i = 0; i < nq; ++i) {
+      hits.push_back(key(rnd(&s) % nrec));
+      misses.push_back(key(nrec + i));
+    }
+
+    tinycdb::reader<tinycdb::mmap_backend> rm(dbname);
+    tinycdb::reader<tinycdb::file_backend> rf(dbname);
+    struct cdb *cp = rf.handle();
+    std::vector<char> buf(65536);
+
+    bench("c.find+read", hits, [&](const std::string &k) {
+      if (cdb_find(cp, k.data(), k.size()) <= 0)
+        return 0u;
+      cdb_readdata(cp, buf.data());
+      return cdb_datalen(cp) + 1;
+    });
+    bench("c.find+get", hits, [&](const std::string &k) {
+      if (cdb_find(cp, k.data(), k.size()) <= 0)
+        return 0u;
+      return (unsigned)((const char*)cdb_getdata(cp))[0] + cdb_datalen(cp) + 1;
+    });
+    bench("cxx.file.find", hits, [&](const std::string &k) {
+      auto v = rf.find(k);
+      return v ? (unsigned)v->size() + 1 : 0u;
+    });
+    bench("cxx.mmap.find", hits, [&](const std::string &k) {
+      auto v = rm.find(k);
+      return v ? (unsigned)v->size() + 1 : 0u;
+    });
+    bench("c.miss", misses, [&](const std::string &k) {
+      return (unsigned)cdb_find(cp, k.data(), k.size()) + 1;
+    });
+    bench("cxx.mmap.miss", misses, [&](const std::string &k) {
+      return (unsigned)rm.contains(k) + 1;
+    });
+
+#ifdef TINYCDB_COROUTINES
+    {
+      std::vector<struct cdb_query> qv(hits.size());
+      unsigned long long sum = 0;
+      double t;
+      for (i = 0; i < hits.size(); ++i) {
+        qv[i].key = hits[i].data();
+        qv[i].klen = hits[i].size();
+      }
+      t = now();
+      for (i = 0; i < qv.size(); i += 256)
+        sum += cdb_findv(cp, &qv[i], qv.size() - i < 256 ? qv.size() - i : 256);
+      result("c.findv", qv.size() / (now() - t), "ops/s");
+      if (!sum)
+        fprintf(stderr, "c.findv: nothing found\n");
+    }
+    for (unsigned g : {0u, 1u, 4u, 8u, 16u, 32u}) {
+      tinycdb::interleaver il(rm, g);
+      unsigned long long sum = 0;
+      char name[64];
+      double t = now();
+      il.find(hits, [&](std::size_t, std::optional<std::string_view> v) {
+        sum += v ? v->size() + 1 : 0;
+      });
+      t = now() - t;
+      if (g)
+        sprintf(name, "cxx.interleaved.%u", g);
+      else
+        sprintf(name, "cxx.interleaved.adaptive(%u)", il.group());
+      result(name, hits.size() / t, "ops/s");
+      if (!sum)
+        fprintf(stderr, "%s: nothing found\n", name);
+    }
+#endif
+
+    {
+      unsigned cpos, n = 0;
+      unsigned long long bytes = 0;
+      double t = now();
+      cdb_seqinit(&cpos, cp);
+      while(cdb_seqnext(&cpos, cp) > 0)
+        ++n, bytes += cdb_datalen(cp);
+      result("c.seqnext", n / (now() - t), "records/s");
+      n = 0;
+      t = now();
+      for (const auto &r : rm.records())
+        ++n, bytes += r.second.size();
+      result("cxx.mmap.records", n / (now() - t), "records/s");
+      if (!bytes)
+        fprintf(stderr, "no records\n");
+    }
+  }
+  catch(const std::exception &e) {
+    fprintf(stderr, "cdb-bench-cxx: %s\n", e.what());
+    return 111;
+  }
+  unlink(dbname);
+  return 0;
+}
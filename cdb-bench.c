@@ -0,0 +1,938 @@
+/* cdb-bench.c: cdb benchmark program
+ *
+ * Generates a synthetic dataset, builds a database from it and measures
+ * build throughput, lookup latency and scan rates.  Results are printed
+ * one per line, as
+ *   name<TAB>value<TAB>unit
+ * after a few comment lines (starting with #) describing the run, so
+ * they can be collected and compared between versions and backends.
+ *
+ * With -S, it measures a running `cdb -S' server instead, which should
+ * serve a database made by cdb-bench -K with the same options, and with
+ * -S -r it just sends standard input to the server and prints the
+ * answers, for tests.  With -m, it measures map format parsing.
+ *
+ * This file is a part of tinycdb package by Michael Tokarev, mjt@corpit.ru.
+ * Public domain.
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include "cdb.h"
+#include "maptok.h"
+
+#define FILLER  (1 << 20)  /* values are taken from a random buffer */
+#define NPUT    4          /* number of cdb_make_put() modes measured */
+#define VPIECE  1024       /* cdb_make_addv() gets values in pieces this big */
+
+struct dist {        /* size distribution */
+  unsigned min, max;
+  int skew;          /* skewed towards min, or else uniform */
+};
+
+struct rec {
+  unsigned koff, klen;  /* key in keys[] */
+  unsigned voff, vlen;  /* value in filler[] */
+};
+
+static const char *progname = "cdb-bench";
+static unsigned long long seed = 1;
+static struct dist kdist = { 8, 32, 0 }, vdist = { 0, 100, 0 };
+static unsigned nrec = 1000000, nput = 10000, nq = 1000000;
+static unsigned dups = 10;  /* percent */
+static unsigned maxthreads = 4;
+static int locked;
+static int fixkey;  /* build in CDB_FMT_FIXKEY format */
+static int compact;  /* let cdb_make_finish() pick the format */
+static unsigned hashfn;  /* CDB_HASH_xxx */
+static unsigned ntables, load;  /* cdb_make_tables() arguments */
+static const char *const hashnames[] = {
+  "default", "xxh64", "siphash", "halfsiphash"
+};
+static const char *dbname = "cdb-bench.cdb";
+
+static struct rec *recs;
+static unsigned char *keys, *filler;
+static unsigned nkeys;           /* distinct keys in the dataset */
+static struct cdb_query *hits, *misses;
+
+static void
+#ifdef __GNUC__
+__attribute__((noreturn,format(printf,2,3)))
+#endif
+error(int errnum, const char *fmt, ...)
+{
+  va_list ap;
+  fprintf(stderr, "%s: ", progname);
+  va_start(ap, fmt);
+  vfprintf(stderr, fmt, ap);
+  va_end(ap);
+  if (errnum)
+    fprintf(stderr, ": %s", strerror(errnum));
+  putc('\n', stderr);
+  exit(errnum ? 111 : 2);
+}
+
+static void *
+xmalloc(size_t len)
+{
+  void *p = malloc(len ? len : 1);
+  if (!p)
+    error(ENOMEM, "unable to allocate %lu bytes", (unsigned long)len);
+  return p;
+}
+
+static double
+now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void
+result(const char *name, double value, const char *unit)
+{
+  printf("%s\t%.*f\t%s\n", name, value < 100 ? 2 : 0, value, unit);
+  fflush(stdout);
+}
+
+/* splitmix64 */
+static unsigned long long
+rnd(unsigned long long *s)
+{
+  unsigned long long z = (*s += 0x9e3779b97f4a7c15ULL);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+static unsigned
+pick(const struct dist *d, unsigned long long *s)
+{
+  unsigned long long r = rnd(s);
+  unsigned range = d->max - d->min + 1;
+  if (d->skew) { /* cube of a uniform [0,1): most values are small */
+    unsigned long long u = r & 0xffff;
+    return d->min + (unsigned)((u * u >> 16) * u * range >> 32);
+  }
+  return range ? d->min + (unsigned)(r % range) : d->min;
+}
+
+/* 32-bit bijection, so keys built from it are unique */
+static unsigned
+mix32(unsigned x)
+{
+  x ^= (unsigned)seed;
+  x ^= x >> 16; x *= 0x7feb352dU;
+  x ^= x >> 15; x *= 0x846ca68bU;
+  x ^= x >> 16;
+  return x;
+}
+
+/* key number i: 4 bytes of mix32(i), then pseudo-random letters */
+static unsigned
+genkey(unsigned i, unsigned char *k)
+{
+  unsigned long long s = seed ^ ((unsigned long long)i << 32);
+  unsigned long long r = 0;
+  unsigned len = pick(&kdist, &s), x = mix32(i), j;
+  k[0] = x; k[1] = x >> 8; k[2] = x >> 16; k[3] = x >> 24;
+  for (j = 4; j < len; ++j, r >>= 8) {
+    if (!((j - 4) & 7))
+      r = rnd(&s);
+    k[j] = 'a' + (r & 15);
+  }
+  return len;
+}
+
+static void
+gendata(void)
+{
+  unsigned long long s = seed;
+  unsigned long long klen = 0, vlen = 0;
+  unsigned *knum = (unsigned*)xmalloc(nrec * sizeof(*knum));
+  unsigned i;
+  double t = now();
+
+  filler = (unsigned char*)xmalloc(FILLER + vdist.max);
+  for (i = 0; i < FILLER + vdist.max; ++i)
+    filler[i] = 'A' + rnd(&s) % 26;
+
+  /* which key every record has: a new one, or (dups% of the time) one
+   * of the keys seen before */
+  nkeys = 0;
+  for (i = 0; i < nrec; ++i)
+    knum[i] = nkeys && rnd(&s) % 100 < dups ? rnd(&s) % nkeys : nkeys++;
+
+  keys = (unsigned char*)xmalloc((size_t)nkeys * kdist.max);
+  recs = (struct rec*)xmalloc(nrec * sizeof(*recs));
+  for (i = 0; i < nrec; ++i) {
+    struct rec *r = &recs[i];
+    unsigned char *k = keys + (size_t)knum[i] * kdist.max;
+    r->koff = knum[i] * kdist.max;
+    r->klen = genkey(knum[i], k);
+    r->vlen = pick(&vdist, &s);
+    r->voff = rnd(&s) % FILLER;
+    klen += r->klen;
+    vlen += r->vlen;
+  }
+  free(knum);
+
+  /* queries: random existing keys, and keys which are not there */
+  hits = (struct cdb_query*)xmalloc(nq * sizeof(*hits));
+  misses = (struct cdb_query*)xmalloc(nq * sizeof(*misses));
+  for (i = 0; i < nq; ++i) {
+    unsigned k = rnd(&s) % nkeys;
+    hits[i].key = keys + (size_t)k * kdist.max;
+    hits[i].klen = genkey(k, keys + (size_t)k * kdist.max);
+  }
+  {
+    unsigned char *mk = (unsigned char*)xmalloc((size_t)nq * kdist.max);
+    for (i = 0; i < nq; ++i) {
+      misses[i].key = mk + (size_t)i * kdist.max;
+      misses[i].klen = genkey(nkeys + i, mk + (size_t)i * kdist.max);
+    }
+  }
+
+  printf("# records %u keys %u klen-avg %.1f vlen-avg %.1f\n",
+         nrec, nkeys, (double)klen / nrec, (double)vlen / nrec);
+  result("gen.time", (now() - t) * 1e3, "ms");
+}
+
+static int
+createdb(struct cdb_make *cdbmp, const char *name)
+{
+  int fd;
+  unlink(name);
+  if ((fd = open(name, O_RDWR|O_CREAT|O_TRUNC, 0644)) < 0)
+    error(errno, "unable to create %s", name);
+  if (cdb_make_start(cdbmp, fd) != 0)
+    error(errno, "cdb_make_start");
+  if (fixkey && cdb_make_fixkey(cdbmp, kdist.min) != 0)
+    error(errno, "cdb_make_fixkey");
+  if (compact)
+    cdb_make_compact(cdbmp);
+  if (hashfn && cdb_make_hash(cdbmp, hashfn, "cdb-bench hkey 0") != 0)
+    error(errno, "cdb_make_hash");
+  if ((ntables || load) && cdb_make_tables(cdbmp, ntables, load) != 0)
+    error(errno, "cdb_make_tables");
+  return fd;
+}
+
+static void
+bench_build(void)
+{
+  static const struct { const char *name; enum cdb_put_mode mode; }
+  modes[NPUT] = {
+    { "build.put.insert", CDB_PUT_INSERT },
+    { "build.put.replace", CDB_PUT_REPLACE },
+    { "build.put.replace0", CDB_PUT_REPLACE0 },
+    { "build.put.warn", CDB_PUT_WARN },
+  };
+  struct cdb_make cdbm;
+  unsigned long long bytes = 0;
+  unsigned i, m, n;
+  double t, t1;
+  struct stat st;
+  int fd;
+
+  for (m = 0; m < NPUT; ++m) {
+    n = nput < nrec ? nput : nrec;
+    fd = createdb(&cdbm, dbname);
+    t = now();
+    for (i = 0; i < n; ++i)
+      if (cdb_make_put(&cdbm, keys + recs[i].koff, recs[i].klen,
+                       filler + recs[i].voff, recs[i].vlen,
+                       modes[m].mode) < 0)
+        error(errno, "cdb_make_put");
+    if (cdb_make_finish(&cdbm) != 0)
+      error(errno, "cdb_make_finish");
+    result(modes[m].name, n / (now() - t), "records/s");
+    close(fd);
+  }
+
+  /* the database used by all the rest */
+  fd = createdb(&cdbm, dbname);
+  t = now();
+  for (i = 0; i < nrec; ++i) {
+    if (cdb_make_add(&cdbm, keys + recs[i].koff, recs[i].klen,
+                     filler + recs[i].voff, recs[i].vlen) != 0)
+      error(errno, "cdb_make_add");
+    bytes += 8 + recs[i].klen + recs[i].vlen;
+  }
+  t1 = now();
+  if (cdb_make_finish(&cdbm) != 0)
+    error(errno, "cdb_make_finish");
+  result("build.add", nrec / (t1 - t), "records/s");
+  result("build.add.bw", bytes / (t1 - t) / 1048576, "MB/s");
+  result("build.finish", (now() - t1) * 1e3, "ms");
+  if (fstat(fd, &st) != 0)
+    error(errno, "fstat");
+  result("db.size", st.st_size, "bytes");
+  close(fd);
+}
+
+/* 0 if the two files have the same content */
+static int
+cmpfiles(const char *a, const char *b)
+{
+  static unsigned char ba[65536], bb[65536];
+  int fa = open(a, O_RDONLY), fb = open(b, O_RDONLY);
+  int la, lb, r = -1;
+  if (fa < 0 || fb < 0)
+    error(errno, "unable to open %s", fa < 0 ? a : b);
+  do {
+    la = read(fa, ba, sizeof(ba));
+    lb = read(fb, bb, sizeof(bb));
+    if (la < 0 || lb < 0)
+      error(errno, "unable to read %s", la < 0 ? a : b);
+  } while(la == lb && (r = memcmp(ba, bb, la)) == 0 && la);
+  close(fa);
+  close(fb);
+  return la != lb || r;
+}
+
+/* the same database once again, with the values given to
+ * cdb_make_addv() in VPIECE pieces: large ones are written by
+ * writev() without going through the buffer, and the result
+ * should be exactly the same */
+static void
+bench_addv(void)
+{
+  struct cdb_make cdbm;
+  struct iovec *iov = (struct iovec*)
+    xmalloc((vdist.max / VPIECE + 1) * sizeof(*iov));
+  char *name = (char*)xmalloc(strlen(dbname) + 3);
+  unsigned i, n, l;
+  unsigned char *v;
+  double t;
+  int fd;
+
+  sprintf(name, "%s.v", dbname);
+  fd = createdb(&cdbm, name);
+  t = now();
+  for (i = 0; i < nrec; ++i) {
+    v = filler + recs[i].voff;
+    for (n = 0, l = recs[i].vlen; l > VPIECE; ++n, v += VPIECE, l -= VPIECE) {
+      iov[n].iov_base = v;
+      iov[n].iov_len = VPIECE;
+    }
+    iov[n].iov_base = v;
+    iov[n++].iov_len = l;
+    if (cdb_make_addv(&cdbm, keys + recs[i].koff, recs[i].klen, iov, n) != 0)
+      error(errno, "cdb_make_addv");
+  }
+  result("build.addv", nrec / (now() - t), "records/s");
+  if (cdb_make_finish(&cdbm) != 0)
+    error(errno, "cdb_make_finish");
+  close(fd);
+  if (cmpfiles(dbname, name) != 0)
+    error(0, "%s built by cdb_make_addv() differs from %s", name, dbname);
+  unlink(name);
+  free(name);
+  free(iov);
+}
+
+static void
+opendb(struct cdb *cdbp)
+{
+  int fd = open(dbname, O_RDONLY);
+  if (fd < 0 || (locked ? cdb_init_locked(cdbp, fd) : cdb_init(cdbp, fd)))
+    error(errno, "unable to open %s", dbname);
+}
+
+static void
+closedb(struct cdb *cdbp)
+{
+  int fd = cdb_fileno(cdbp);
+  cdb_free(cdbp);
+  close(fd);
+}
+
+static int
+cmpuns(const void *a, const void *b)
+{
+  unsigned x = *(const unsigned*)a, y = *(const unsigned*)b;
+  return x < y ? -1 : x > y;
+}
+
+/* per-lookup latency of cdb_find(), including the clock overhead */
+static void
+bench_latency(struct cdb *cdbp, const char *name,
+              const struct cdb_query *qv, int expect)
+{
+  static const struct { const char *sfx; unsigned pm; } pct[] = {
+    { "p50", 500 }, { "p90", 900 }, { "p99", 990 }, { "p999", 999 },
+  };
+  unsigned *lat = (unsigned*)xmalloc(nq * sizeof(*lat));
+  char buf[64];
+  unsigned i;
+  double t, t0, tot = 0;
+  int r;
+
+  t = now();
+  for (i = 0; i < nq; ++i) {
+    t0 = t;
+    r = cdb_find(cdbp, qv[i].key, qv[i].klen);
+    t = now();
+    if (r != expect)
+      error(r < 0 ? errno : 0, "%s: unexpected cdb_find() result", name);
+    lat[i] = (unsigned)((t - t0) * 1e9);
+    tot += t - t0;
+  }
+  qsort(lat, nq, sizeof(*lat), cmpuns);
+  sprintf(buf, "%s.rate", name);
+  result(buf, nq / tot, "ops/s");
+  for (i = 0; i < sizeof(pct) / sizeof(pct[0]); ++i) {
+    sprintf(buf, "%s.%s", name, pct[i].sfx);
+    result(buf, lat[(unsigned long long)nq * pct[i].pm / 1000], "ns");
+  }
+  sprintf(buf, "%s.max", name);
+  result(buf, lat[nq - 1], "ns");
+  free(lat);
+}
+
+static void
+bench_findv(struct cdb *cdbp)
+{
+  struct cdb_query *qv = (struct cdb_query*)xmalloc(nq * sizeof(*qv));
+  double t;
+  memcpy(qv, hits, nq * sizeof(*qv));
+  t = now();
+  if (cdb_findv(cdbp, qv, nq) != (int)nq)
+    error(errno, "cdb_findv");
+  result("findv.rate", nq / (now() - t), "ops/s");
+  free(qv);
+}
+
+/* hash table behaviour, if the library collects lookup statistics */
+static void
+bench_stats(struct cdb *cdbp)
+{
+  struct cdb_stats st;
+  unsigned i;
+  memset(&st, 0, sizeof(st));
+  if (cdb_stats_attach(cdbp, &st) != 0)
+    return;
+  for (i = 0; i < nq; ++i)
+    cdb_find(cdbp, hits[i].key, hits[i].klen);
+  for (i = 0; i < nq; ++i)
+    cdb_find(cdbp, misses[i].key, misses[i].klen);
+  cdb_stats_attach(cdbp, NULL);
+  result("stats.probes.avg", (double)st.probes / st.lookups, "slots/lookup");
+  result("stats.collisions", (double)st.collisions / st.lookups, "/lookup");
+  result("stats.bytes", (double)(st.bytes[0] + st.bytes[1] + st.bytes[2])
+         / st.lookups, "bytes/lookup");
+  for (i = 0; i < CDB_STATS_NPROBE; ++i)
+    if (st.probehist[i]) {
+      char buf[64];
+      sprintf(buf, "stats.probes.%u%s", i, i == CDB_STATS_NPROBE-1 ? "+" : "");
+      result(buf, st.probehist[i], "lookups");
+    }
+}
+
+static void
+bench_scan(struct cdb *cdbp)
+{
+  struct cdb_find cf;
+  unsigned long long bytes = 0;
+  unsigned i, n = 0, cpos;
+  double t = now();
+  int r;
+
+  for (i = 0; i < nq; ++i) {
+    if (cdb_findinit(&cf, cdbp, hits[i].key, hits[i].klen) <= 0)
+      error(errno, "cdb_findinit");
+    while((r = cdb_findnext(&cf)) > 0)
+      ++n;
+    if (r < 0)
+      error(errno, "cdb_findnext");
+  }
+  result("findnext.rate", n / (now() - t), "records/s");
+
+  n = 0;
+  t = now();
+  cdb_seqinit(&cpos, cdbp);
+  while((r = cdb_seqnext(&cpos, cdbp)) > 0) {
+    ++n;
+    bytes += 8 + cdb_keylen(cdbp) + cdb_datalen(cdbp);
+  }
+  if (r < 0 || n != nrec)
+    error(r < 0 ? errno : 0, "cdb_seqnext");
+  t = now() - t;
+  result("seqnext.rate", n / t, "records/s");
+  result("seqnext.bw", bytes / t / 1048576, "MB/s");
+}
+
+struct worker {
+  pthread_t tid;
+  unsigned first;
+};
+
+static void *
+worker(void *arg)
+{
+  struct worker *w = (struct worker*)arg;
+  struct cdb c;
+  unsigned i, k;
+  opendb(&c);
+  for (i = 0, k = w->first; i < nq; ++i, k = k + 1 < nq ? k + 1 : 0)
+    if (cdb_find(&c, hits[k].key, hits[k].klen) <= 0)
+      error(errno, "cdb_find");
+  closedb(&c);
+  return NULL;
+}
+
+/* lookup scaling: every thread has its own handle and does nq lookups */
+static void
+bench_threads(void)
+{
+  struct worker *w = (struct worker*)xmalloc(maxthreads * sizeof(*w));
+  char buf[64];
+  unsigned n, i;
+  double t;
+  int r;
+
+  for (n = 1; ; n = n * 2 < maxthreads ? n * 2 : maxthreads) {
+    t = now();
+    for (i = 0; i < n; ++i) {
+      w[i].first = (unsigned long long)nq * i / n;
+      if ((r = pthread_create(&w[i].tid, NULL, worker, &w[i])) != 0)
+        error(r, "unable to create thread");
+    }
+    for (i = 0; i < n; ++i)
+      pthread_join(w[i].tid, NULL);
+    sprintf(buf, "find.threads.%u", n);
+    result(buf, (double)nq * n / (now() - t), "ops/s");
+    if (n == maxthreads)
+      break;
+  }
+  free(w);
+}
+
+/* -m: map format parsing, the first part of cdb -c -m.  The dataset is
+ * written as "key value" lines (with the binary start of keys in hex)
+ * and split into records by maptok(), and, for comparison, by the
+ * fgets()-based parser cdb used before it. */
+
+static int mapmode;
+static volatile unsigned long long mapsink;
+
+static void
+mapcount(void *arg, const unsigned char *key, unsigned klen,
+         const unsigned char *val, unsigned vlen)
+{
+  ++*(unsigned long long*)arg;
+  mapsink += klen + vlen;
+}
+
+static unsigned long long
+mapfgets(char *text, size_t len)
+{
+  FILE *f = fmemopen(text, len, "r");
+  unsigned blen = 512, l;
+  char *buf = (char*)xmalloc(blen), *k, *v;
+  unsigned long long n = 0;
+  if (!f)
+    error(errno, "fmemopen");
+  while(fgets(buf, blen, f) != NULL) {
+    for (l = 0; ; ) {
+      l += strlen(buf + l);
+      v = buf + l;
+      if (v > buf && v[-1] == '\n') {
+        v[-1] = '\0';
+        break;
+      }
+      if (l + 1 >= blen && !(buf = (char*)realloc(buf, blen = l + 512)))
+        error(ENOMEM, "unable to allocate %u bytes", blen);
+      if (!fgets(buf + l, blen - l, f))
+        break;
+    }
+    k = buf;
+    while(*k == ' ' || *k == '\t') ++k;
+    if (!*k || *k == '#')
+      continue;
+    v = k;
+    while(*v && *v != ' ' && *v != '\t') ++v;
+    if (*v) *v++ = '\0';
+    while(*v == ' ' || *v == '\t') ++v;
+    ++n;
+    mapsink += strlen(k) + strlen(v);
+  }
+  fclose(f);
+  free(buf);
+  return n;
+}
+
+static void
+bench_map(void)
+{
+  size_t len = 0;
+  unsigned char *text, *p, *k;
+  unsigned long long n;
+  unsigned i;
+  double t;
+
+  for (i = 0; i < nrec; ++i)
+    len += recs[i].klen + 4 + 1 + recs[i].vlen + 1;
+  p = text = (unsigned char*)xmalloc(len);
+  for (i = 0; i < nrec; ++i) {
+    k = keys + recs[i].koff;
+    p += sprintf((char*)p, "%02x%02x%02x%02x", k[0], k[1], k[2], k[3]);
+    memcpy(p, k + 4, recs[i].klen - 4);
+    p += recs[i].klen - 4;
+    *p++ = ' ';
+    memcpy(p, filler + recs[i].voff, recs[i].vlen);
+    p += recs[i].vlen;
+    *p++ = '\n';
+  }
+  printf("# tokenizer %s text %.1f MB\n", maptok_impl, len / 1048576.);
+
+  n = 0;
+  t = now();
+  maptok(text, len, 1, mapcount, &n);
+  t = now() - t;
+  if (n != nrec)
+    error(0, "maptok: %llu records instead of %u", n, nrec);
+  result("map.parse", n / t, "lines/s");
+  result("map.parse.bw", len / t / 1048576, "MB/s");
+
+  t = now();
+  n = mapfgets((char*)text, len);
+  t = now() - t;
+  if (n != nrec)
+    error(0, "fgets: %llu records instead of %u", n, nrec);
+  result("map.fgets", n / t, "lines/s");
+  result("map.fgets.bw", len / t / 1048576, "MB/s");
+  free(text);
+}
+
+/* -S: load a cdb -S server.  Every thread has its own connection and
+ * keeps up to depth requests in flight, answered in order. */
+
+#define SREQ_GET 0xcd
+#define SRES_OK 0
+#define SRES_NOTFOUND 1
+
+static const char *sockname;
+static unsigned depth = 16;
+
+struct client {
+  pthread_t tid;
+  const struct cdb_query *qv;
+  unsigned first, n;
+  int expect;
+  unsigned *lat;       /* per request latency, ns */
+  unsigned char *ib;   /* input buffer */
+  unsigned ipos, iend, isize;
+  int fd;
+};
+
+static void
+cfill(struct client *cl, unsigned need)
+{
+  ssize_t l;
+  if (cl->iend - cl->ipos >= need)
+    return;
+  memmove(cl->ib, cl->ib + cl->ipos, cl->iend - cl->ipos);
+  cl->iend -= cl->ipos;
+  cl->ipos = 0;
+  if (need > cl->isize) {
+    cl->isize = need;
+    if (!(cl->ib = (unsigned char*)realloc(cl->ib, cl->isize)))
+      error(ENOMEM, "unable to allocate memory");
+  }
+  while(cl->iend < need) {
+    l = read(cl->fd, cl->ib + cl->iend, cl->isize - cl->iend);
+    if (l <= 0)
+      error(l ? errno : 0, "%s: read error", sockname);
+    cl->iend += l;
+  }
+}
+
+/* connect to the server, waiting up to 5 seconds for it to come up */
+static int
+sconnect(void)
+{
+  struct sockaddr_un sa;
+  struct timespec ts = { 0, 10000000 };
+  unsigned tries;
+  int fd;
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sun_family = AF_UNIX;
+  strncpy(sa.sun_path, sockname, sizeof(sa.sun_path) - 1);
+  for (tries = 0; ; ++tries) {
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+      error(errno, "unable to create socket");
+    if (connect(fd, (struct sockaddr*)&sa, sizeof(sa)) == 0)
+      return fd;
+    if ((errno != ENOENT && errno != ECONNREFUSED) || tries >= 500)
+      error(errno, "unable to connect to %s", sockname);
+    close(fd);
+    nanosleep(&ts, NULL);
+  }
+}
+
+static void *
+client(void *arg)
+{
+  struct client *cl = (struct client*)arg;
+  unsigned char *ob = (unsigned char*)xmalloc(depth * (5 + kdist.max));
+  double *sent = (double*)xmalloc(depth * sizeof(*sent));
+  unsigned i, j, k, n, olen, vlen;
+  const unsigned char *p;
+  double t;
+
+  cl->fd = sconnect();
+  cl->ib = (unsigned char*)xmalloc(cl->isize = 65536);
+  cl->ipos = cl->iend = 0;
+
+  for (i = 0, k = cl->first; i < cl->n; i += n) {
+    n = cl->n - i < depth ? cl->n - i : depth;
+    t = now();
+    for (j = olen = 0; j < n; ++j, k = k + 1 < nq ? k + 1 : 0) {
+      ob[olen] = SREQ_GET;
+      cdb_pack(cl->qv[k].klen, ob + olen + 1);
+      memcpy(ob + olen + 5, cl->qv[k].key, cl->qv[k].klen);
+      olen += 5 + cl->qv[k].klen;
+      sent[j] = t;
+    }
+    if (write(cl->fd, ob, olen) != (ssize_t)olen)
+      error(errno, "%s: write error", sockname);
+    for (j = 0; j < n; ++j) {
+      cfill(cl, 5);
+      p = cl->ib + cl->ipos;
+      if (p[0] != (cl->expect ? SRES_OK : SRES_NOTFOUND))
+        error(0, "%s: unexpected answer %u (was the database built by "
+              "cdb-bench -K with the same options?)", sockname, p[0]);
+      vlen = cdb_unpack(p + 1);
+      cfill(cl, 5 + vlen);
+      cl->ipos += 5 + vlen;
+      cl->lat[i + j] = (unsigned)((now() - sent[j]) * 1e9);
+    }
+  }
+  close(cl->fd);
+  free(cl->ib);
+  free(ob);
+  free(sent);
+  return NULL;
+}
+
+static void
+bench_server(const char *name, const struct cdb_query *qv, int expect)
+{
+  static const struct { const char *sfx; unsigned pm; } pct[] = {
+    { "p50", 500 }, { "p90", 900 }, { "p99", 990 }, { "p999", 999 },
+  };
+  struct client *cl = (struct client*)xmalloc(maxthreads * sizeof(*cl));
+  unsigned *lat = (unsigned*)xmalloc(nq * sizeof(*lat));
+  char buf[64];
+  unsigned i;
+  double t;
+  int r;
+
+  t = now();
+  for (i = 0; i < maxthreads; ++i) {
+    cl[i].qv = qv;
+    cl[i].expect = expect;
+    cl[i].first = (unsigned long long)nq * i / maxthreads;
+    cl[i].n = (unsigned long long)nq * (i + 1) / maxthreads - cl[i].first;
+    cl[i].lat = lat + cl[i].first;
+    if ((r = pthread_create(&cl[i].tid, NULL, client, &cl[i])) != 0)
+      error(r, "unable to create thread");
+  }
+  for (i = 0; i < maxthreads; ++i)
+    pthread_join(cl[i].tid, NULL);
+  t = now() - t;
+  qsort(lat, nq, sizeof(*lat), cmpuns);
+  sprintf(buf, "%s.rate", name);
+  result(buf, nq / t, "ops/s");
+  for (i = 0; i < sizeof(pct) / sizeof(pct[0]); ++i) {
+    sprintf(buf, "%s.%s", name, pct[i].sfx);
+    result(buf, lat[(unsigned long long)nq * pct[i].pm / 1000], "ns");
+  }
+  sprintf(buf, "%s.max", name);
+  result(buf, lat[nq - 1], "ns");
+  free(lat);
+  free(cl);
+}
+
+/* -S -r: send standard input to the server as is, and copy the
+ * answers to standard output until the server closes the connection
+ * (which it does after the input ends, or on quit) */
+static int
+sraw(void)
+{
+  unsigned char buf[65536];
+  int fd = sconnect();
+  ssize_t l;
+
+  while((l = read(0, buf, sizeof(buf))) > 0)
+    if (write(fd, buf, l) != l)
+      error(errno, "%s: write error", sockname);
+  if (l < 0)
+    error(errno, "read error");
+  shutdown(fd, SHUT_WR);
+  while((l = read(fd, buf, sizeof(buf))) > 0)
+    if (write(1, buf, l) != l)
+      error(errno, "write error");
+  if (l < 0)
+    error(errno, "%s: read error", sockname);
+  close(fd);
+  return 0;
+}
+
+static void
+getdist(struct dist *d, const char *arg, const char *what)
+{
+  char *ep;
+  d->skew = 0;
+  d->min = d->max = strtoul(arg, &ep, 10);
+  if (*ep == ':') {
+    d->max = strtoul(ep + 1, &ep, 10);
+    if (strcmp(ep, ":skew") == 0)
+      d->skew = 1, ep += 5;
+  }
+  if (*ep || d->max < d->min || d->max > (1u << 24))
+    error(0, "invalid %s size `%s'", what, arg);
+}
+
+static unsigned
+getnum(const char *arg, const char *what, unsigned min, unsigned max)
+{
+  char *ep;
+  unsigned long v = strtoul(arg, &ep, 0);
+  if (*ep || v < min || v > max)
+    error(0, "invalid %s `%s'", what, arg);
+  return v;
+}
+
+int main(int argc, char **argv)
+{
+  struct cdb c;
+  int keep = 0, raw = 0;
+  int opt;
+
+  while((opt = getopt(argc, argv, "n:p:q:k:v:d:t:s:f:S:D:H:T:L:lFCKmrh")) != EOF)
+    switch(opt) {
+    case 'n': nrec = getnum(optarg, "number of records", 1, 0x7fffffff); break;
+    case 'p': nput = getnum(optarg, "number of records", 0, 0x7fffffff); break;
+    case 'q': nq = getnum(optarg, "number of queries", 1, 0x7fffffff); break;
+    case 'k': getdist(&kdist, optarg, "key"); break;
+    case 'v': getdist(&vdist, optarg, "value"); break;
+    case 'd': dups = getnum(optarg, "duplicate percentage", 0, 99); break;
+    case 't': maxthreads = getnum(optarg, "number of threads", 1, 1024); break;
+    case 's': seed = getnum(optarg, "seed", 0, 0xffffffff); break;
+    case 'f': dbname = optarg; break;
+    case 'S': sockname = optarg; break;
+    case 'D': depth = getnum(optarg, "pipeline depth", 1, 65536); break;
+    case 'l': locked = 1; break;
+    case 'F': fixkey = 1; break;
+    case 'C': compact = 1; break;
+    case 'H':
+      for (hashfn = 0; strcmp(optarg, hashnames[hashfn]) != 0; )
+        if (++hashfn >= sizeof(hashnames) / sizeof(hashnames[0]))
+          error(0, "unknown hash function `%s'", optarg);
+      break;
+    case 'T':
+      ntables = getnum(optarg, "number of tables", 1, 65536);
+      if (ntables & (ntables - 1))
+        error(0, "invalid number of tables `%s'", optarg);
+      break;
+    case 'L': load = getnum(optarg, "load", 1, 100); break;
+    case 'K': keep = 1; break;
+    case 'm': mapmode = 1; break;
+    case 'r': raw = 1; break;
+    case 'h':
+      printf("\
+%s: Constant DataBase (CDB) benchmark version %g.  Usage is:\n\
+ %s [-n records] [-p putrecords] [-q queries] [-k klen] [-v vlen]\n\
+   [-d dup%%] [-t threads] [-s seed] [-f dbfile] [-l] [-F] [-C] [-H hash]\n\
+   [-T tables] [-L load%%] [-K]\n\
+ %s -S socket [-D depth] [-n records] [-q queries] [-k klen] [-d dup%%]\n\
+   [-t threads] [-s seed]\n\
+ %s -S socket -r\n\
+ %s -m [-n records] [-k klen] [-v vlen] [-d dup%%] [-s seed]\n\
+ where klen and vlen are N, MIN:MAX or MIN:MAX:skew\n\
+ (-l: lock the database in memory, -F: fixed-length keys (klen 4, 8 or 16),\n\
+  -C: smallest format records allow (dense with fixed-length values),\n\
+  -H: hash function, default, xxh64, siphash or halfsiphash,\n\
+  -T: power-of-two number of hash tables, -L: hash table load,\n\
+  -K: keep dbfile,\n\
+  -S: load a cdb -S server, with depth requests in flight per thread,\n\
+  -r: send standard input to the server and print the answers,\n\
+  -m: map format (cdb -c -m input) parsing only)\n",
+             progname, TINYCDB_VERSION, progname, progname, progname,
+             progname);
+      return 0;
+    default:
+      fprintf(stderr, "%s: try `%s -h' for help\n", progname, progname);
+      return 2;
+    }
+  if (raw) {
+    if (!sockname)
+      error(0, "-r needs -S socket");
+    return sraw();
+  }
+  if (kdist.min < 4)
+    error(0, "keys should be at least 4 bytes long");
+  if (fixkey && (kdist.min != kdist.max ||
+                 (kdist.min != 4 && kdist.min != 8 && kdist.min != 16)))
+    error(0, "-F needs -k 4, -k 8 or -k 16");
+
+  printf("# cdb-bench version %g backend %s%s%s%s",
+         TINYCDB_VERSION, locked ? "posix-mlock" : "posix",
+         fixkey ? " format fixkey" : compact ? " format compact" : "",
+         hashfn ? " hash " : "", hashfn ? hashnames[hashfn] : "");
+  if (ntables)
+    printf(" tables %u", ntables);
+  if (load)
+    printf(" load %u", load);
+  printf("\n");
+  printf("# options -n %u -p %u -q %u -k %u:%u%s -v %u:%u%s -d %u -t %u -s %llu\n",
+         nrec, nput, nq, kdist.min, kdist.max, kdist.skew ? ":skew" : "",
+         vdist.min, vdist.max, vdist.skew ? ":skew" : "",
+         dups, maxthreads, seed);
+
+  gendata();
+  if (sockname) {
+    printf("# server %s depth %u\n", sockname, depth);
+    bench_server("server.hit", hits, 1);
+    bench_server("server.miss", misses, 0);
+    return 0;
+  }
+  if (mapmode) {
+    bench_map();
+    return 0;
+  }
+  bench_build();
+  bench_addv();
+  opendb(&c);
+  bench_latency(&c, "find.hit", hits, 1);
+  bench_latency(&c, "find.miss", misses, 0);
+  bench_findv(&c);
+  bench_stats(&c);
+  bench_scan(&c);
+  closedb(&c);
+  bench_threads();
+
+  if (!keep)
+    unlink(dbname);
+  return 0;
+}
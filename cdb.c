@@ -11,8 +11,12 @@
 # include <malloc.h>
 /* This pragma suppresses snippy VC warnings for POSIX functions like read() */
 # pragma warning(disable: 4996)
+# define fseeko _fseeki64
+# define ftello _ftelli64
+# define ftruncate _chsize_s
 #else
 # include <unistd.h>
+# include <getopt.h>
 #endif
 
 #include <sys/types.h>
@@ -24,6 +28,7 @@
 #include <errno.h>
 #include <sys/stat.h>
 #include "cdb.h"
+#include "maptok.h"
 
 #ifndef EPROTO
 # define EPROTO EINVAL
@@ -33,6 +38,24 @@
 # define HAVE_PROGRAM_INVOCATION_SHORT_NAME
 #endif
 
+#ifndef _WIN32
+# define HAVE_PTHREAD
+# include <pthread.h>
+#endif
+
+#define strify(x) _strify(x)
+#define _strify(x) #x
+
+#ifdef __linux__
+# define HAVE_EPOLL
+# include <sys/epoll.h>
+# include <sys/socket.h>
+# include <sys/uio.h>
+# include <sys/un.h>
+# include <signal.h>
+# include <time.h>
+#endif
+
 #ifdef HAVE_PROGRAM_INVOCATION_SHORT_NAME
 # define progname program_invocation_short_name
 #else
@@ -53,26 +76,32 @@ static char *progname;
 #define F_WARNDUP  0x0100
 #define F_ERRDUP  0x0200
 #define F_MAP    0x1000  /* map format (or else CDB native format) */
+#define F_DELTA  0x2000  /* collect changes for cdb_make_update() */
+#define F_STREAM 0x4000  /* produce streamed files (toc at the end) */
+#define F_PREFETCH 0x8000 /* batch query through cdb_findv() */
+#define F_STATS  0x10000 /* print lookup statistics */
+#define F_JSON   0x20000 /* machine-readable -s output */
+#define F_CRC    0x40000 /* write checksums */
+#define F_COMPACT 0x80000 /* pick the smallest format at finish */
+#define F_SEND   0x100000 /* -q value output through cdb_senddata() */
+#define F_LAYER  0x200000 /* -c of an overlay layer, with tombstones */
 
-/* Silly defines just to suppress silly compiler warnings.
- * The thing is, trivial routines like strlen(), fgets() etc expects
- * char* argument, and GCC>=4 complains about using unsigned char* here.
- * Silly silly silly.
- */
-#ifdef __GNUC__
-static inline size_t ustrlen(const unsigned char *s) {
-  return strlen((const char*)s);
-}
-static inline unsigned char *ufgets(unsigned char *s, int size, FILE *f) {
-  return (unsigned char*)fgets((char*)s, size, f);
-}
-#else
-# define ustrlen strlen
-# define ufgets fgets
-#endif
+#define BIGVAL  65536   /* values this large are copied file-to-file */
+#define MAPBLOCK  (1 << 20)  /* map format input is read in such blocks */
 
 static unsigned char *buf;
 static unsigned blen;
+static unsigned fixkey;    /* --fixkey: length of all keys, or 0 */
+static unsigned fixval = ~0u;  /* value length of a dense database kept */
+static unsigned hashfn;    /* --hash: CDB_HASH_xxx */
+static unsigned char hashkey[16];  /* and its key */
+static unsigned ntables;   /* --tables: power of two, 0 for the classic 256 */
+static unsigned loadpct;   /* --load: hash table load in percents, or 0 */
+static unsigned filterbits = ~0u;  /* --filter: bits per key, if given */
+static const char *const hashnames[] = {
+  "default", "xxh64", "siphash", "halfsiphash"
+};
+static struct cdb_make *hmake;  /* keys are hashed in its format */
 
 static void
 #ifdef __GNUC__
@@ -98,7 +127,9 @@ error(int errnum, const char *fmt, ...)
 }
 
 static void allocbuf(unsigned len) {
-  if (blen < len) {
+  if (blen < len || !buf) {
+    if (!len)	/* an empty value still wants a valid buffer */
+      len = 1;
     buf = (unsigned char*)(buf ? realloc(buf, len) : malloc(len));
     if (!buf)
       error(ENOMEM, "unable to allocate %u bytes", len);
@@ -106,42 +137,376 @@ static void allocbuf(unsigned len) {
   }
 }
 
+/* is dbname a manifest with this magic (of a sharded database or an
+ * overlay)? */
+static int ismanifest(const char *dbname, const char *magic)
+{
+  char b[16];
+  unsigned len = strlen(magic);
+  int fd = open(dbname, O_RDONLY);
+  int r = fd >= 0 && read(fd, b, len + 1) == (int)len + 1 &&
+    memcmp(b, magic, len) == 0 && b[len] == ' ';
+  if (fd >= 0)
+    close(fd);
+  return r;
+}
+
+/* --stats: one block for all handles, since we're single-threaded */
+static struct cdb_stats qstats;
+
+static void
+attachstats(struct cdb *cdbp, unsigned n)
+{
+  while(n--)
+    if (cdb_stats_attach(cdbp++, &qstats) != 0)
+      error(errno, "lookup statistics");
+}
+
+static void
+printstats(void)
+{
+  unsigned i;
+  fprintf(stderr, "lookups %llu\nhits %llu\nmisses %llu\nerrors %llu\n"
+          "probes %llu\ncollisions %llu\n"
+          "bytes.other %llu\nbytes.htab %llu\nbytes.data %llu\nprobehist",
+          qstats.lookups, qstats.hits, qstats.misses, qstats.errors,
+          qstats.probes, qstats.collisions, qstats.bytes[0],
+          qstats.bytes[1], qstats.bytes[2]);
+  for (i = 0; i < CDB_STATS_NPROBE; ++i)
+    fprintf(stderr, " %llu", qstats.probehist[i]);
+  putc('\n', stderr);
+}
+
+/* write the value of the current record of cdbp */
+static void qput(struct cdb *cdbp, int flags)
+{
+  if (flags & F_SEND) {
+    if (fflush(stdout) != 0 || cdb_senddata(cdbp, 1) != 0)
+      error(errno, "unable to write value");
+  }
+  else {
+    allocbuf(cdb_datalen(cdbp));
+    if (cdb_read(cdbp, buf, cdb_datalen(cdbp), cdb_datapos(cdbp)) != 0)
+      error(errno, "unable to read value");
+    fwrite(buf, 1, cdb_datalen(cdbp), stdout);
+  }
+  if (flags & F_MAP) putchar('\n');
+}
+
+/* -q of an overlay: only the first visible record of a key */
+static int qomode(char *dbname, const char *key, int num, int flags)
+{
+  struct cdb_overlay co;
+  struct cdb *cdbp;
+  int r;
+
+  if (num > 1)
+    error(0, "-n cannot be used with an overlay");
+  if (cdb_overlay_init(&co, dbname) != 0)
+    error(errno, "unable to open overlay `%s'", dbname);
+  if (flags & F_STATS)
+    attachstats(co.cdb_layers, co.cdb_nlayers);
+  r = cdb_overlay_find(&co, key, strlen(key), &cdbp);
+  if (r < 0)
+    error(errno, "%s", key);
+  if (r)
+    qput(cdbp, flags);
+  cdb_overlay_free(&co);
+  return r ? 0 : 100;
+}
+
 static int qmode(char *dbname, const char *key, int num, int flags)
 {
-  struct cdb c;
+  struct cdb c, *cdbp;
+  struct cdb_sharded cs;
   struct cdb_find cf;
   int r;
   int n, found;
+  int sharded = ismanifest(dbname, CDB_SHARDS_MAGIC);
 
+  if (!sharded && ismanifest(dbname, CDB_OVERLAY_MAGIC))
+    return qomode(dbname, key, num, flags);
   memset(&c, 0, sizeof(c));
-  r = open(dbname, O_RDONLY);
-  if (r < 0 || cdb_init(&c, r) != 0)
-    error(errno, "unable to open database `%s'", dbname);
-
-  r = cdb_findinit(&cf, &c, key, strlen(key));
+  if (sharded) {
+    if (cdb_sharded_init(&cs, dbname) != 0)
+      error(errno, "unable to open database `%s'", dbname);
+    if (flags & F_STATS)
+      attachstats(cs.cdb_shards, cs.cdb_nshards);
+    r = cdb_sharded_findinit(&cf, &cs, key, strlen(key));
+  }
+  else {
+    r = open(dbname, O_RDONLY);
+    if (r < 0 || cdb_init(&c, r) != 0)
+      error(errno, "unable to open database `%s'", dbname);
+    if (flags & F_STATS)
+      attachstats(&c, 1);
+    r = cdb_findinit(&cf, &c, key, strlen(key));
+  }
   if (!r)
     return 100;
   else if (r < 0)
     error(errno, "%s", key);
+  cdbp = cf.cdb_cdbp;
   n = 0; found = 0;
   while((r = cdb_findnext(&cf)) > 0) {
     ++n;
     if (num && num != n) continue;
     ++found;
-    allocbuf(cdb_datalen(&c));
-    if (cdb_read(&c, buf, cdb_datalen(&c), cdb_datapos(&c)) != 0)
-      error(errno, "unable to read value");
-    fwrite(buf, 1, cdb_datalen(&c), stdout);
-    if (flags & F_MAP) putchar('\n');
+    qput(cdbp, flags);
     if (num)
       break;
   }
   if (r < 0)
     error(0, "%s", key);
-  cdb_free(&c);
+  if (sharded)
+    cdb_sharded_free(&cs);
+  else
+    cdb_free(&c);
   return found ? 0 : 100;
 }
 
+static void badinput(const char *fn) {
+  fprintf(stderr, "%s: %s: bad format\n", progname, fn);
+  exit(2);
+}
+
+static void badklen(unsigned klen) {
+  fprintf(stderr, "%s: key length %u does not match --fixkey %u\n",
+          progname, klen, fixkey);
+  exit(2);
+}
+
+static void badvlen(unsigned vlen) {
+  fprintf(stderr, "%s: value length %u does not match the database's %u\n",
+          progname, vlen, fixval);
+  exit(2);
+}
+
+/* --fixkey, and value length of a dense database being updated */
+static void checklen(unsigned klen, unsigned vlen) {
+  if (fixkey && klen != fixkey)
+    badklen(klen);
+  if (fixval != ~0u && vlen != fixval)
+    badvlen(vlen);
+}
+
+/* -q -b: batch query.  Keys are read in large blocks and looked up in
+ * groups against one mapping; values are written right from the mapped
+ * file into a large stdio buffer. */
+
+#define QBATCH  256        /* keys looked up at once */
+#define QBLOCK  (1 << 20)  /* input is read in such blocks */
+
+/* get next key from [*pp,e) into *qp.  Return 0 if more input is
+ * needed (or there are no more keys at eof), 1 if a key is found */
+static int
+qbkey(const unsigned char **pp, const unsigned char *e, int eof, int flags,
+      struct cdb_query *qp, const char *fn)
+{
+  const unsigned char *p = *pp, *q;
+  unsigned klen;
+
+  if (flags & F_MAP) { /* a line is a key */
+    if (p >= e)
+      return 0;
+    if ((q = (const unsigned char*)memchr(p, '\n', e - p)) != NULL)
+      *pp = q + 1;
+    else if (eof)
+      *pp = q = e;
+    else
+      return 0;
+    qp->key = p;
+    qp->klen = q - p;
+    return 1;
+  }
+
+  /* netstring, klen:key, or a line of -l output, +klen:key */
+  while(p < e && (*p == '\n' || *p == ' ' || *p == '\t' || *p == '\r'))
+    ++p;
+  *pp = p;
+  if (p >= e)
+    return 0;
+  if (*p == '+')
+    ++p;
+  if (p >= e)
+    goto more;
+  if (*p < '0' || *p > '9')
+    goto bad;
+  klen = 0;
+  while(p < e && *p >= '0' && *p <= '9') {
+    if (klen > (0xffffffff - 9) / 10)
+      goto bad;
+    klen = klen * 10 + (*p++ - '0');
+  }
+  if (p >= e)
+    goto more;
+  if (*p++ != ':')
+    goto bad;
+  if ((size_t)(e - p) <= klen)
+    goto more;
+  if (p[klen] != ',' && p[klen] != '\n')
+    goto bad;
+  qp->key = p;
+  qp->klen = klen;
+  *pp = p + klen + 1;
+  return 1;
+
+more:
+  if (!eof)
+    return 0;
+bad:
+  badinput(fn);
+  return 0;
+}
+
+static void
+qbput(const struct cdb *cdbp, const struct cdb_query *qp, int flags)
+{
+  const void *v = cdb_get(cdbp, qp->vlen, qp->vpos);
+  if (!v)
+    error(errno, "unable to read value");
+  if (flags & F_MAP) {
+    fwrite(qp->key, 1, qp->klen, stdout);
+    putc(' ', stdout);
+  }
+  else {
+    printf("+%u,%u:", qp->klen, qp->vlen);
+    fwrite(qp->key, 1, qp->klen, stdout);
+    fputs("->", stdout);
+  }
+  fwrite(v, 1, qp->vlen, stdout);
+  putc('\n', stdout);
+}
+
+/* look up and print a group of keys, return number of keys not found */
+static unsigned
+qbgroup(struct cdb *cdbp, struct cdb_sharded *csp,
+        struct cdb_query *qv, unsigned n, int num, int flags)
+{
+  unsigned i, missing = 0;
+  int r, k;
+
+  if (flags & F_PREFETCH) {
+    if (cdb_findv(cdbp, qv, n) < 0)
+      error(errno, "unable to read database");
+    for (i = 0; i < n; ++i)
+      if (qv[i].vpos)
+        qbput(cdbp, &qv[i], flags);
+      else
+        ++missing;
+    return missing;
+  }
+
+  for (i = 0; i < n; ++i) {
+    struct cdb_find cf;
+    r = csp ? cdb_sharded_findinit(&cf, csp, qv[i].key, qv[i].klen)
+            : cdb_findinit(&cf, cdbp, qv[i].key, qv[i].klen);
+    for (k = 0; r > 0 && k < (num ? num : 1); ++k)
+      r = cdb_findnext(&cf);
+    if (r < 0)
+      error(errno, "unable to read database");
+    if (r) {
+      qv[i].vpos = cdb_datapos(cf.cdb_cdbp);
+      qv[i].vlen = cdb_datalen(cf.cdb_cdbp);
+      qbput(cf.cdb_cdbp, &qv[i], flags);
+    }
+    else
+      ++missing;
+  }
+  return missing;
+}
+
+static int
+qbmode(char *dbname, int argc, char **argv, int num, int flags)
+{
+  struct cdb c;
+  struct cdb_sharded cs;
+  struct cdb_query qv[QBATCH];
+  unsigned char *ib;
+  unsigned ilen = QBLOCK, n, missing = 0;
+  int sharded = ismanifest(dbname, CDB_SHARDS_MAGIC);
+  int i, fd;
+
+  if (!sharded && ismanifest(dbname, CDB_OVERLAY_MAGIC))
+    error(0, "-b cannot be used with an overlay");
+  if (sharded) {
+    if (cdb_sharded_init(&cs, dbname) != 0)
+      error(errno, "unable to open database `%s'", dbname);
+    if (flags & F_STATS)
+      attachstats(cs.cdb_shards, cs.cdb_nshards);
+    flags &= ~F_PREFETCH;
+  }
+  else {
+    fd = open(dbname, O_RDONLY);
+    if (fd < 0 || cdb_init(&c, fd) != 0)
+      error(errno, "unable to open database `%s'", dbname);
+    if (flags & F_STATS)
+      attachstats(&c, 1);
+  }
+  if (num)
+    flags &= ~F_PREFETCH;
+  if (!(ib = (unsigned char*)malloc(ilen)))
+    error(ENOMEM, "unable to allocate %u bytes", ilen);
+  setvbuf(stdout, NULL, _IOFBF, QBLOCK);
+
+  for (i = 0; i < (argc ? argc : 1); ++i) {
+    const char *fn = argc && strcmp(argv[i], "-") ? argv[i] : "(stdin)";
+    const unsigned char *p = ib, *e = ib;
+    FILE *f = stdin;
+    int eof = 0;
+    if (argc && strcmp(argv[i], "-") && !(f = fopen(argv[i], "r" FBINMODE)))
+      error(errno, "%s", argv[i]);
+    n = 0;
+    for(;;) {
+      size_t l;
+      while(n < QBATCH && qbkey(&p, e, eof, flags, &qv[n], fn))
+        ++n;
+      missing += qbgroup(sharded ? NULL : &c, sharded ? &cs : NULL,
+                         qv, n, num, flags);
+      if (n == QBATCH) {
+        n = 0;
+        continue;
+      }
+      n = 0;
+      if (eof)
+        break;
+      /* more input is needed; keys of the group are done with */
+      l = e - p;
+      if (l == ilen) { /* a key longer than the buffer */
+        unsigned char *t = (unsigned char*)realloc(ib, ilen << 1);
+        if (!t)
+          error(ENOMEM, "unable to allocate %u bytes", ilen << 1);
+        ilen <<= 1;
+        ib = t;
+      }
+      else
+        memmove(ib, p, l);
+      p = ib;
+      e = ib + l;
+      l = fread(ib + l, 1, ilen - l, f);
+      if (!l) {
+        if (ferror(f))
+          error(errno, "%s", fn);
+        eof = 1;
+      }
+      e += l;
+    }
+    if (f != stdin)
+      fclose(f);
+  }
+
+  if (!(flags & F_MAP))
+    putc('\n', stdout);
+  free(ib);
+  if (sharded)
+    cdb_sharded_free(&cs);
+  else
+    cdb_free(&c);
+  if (ferror(stdout))
+    return -1;
+  return missing ? 100 : 0;
+}
+
 static void
 fget(FILE *f, unsigned char *b, unsigned len, unsigned *posp, unsigned limit)
 {
@@ -170,11 +535,100 @@ fcpy(FILE *fi, FILE *fo, unsigned len, unsigned *posp, unsigned limit)
   return 0;
 }
 
+/* The format, the toc and the extension section of a database are
+ * decoded by the library, which needs to see all of it: a regular file
+ * is mapped, of other input (a pipe) only the parts which matter are
+ * kept in memory. */
+
+/* number of hash tables, record header length in the format of c */
+#define NTABLES(c) ((c)->cdb_fmt & CDB_FMT_POW2 ? 1u << (c)->cdb_tbits : 256u)
+#define RHLEN(c) \
+  ((c)->cdb_fmt & CDB_FMT_DENSE ? 0 : (c)->cdb_fmt & CDB_FMT_FIXKEY ? 4 : 8)
+
+/* Set up *cp for database f, read up to 2048 with the first 2048 bytes
+ * in head, and return its toc.  If f is not a regular file, cp->file
+ * is NULL and *cp all zeros, the classic format, and NULL is returned
+ * unless the toc is in head. */
+static const unsigned char *
+ftoc(FILE *f, const unsigned char *head, struct cdb *cp)
+{
+  struct stat st;
+  const unsigned char *toc;
+
+  memset(cp, 0, sizeof(*cp));
+  if (fstat(fileno(f), &st) != 0 || !S_ISREG(st.st_mode))
+    return cdb_unpack(head) ? head : NULL;
+  if (cdb_init(cp, fileno(f)) != 0)
+    error(errno, "unsupported cdb file format");
+  if (!cdb_unpack(head) && !cp->cdb_toc)
+    error(EPROTO, "invalid cdb file format%s",
+          cp->cdb_ext ? ": no toc" : "");
+  toc = (const unsigned char*)cdb_get(cp, NTABLES(cp) << 3, cp->cdb_toc);
+  if (!toc)
+    error(EPROTO, "invalid cdb file format");
+  return toc;
+}
+
+/* A database on a pipe, of which only the first 2048 bytes and the
+ * tail from tpos on are kept in memory, as a struct cdb_file */
+struct mfile {
+  const unsigned char *head, *tail;
+  unsigned tpos;
+};
+
+static int
+mfopen(struct cdb_file *fp)
+{
+  (void)fp;
+  return 0;
+}
+
+static const void *
+mfget(struct cdb_file *fp, unsigned len, unsigned pos, unsigned bufid)
+{
+  const struct mfile *mp = (const struct mfile*)fp->opaque;
+  (void)bufid;
+  if (pos <= 2048 && len <= 2048 - pos)
+    return mp->head + pos;
+  if (pos >= mp->tpos && pos <= fp->fsize && len <= fp->fsize - pos)
+    return mp->tail + (pos - mp->tpos);
+  return NULL;
+}
+
+static void
+mfclose(struct cdb_file *fp)
+{
+  (void)fp;
+}
+
+/* set up *cp for a database on a pipe, size bytes long, with its head
+ * and the last tlen bytes of it in tail */
+static void
+mfinit(struct cdb *cp, const unsigned char *head,
+       const unsigned char *tail, unsigned tlen, unsigned long long size)
+{
+  static struct mfile m;
+  static struct cdb_file mf = {
+    mfopen, NULL, mfget, NULL, NULL, NULL, NULL, mfclose, &m, 0, NULL, NULL
+  };
+  if (size > 0xffffffff)
+    error(EPROTO, "invalid cdb file format");
+  m.head = head;
+  m.tail = tail;
+  m.tpos = (unsigned)size - tlen;
+  mf.fsize = (unsigned)size;
+  if (cdb_init_with_file(cp, &mf) != 0)
+    error(errno, "unsupported cdb file format");
+}
+
 static int
 dmode(char *dbname, char mode, int flags)
 {
-  unsigned eod, klen, vlen;
-  unsigned pos = 0;
+  unsigned eod, klen, vlen, hlen;
+  unsigned pos = 0, rpos, t = 0;
+  struct cdb c;
+  struct cdb_layer l;
+  const unsigned char *toc, *tomb = NULL;
   FILE *f;
   if (strcmp(dbname, "-") == 0)
     f = stdin;
@@ -182,11 +636,34 @@ dmode(char *dbname, char mode, int flags)
     error(errno, "open %s", dbname);
   allocbuf(2048);
   fget(f, buf, 2048, &pos, 2048);
-  eod = cdb_unpack(buf);
+  if (!(toc = ftoc(f, buf, &c)))
+    error(ESPIPE, "%s: streamed database", dbname);
+  eod = cdb_unpack(toc);
+  /* tombstones of a layer are dumped as deletions, -klen:key */
+  memset(&l, 0, sizeof(l));
+  if (!(flags & F_MAP) && c.file) {
+    if (cdb_layer_init(&c, &l) < 0 ||
+        !(tomb = (const unsigned char*)cdb_get(&c, l.cdb_ntomb << 2,
+                                               l.cdb_tomb)))
+      error(EPROTO, "invalid cdb file format");
+  }
+  /* fixed-length key records have no key length, dense ones nothing */
+  hlen = RHLEN(&c);
   while(pos < eod) {
-    fget(f, buf, 8, &pos, eod);
-    klen = cdb_unpack(buf);
-    vlen = cdb_unpack(buf + 4);
+    rpos = pos;
+    fget(f, buf, hlen, &pos, eod);
+    klen = hlen < 8 ? c.cdb_fklen : cdb_unpack(buf);
+    vlen = hlen ? cdb_unpack(buf + hlen - 4) : c.cdb_fvlen;
+    while(t < l.cdb_ntomb && cdb_unpack(tomb + (t << 2)) < rpos)
+      ++t;
+    if (t < l.cdb_ntomb && cdb_unpack(tomb + (t << 2)) == rpos) {
+      if (printf("-%u:", klen) < 0 ||
+          fcpy(f, stdout, klen, &pos, eod) != 0 ||
+          fcpy(f, NULL, vlen, &pos, eod) != 0 ||
+          putc('\n', stdout) < 0)
+        return -1;
+      continue;
+    }
     if (!(flags & F_MAP))
       if (printf(mode == 'd' ? "+%u,%u:" : "+%u:", klen, vlen) < 0) return -1;
     if (fcpy(f, stdout, klen, &pos, eod) != 0) return -1;
@@ -200,6 +677,8 @@ dmode(char *dbname, char mode, int flags)
   }
   if (pos != eod)
     error(EPROTO, "invalid cdb file format");
+  if (c.file)
+    cdb_free(&c);
   if (!(flags & F_MAP))
     if (putc('\n', stdout) < 0)
       return -1;
@@ -210,13 +689,18 @@ static int smode(char *dbname) {
   FILE *f;
   unsigned pos, eod;
   unsigned cnt = 0;
-  unsigned kmin = 0, kmax = 0, ktot = 0;
-  unsigned vmin = 0, vmax = 0, vtot = 0;
-  unsigned hmin = 0, hmax = 0, htot = 0, hcnt = 0;
+  unsigned kmin = 0, kmax = 0;
+  unsigned vmin = 0, vmax = 0;
+  unsigned hmin = 0, hmax = 0, hcnt = 0;
+  unsigned long long ktot = 0, vtot = 0, htot = 0;
 #define NDIST 11
   unsigned dist[NDIST];
-  unsigned char toc[2048];
-  unsigned k;
+  unsigned char head[2048];
+  const unsigned char *toc = head;
+  unsigned k, rhlen, ss;
+  struct cdb c;
+  struct cdb_layer l;  /* overlay record of a layer */
+  unsigned *rhval = NULL;  /* hash values of CDB_FMT_DENSE records */
 
   if (strcmp(dbname, "-") == 0)
     f = stdin;
@@ -224,17 +708,34 @@ static int smode(char *dbname) {
     error(errno, "open %s", dbname);
 
   pos = 0;
-  fget(f, toc, 2048, &pos, 2048);
+  fget(f, head, 2048, &pos, 2048);
+  if (!(toc = ftoc(f, head, &c)))
+    error(ESPIPE, "%s: streamed database", dbname);
 
   allocbuf(2048);
 
   eod = cdb_unpack(toc);
+  rhlen = RHLEN(&c);
+  ss = c.cdb_fmt & CDB_FMT_DENSE ? 4 : 8;
+  if (c.cdb_fmt & CDB_FMT_DENSE) {
+    /* slots have the record number, and hash values come from the keys */
+    if (eod < 2048) error(EPROTO, "invalid cdb file format");
+    rhval = (unsigned*)malloc(((eod - 2048) / (c.cdb_fklen + c.cdb_fvlen) + 1)
+                              * sizeof(unsigned));
+    if (!rhval)
+      error(ENOMEM, "unable to allocate memory");
+  }
   while(pos < eod) {
     unsigned klen, vlen;
-    fget(f, buf, 8, &pos, eod);
-    klen = cdb_unpack(buf);
-    vlen = cdb_unpack(buf + 4);
-    fcpy(f, NULL, klen, &pos, eod);
+    fget(f, buf, rhlen, &pos, eod);
+    klen = rhlen < 8 ? c.cdb_fklen : cdb_unpack(buf);
+    vlen = rhlen ? cdb_unpack(buf + rhlen - 4) : c.cdb_fvlen;
+    if (rhval) {
+      fget(f, buf, klen, &pos, eod);
+      rhval[cnt] = cdb_hashkey(&c, buf, klen);
+    }
+    else
+      fcpy(f, NULL, klen, &pos, eod);
     fcpy(f, NULL, vlen, &pos, eod);
     ++cnt;
     ktot += klen;
@@ -249,16 +750,24 @@ static int smode(char *dbname) {
 
   for (k = 0; k < NDIST; ++k)
     dist[k] = 0;
-  for (k = 0; k < 256; ++k) {
+  for (k = 0; k < NTABLES(&c); ++k) {
     unsigned i = cdb_unpack(toc + (k << 3));
     unsigned hlen = cdb_unpack(toc + (k << 3) + 4);
     if (i != pos) error(EPROTO, "invalid cdb hash table");
     if (!hlen) continue;
     for (i = 0; i < hlen; ++i) {
       unsigned h;
-      fget(f, buf, 8, &pos, 0xffffffff);
-      if (!cdb_unpack(buf + 4)) continue;
-      h = (cdb_unpack(buf) >> 8) % hlen;
+      fget(f, buf, ss, &pos, 0xffffffff);
+      if (rhval) {
+        h = cdb_unpack(buf) & ((1u << c.cdb_ibits) - 1);
+        if (!h) continue;
+        if (h > cnt) error(EPROTO, "invalid cdb hash table");
+        h = rhval[h - 1];
+      }
+      else if (!cdb_unpack(buf + 4)) continue;
+      else h = cdb_unpack(buf);
+      h = c.cdb_fmt & CDB_FMT_POW2 ?
+          (h >> c.cdb_tbits) & (hlen - 1) : (h >> 8) % hlen;
       if (h == i) h = 0;
       else {
         if (h < i) h = i - h;
@@ -272,26 +781,332 @@ static int smode(char *dbname) {
     htot += hlen;
     ++hcnt;
   }
+  free(rhval);
+  if (c.cdb_fmt & CDB_FMT_DENSE)
+    printf("format: dense, keys of %u bytes, values of %u bytes\n",
+           c.cdb_fklen, c.cdb_fvlen);
+  else if (c.cdb_fmt & CDB_FMT_FIXKEY)
+    printf("format: fixed-length keys of %u bytes\n", c.cdb_fklen);
+  if (c.cdb_fmt & CDB_FMT_HASH)
+    printf("hash function: %s\n", hashnames[c.cdb_hfn]);
+  if (c.cdb_fmt & CDB_FMT_POW2)
+    printf("hash tables: %u, sizes powers of two\n", NTABLES(&c));
+  if (c.file && cdb_layer_init(&c, &l) > 0) {
+    printf("overlay layer: %u tombstones", l.cdb_ntomb);
+    if (l.cdb_filter)
+      printf(", filter of %u bytes, %u bits set per key",
+             l.cdb_fblocks * 64, l.cdb_fk);
+    putchar('\n');
+  }
   printf("number of records: %u\n", cnt);
   printf("key min/avg/max length: %u/%u/%u\n",
-         kmin, cnt ? (ktot + cnt / 2) / cnt : 0, kmax);
+         kmin, (unsigned)(cnt ? (ktot + cnt / 2) / cnt : 0), kmax);
   printf("val min/avg/max length: %u/%u/%u\n",
-         vmin, cnt ? (vtot + cnt / 2) / cnt : 0, vmax);
-  printf("hash tables/entries/collisions: %u/%u/%u\n",
+         vmin, (unsigned)(cnt ? (vtot + cnt / 2) / cnt : 0), vmax);
+  printf("hash tables/entries/collisions: %u/%llu/%u\n",
          hcnt, htot, cnt - dist[0]);
   printf("hash table min/avg/max length: %u/%u/%u\n",
-         hmin, hcnt ? (htot + hcnt / 2) / hcnt : 0, hmax);
+         hmin, (unsigned)(hcnt ? (htot + hcnt / 2) / hcnt : 0), hmax);
   printf("hash table distances:\n");
   for(k = 0; k < NDIST; ++k)
     printf(" %c%u: %6u %2u%%\n",
            k == NDIST - 1 ? '>' : 'd', k == NDIST - 1 ? k - 1 : k,
            dist[k], cnt ? dist[k] * 100 / cnt : 0);
+  if (c.file)
+    cdb_free(&c);
   return 0;
 }
 
-static void badinput(const char *fn) {
-  fprintf(stderr, "%s: %s: bad format\n", progname, fn);
-  exit(2);
+/* value lengths for percentiles: exact below 1024,
+ * then 64 classes per power of two */
+#define VCLASSES (1024 + (22 << 6))
+
+static unsigned vclass(unsigned v) {
+  unsigned e;
+  if (v < 1024) return v;
+  for (e = 10; v >> (e + 1); ++e)
+    ;
+  return 1024 + ((e - 10) << 6) + ((v >> (e - 6)) & 63);
+}
+
+static unsigned vclassmin(unsigned c) {
+  if (c < 1024) return c;
+  c -= 1024;
+  return (64 + (c & 63)) << ((c >> 6) + 4);
+}
+
+/* distinct cache lines (64 bytes) and pages (4K) touched by a lookup */
+struct touched {
+  unsigned n[2];
+  unsigned long long u[2][16];
+};
+
+static void
+touch(struct touched *tp, unsigned long long pos, unsigned len) {
+  unsigned k, i;
+  unsigned long long u, e;
+  if (!len) return;
+  for (k = 0; k < 2; ++k) {
+    u = pos >> (k ? 12 : 6);
+    e = (pos + len - 1) >> (k ? 12 : 6);
+    if (e - u >= 8) { /* a large value, nothing else is that big */
+      tp->n[k] += e - u + 1;
+      continue;
+    }
+    for (; u <= e; ++u) {
+      for (i = 0; i < tp->n[k] && i < 16 && tp->u[k][i] != u; ++i)
+        ;
+      if (i < tp->n[k] && i < 16)
+        continue;
+      if (tp->n[k] < 16)
+        tp->u[k][tp->n[k]] = u;
+      ++tp->n[k];
+    }
+  }
+}
+
+/* m slots of ss bytes of a hash table of n slots at htab, starting
+ * with slot s */
+static void
+touchslots(struct touched *tp, unsigned htab, unsigned n,
+           unsigned s, unsigned m, unsigned ss) {
+  if (s + m <= n)
+    touch(tp, htab + s * ss, m * ss);
+  else {
+    touch(tp, htab + s * ss, (n - s) * ss);
+    touch(tp, htab, (m - (n - s)) * ss);
+  }
+}
+
+/* Record position of hash table slot p of c mapped at mem, 0 for an
+ * empty slot, and its hash value.  A CDB_FMT_DENSE slot has the record
+ * number in its low bits, and the key is hashed again; a bad number
+ * gives 1. */
+static unsigned
+jslot(const struct cdb *c, const unsigned char *mem, const unsigned char *p,
+      unsigned *hp) {
+  unsigned rlen = c->cdb_fklen + c->cdb_fvlen, r;
+  if (!(c->cdb_fmt & CDB_FMT_DENSE)) {
+    *hp = cdb_unpack(p);
+    return cdb_unpack(p + 4);
+  }
+  if (!(r = cdb_unpack(p) & ((1u << c->cdb_ibits) - 1)))
+    return 0;
+  if (r - 1 >= (c->cdb_dend - 2048) / rlen)
+    return 1;
+  r = 2048 + (r - 1) * rlen;
+  *hp = cdb_hashkey(c, mem + r, c->cdb_fklen);
+  return r;
+}
+
+static unsigned long long
+nunits(unsigned long long pos, unsigned long long len, unsigned shift) {
+  return len ? ((pos + len - 1) >> shift) - (pos >> shift) + 1 : 0;
+}
+
+/* -s --json: layout diagnostics, reading the mapped file */
+static int jsmode(char *dbname) {
+  struct cdb c;
+  struct cdb_layer l;
+  const unsigned char *mem, *toc, *p;
+  int fd;
+  unsigned fsize, dend, hend, pos, t, i, k, rh, ss, tmask, nt;
+  unsigned cnt = 0, used = 0, hcnt = 0, maxprobe = 0, rsplit = 0;
+  unsigned *tused, *tprobe;
+  unsigned kmin = ~0u, kmax = 0, vmin = ~0u, vmax = 0, hmin = ~0u, hmax = 0;
+  unsigned tsplit4k = 0, tsplit2m = 0;
+  unsigned long long ktot = 0, vtot = 0, htot = 0;
+  unsigned long long hprobes = 0, hacc[2] = { 0, 0 };
+  double mprobes = 0, macc[2] = { 0, 0 };
+  struct touched tt;
+  unsigned dist[NDIST];
+  unsigned *vhist;
+  static const struct { const char *name; unsigned pm; } pct[] = {
+    { "p50", 500 }, { "p90", 900 }, { "p99", 990 }, { "p999", 999 },
+  };
+  const char *sep;
+
+  fd = strcmp(dbname, "-") == 0 ? 0 : open(dbname, O_RDONLY);
+  if (fd < 0 || cdb_init(&c, fd) != 0)
+    error(errno, "unable to open database `%s'", dbname);
+  fsize = c.file->fsize;
+  if (!(mem = (const unsigned char*)cdb_get(&c, fsize, 0)))
+    error(errno, "unable to read database `%s'", dbname);
+  toc = mem + c.cdb_toc;
+  dend = c.cdb_dend;
+  hend = c.cdb_ext ? c.cdb_ext : fsize;
+  rh = RHLEN(&c);
+  ss = c.cdb_fmt & CDB_FMT_DENSE ? 4 : 8;   /* hash table slot size */
+  /* hash value bits a reader compares */
+  tmask = c.cdb_fmt & CDB_FMT_DENSE ? ~((1u << c.cdb_ibits) - 1) : ~0u;
+#define RKLEN(r) (rh < 8 ? c.cdb_fklen : cdb_unpack(mem + (r)))
+#define RVLEN(r) (rh ? cdb_unpack(mem + (r) + rh - 4) : c.cdb_fvlen)
+  nt = NTABLES(&c);
+  vhist = (unsigned*)calloc(VCLASSES + 2 * nt, sizeof(unsigned));
+  if (!vhist)
+    error(ENOMEM, "unable to allocate memory");
+  tused = vhist + VCLASSES;
+  tprobe = tused + nt;
+
+  for (pos = 2048; pos < dend; ) {
+    unsigned klen, vlen;
+    if (dend - pos < rh) error(EPROTO, "invalid cdb file format");
+    klen = RKLEN(pos);
+    vlen = RVLEN(pos);
+    if (dend - pos - rh < klen || dend - pos - rh - klen < vlen)
+      error(EPROTO, "invalid cdb file format");
+    ++cnt;
+    ktot += klen;
+    if (kmin > klen) kmin = klen;
+    if (kmax < klen) kmax = klen;
+    vtot += vlen;
+    if (vmin > vlen) vmin = vlen;
+    if (vmax < vlen) vmax = vlen;
+    ++vhist[vclass(vlen)];
+    if (nunits(pos, rh + klen + vlen, 12) > 1)
+      ++rsplit;
+    pos += rh + klen + vlen;
+  }
+
+  for (k = 0; k < NDIST; ++k)
+    dist[k] = 0;
+  for (t = 0; t < nt; ++t) {
+    unsigned htab = cdb_unpack(toc + (t << 3));
+    unsigned n = cdb_unpack(toc + (t << 3) + 4);
+    unsigned long long miss[3] = { 0, 0, 0 };
+    tused[t] = tprobe[t] = 0;
+    if (!n) {
+      macc[0] += 1, macc[1] += 1; /* just the toc */
+      continue;
+    }
+    if (htab < dend || htab > hend || n > (hend - htab) / ss)
+      error(EPROTO, "invalid cdb hash table");
+    p = mem + htab;
+    for (i = 0; i < n; ++i) {
+      unsigned h, hr;
+      unsigned rpos = jslot(&c, mem, p + i * ss, &h);
+      unsigned s, d, j, klen;
+      if (!rpos) continue;
+      if (rpos < 2048 || rpos > dend - rh)
+        error(EPROTO, "invalid cdb hash table");
+      ++tused[t];
+      s = c.cdb_fmt & CDB_FMT_POW2 ?
+          (h >> c.cdb_tbits) & (n - 1) : (h >> 8) % n;
+      d = i >= s ? i - s : n - s + i;
+      k = d < NDIST - 1 ? d : NDIST - 1;
+      ++dist[k];
+      if (tprobe[t] < d + 1) tprobe[t] = d + 1;
+      hprobes += d + 1;
+      /* toc entry, slots up to this one, records with the same hash
+       * value on the way (key length, maybe the key), and the record */
+      tt.n[0] = tt.n[1] = 0;
+      touch(&tt, c.cdb_toc + (t << 3), 8);
+      touchslots(&tt, htab, n, s, d + 1, ss);
+      klen = RKLEN(rpos);
+      for (j = s; j != i; j = j + 1 < n ? j + 1 : 0) {
+        unsigned r = jslot(&c, mem, p + j * ss, &hr);
+        if (r < 2048 || r > dend - rh || ((hr ^ h) & tmask))
+          continue;
+        touch(&tt, r, RKLEN(r) == klen ? rh + klen : rh);
+      }
+      touch(&tt, rpos, rh + klen + RVLEN(rpos));
+      hacc[0] += tt.n[0];
+      hacc[1] += tt.n[1];
+    }
+    /* a miss examines slots up to the first empty one */
+    for (i = 0; i < n; ++i) {
+      unsigned m = 1;
+      while(m < n && cdb_unpack(p + ((i + m - 1) % n) * ss + ss - 4))
+        ++m;
+      tt.n[0] = tt.n[1] = 0;
+      touch(&tt, c.cdb_toc + (t << 3), 8);
+      touchslots(&tt, htab, n, i, m, ss);
+      miss[0] += tt.n[0];
+      miss[1] += tt.n[1];
+      miss[2] += m;
+    }
+    /* every table gets its share of misses, spread evenly over its slots */
+    macc[0] += (double)miss[0] / n;
+    macc[1] += (double)miss[1] / n;
+    mprobes += (double)miss[2] / n;
+    used += tused[t];
+    if (maxprobe < tprobe[t]) maxprobe = tprobe[t];
+    if (nunits(htab, n * ss, 12) > 1) ++tsplit4k;
+    if (nunits(htab, n * ss, 21) > 1) ++tsplit2m;
+    if (hmin > n) hmin = n;
+    if (hmax < n) hmax = n;
+    htot += n;
+    ++hcnt;
+  }
+  if (used != cnt)
+    error(EPROTO, "invalid cdb hash table");
+
+#undef RKLEN
+#undef RVLEN
+#define AVG(tot, n) ((n) ? (double)(tot) / (n) : 0.0)
+  printf("{\n \"format\": \"%s\",\n",
+         c.cdb_fmt & CDB_FMT_DENSE ? "dense" :
+         c.cdb_fmt & CDB_FMT_FIXKEY ? "fixkey" :
+         c.cdb_toc && !c.cdb_fmt ? "streamed" : "classic");
+  if (c.cdb_fmt & CDB_FMT_HASH)
+    printf(" \"hash_function\": \"%s\",\n", hashnames[c.cdb_hfn]);
+  if (c.cdb_fmt & CDB_FMT_POW2)
+    printf(" \"toc\": {\"tables\": %u, \"pow2\": true},\n", nt);
+  if (cdb_layer_init(&c, &l) > 0)
+    printf(" \"overlay\": {\"tombstones\": %u, \"filter_bytes\": %u,"
+           " \"filter_k\": %u},\n", l.cdb_ntomb, l.cdb_fblocks * 64,
+           l.cdb_fk);
+  printf(" \"size\": %u,\n \"records\": %u,\n", fsize, cnt);
+  printf(" \"key\": {\"min\": %u, \"avg\": %.2f, \"max\": %u, \"total\": %llu},\n",
+         cnt ? kmin : 0, AVG(ktot, cnt), kmax, ktot);
+  printf(" \"value\": {\"min\": %u, \"avg\": %.2f, \"max\": %u, \"total\": %llu",
+         cnt ? vmin : 0, AVG(vtot, cnt), vmax, vtot);
+  for (i = 0; i < sizeof(pct) / sizeof(pct[0]); ++i) {
+    /* smallest length of the class holding the record of this rank */
+    unsigned long long rank = ((unsigned long long)cnt * pct[i].pm + 999) / 1000;
+    unsigned long long sum = 0;
+    for (k = 0; k < VCLASSES - 1 && (sum += vhist[k]) < rank; ++k)
+      ;
+    printf(", \"%s\": %u", pct[i].name, cnt ? vclassmin(k) : 0);
+  }
+  printf("},\n");
+  printf(" \"data\": {\"offset\": 2048, \"bytes\": %u, \"records_split_4k\": %u},\n",
+         dend - 2048, rsplit);
+  printf(" \"hash\": {\"offset\": %u, \"bytes\": %u, \"tables\": %u,"
+         " \"slots\": %llu, \"load\": %.3f,\n"
+         "  \"min\": %u, \"avg\": %.2f, \"max\": %u,"
+         " \"collisions\": %u, \"max_probe\": %u,\n"
+         "  \"pages_4k\": %llu, \"pages_2m\": %llu,"
+         " \"tables_split_4k\": %u, \"tables_split_2m\": %u,\n"
+         "  \"distances\": [",
+         dend, hend - dend, hcnt, htot, AVG(cnt, htot),
+         hcnt ? hmin : 0, AVG(htot, hcnt), hmax, cnt - dist[0], maxprobe,
+         nunits(dend, hend - dend, 12), nunits(dend, hend - dend, 21),
+         tsplit4k, tsplit2m);
+  for (k = 0; k < NDIST; ++k)
+    printf(k ? ", %u" : "%u", dist[k]);
+  printf("]},\n");
+  printf(" \"hit\": {\"probes\": %.3f, \"lines\": %.3f, \"pages\": %.3f},\n",
+         AVG(hprobes, cnt), AVG(hacc[0], cnt), AVG(hacc[1], cnt));
+  printf(" \"miss\": {\"probes\": %.3f, \"lines\": %.3f, \"pages\": %.3f},\n",
+         mprobes / nt, macc[0] / nt, macc[1] / nt);
+  printf(" \"tables\": [");
+  sep = "\n";
+  for (t = 0; t < nt; ++t) {
+    unsigned htab = cdb_unpack(toc + (t << 3));
+    unsigned n = cdb_unpack(toc + (t << 3) + 4);
+    if (!n) continue;
+    printf("%s  {\"index\": %u, \"offset\": %u, \"slots\": %u, \"used\": %u,"
+           " \"load\": %.3f, \"max_probe\": %u, \"pages_4k\": %llu}",
+           sep, t, htab, n, tused[t], (double)tused[t] / n, tprobe[t],
+           nunits(htab, n * ss, 12));
+    sep = ",\n";
+  }
+  printf("\n ]\n}\n");
+#undef AVG
+  free(vhist);
+  cdb_free(&c);
+  return 0;
 }
 
 static int getnum(FILE *f, unsigned *np, const char *fn) {
@@ -308,13 +1123,79 @@ static int getnum(FILE *f, unsigned *np, const char *fn) {
   return c;
 }
 
+/* changes for -i, kept in memory until all input is read.
+ * Keys and values live in one growing arena, so the delta array
+ * holds offsets into it until deltafinish() turns them into pointers */
+static struct cdb_delta *delta;
+static unsigned ndelta, adelta;
+static unsigned char *arena;
+static unsigned alen, apos;
+
+static unsigned
+arenaput(const unsigned char *p, unsigned len)
+{
+  unsigned pos = apos;
+  if (alen - apos < len) {
+    if (0xffffffff - apos < len)
+      error(ENOMEM, "too many changes");
+    while(alen - apos < len)
+      alen = alen ? (alen > 0x7fffffff ? 0xffffffff : alen << 1) : 65536;
+    arena = (unsigned char*)(arena ? realloc(arena, alen) : malloc(alen));
+    if (!arena)
+      error(ENOMEM, "unable to allocate %u bytes", alen);
+  }
+  memcpy(arena + apos, p, len);
+  apos += len;
+  return pos;
+}
+
 static void
-addrec(struct cdb_make *cdbmp,
-       const unsigned char *key, unsigned klen,
-       const unsigned char *val, unsigned vlen,
-       int flags)
+adddelta(const unsigned char *key, unsigned klen,
+         const unsigned char *val, unsigned vlen)
+{
+  struct cdb_delta *d;
+  if (ndelta >= adelta) {
+    adelta = adelta ? adelta << 1 : 1024;
+    delta = (struct cdb_delta*)(delta ? realloc(delta, adelta * sizeof(*d))
+                                      : malloc(adelta * sizeof(*d)));
+    if (!delta)
+      error(ENOMEM, "unable to allocate memory");
+  }
+  d = delta + ndelta++;
+  d->klen = klen;
+  d->key = (const void*)(size_t)arenaput(key, klen);
+  d->vlen = vlen;
+  d->val = val ? (const void*)(size_t)(arenaput(val, vlen) + 1) : NULL;
+}
+
+static void
+deltafinish(void)
+{
+  unsigned i;
+  for (i = 0; i < ndelta; ++i) {
+    delta[i].key = arena + (size_t)delta[i].key;
+    if (delta[i].val)
+      delta[i].val = arena + (size_t)delta[i].val - 1;
+  }
+}
+
+static void
+shardrec(unsigned hval,
+         const unsigned char *key, unsigned klen,
+         const unsigned char *val, unsigned vlen);
+
+static void
+addrech(struct cdb_make *cdbmp, unsigned hval,
+        const unsigned char *key, unsigned klen,
+        const unsigned char *val, unsigned vlen,
+        int flags)
 {
-  int r = cdb_make_put(cdbmp, key, klen, val, vlen, flags & F_DUPMASK);
+  int r;
+  if (!cdbmp) {  /* building a sharded database */
+    shardrec(hval, key, klen, val, vlen);
+    return;
+  }
+  r = cdb_make_puth(cdbmp, hval, key, klen, val, vlen, flags & F_DUPMASK);
   if (r < 0)
     error(errno, "cdb_make_put");
   else if (r && (flags & F_WARNDUP)) {
@@ -326,19 +1207,63 @@ addrec(struct cdb_make *cdbmp,
   }
 }
 
+static void
+addrec(struct cdb_make *cdbmp,
+       const unsigned char *key, unsigned klen,
+       const unsigned char *val, unsigned vlen,
+       int flags)
+{
+  checklen(klen, vlen);
+  if (flags & F_DELTA)
+    adddelta(key, klen, val, vlen);
+  else
+    addrech(cdbmp, cdb_make_hashkey(hmake, key, klen),
+            key, klen, val, vlen, flags);
+}
+
 static void
 dofile_cdb(struct cdb_make *cdbmp, FILE *f, const char *fn, int flags)
 {
   unsigned klen, vlen;
   int c;
-  while((c = getc(f)) == '+') {
+  struct stat st;
+  /* large values from a regular file in add mode bypass stdio
+   * (not when sharding, where records go through shardrec()) */
+  int bigok = cdbmp && !(flags & (F_DUPMASK|F_DELTA)) &&
+    fstat(fileno(f), &st) == 0 && S_ISREG(st.st_mode);
+  while((c = getc(f)) == '+' ||
+        (c == '-' && (flags & (F_DELTA|F_LAYER)))) {
+    if (c == '-') {  /* deletion: -klen:key */
+      if (getnum(f, &klen, fn) != ':')
+        badinput(fn);
+      allocbuf(klen);
+      fget(f, buf, klen, NULL, 0);
+      if (getc(f) != '\n') badinput(fn);
+      if (flags & F_DELTA)
+        adddelta(buf, klen, NULL, 0);
+      else if (fixkey && klen != fixkey)
+        badklen(klen);
+      else if (cdb_make_delete(cdbmp, buf, klen) != 0)
+        error(errno, "cdb_make_delete");
+      continue;
+    }
     if ((c = getnum(f, &klen, fn)) != ',' ||
         (c = getnum(f, &vlen, fn)) != ':' ||
         0xffffffff - klen < vlen)
       badinput(fn);
-    allocbuf(klen + vlen);
+    allocbuf(klen + (bigok && vlen >= BIGVAL ? 0 : vlen));
     fget(f, buf, klen, NULL, 0);
     if (getc(f) != '-' || getc(f) != '>') badinput(fn);
+    if (bigok && vlen >= BIGVAL) {
+      off_t pos = ftello(f);
+      checklen(klen, vlen);
+      if (pos < 0 || fseeko(f, vlen, SEEK_CUR) != 0)
+        error(errno, "%s", fn);
+      if (getc(f) != '\n') badinput(fn);
+      if (cdb_make_addfd(cdbmp, buf, klen, fileno(f), pos, vlen) != 0)
+        error(errno, "cdb_make_addfd");
+      continue;
+    }
     fget(f, buf + klen, vlen, NULL, 0);
     if (getc(f) != '\n') badinput(fn);
     addrec(cdbmp, buf, klen, buf + klen, vlen, flags);
@@ -346,34 +1271,36 @@ dofile_cdb(struct cdb_make *cdbmp, FILE *f, const char *fn, int flags)
   if (c != '\n') badinput(fn);
 }
 
+struct lnarg {
+  struct cdb_make *cdbmp;
+  int flags;
+};
+
+static void
+lnrec(void *arg, const unsigned char *key, unsigned klen,
+      const unsigned char *val, unsigned vlen)
+{
+  struct lnarg *a = (struct lnarg*)arg;
+  addrec(a->cdbmp, key, klen, val, vlen, a->flags);
+}
+
 static void
 dofile_ln(struct cdb_make *cdbmp, FILE *f, int flags)
 {
-  unsigned char *k, *v;
-  while(ufgets(buf, blen, f) != NULL) {
-    unsigned l = 0;
-    for (;;) {
-      l += ustrlen(buf + l);
-      v = buf + l;
-      if (v > buf && v[-1] == '\n') {
-        v[-1] = '\0';
-        break;
-      }
-      if (l < blen)
-        allocbuf(l + 512);
-      if (!ufgets(buf + l, blen - l, f))
-        break;
-    }
-    k = buf;
-    while(*k == ' ' || *k == '\t') ++k;
-    if (!*k || *k == '#')
-      continue;
-    v = k;
-    while(*v && *v != ' ' && *v != '\t') ++v;
-    if (*v) *v++ = '\0';
-    while(*v == ' ' || *v == '\t') ++v;
-    addrec(cdbmp, k, ustrlen(k), v, ustrlen(v), flags);
-  }
+  struct lnarg a;
+  size_t len = 0, n, used;
+  a.cdbmp = cdbmp;
+  a.flags = flags;
+  allocbuf(MAPBLOCK);
+  do {
+    if (len == blen)  /* line longer than the buffer */
+      allocbuf(blen * 2);
+    n = fread(buf + len, 1, blen - len, f);
+    len += n;
+    used = maptok(buf, len, !n, lnrec, &a);
+    memmove(buf, buf + used, len - used);
+    len -= used;
+  } while(n);
 }
 
 static void
@@ -387,11 +1314,335 @@ dofile(struct cdb_make *cdbmp, FILE *f, const char *fn, int flags)
     error(errno, "read error");
 }
 
-static int
-cmode(char *dbname, char *tmpname, int argc, char **argv, int flags, int perms)
-{
-  struct cdb_make cdb;
-  int fd;
+#ifdef HAVE_PTHREAD
+
+/* Parallel input pipeline for -j: a reader thread cuts the input into
+ * large blocks at record boundaries, worker threads parse the blocks
+ * and hash the keys, and the calling thread adds the records to the
+ * database strictly in input order, so the result (including duplicate
+ * handling) is exactly the same as with the sequential code above. */
+
+#define PBLOCK  (4 << 20)  /* input block size */
+
+struct prec {
+  const unsigned char *key, *val;
+  unsigned klen, vlen, hval;
+};
+
+struct pblock {
+  unsigned char *data;
+  size_t len;
+  int last;       /* no input after this block */
+  int err;        /* read error (errno) at the end of this block */
+  int bad;        /* invalid input found in this block */
+  int done;       /* parsed */
+  struct prec *recs;
+  unsigned nrecs, arecs;
+};
+
+struct pipeline {
+  pthread_mutex_t mtx;
+  pthread_cond_t cfree, cwork, cdone;
+  struct pblock *blk;
+  unsigned nblk;
+  unsigned rd, wk, wr;  /* blocks read, taken by workers, written */
+  int eof;              /* reader is finished */
+  int fd, flags;
+};
+
+/* parse "+klen,vlen:" at *pp; 1 if ok, 0 if incomplete, -1 if invalid */
+static int
+phdr(const unsigned char **pp, const unsigned char *e,
+     unsigned *klenp, unsigned *vlenp)
+{
+  const unsigned char *p = *pp + 1;
+  unsigned n[2], c;
+  int i;
+  for (i = 0; i < 2; ++i) {
+    if (p >= e) return 0;
+    if (*p < '0' || *p > '9') return -1;
+    n[i] = 0;
+    while(p < e && *p >= '0' && *p <= '9') {
+      c = *p++ - '0';
+      if (0xffffffff / 10 - c < n[i]) return -1;
+      n[i] = n[i] * 10 + c;
+    }
+    if (p >= e) return 0;
+    if (*p++ != (i ? ':' : ',')) return -1;
+  }
+  if (0xffffffff - n[0] < n[1]) return -1;
+  *klenp = n[0];
+  *vlenp = n[1];
+  *pp = p;
+  return 1;
+}
+
+/* length of the complete native records at the start of d */
+static size_t
+pcut_cdb(const unsigned char *d, size_t len, int *lastp)
+{
+  const unsigned char *p = d, *q, *e = d + len;
+  unsigned klen, vlen;
+  int r;
+  while(p < e) {
+    if (*p == '\n') {  /* end of records */
+      *lastp = 1;
+      return p + 1 - d;
+    }
+    q = p;
+    if (*p != '+' || (r = phdr(&q, e, &klen, &vlen)) < 0) {
+      *lastp = 1;  /* let a worker complain */
+      return len;
+    }
+    if (!r || (unsigned long long)klen + vlen + 3 > (size_t)(e - q))
+      break;
+    p = q + klen + vlen + 3;
+  }
+  return p - d;
+}
+
+/* length of the complete lines at the start of d */
+static size_t
+pcut_ln(const unsigned char *d, size_t len)
+{
+  while(len && d[len-1] != '\n')
+    --len;
+  return len;
+}
+
+static void
+paddrec(struct pblock *b,
+        const unsigned char *key, unsigned klen,
+        const unsigned char *val, unsigned vlen)
+{
+  struct prec *r;
+  if (b->nrecs >= b->arecs) {
+    b->arecs = b->arecs ? b->arecs << 1 : 4096;
+    b->recs = (struct prec*)realloc(b->recs, b->arecs * sizeof(*r));
+    if (!b->recs)
+      error(ENOMEM, "unable to allocate memory");
+  }
+  checklen(klen, vlen);
+  r = b->recs + b->nrecs++;
+  r->key = key; r->klen = klen;
+  r->val = val; r->vlen = vlen;
+  r->hval = cdb_make_hashkey(hmake, key, klen);
+}
+
+static void
+pparse_cdb(struct pblock *b)
+{
+  const unsigned char *p = b->data, *e = p + b->len, *key;
+  unsigned klen, vlen;
+  while(p < e) {
+    if (*p == '\n')
+      return;
+    if (*p != '+' || phdr(&p, e, &klen, &vlen) <= 0 ||
+        (unsigned long long)klen + vlen + 3 > (size_t)(e - p))
+      break;
+    key = p;
+    p += klen;
+    if (p[0] != '-' || p[1] != '>' || p[2 + vlen] != '\n')
+      break;
+    paddrec(b, key, klen, p + 2, vlen);
+    p += 2 + vlen + 1;
+  }
+  if (p < e || b->last)
+    b->bad = 1;
+}
+
+static void
+pmaprec(void *arg, const unsigned char *key, unsigned klen,
+        const unsigned char *val, unsigned vlen)
+{
+  paddrec((struct pblock*)arg, key, klen, val, vlen);
+}
+
+static void
+pparse_ln(struct pblock *b)
+{
+  maptok(b->data, b->len, 1, pmaprec, b);
+}
+
+static void *
+preader(void *arg)
+{
+  struct pipeline *pl = (struct pipeline*)arg;
+  unsigned char *carry = NULL;
+  size_t clen = 0;
+  int last = 0;
+  while(!last) {
+    struct pblock *b;
+    size_t cap = clen * 2 > PBLOCK ? clen * 2 : PBLOCK, len = clen, cut;
+    int eof = 0, err = 0;
+    ssize_t l;
+
+    pthread_mutex_lock(&pl->mtx);
+    while(pl->rd - pl->wr >= pl->nblk)
+      pthread_cond_wait(&pl->cfree, &pl->mtx);
+    b = pl->blk + pl->rd % pl->nblk;
+    pthread_mutex_unlock(&pl->mtx);
+
+    memset(b, 0, sizeof(*b));
+    if (!(b->data = (unsigned char*)malloc(cap)))
+      error(ENOMEM, "unable to allocate memory");
+    if (clen)
+      memcpy(b->data, carry, clen);
+    for(;;) {
+      while(len < cap && !eof) {
+        l = read(pl->fd, b->data + len, cap - len);
+        if (l > 0)
+          len += l;
+        else if (!l)
+          eof = 1;
+        else if (errno != EINTR)
+          err = errno, eof = 1;
+      }
+      if (pl->flags & F_MAP)
+        cut = eof ? len : pcut_ln(b->data, len);
+      else {
+        cut = pcut_cdb(b->data, len, &last);
+        if (eof && !last)
+          cut = len;
+      }
+      if (cut || eof || last)
+        break;
+      /* a record bigger than the block */
+      cap *= 2;
+      if (!(b->data = (unsigned char*)realloc(b->data, cap)))
+        error(ENOMEM, "unable to allocate memory");
+    }
+    if (eof)
+      last = 1;
+    /* keep the partial record for the next block */
+    clen = len - cut;
+    if (clen && !last) {
+      if (!(carry = (unsigned char*)realloc(carry, clen)))
+        error(ENOMEM, "unable to allocate memory");
+      memcpy(carry, b->data + cut, clen);
+    }
+    b->len = cut;
+    b->last = last;
+    b->err = err;
+
+    pthread_mutex_lock(&pl->mtx);
+    ++pl->rd;
+    if (last)
+      pl->eof = 1;
+    pthread_cond_broadcast(&pl->cwork);
+    pthread_cond_broadcast(&pl->cdone);
+    pthread_mutex_unlock(&pl->mtx);
+  }
+  free(carry);
+  return NULL;
+}
+
+static void *
+pworker(void *arg)
+{
+  struct pipeline *pl = (struct pipeline*)arg;
+  struct pblock *b;
+  for(;;) {
+    pthread_mutex_lock(&pl->mtx);
+    while(pl->wk == pl->rd && !pl->eof)
+      pthread_cond_wait(&pl->cwork, &pl->mtx);
+    if (pl->wk == pl->rd) {
+      pthread_mutex_unlock(&pl->mtx);
+      return NULL;
+    }
+    b = pl->blk + pl->wk++ % pl->nblk;
+    pthread_mutex_unlock(&pl->mtx);
+
+    if (pl->flags & F_MAP)
+      pparse_ln(b);
+    else
+      pparse_cdb(b);
+
+    pthread_mutex_lock(&pl->mtx);
+    b->done = 1;
+    pthread_cond_broadcast(&pl->cdone);
+    pthread_mutex_unlock(&pl->mtx);
+  }
+}
+
+static void
+dofile_mt(struct cdb_make *cdbmp, int fd, const char *fn, int flags,
+          int jobs)
+{
+  struct pipeline pl;
+  pthread_t *tids;
+  struct pblock *b;
+  unsigned i;
+  int r;
+
+  memset(&pl, 0, sizeof(pl));
+  pthread_mutex_init(&pl.mtx, NULL);
+  pthread_cond_init(&pl.cfree, NULL);
+  pthread_cond_init(&pl.cwork, NULL);
+  pthread_cond_init(&pl.cdone, NULL);
+  pl.nblk = jobs * 2 + 2;
+  pl.blk = (struct pblock*)calloc(pl.nblk, sizeof(*pl.blk));
+  tids = (pthread_t*)malloc((jobs + 1) * sizeof(*tids));
+  if (!pl.blk || !tids)
+    error(ENOMEM, "unable to allocate memory");
+  pl.fd = fd;
+  pl.flags = flags;
+
+  if ((r = pthread_create(&tids[0], NULL, preader, &pl)) != 0)
+    error(r, "unable to create thread");
+  for (i = 1; i <= (unsigned)jobs; ++i)
+    if ((r = pthread_create(&tids[i], NULL, pworker, &pl)) != 0)
+      error(r, "unable to create thread");
+
+  for(;;) {
+    pthread_mutex_lock(&pl.mtx);
+    while(pl.wr == pl.rd ? !pl.eof : !pl.blk[pl.wr % pl.nblk].done)
+      pthread_cond_wait(&pl.cdone, &pl.mtx);
+    if (pl.wr == pl.rd) {
+      pthread_mutex_unlock(&pl.mtx);
+      break;
+    }
+    b = pl.blk + pl.wr % pl.nblk;
+    pthread_mutex_unlock(&pl.mtx);
+
+    for (i = 0; i < b->nrecs; ++i)
+      addrech(cdbmp, b->recs[i].hval, b->recs[i].key, b->recs[i].klen,
+              b->recs[i].val, b->recs[i].vlen, flags);
+    if (b->err)
+      error(b->err, "read error");
+    if (b->bad)
+      badinput(fn);
+    free(b->data);
+    free(b->recs);
+
+    pthread_mutex_lock(&pl.mtx);
+    ++pl.wr;
+    pthread_cond_signal(&pl.cfree);
+    pthread_mutex_unlock(&pl.mtx);
+  }
+
+  for (i = 0; i <= (unsigned)jobs; ++i)
+    pthread_join(tids[i], NULL);
+  free(tids);
+  free(pl.blk);
+  pthread_cond_destroy(&pl.cfree);
+  pthread_cond_destroy(&pl.cwork);
+  pthread_cond_destroy(&pl.cdone);
+  pthread_mutex_destroy(&pl.mtx);
+}
+
+#endif /* HAVE_PTHREAD */
+
+/* create (temporary) database file, return its descriptor */
+static int
+createdb(char *dbname, char **tmpnamep, int perms)
+{
+  char *tmpname = *tmpnamep;
+  int fd;
+  if (strcmp(dbname, "-") == 0) { /* standard output, as is */
+    *tmpnamep = dbname;
+    return 1;
+  }
   if (!tmpname) {
     tmpname = (char*)malloc(strlen(dbname) + 5);
     if (!tmpname)
@@ -414,42 +1665,1385 @@ cmode(char *dbname, char *tmpname, int argc, char **argv, int flags, int perms)
             perms >= 0 ? perms : 0666);
   if (fd < 0)
     error(errno, "unable to create %s", tmpname);
-  cdb_make_start(&cdb, fd);
+  *tmpnamep = tmpname;
+  return fd;
+}
+
+/* finish the database and move it to its permanent place */
+static void
+finishdb(struct cdb_make *cdbmp, int fd, char *dbname, char *tmpname)
+{
+  if (cdb_make_finish(cdbmp) != 0)
+    error(errno, "cdb_make_finish");
+  close(fd);
+  if (tmpname != dbname)
+    if (rename(tmpname, dbname) != 0)
+      error(errno, "rename %s->%s", tmpname, dbname);
+}
+
+/* start a database with the options given */
+static void
+startdb(struct cdb_make *cdbmp, int fd, int flags)
+{
+  cdb_make_start(cdbmp, fd);
+  if (flags & F_STREAM)
+    cdb_make_stream(cdbmp);
+  if (flags & F_CRC)
+    cdb_make_checksum(cdbmp, 0);
+  if (fixval != ~0u)
+    cdb_make_dense(cdbmp, fixkey, fixval);
+  else if (fixkey)
+    cdb_make_fixkey(cdbmp, fixkey);
+  if (flags & F_COMPACT)
+    cdb_make_compact(cdbmp);
+  if (hashfn)
+    cdb_make_hash(cdbmp, hashfn, hashkey);
+  if (ntables || loadpct)
+    cdb_make_tables(cdbmp, ntables, loadpct);
+  /* layers of an overlay get a filter unless told otherwise */
+  if (filterbits != ~0u)
+    cdb_make_filter(cdbmp, filterbits);
+  else if (flags & F_LAYER)
+    cdb_make_filter(cdbmp, 10);
+  if (!hmake)
+    hmake = cdbmp;
+}
+
+/* read all input files (or stdin) into the database */
+static void
+doinput(struct cdb_make *cdbmp, int argc, char **argv, int flags, int jobs)
+{
   allocbuf(4096);
+#ifdef HAVE_PTHREAD
+  if (jobs && !(flags & (F_DELTA|F_LAYER))) {
+    int i, ifd;
+    for (i = 0; i < (argc ? argc : 1); ++i) {
+      if (!argc || strcmp(argv[i], "-") == 0)
+        dofile_mt(cdbmp, 0, "(stdin)", flags, jobs);
+      else {
+        if ((ifd = open(argv[i], O_RDONLY)) < 0)
+          error(errno, "%s", argv[i]);
+        dofile_mt(cdbmp, ifd, argv[i], flags, jobs);
+        close(ifd);
+      }
+    }
+  }
+  else
+#endif
   if (argc) {
     int i;
     for (i = 0; i < argc; ++i) {
       if (strcmp(argv[i], "-") == 0)
-        dofile(&cdb, stdin, "(stdin)", flags);
+        dofile(cdbmp, stdin, "(stdin)", flags);
       else {
         FILE *f = fopen(argv[i], "r");
         if (!f)
           error(errno, "%s", argv[i]);
-        dofile(&cdb, f, argv[i], flags);
+        dofile(cdbmp, f, argv[i], flags);
         fclose(f);
       }
     }
   }
   else
-    dofile(&cdb, stdin, "(stdin)", flags);
-  if (cdb_make_finish(&cdb) != 0)
-    error(errno, "cdb_make_finish");
+    dofile(cdbmp, stdin, "(stdin)", flags);
+}
+
+static int
+cmode(char *dbname, char *tmpname, int argc, char **argv, int flags, int perms,
+      char *olddb, int jobs)
+{
+  struct cdb_make cdb;
+  struct cdb c;
+  int ofd = -1, fd;
+  /* the old database may well be the one being replaced, so open it first */
+  if (olddb) {
+    ofd = open(olddb, O_RDONLY);
+    if (ofd < 0 || cdb_init(&c, ofd) != 0)
+      error(errno, "unable to open database `%s'", olddb);
+    flags |= F_DELTA;
+    if (!fixkey) {  /* keep the format */
+      fixkey = c.cdb_fklen;
+      if (c.cdb_fmt & CDB_FMT_DENSE)
+        fixval = c.cdb_fvlen;
+    }
+    if (!hashfn) {
+      hashfn = c.cdb_hfn;
+      memcpy(hashkey, c.cdb_hkey, 16);
+    }
+    if (!ntables && (c.cdb_fmt & CDB_FMT_POW2))
+      ntables = 1u << c.cdb_tbits;
+  }
+  fd = createdb(dbname, &tmpname, perms);
+  startdb(&cdb, fd, flags);
+  doinput(&cdb, argc, argv, flags, jobs);
+  if (olddb) {
+    deltafinish();
+    if (cdb_make_update(&cdb, &c, delta, ndelta) != 0)
+      error(errno, "%s", olddb);
+    cdb_free(&c);
+    close(ofd);
+  }
+  finishdb(&cdb, fd, dbname, tmpname);
+  return 0;
+}
+
+/* --shards: records are routed by cdb_shardof() of their hash value to
+ * one of several databases, each built by its own thread from batches
+ * of records queued by the input side.  Every shard sees its records in
+ * input order, so duplicate handling works as in a single database. */
+
+#define SBATCH  (256 << 10)  /* records are queued in batches this large */
+#define SQUEUE  4            /* max queued batches per shard */
+
+struct sbatch {
+  struct sbatch *next;
+  size_t len, cap;
+  unsigned char *data;  /* records: hval klen vlen key val */
+};
+
+struct shard {
+  struct cdb_make cdbm;
+  int fd;
+  char *name, *tmpname;
+  struct sbatch *cur;   /* being filled */
+#ifdef HAVE_PTHREAD
+  pthread_t tid;
+  pthread_mutex_t mtx;
+  pthread_cond_t cv;
+  struct sbatch *head, **tailp;
+  unsigned queued;
+  int eof;
+#endif
+};
+
+static struct shard *shards;
+static unsigned nshards;
+static int shflags;
+
+/* add all records of the batch to the shard database */
+static void
+shardput(struct shard *sh, struct sbatch *b)
+{
+  const unsigned char *p = b->data, *e = p + b->len;
+  unsigned h[3];
+  while(p < e) {
+    memcpy(h, p, sizeof(h));
+    p += sizeof(h);
+    addrech(&sh->cdbm, h[0], p, h[1], p + h[1], h[2], shflags);
+    p += h[1] + h[2];
+  }
+  free(b->data);
+  free(b);
+}
+
+#ifdef HAVE_PTHREAD
+static void *
+shardthread(void *arg)
+{
+  struct shard *sh = (struct shard*)arg;
+  struct sbatch *b;
+  for(;;) {
+    pthread_mutex_lock(&sh->mtx);
+    while(!sh->head && !sh->eof)
+      pthread_cond_wait(&sh->cv, &sh->mtx);
+    if ((b = sh->head) != NULL) {
+      if (!(sh->head = b->next))
+        sh->tailp = &sh->head;
+      --sh->queued;
+      pthread_cond_broadcast(&sh->cv);
+    }
+    pthread_mutex_unlock(&sh->mtx);
+    if (!b)
+      break;
+    shardput(sh, b);
+  }
+  finishdb(&sh->cdbm, sh->fd, sh->name, sh->tmpname);
+  return NULL;
+}
+#endif
+
+/* hand the current batch over to the shard */
+static void
+shardflush(struct shard *sh)
+{
+  struct sbatch *b = sh->cur;
+  if (!b)
+    return;
+  sh->cur = NULL;
+#ifdef HAVE_PTHREAD
+  b->next = NULL;
+  pthread_mutex_lock(&sh->mtx);
+  while(sh->queued >= SQUEUE)
+    pthread_cond_wait(&sh->cv, &sh->mtx);
+  *sh->tailp = b;
+  sh->tailp = &b->next;
+  ++sh->queued;
+  pthread_cond_broadcast(&sh->cv);
+  pthread_mutex_unlock(&sh->mtx);
+#else
+  shardput(sh, b);
+#endif
+}
+
+static void
+shardrec(unsigned hval,
+         const unsigned char *key, unsigned klen,
+         const unsigned char *val, unsigned vlen)
+{
+  struct shard *sh = &shards[cdb_shardof(hval, nshards)];
+  struct sbatch *b = sh->cur;
+  unsigned h[3];
+  size_t need = sizeof(h) + (size_t)klen + vlen;
+  if (b && b->cap - b->len < need) {
+    shardflush(sh);
+    b = NULL;
+  }
+  if (!b) {
+    if (!(b = (struct sbatch*)malloc(sizeof(*b))))
+      error(ENOMEM, "unable to allocate memory");
+    b->len = 0;
+    b->cap = need > SBATCH ? need : SBATCH;
+    if (!(b->data = (unsigned char*)malloc(b->cap)))
+      error(ENOMEM, "unable to allocate memory");
+    sh->cur = b;
+  }
+  h[0] = hval; h[1] = klen; h[2] = vlen;
+  memcpy(b->data + b->len, h, sizeof(h));
+  memcpy(b->data + b->len + sizeof(h), key, klen);
+  memcpy(b->data + b->len + sizeof(h) + klen, val, vlen);
+  b->len += need;
+}
+
+static int
+shmode(char *dbname, char *tmpname, int argc, char **argv, int flags,
+       int perms, unsigned n, int jobs)
+{
+  struct shard *sh;
+  const char *base = strrchr(dbname, '/');
+  char *mtmp = tmpname;
+  FILE *f;
+  unsigned i;
+  int fd;
+
+  if (tmpname && strcmp(tmpname, "-") != 0 && strcmp(tmpname, dbname) != 0)
+    error(0, "temp file name can not be given for a sharded database");
+  if (strcmp(dbname, "-") == 0)
+    error(0, "sharded database can not be written to standard output");
+  base = base ? base + 1 : dbname;
+  shards = (struct shard*)calloc(n, sizeof(*shards));
+  if (!shards)
+    error(ENOMEM, "unable to allocate memory");
+  nshards = n;
+  shflags = flags;
+  for (i = 0; i < n; ++i) {
+    sh = &shards[i];
+    if (!(sh->name = (char*)malloc(strlen(dbname) + 12)))
+      error(ENOMEM, "unable to allocate memory");
+    sprintf(sh->name, "%s.%u", dbname, i);
+    sh->tmpname = tmpname ? "-" : NULL;
+    sh->fd = createdb(sh->name, &sh->tmpname, perms);
+    startdb(&sh->cdbm, sh->fd, flags);
+#ifdef HAVE_PTHREAD
+    {
+      int r;
+      pthread_mutex_init(&sh->mtx, NULL);
+      pthread_cond_init(&sh->cv, NULL);
+      sh->tailp = &sh->head;
+      if ((r = pthread_create(&sh->tid, NULL, shardthread, sh)) != 0)
+        error(r, "unable to create thread");
+    }
+#endif
+  }
+
+  doinput(NULL, argc, argv, flags, jobs);
+
+  for (i = 0; i < n; ++i) {
+    sh = &shards[i];
+    shardflush(sh);
+#ifdef HAVE_PTHREAD
+    pthread_mutex_lock(&sh->mtx);
+    sh->eof = 1;
+    pthread_cond_broadcast(&sh->cv);
+    pthread_mutex_unlock(&sh->mtx);
+#else
+    finishdb(&sh->cdbm, sh->fd, sh->name, sh->tmpname);
+#endif
+  }
+#ifdef HAVE_PTHREAD
+  for (i = 0; i < n; ++i)
+    pthread_join(shards[i].tid, NULL);
+#endif
+
+  /* the manifest goes last, so it never names incomplete shards */
+  fd = createdb(dbname, &mtmp, perms);
+  if (!(f = fdopen(fd, "w")))
+    error(errno, "%s", mtmp);
+  fprintf(f, CDB_SHARDS_MAGIC " %u\n", n);
+  for (i = 0; i < n; ++i)
+    fprintf(f, "%s.%u\n", base, i);
+  if (fclose(f) != 0)
+    error(errno, "unable to write %s", mtmp);
+  if (mtmp != dbname)
+    if (rename(mtmp, dbname) != 0)
+      error(errno, "rename %s->%s", mtmp, dbname);
+  return 0;
+}
+
+static int
+mmode(char *dbname, char *tmpname, int argc, char **argv, int flags, int perms)
+{
+  struct cdb_make cdbm;
+  int fd = createdb(dbname, &tmpname, perms);
+  int i, r;
+  startdb(&cdbm, fd, flags);
+  for (i = 0; i < argc; ++i) {
+    struct cdb c;
+    int ifd = open(argv[i], O_RDONLY);
+    if (ifd < 0 || cdb_init(&c, ifd) != 0)
+      error(errno, "unable to open database `%s'", argv[i]);
+    r = cdb_make_merge(&cdbm, &c, flags & F_DUPMASK);
+    if (r < 0)
+      error(errno, "%s", argv[i]);
+    else if (r && (flags & F_WARNDUP)) {
+      fprintf(stderr, "%s: %s: duplicate keys\n", progname, argv[i]);
+      if (flags & F_ERRDUP)
+        exit(1);
+    }
+    cdb_free(&c);
+    close(ifd);
+  }
+  finishdb(&cdbm, fd, dbname, tmpname);
+  return 0;
+}
+
+/* --overlay: merge layers num and up of an overlay (1 is the base, all
+ * of it by default) into one database.  The result of a partial merge
+ * is a layer itself, so it keeps tombstones and gets a filter.  Any of
+ * the layers may be replaced, they are all open by now. */
+static int
+omode(char *dbname, char *tmpname, const char *manifest, int num, int flags,
+      int perms)
+{
+  struct cdb_overlay co;
+  struct cdb_make cdbm;
+  int fd;
+  if (cdb_overlay_init(&co, manifest) != 0)
+    error(errno, "unable to open overlay `%s'", manifest);
+  if (num > (int)co.cdb_nlayers)
+    error(0, "overlay `%s' has %u layers only", manifest, co.cdb_nlayers);
+  fd = createdb(dbname, &tmpname, perms);
+  startdb(&cdbm, fd, num > 1 ? flags | F_LAYER : flags);
+  if (cdb_make_overlay(&cdbm, &co, num ? num - 1 : 0) != 0)
+    error(errno, "%s", manifest);
+  finishdb(&cdbm, fd, dbname, tmpname);
+  cdb_overlay_free(&co);
+  return 0;
+}
+
+/* -V: verify checksums, every thread its own part of the file */
+struct vpart {
+  const struct cdb *cdbp;
+  unsigned part, nparts;
+  int r, err;
+#ifdef HAVE_PTHREAD
+  pthread_t tid;
+#endif
+};
+
+static void *
+vpart(void *arg)
+{
+  struct vpart *vp = (struct vpart*)arg;
+  vp->r = cdb_verify(vp->cdbp, vp->part, vp->nparts);
+  vp->err = errno;
+  return NULL;
+}
+
+static int
+vmode(char *dbname, int jobs)
+{
+  struct cdb c;
+  struct vpart *vp;
+  unsigned i, n = jobs ? jobs : 1;
+  int fd = open(dbname, O_RDONLY);
+
+  if (fd < 0 || cdb_init(&c, fd) != 0)
+    error(errno, "unable to open database `%s'", dbname);
+  if (!(vp = (struct vpart*)calloc(n, sizeof(*vp))))
+    error(ENOMEM, "unable to allocate memory");
+  for (i = 0; i < n; ++i) {
+    vp[i].cdbp = &c;
+    vp[i].part = i;
+    vp[i].nparts = n;
+  }
+#ifdef HAVE_PTHREAD
+  for (i = 1; i < n; ++i)
+    if ((errno = pthread_create(&vp[i].tid, NULL, vpart, &vp[i])) != 0)
+      error(errno, "unable to create thread");
+#endif
+  vpart(&vp[0]);
+  for (i = 1; i < n; ++i) {
+#ifdef HAVE_PTHREAD
+    pthread_join(vp[i].tid, NULL);
+#else
+    vpart(&vp[i]);
+#endif
+  }
+  for (i = 0; i < n; ++i)
+    if (vp[i].r < 0)
+      error(vp[i].err, vp[i].err == EPROTO ?
+            "%s: checksum mismatch" : "%s", dbname);
+  i = vp[0].r;
+  free(vp);
+  cdb_free(&c);
   close(fd);
+  if (!i) {
+    fprintf(stderr, "%s: %s: no checksums\n", progname, dbname);
+    return 100;
+  }
+  return 0;
+}
+
+/* Drop the toc from extension section e of length len, moving other
+ * records to the beginning of e, and return their length. */
+static unsigned
+eother(unsigned char *e, unsigned len)
+{
+  unsigned char *p = e;
+  unsigned l, olen = 0;
+  while(len >= 8) {
+    l = cdb_unpack(p + 4);
+    if (l > len - 8)
+      error(EPROTO, "invalid cdb file format");
+    if (memcmp(p, CDB_EXT_TOC, 4) != 0) {
+      memmove(e + olen, p, 8 + l);
+      olen += 8 + l;
+    }
+    p += 8 + l;
+    len -= 8 + l;
+  }
+  return olen;
+}
+
+/* write extension section at pos: the toc if given, other records e */
+static void
+wext(FILE *fo, const char *name, unsigned pos, const unsigned char *toc,
+     const unsigned char *e, unsigned elen)
+{
+  unsigned char h[CDB_EXT_FOOTER];
+  unsigned len = (toc ? 8 + 2048 : 0) + elen;
+  if (0xffffffff - pos - CDB_EXT_FOOTER < len)
+    error(ENOMEM, "%s", name);
+  if (toc) {
+    memcpy(h, CDB_EXT_TOC, 4);
+    cdb_pack(2048, h + 4);
+    if (fwrite(h, 1, 8, fo) != 8 || fwrite(toc, 1, 2048, fo) != 2048)
+      error(errno, "unable to write %s", name);
+  }
+  cdb_pack(pos, h);
+  cdb_pack(len, h + 4);
+  memcpy(h + 8, CDB_EXT_MAGIC, 8);
+  if (fwrite(e, 1, elen, fo) != elen ||
+      fwrite(h, 1, CDB_EXT_FOOTER, fo) != CDB_EXT_FOOTER)
+    error(errno, "unable to write %s", name);
+}
+
+#define MAXEXT  (1 << 20)  /* max extension section size we handle */
+
+static unsigned char ebuf[MAXEXT + CDB_EXT_FOOTER];
+
+/* toc of classic database c, the only format --convert handles */
+static const unsigned char *
+xtoc(const struct cdb *cp)
+{
+  const unsigned char *toc;
+  unsigned fmt = cp->cdb_fmt;
+  if (fmt)
+    error(EPROTO, "can not handle %s format",
+          fmt & CDB_FMT_DENSE ? "dense" :
+          fmt & CDB_FMT_FIXKEY ? "fixed-length key" :
+          fmt & CDB_FMT_HASH ? "hash function" : "power-of-two table");
+  if (!(toc = (const unsigned char*)cdb_get(cp, 2048, cp->cdb_toc)))
+    error(EPROTO, "invalid cdb file format");
+  return toc;
+}
+
+/* --convert: rewrite a database as a streamed or a classic one, in one
+ * sequential pass where possible.  Records and hash tables stay in place,
+ * only the toc moves; other extension records are carried over. */
+static int
+xmode(char *dbname, char *tmpname, char *indb, int flags, int perms)
+{
+  unsigned char toc[2048];
+  const unsigned char *et;
+  unsigned pos = 0, end = 2048, ext = 0, t, olen = 0, len;
+  struct cdb c;
+  FILE *fi, *fo;
+  int fd;
+
+  if (strcmp(indb, "-") == 0)
+    fi = stdin;
+  else if ((fi = fopen(indb, "r" FBINMODE)) == NULL)
+    error(errno, "open %s", indb);
+  allocbuf(65536);
+  fget(fi, toc, 2048, &pos, 2048);
+  if ((et = ftoc(fi, toc, &c)) != NULL) {
+    /* toc is known, copy everything up to the end of hash tables */
+    if (c.file) {
+      memcpy(toc, xtoc(&c), 2048);
+      ext = c.cdb_ext;
+    }
+    for (t = 0; t < 256; ++t) {
+      unsigned hpos = cdb_unpack(toc + (t << 3));
+      unsigned hlen = cdb_unpack(toc + (t << 3) + 4);
+      if (hpos < 2048 || hlen > (0xffffffff - hpos) >> 3 ||
+          (ext && hpos + (hlen << 3) > ext))
+        error(EPROTO, "invalid cdb file format");
+      if (end < hpos + (hlen << 3))
+        end = hpos + (hlen << 3);
+    }
+    fd = createdb(dbname, &tmpname, perms);
+    if (!(fo = fdopen(fd, "w" FBINMODE)))
+      error(errno, "%s", tmpname);
+    if (flags & F_STREAM)
+      memset(buf, 0, 2048);
+    else
+      memcpy(buf, toc, 2048);
+    if (fwrite(buf, 1, 2048, fo) != 2048 ||
+        fcpy(fi, fo, end - 2048, &pos, end) != 0)
+      error(errno, "unable to write %s", tmpname);
+    if (c.file) {
+      /* the extension section, if any, follows hash tables */
+      if (ext && ext != end)
+        error(EPROTO, "invalid cdb file format");
+      if ((len = c.cdb_extlen) > MAXEXT)
+        error(EPROTO, "extension section is too large");
+      if (ext)
+        memcpy(ebuf, cdb_get(&c, len, ext), len);
+      cdb_free(&c);
+    }
+    else {
+      /* on a pipe, whatever follows hash tables is the extension section */
+      len = fread(ebuf, 1, sizeof(ebuf), fi);
+      if (ferror(fi))
+        error(errno, "unable to read");
+      if (len == sizeof(ebuf))
+        error(EPROTO, "extension section is too large");
+      mfinit(&c, toc, ebuf, len, (unsigned long long)end + len);
+      if ((ext = c.cdb_ext) != 0 && ext != end)
+        error(EPROTO, "invalid cdb file format");
+      len = c.cdb_extlen;
+    }
+    if (ext)
+      olen = eother(ebuf, len);
+    if ((flags & F_STREAM) || olen)
+      wext(fo, tmpname, end, flags & F_STREAM ? toc : NULL, ebuf, olen);
+  }
+  else {
+    /* A streamed database on a pipe: its toc comes last.  Copy it all,
+     * keeping the tail, then put the toc in place and cut the extension
+     * section off.  This needs seekable, but not readable, output. */
+    unsigned char *tail = ebuf;
+    unsigned long long total = 2048;
+    unsigned tlen = 0;
+    size_t l;
+    fd = createdb(dbname, &tmpname, perms);
+    if (!(fo = fdopen(fd, "w" FBINMODE)))
+      error(errno, "%s", tmpname);
+    if (fwrite(toc, 1, 2048, fo) != 2048)
+      error(errno, "unable to write %s", tmpname);
+    while((l = fread(buf, 1, blen, fi)) != 0) {
+      if (fwrite(buf, 1, l, fo) != l)
+        error(errno, "unable to write %s", tmpname);
+      total += l;
+      if (l >= sizeof(ebuf))
+        memcpy(tail, buf + l - sizeof(ebuf), tlen = sizeof(ebuf));
+      else {
+        if (tlen + l > sizeof(ebuf)) {
+          memmove(tail, tail + tlen + l - sizeof(ebuf), sizeof(ebuf) - l);
+          tlen = sizeof(ebuf) - l;
+        }
+        memcpy(tail + tlen, buf, l);
+        tlen += l;
+      }
+    }
+    if (ferror(fi))
+      error(errno, "unable to read");
+    if (!(flags & F_STREAM)) {
+      mfinit(&c, toc, tail, tlen, total);
+      if (!(ext = c.cdb_ext) || ext < total - tlen)
+        error(EPROTO, "invalid cdb file format");
+      if (!c.cdb_toc && !c.cdb_fmt)
+        error(EPROTO, "invalid cdb file format: no toc");
+      memcpy(toc, xtoc(&c), 2048);
+      tail += ext - (total - tlen);
+      olen = eother(tail, c.cdb_extlen);
+      if (fflush(fo) != 0)
+        error(errno, "unable to write %s", tmpname);
+      if (lseek(fd, 0, SEEK_SET) != 0)
+        error(errno, "%s: streamed database can only be converted "
+              "to a file", indb);
+      if (write(fd, toc, 2048) != 2048 || ftruncate(fd, ext) != 0)
+        error(errno, "unable to write %s", tmpname);
+      if (olen) {
+        if (fseeko(fo, ext, SEEK_SET) != 0)
+          error(errno, "unable to seek");
+        wext(fo, tmpname, ext, NULL, tail, olen);
+      }
+    }
+  }
+  if (fi != stdin)
+    fclose(fi);
+  if (fclose(fo) != 0)
+    error(errno, "unable to write %s", tmpname);
   if (tmpname != dbname)
     if (rename(tmpname, dbname) != 0)
       error(errno, "rename %s->%s", tmpname, dbname);
   return 0;
 }
 
+/* --nss: make passwd.cdb, group.cdb and shadow.cdb for nss_cdb, in the
+ * layout of nss_cdb-Makefile.  A database is rebuilt only if its source
+ * has a different modification time than the one recorded on it. */
+
+struct nssdb {
+  const char *name;
+  unsigned nf;          /* fields in an entry */
+  int byid;             /* entries are indexed by ":id" too */
+};
+
+static const struct nssdb nssdbs[] = {
+  { "passwd", 7, 1 },
+  { "group", 4, 1 },
+  { "shadow", 9, 0 },
+};
+
+struct nsmember {       /* user is a member of group gid */
+  const unsigned char *user, *gid;
+  unsigned ulen, glen, idx;
+};
+
+static int
+cmpmember(const void *a, const void *b)
+{
+  const struct nsmember *x = (const struct nsmember*)a;
+  const struct nsmember *y = (const struct nsmember*)b;
+  int r = memcmp(x->user, y->user, x->ulen < y->ulen ? x->ulen : y->ulen);
+  if (r)
+    return r;
+  if (x->ulen != y->ulen)
+    return x->ulen < y->ulen ? -1 : 1;
+  return x->idx < y->idx ? -1 : x->idx > y->idx;
+}
+
+static void
+nsadd(struct cdb_make *cdbmp, const char *fn,
+      const void *key, unsigned klen, const void *val, unsigned vlen)
+{
+  if (cdb_make_add(cdbmp, key, klen, val, vlen) != 0)
+    error(errno, "%s", fn);
+}
+
+/* membership index of group.cdb: ":@user" -> gid,gid,... */
+static void
+nsmembers(struct cdb_make *cdbmp, const char *fn,
+          struct nsmember *mv, unsigned n)
+{
+  unsigned i, j, k, len;
+  qsort(mv, n, sizeof(*mv), cmpmember);
+  nsadd(cdbmp, fn, ":@", 2, "", 0);
+  for (i = 0; i < n; i = j) {
+    len = mv[i].ulen + 2;
+    for (j = i; j < n && mv[j].ulen == mv[i].ulen &&
+                memcmp(mv[j].user, mv[i].user, mv[i].ulen) == 0; ++j)
+      len += mv[j].glen + 1;
+    allocbuf(len);
+    buf[0] = ':'; buf[1] = '@';
+    memcpy(buf + 2, mv[i].user, mv[i].ulen);
+    for (len = mv[i].ulen + 2, k = i; k < j; ++k) {
+      if (k > i)
+        buf[len++] = ',';
+      memcpy(buf + len, mv[k].gid, mv[k].glen);
+      len += mv[k].glen;
+    }
+    nsadd(cdbmp, fn, buf, mv[i].ulen + 2, buf + mv[i].ulen + 2,
+          len - mv[i].ulen - 2);
+  }
+}
+
+static void
+nsbuild(const struct nssdb *db, const char *src, const char *dst,
+        const struct stat *st, int fd, int flags)
+{
+  struct cdb_make cdbm;
+  struct nsmember *mv = NULL;
+  unsigned nm = 0, am = 0;
+  unsigned char *data, *p, *e, *l, *f[10], *m;
+  char *dbname = (char*)dst, *tmpname = NULL;
+  struct timespec ts[2];
+  unsigned nf;
+  ssize_t r;
+  size_t len;
+  int ofd;
+
+  if (st->st_size > 0xffffffffu)
+    error(EFBIG, "%s", src);
+  len = st->st_size;
+  if (!(data = (unsigned char*)malloc(len + 1)))
+    error(ENOMEM, "unable to allocate memory");
+  for (r = 0; (size_t)r < len; r += ofd)
+    if ((ofd = read(fd, data + r, len - r)) <= 0)
+      error(ofd ? errno : EIO, "%s", src);
+  e = data + len;
+
+  ofd = createdb(dbname, &tmpname, 0600);
+  cdb_make_start(&cdbm, ofd);
+  if (flags & F_STREAM)
+    cdb_make_stream(&cdbm);
+  if (flags & F_CRC)
+    cdb_make_checksum(&cdbm, 0);
+
+  for (l = data; l < e; l = p + 1) {
+    if (!(p = (unsigned char*)memchr(l, '\n', e - l)))
+      p = e;
+    if (l == p || *l == '#')
+      continue;
+    /* split on colons, f[i] is the start of field i, f[nf] the end */
+    for (f[0] = l, nf = 1, m = l; m < p && nf <= db->nf; ++m)
+      if (*m == ':')
+        f[nf++] = m + 1;
+    if (nf != db->nf || m != p)
+      continue;
+    f[nf] = p + 1;
+    nsadd(&cdbm, src, l, f[1] - l - 1, l, p - l);
+    if (db->byid) {
+      allocbuf(f[3] - f[2]);
+      buf[0] = ':';
+      memcpy(buf + 1, f[2], f[3] - f[2] - 1);
+      nsadd(&cdbm, src, buf, f[3] - f[2], l, p - l);
+    }
+    if (db->nf == 4) {  /* group members */
+      for (m = f[3]; m < p; m = l + 1) {
+        if (!(l = (unsigned char*)memchr(m, ',', p - m)))
+          l = p;
+        if (l == m)
+          continue;
+        if (nm == am) {
+          am = am ? am << 1 : 1024;
+          if (!(mv = (struct nsmember*)realloc(mv, am * sizeof(*mv))))
+            error(ENOMEM, "unable to allocate memory");
+        }
+        mv[nm].user = m;
+        mv[nm].ulen = l - m;
+        mv[nm].gid = f[2];
+        mv[nm].glen = f[3] - f[2] - 1;
+        mv[nm].idx = nm;
+        ++nm;
+      }
+    }
+  }
+  if (db->nf == 4)
+    nsmembers(&cdbm, src, mv, nm);
+
+  if (cdb_make_finish(&cdbm) != 0)
+    error(errno, "cdb_make_finish");
+  /* same owner and permissions as the source, and its mtime */
+  if (fchmod(ofd, st->st_mode & 07777) != 0 ||
+      (fchown(ofd, st->st_uid, st->st_gid) != 0 && errno != EPERM))
+    error(errno, "%s", tmpname);
+  ts[0] = st->st_atim;
+  ts[1] = st->st_mtim;
+  if (futimens(ofd, ts) != 0)
+    error(errno, "%s", tmpname);
+  close(ofd);
+  if (rename(tmpname, dbname) != 0)
+    error(errno, "rename %s->%s", tmpname, dbname);
+  free(tmpname);
+  free(mv);
+  free(data);
+}
+
+static int
+nsmode(const char *srcdir, const char *dstdir, int flags)
+{
+  char *src, *dst;
+  struct stat st, dst_st;
+  unsigned i, found = 0;
+  int fd;
+
+  src = (char*)malloc(strlen(srcdir) + 16);
+  dst = (char*)malloc(strlen(dstdir) + 16);
+  if (!src || !dst)
+    error(ENOMEM, "unable to allocate memory");
+  for (i = 0; i < sizeof(nssdbs) / sizeof(nssdbs[0]); ++i) {
+    sprintf(src, "%s/%s", srcdir, nssdbs[i].name);
+    sprintf(dst, "%s/%s.cdb", dstdir, nssdbs[i].name);
+    if ((fd = open(src, O_RDONLY)) < 0) {
+      if (errno == ENOENT)
+        continue;
+      error(errno, "%s", src);
+    }
+    ++found;
+    if (fstat(fd, &st) != 0)
+      error(errno, "%s", src);
+    if (stat(dst, &dst_st) == 0 &&
+        dst_st.st_mtim.tv_sec == st.st_mtim.tv_sec &&
+        dst_st.st_mtim.tv_nsec == st.st_mtim.tv_nsec) {
+      close(fd);
+      continue;  /* up to date */
+    }
+    nsbuild(&nssdbs[i], src, dst, &st, fd, flags);
+    close(fd);
+  }
+  if (!found)
+    error(ENOENT, "no passwd, group or shadow in %s", srcdir);
+  free(src);
+  free(dst);
+  return 0;
+}
+
+#ifdef HAVE_EPOLL
+
+/* -S: serve a database over a unix socket.
+ *
+ * Requests are pipelined and answered in order.  A binary request is
+ * SREQ_GET, 4-byte key length and the key, and the answer is a status
+ * byte, 4-byte value length and the value.  Text requests are the get,
+ * gets, version and quit commands of memcached.  Values are written
+ * right from the mapping with writev().
+ *
+ * Every worker thread runs its own epoll loop over connections it
+ * accepted.  The first one also checks every second if the database
+ * was replaced, and switches to the new file.  A mapping stays while
+ * any connection has output from it pending. */
+
+#define SREQ_GET 0xcd
+#define SRES_OK 0
+#define SRES_NOTFOUND 1
+#define SRES_ERROR 2
+#define SMAXLINE 4096       /* longest text request */
+#define SMAXKEY 250         /* longest key of a text request */
+#define SMAXREQ (1 << 26)   /* longest binary request */
+#define SMAXOUT (1 << 20)   /* stop reading requests with that much queued */
+#define SIOV 1024
+
+struct sgen {         /* a generation of the database being served */
+  struct cdb cdb;
+  int fd;
+  unsigned refs;
+  unsigned long long id;
+  struct stat st;
+};
+
+struct sout {         /* queued output: p, or ob + off if p is NULL */
+  const unsigned char *p;
+  unsigned off, len;
+};
+
+struct sconn {
+  int fd;
+  unsigned events;
+  struct sgen *gen;   /* values queued are from this one */
+  unsigned char *ib;  /* input */
+  unsigned isize, ipos, iend;
+  unsigned char *ob;  /* answer headers */
+  unsigned osize, oend;
+  struct sout *ov;
+  unsigned nov, aov, ovpos;
+  unsigned long long oqueued;
+  int quit;
+};
+
+static const char *sname;
+static struct sgen *scur;
+static pthread_mutex_t smtx = PTHREAD_MUTEX_INITIALIZER;
+static int slfd;
+
+static struct sgen *
+sopen(void)
+{
+  struct sgen *g = (struct sgen*)calloc(1, sizeof(*g));
+  int err;
+  if (!g)
+    return errno = ENOMEM, NULL;
+  if ((g->fd = open(sname, O_RDONLY)) >= 0) {
+    if (fstat(g->fd, &g->st) == 0 && cdb_init(&g->cdb, g->fd) == 0) {
+      g->refs = 1;
+      return g;
+    }
+    err = errno;
+    close(g->fd);
+    errno = err;
+  }
+  free(g);
+  return NULL;
+}
+
+/* drop a reference to g, with smtx held */
+static void
+sunref(struct sgen *g)
+{
+  if (--g->refs == 0) {
+    cdb_free(&g->cdb);
+    close(g->fd);
+    free(g);
+  }
+}
+
+static struct sgen *
+sacquire(void)
+{
+  struct sgen *g;
+  pthread_mutex_lock(&smtx);
+  g = scur;
+  ++g->refs;
+  pthread_mutex_unlock(&smtx);
+  return g;
+}
+
+static void
+srelease(struct sgen *g)
+{
+  pthread_mutex_lock(&smtx);
+  sunref(g);
+  pthread_mutex_unlock(&smtx);
+}
+
+#define samefile(a, b) \
+  ((a).st_dev == (b).st_dev && (a).st_ino == (b).st_ino && \
+   (a).st_size == (b).st_size && (a).st_mtime == (b).st_mtime)
+
+/* switch to a new file if the database was replaced or changed.
+ * Only the first worker changes scur, so it may look at it freely. */
+static void
+sreload(void)
+{
+  static struct stat bad;  /* do not complain about it every second */
+  struct stat st;
+  struct sgen *g;
+  if (stat(sname, &st) != 0 || samefile(st, scur->st) || samefile(st, bad))
+    return;
+  if (!(g = sopen())) {
+    fprintf(stderr, "%s: unable to reopen %s: %s\n",
+            progname, sname, strerror(errno));
+    bad = st;
+    return;
+  }
+  pthread_mutex_lock(&smtx);
+  g->id = scur->id + 1;
+  sunref(scur);
+  scur = g;
+  pthread_mutex_unlock(&smtx);
+}
+
+/* queue len bytes at p, or len bytes just placed at the end of ob */
+static void
+squeue(struct sconn *cn, const void *p, unsigned len)
+{
+  struct sout *o;
+  if (!len)
+    return;
+  if (!p && cn->nov && !cn->ov[cn->nov-1].p &&
+      cn->ov[cn->nov-1].off + cn->ov[cn->nov-1].len == cn->oend) {
+    cn->ov[cn->nov-1].len += len;  /* merge adjacent headers */
+    cn->oend += len;
+    cn->oqueued += len;
+    return;
+  }
+  if (cn->nov == cn->aov) {
+    cn->aov = cn->aov ? cn->aov << 1 : 64;
+    if (!(cn->ov = (struct sout*)realloc(cn->ov, cn->aov * sizeof(*o))))
+      error(ENOMEM, "unable to allocate memory");
+  }
+  o = cn->ov + cn->nov++;
+  o->p = (const unsigned char*)p;
+  o->off = cn->oend;
+  o->len = len;
+  if (!p)
+    cn->oend += len;
+  cn->oqueued += len;
+}
+
+/* room for len bytes of a header */
+static unsigned char *
+sroom(struct sconn *cn, unsigned len)
+{
+  if (cn->osize - cn->oend < len) {
+    while(cn->osize - cn->oend < len)
+      cn->osize = cn->osize ? cn->osize << 1 : 4096;
+    if (!(cn->ob = (unsigned char*)realloc(cn->ob, cn->osize)))
+      error(ENOMEM, "unable to allocate memory");
+  }
+  return cn->ob + cn->oend;
+}
+
+static void
+stext(struct sconn *cn, struct cdb *cdbp, const char *s, const char *e)
+{
+  const char *w;
+  unsigned l, cas;
+  int r;
+
+#define sword() \
+  while(s < e && (*s == ' ' || *s == '\t')) ++s; \
+  for (w = s; s < e && *s != ' ' && *s != '\t'; ++s)
+  sword();
+  l = s - w;
+  if ((l == 3 && memcmp(w, "get", 3) == 0) ||
+      (l == 4 && memcmp(w, "gets", 4) == 0)) {
+    cas = l == 4;
+    sword();
+    if (!(l = s - w)) {  /* at least one key is needed */
+      squeue(cn, "ERROR\r\n", 7);
+      return;
+    }
+    do {
+      if (l > SMAXKEY) {
+        squeue(cn, "CLIENT_ERROR bad command line format\r\n", 38);
+        return;
+      }
+      if ((r = cdb_find(cdbp, w, l)) < 0) {
+        squeue(cn, "SERVER_ERROR read error\r\n", 25);
+        return;
+      }
+      if (r) {
+        l = sprintf((char*)sroom(cn, SMAXKEY + 64),
+                    cas ? "VALUE %.*s 0 %u %llu\r\n" : "VALUE %.*s 0 %u\r\n",
+                    (int)l, w, cdb_datalen(cdbp), cn->gen->id + 1);
+        squeue(cn, NULL, l);
+        squeue(cn, cdb_getdata(cdbp), cdb_datalen(cdbp));
+        squeue(cn, "\r\n", 2);
+      }
+      sword();
+    } while((l = s - w) != 0);
+    squeue(cn, "END\r\n", 5);
+  }
+  else if (l == 7 && memcmp(w, "version", 7) == 0) {
+    l = sprintf((char*)sroom(cn, 64), "VERSION %s\r\n",
+                strify(TINYCDB_VERSION));
+    squeue(cn, NULL, l);
+  }
+  else if (l == 4 && memcmp(w, "quit", 4) == 0)
+    cn->quit = 1;
+  else
+    squeue(cn, "ERROR\r\n", 7);
+#undef sword
+}
+
+/* answer complete requests in the input buffer, return -1 on a bad one */
+static int
+sparse(struct sconn *cn)
+{
+  struct cdb c = cn->gen->cdb;  /* a private handle, sharing the mapping */
+  const unsigned char *p, *e;
+  unsigned char *h;
+  unsigned klen;
+  int r;
+
+  while(cn->ipos < cn->iend && !cn->quit && cn->oqueued < SMAXOUT) {
+    p = cn->ib + cn->ipos;
+    if (*p == SREQ_GET) {
+      if (cn->iend - cn->ipos < 5)
+        break;
+      klen = cdb_unpack(p + 1);
+      if (klen > SMAXREQ)
+        return -1;
+      if (cn->iend - cn->ipos - 5 < klen)
+        break;
+      r = cdb_find(&c, p + 5, klen);
+      h = sroom(cn, 5);
+      h[0] = r > 0 ? SRES_OK : r ? SRES_ERROR : SRES_NOTFOUND;
+      cdb_pack(r > 0 ? cdb_datalen(&c) : 0, h + 1);
+      squeue(cn, NULL, 5);
+      if (r > 0)
+        squeue(cn, cdb_getdata(&c), cdb_datalen(&c));
+      cn->ipos += 5 + klen;
+    }
+    else {
+      if (!(e = memchr(p, '\n', cn->iend - cn->ipos)))
+        return cn->iend - cn->ipos < SMAXLINE ? 0 : -1;
+      cn->ipos += e - p + 1;
+      if (e > p && e[-1] == '\r')
+        --e;
+      stext(cn, &c, (const char*)p, (const char*)e);
+    }
+  }
+  return 0;
+}
+
+/* write queued output, return -1 on error */
+static int
+sflush(struct sconn *cn)
+{
+  struct iovec iov[SIOV];
+  struct sout *o;
+  unsigned i, n;
+  ssize_t l;
+
+  while(cn->ovpos < cn->nov) {
+    for (i = cn->ovpos, n = 0; i < cn->nov && n < SIOV; ++i, ++n) {
+      o = cn->ov + i;
+      iov[n].iov_base = (void*)(o->p ? o->p : cn->ob + o->off);
+      iov[n].iov_len = o->len;
+    }
+    l = writev(cn->fd, iov, n);
+    if (l < 0)
+      return errno == EAGAIN || errno == EINTR ? 0 : -1;
+    while(l) {
+      o = cn->ov + cn->ovpos;
+      if ((size_t)l >= o->len) {
+        l -= o->len;
+        ++cn->ovpos;
+      }
+      else {
+        if (o->p)
+          o->p += l;
+        else
+          o->off += l;
+        o->len -= l;
+        l = 0;
+      }
+    }
+  }
+  cn->nov = cn->ovpos = cn->oend = 0;
+  cn->oqueued = 0;
+  return 0;
+}
+
+/* Do what can be done for a connection now.  Return -1 if it is to be
+ * closed, or events to wait for. */
+static int
+sserve(struct sconn *cn)
+{
+  unsigned rounds;
+  ssize_t l;
+
+  for (rounds = 0; rounds < 16; ++rounds) {
+    if (cn->nov) {
+      if (sflush(cn) < 0)
+        return -1;
+      if (cn->nov)
+        return EPOLLOUT;
+    }
+    if (cn->gen) {
+      srelease(cn->gen);
+      cn->gen = NULL;
+    }
+    if (cn->quit)
+      return -1;
+    if (cn->ipos < cn->iend) {
+      cn->gen = sacquire();
+      if (sparse(cn) < 0)
+        return -1;
+      if (cn->nov)
+        continue;
+      srelease(cn->gen);
+      cn->gen = NULL;
+    }
+    if (cn->ipos) {
+      memmove(cn->ib, cn->ib + cn->ipos, cn->iend - cn->ipos);
+      cn->iend -= cn->ipos;
+      cn->ipos = 0;
+    }
+    if (cn->iend == cn->isize) {
+      if (cn->isize > SMAXREQ)
+        return -1;
+      cn->isize <<= 1;
+      if (!(cn->ib = (unsigned char*)realloc(cn->ib, cn->isize)))
+        error(ENOMEM, "unable to allocate memory");
+    }
+    l = read(cn->fd, cn->ib + cn->iend, cn->isize - cn->iend);
+    if (l > 0)
+      cn->iend += l;
+    else if (!l || (errno != EAGAIN && errno != EINTR))
+      return -1;
+    else
+      return EPOLLIN;
+  }
+  return cn->nov ? EPOLLOUT : EPOLLIN;  /* let others run */
+}
+
+static void
+sclose(struct sconn *cn)
+{
+  close(cn->fd);
+  if (cn->gen)
+    srelease(cn->gen);
+  free(cn->ib);
+  free(cn->ob);
+  free(cn->ov);
+  free(cn);
+}
+
+static void *
+sworker(void *arg)
+{
+  struct epoll_event ev, evs[64];
+  struct sconn *cn;
+  time_t last = time(NULL);
+  int ep = epoll_create1(EPOLL_CLOEXEC);
+  int i, n, r;
+
+  if (ep < 0)
+    error(errno, "epoll");
+  ev.events = EPOLLIN;
+#ifdef EPOLLEXCLUSIVE
+  ev.events |= EPOLLEXCLUSIVE;
+#endif
+  ev.data.ptr = NULL;
+  if (epoll_ctl(ep, EPOLL_CTL_ADD, slfd, &ev) != 0)
+    error(errno, "epoll");
+  for (;;) {
+    n = epoll_wait(ep, evs, sizeof(evs) / sizeof(evs[0]), arg ? 1000 : -1);
+    if (arg && time(NULL) != last) {
+      last = time(NULL);
+      sreload();
+    }
+    for (i = 0; i < n; ++i) {
+      if (!(cn = (struct sconn*)evs[i].data.ptr)) {
+        if ((r = accept4(slfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) < 0)
+          continue;
+        if (!(cn = (struct sconn*)calloc(1, sizeof(*cn))) ||
+            !(cn->ib = (unsigned char*)malloc(cn->isize = 65536)))
+          error(ENOMEM, "unable to allocate memory");
+        cn->fd = r;
+        cn->events = ev.events = EPOLLIN;
+        ev.data.ptr = cn;
+        if (epoll_ctl(ep, EPOLL_CTL_ADD, cn->fd, &ev) != 0)
+          sclose(cn);
+        continue;
+      }
+      if ((r = sserve(cn)) < 0)
+        sclose(cn);
+      else if ((unsigned)r != cn->events) {
+        cn->events = ev.events = r;
+        ev.data.ptr = cn;
+        if (epoll_ctl(ep, EPOLL_CTL_MOD, cn->fd, &ev) != 0)
+          sclose(cn);
+      }
+    }
+  }
+  return NULL;
+}
+
+static int
+servemode(char *sock, char *dbname, int jobs)
+{
+  struct sockaddr_un sa;
+  struct stat st;
+  pthread_t tid;
+  int i;
+
+  sname = dbname;
+  if (!(scur = sopen()))
+    error(errno, "unable to open database `%s'", dbname);
+  memset(&sa, 0, sizeof(sa));
+  sa.sun_family = AF_UNIX;
+  if (strlen(sock) >= sizeof(sa.sun_path))
+    error(ENAMETOOLONG, "%s", sock);
+  strcpy(sa.sun_path, sock);
+  if (lstat(sock, &st) == 0 && S_ISSOCK(st.st_mode))
+    unlink(sock);  /* left from a previous run */
+  if ((slfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0 ||
+      bind(slfd, (struct sockaddr*)&sa, sizeof(sa)) != 0 ||
+      listen(slfd, SOMAXCONN) != 0)
+    error(errno, "%s", sock);
+  signal(SIGPIPE, SIG_IGN);
+  for (i = 1; i < jobs; ++i)
+    if ((errno = pthread_create(&tid, NULL, sworker, NULL)) != 0)
+      error(errno, "unable to create thread");
+  sworker(&slfd);  /* the first worker also reloads */
+  return 0;
+}
+
+#endif /* HAVE_EPOLL */
+
+/* --hash fn[:key], key being up to 32 hex digits, random by default */
+static void
+parsehash(const char *arg)
+{
+  const char *k = strchr(arg, ':');
+  unsigned l = k ? (unsigned)(k - arg) : strlen(arg), i;
+  for (hashfn = 0; ; ++hashfn) {
+    if (hashfn >= sizeof(hashnames) / sizeof(hashnames[0]))
+      error(0, "unknown hash function `%.*s' (should be default, xxh64, "
+            "siphash or halfsiphash)", (int)l, arg);
+    if (strlen(hashnames[hashfn]) == l && memcmp(hashnames[hashfn], arg, l) == 0)
+      break;
+  }
+  memset(hashkey, 0, sizeof(hashkey));
+  if (k) {
+    for (i = 0, ++k; *k; ++i, ++k) {
+      int d = *k >= '0' && *k <= '9' ? *k - '0' :
+              *k >= 'a' && *k <= 'f' ? *k - 'a' + 10 :
+              *k >= 'A' && *k <= 'F' ? *k - 'A' + 10 : -1;
+      if (d < 0 || i >= 2 * sizeof(hashkey))
+        error(0, "invalid hash key `%s' (should be up to 32 hex digits)",
+              strchr(arg, ':') + 1);
+      hashkey[i >> 1] |= d << (i & 1 ? 0 : 4);
+    }
+  }
+  else if (hashfn == CDB_HASH_SIPHASH || hashfn == CDB_HASH_HALFSIP) {
+    int fd = open("/dev/urandom", O_RDONLY);
+    if (fd < 0 || cdb_bread(fd, hashkey, sizeof(hashkey)) < 0)
+      error(errno, "unable to get a random hash key");
+    close(fd);
+  }
+}
+
+#define OPT_SHARDS 256
+#define OPT_STREAM 257
+#define OPT_CONVERT 258
+#define OPT_PREFETCH 259
+#define OPT_STATS 260
+#define OPT_JSON 261
+#define OPT_CHECKSUM 262
+#define OPT_NSS 263
+#define OPT_FIXKEY 264
+#define OPT_COMPACT 265
+#define OPT_HASH 266
+#define OPT_TABLES 267
+#define OPT_LOAD 268
+#define OPT_SENDFILE 269
+#define OPT_LAYER 270
+#define OPT_FILTER 271
+#define OPT_OVERLAY 272
+
+static const struct option longopts[] = {
+  { "shards", 1, NULL, OPT_SHARDS },
+  { "stream", 0, NULL, OPT_STREAM },
+  { "convert", 0, NULL, OPT_CONVERT },
+  { "prefetch", 0, NULL, OPT_PREFETCH },
+  { "stats", 0, NULL, OPT_STATS },
+  { "json", 0, NULL, OPT_JSON },
+  { "checksum", 0, NULL, OPT_CHECKSUM },
+  { "nss", 0, NULL, OPT_NSS },
+  { "fixkey", 1, NULL, OPT_FIXKEY },
+  { "compact", 0, NULL, OPT_COMPACT },
+  { "hash", 1, NULL, OPT_HASH },
+  { "tables", 1, NULL, OPT_TABLES },
+  { "load", 1, NULL, OPT_LOAD },
+  { "sendfile", 0, NULL, OPT_SENDFILE },
+  { "layer", 0, NULL, OPT_LAYER },
+  { "filter", 1, NULL, OPT_FILTER },
+  { "overlay", 0, NULL, OPT_OVERLAY },
+  { NULL, 0, NULL, 0 }
+};
+
 int main(int argc, char **argv)
 {
   int c;
   char mode = 0;
   char *tmpname = NULL;
+  char *olddb = NULL;
   int flags = 0;
   int num = 0;
   int r;
   int perms = -1;
+  int jobs = 0;
+  unsigned shards = 0;
+  int batch = 0;
+  char *sockname = NULL;
   extern char *optarg;
   extern int optind;
 
@@ -465,14 +3059,74 @@ int main(int argc, char **argv)
   if (argc <= 1)
     error(0, "no arguments given");
 
-  while((c = getopt(argc, argv, "qdlcsht:n:mwruep:0")) != EOF)
+  while((c = getopt_long(argc, argv, "qbdlcMsVS:ht:i:j:n:mwruep:0",
+                         longopts, NULL)) != EOF)
     switch(c) {
-    case 'q': case 'd':  case 'l': case 'c': case 's':
+    case OPT_SHARDS: {
+      char *ep = NULL;
+      long v = strtol(optarg, &ep, 0);
+      if (v <= 0 || v > 65536 || (ep && *ep))
+        error(0, "invalid number of shards `%s'", optarg);
+      shards = v;
+      break;
+    }
+    case OPT_STREAM: flags |= F_STREAM; break;
+    case OPT_PREFETCH: flags |= F_PREFETCH; break;
+    case OPT_STATS: flags |= F_STATS; break;
+    case OPT_JSON: flags |= F_JSON; break;
+    case OPT_CHECKSUM: flags |= F_CRC; break;
+    case OPT_COMPACT: flags |= F_COMPACT; break;
+    case OPT_SENDFILE: flags |= F_SEND; break;
+    case OPT_LAYER: flags |= F_LAYER; break;
+    case OPT_FIXKEY: {
+      char *ep = NULL;
+      long v = strtol(optarg, &ep, 0);
+      if ((v != 4 && v != 8 && v != 16) || (ep && *ep))
+        error(0, "invalid key length `%s' (should be 4, 8 or 16)", optarg);
+      fixkey = v;
+      break;
+    }
+    case OPT_HASH: parsehash(optarg); break;
+    case OPT_TABLES: {
+      char *ep = NULL;
+      long v = strtol(optarg, &ep, 0);
+      if (v <= 0 || v > 65536 || (v & (v - 1)) || (ep && *ep))
+        error(0, "invalid number of tables `%s' "
+              "(should be a power of two up to 65536)", optarg);
+      ntables = v;
+      break;
+    }
+    case OPT_LOAD: {
+      char *ep = NULL;
+      long v = strtol(optarg, &ep, 0);
+      if (v <= 0 || v > 100 || (ep && *ep))
+        error(0, "invalid load `%s' (should be 1 to 100 percents)", optarg);
+      loadpct = v;
+      break;
+    }
+    case OPT_FILTER: {
+      char *ep = NULL;
+      long v = strtol(optarg, &ep, 0);
+      if (v < 0 || v > 32 || (ep && *ep))
+        error(0, "invalid filter size `%s' (should be 0 to 32 bits per key)",
+              optarg);
+      filterbits = v;
+      break;
+    }
+    case 'b': batch = 1; break;
+    case 'S': sockname = optarg; goto setmode;
+    case OPT_NSS: c = 'N'; goto setmode;
+    case OPT_OVERLAY: c = 'O'; goto setmode;
+    case OPT_CONVERT: c = 'C';
+      /* fallthrough */
+    case 'q': case 'd':  case 'l': case 'c': case 'M': case 's': case 'V':
+    setmode:
       if (mode && mode != c)
         error(0, "different modes of operation requested");
       mode = c;
       break;
     case 't': tmpname = optarg; break;
+    case 'i': olddb = optarg; break;
     case 'w': flags |= F_WARNDUP; break;
     case 'e': flags |= F_WARNDUP | F_ERRDUP; break;
     case 'r': flags = (flags & ~F_DUPMASK) | CDB_PUT_REPLACE; break;
@@ -486,6 +3140,12 @@ int main(int argc, char **argv)
         error(0, "invalid permissions `%s'", optarg);
       break;
     }
+    case 'j': {
+      char *ep = NULL;
+      if ((jobs = strtol(optarg, &ep, 0)) <= 0 || jobs > 1024 || (ep && *ep))
+        error(0, "invalid number of threads `%s'", optarg);
+      break;
+    }
     case 'n': {
       char *ep = NULL;
       if ((num = strtol(optarg, &ep, 0)) <= 0 || (ep && *ep))
@@ -493,18 +3153,34 @@ int main(int argc, char **argv)
       break;
     }
     case 'h':
-#define strify(x) _strify(x)
-#define _strify(x) #x
       printf("\
 %s: Constant DataBase (CDB) tool version " strify(TINYCDB_VERSION)
 ". Usage is:\n\
- query:  %s -q [-m] [-n recno|-a] cdbfile key\n\
+ query:  %s -q [-m] [-n recno|-a] [--sendfile] [--stats] cdbfile key\n\
+         %s -q -b [-m] [-n recno] [--prefetch] [--stats] cdbfile [keyfile...]\n\
  dump:   %s -d [-m] [cdbfile|-]\n\
  list:   %s -l [-m] [cdbfile|-]\n\
- create: %s -c [-m] [-wrue0] [-t tempfile|-] [-p perms] cdbfile [infile...]\n\
- stats:  %s -s [cdbfile|-]\n\
+ create: %s -c [-m] [-wrue0] [-j threads] [-t tempfile|-] [-p perms]\n\
+         [--shards N] [--stream] [--checksum] [--fixkey klen] [--compact]\n\
+         [--hash fn[:key]] [--tables N] [--load pct] cdbfile|- [infile...]\n\
+ update: %s -c -i oldcdb [-m] [-t tempfile|-] [-p perms] [--stream]\n\
+         [--checksum] [--tables N] [--load pct] cdbfile|- [infile...]\n\
+ merge:  %s -M [-wrue0] [-t tempfile|-] [-p perms] [--stream] [--checksum]\n\
+         [--fixkey klen] [--compact] [--hash fn[:key]] [--tables N]\n\
+         [--load pct] cdbfile|- incdb...\n\
+ layer:  %s -c --layer [-wrue0] [-t tempfile|-] [-p perms] [--filter bits]\n\
+         [other create options] cdbfile|- [infile...]\n\
+ overlay: %s --overlay [-n layer] [-t tempfile|-] [-p perms] [--filter bits]\n\
+         [other merge options] cdbfile|- manifest\n\
+ convert: %s --convert [--stream] [-t tempfile|-] [-p perms] cdbfile|- incdb|-\n\
+ stats:  %s -s [--json] [cdbfile|-]\n\
+ verify: %s -V [-j threads] cdbfile\n\
+ serve:  %s -S socket [-j threads] cdbfile\n\
+ nss:    %s --nss [--stream] [--checksum] srcdir [dstdir]\n\
  help:   %s -h\n\
-", progname, progname, progname, progname, progname, progname, progname);
+", progname, progname, progname, progname, progname, progname, progname,
+   progname, progname, progname, progname, progname, progname, progname,
+   progname, progname);
       return 0;
 
     default:
@@ -515,27 +3191,92 @@ int main(int argc, char **argv)
   argc -= optind;
   switch(mode) {
     case 'q':
-      if (argc < 2) error(0, "no database or key to query specified");
-      if (argc > 2) error(0, "extra arguments in command line");
-      r = qmode(argv[0], argv[1], num, flags);
+      if (batch) {
+        if (flags & F_SEND)
+          error(0, "--sendfile cannot be used with -b");
+        if (!argc) error(0, "no database specified");
+        r = qbmode(argv[0], argc - 1, argv + 1, num, flags);
+      }
+      else {
+        if (argc < 2) error(0, "no database or key to query specified");
+        if (argc > 2) error(0, "extra arguments in command line");
+        r = qmode(argv[0], argv[1], num, flags);
+      }
+      if (flags & F_STATS)
+        printstats();
       break;
     case 'c':
       if (!argc) error(0, "no database name specified");
+      if (olddb && (flags & (F_WARNDUP|F_DUPMASK)))
+        error(0, "-i cannot be used with -w, -r, -u, -e or -0");
+      if (olddb && (flags & F_COMPACT))
+        error(0, "-i cannot be used with --compact");
       if ((flags & F_WARNDUP) && !(flags & F_DUPMASK))
         flags |= CDB_PUT_WARN;
-      r = cmode(argv[0], tmpname, argc - 1, argv + 1, flags, perms);
+      if (olddb && (flags & F_LAYER))
+        error(0, "-i cannot be used with --layer");
+      if (shards) {
+        if (olddb)
+          error(0, "-i cannot be used with --shards");
+        if (flags & F_LAYER)
+          error(0, "--layer cannot be used with --shards");
+        if (flags & F_COMPACT)
+          error(0, "--compact cannot be used with --shards");
+        r = shmode(argv[0], tmpname, argc - 1, argv + 1, flags, perms,
+                   shards, jobs);
+      }
+      else
+        r = cmode(argv[0], tmpname, argc - 1, argv + 1, flags, perms,
+                  olddb, jobs);
+      break;
+    case 'M':
+      if (!argc) error(0, "no database name specified");
+      if ((flags & F_WARNDUP) && !(flags & F_DUPMASK))
+        flags |= CDB_PUT_WARN;
+      r = mmode(argv[0], tmpname, argc - 1, argv + 1, flags, perms);
+      break;
+    case 'O':
+      if (argc < 2) error(0, "no database name or manifest specified");
+      if (argc > 2) error(0, "extra arguments for overlay");
+      r = omode(argv[0], tmpname, argv[1], num, flags, perms);
       break;
     case 'd':
     case 'l':
       if (argc > 1) error(0, "extra arguments for dump/list");
       r = dmode(argc ? argv[0] : "-", mode, flags);
       break;
+    case 'C':
+      if (argc < 2) error(0, "no database names specified");
+      if (argc > 2) error(0, "extra arguments for convert");
+      r = xmode(argv[0], tmpname, argv[1], flags, perms);
+      break;
     case 's':
       if (argc > 1) error(0, "extra argument(s) for stats");
-      r = smode(argc ? argv[0] : "-");
+      r = flags & F_JSON ? jsmode(argc ? argv[0] : "-")
+                         : smode(argc ? argv[0] : "-");
+      break;
+    case 'V':
+      if (!argc) error(0, "no database name specified");
+      if (argc > 1) error(0, "extra argument(s) for verify");
+      r = vmode(argv[0], jobs);
+      break;
+    case 'S':
+      if (!argc) error(0, "no database name specified");
+      if (argc > 1) error(0, "extra argument(s) for serve");
+#ifdef HAVE_EPOLL
+      r = servemode(sockname, argv[0], jobs ? jobs : 1);
+#else
+      error(0, "server mode is not supported on this platform");
+#endif
+      break;
+    case 'N':
+      if (!argc) error(0, "no source directory specified");
+      if (argc > 2) error(0, "extra argument(s) for nss");
+      r = nsmode(argv[0], argc > 1 ? argv[1] : argv[0], flags);
       break;
     default:
-      error(0, "no -q, -c, -d, -l or -s option specified");
+      error(0, "no -q, -c, -M, -d, -l, -s, -V, -S, --overlay, --convert "
+               "or --nss option specified");
   }
   if (r < 0 || fflush(stdout) < 0)
     error(errno, "unable to write: %d", c);
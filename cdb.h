@@ -5,7 +5,7 @@
  */
 
 #ifndef TINYCDB_VERSION
-#define TINYCDB_VERSION 0.78
+#define TINYCDB_VERSION 0.79
 
 #ifdef __cplusplus
 extern "C" {
@@ -18,6 +18,8 @@ unsigned cdb_hash(const void *buf, unsigned len);
 unsigned cdb_unpack(const unsigned char buf[4]);
 void cdb_pack(unsigned num, unsigned char buf[4]);
 
+struct iovec; /* <sys/uio.h> */
+
 struct cdb_file {
   int (*open)(struct cdb_file *cdbfp);    /* open for reading */
   int (*create)(struct cdb_file *cdbfp);  /* create for writing */
@@ -31,6 +33,11 @@ struct cdb_file {
 
   /* meta data of file */
   unsigned fsize;
+
+  /* optional zero-copy writers, may be NULL.  Both append at the
+   * current position and return number of bytes written, like write() */
+  int (*writev)(struct cdb_file *cdbfp, const struct iovec *iov, int iovcnt);
+  int (*copy)(struct cdb_file *cdbfp, int fd, unsigned long long pos, unsigned len);
 };
 
 struct cdb {
@@ -40,9 +47,43 @@ struct cdb {
   unsigned cdb_kpos, cdb_klen;  /* found key */
 
   struct cdb_file *file;
+
+  unsigned cdb_toc;     /* toc position: 0, or relocated in a streamed file */
+  unsigned cdb_ext, cdb_extlen;  /* extension section, if any */
+
+  struct cdb_stats *cdb_stats;  /* lookup statistics, or NULL */
+
+  unsigned cdb_fmt;     /* CDB_FMT_xxx of a non-classic file, or 0 */
+  unsigned cdb_fklen;   /* key length with CDB_FMT_FIXKEY */
+  unsigned cdb_fvlen;   /* value length with CDB_FMT_DENSE */
+  unsigned cdb_ibits;   /* record index bits of a CDB_FMT_DENSE slot */
+  unsigned cdb_hfn;     /* CDB_HASH_xxx with CDB_FMT_HASH */
+  unsigned char cdb_hkey[16];  /* key of a keyed hash function */
+  unsigned cdb_tbits;   /* 2^cdb_tbits tables with CDB_FMT_POW2 */
 };
 
-#define CDB_STATIC_INIT {0,0,0,0,0,0,0,NULL}
+/* extension section at the end of a file, see cdb(5) */
+#define CDB_EXT_MAGIC "CDB-EXT1"
+#define CDB_EXT_FOOTER 16       /* ext position, ext length, magic */
+#define CDB_EXT_TOC "TOC "      /* relocated toc of a streamed file */
+#define CDB_EXT_CRC "CRC "      /* checksums of the toc and of data chunks */
+#define CDB_EXT_FMT "FMT "      /* format and toc of a non-classic file */
+#define CDB_EXT_PAD "PAD "      /* filler up to the end of the file */
+#define CDB_EXT_OVLY "OVLY"     /* tombstones and filter of an overlay layer */
+
+/* record formats, see cdb(5) */
+#define CDB_FMT_FIXKEY 0x01     /* all keys are 4, 8 or 16 bytes long */
+#define CDB_FMT_DENSE  0x02     /* and all values are cdb_fvlen bytes long */
+#define CDB_FMT_HASH   0x04     /* keys are hashed by cdb_hfn */
+#define CDB_FMT_POW2   0x08     /* 2^cdb_tbits tables of 2^k slots */
+
+/* hash functions of CDB_FMT_HASH, see cdb(5) */
+#define CDB_HASH_DEFAULT  0     /* that of the format, no CDB_FMT_HASH */
+#define CDB_HASH_XXH64    1     /* XXH64, 32 bytes at a time */
+#define CDB_HASH_SIPHASH  2     /* SipHash-2-4, keyed */
+#define CDB_HASH_HALFSIP  3     /* HalfSipHash-2-4, keyed by 8 bytes */
+
+#define CDB_STATIC_INIT {0,0,0,0,0,NULL,0,0,0,NULL,0,0,0,0,0,{0},0}
 
 #define cdb_datapos(c) ((c)->cdb_vpos)
 #define cdb_datalen(c) ((c)->cdb_vlen)
@@ -53,9 +94,12 @@ struct cdb {
 int cdb_init(struct cdb *cdbp, int fd);
 /* initialize cdb with posix file and lock all it's content in memory */
 int cdb_init_locked(struct cdb *cdbp, int fd);
+/* initialize cdb with posix file and verify its checksums if any */
+int cdb_init_verified(struct cdb *cdbp, int fd);
 /* initialize cdb with a customized file implementation */
 int cdb_init_with_file(struct cdb *cdbp, struct cdb_file *file);
 void cdb_free(struct cdb *cdbp);
+int cdb_fileno(const struct cdb *cdbp);
 
 int cdb_read(const struct cdb *cdbp,
              void *buf, unsigned len, unsigned pos);
@@ -64,6 +108,13 @@ int cdb_read(const struct cdb *cdbp,
 #define cdb_readkey(cdbp, buf) \
         cdb_read((cdbp), (buf), cdb_keylen(cdbp), cdb_keypos(cdbp))
 
+/* write data to fd, by sendfile()/splice() when possible */
+int cdb_send(const struct cdb *cdbp, int fd, unsigned len, unsigned pos);
+#define cdb_senddata(cdbp, fd) \
+        cdb_send((cdbp), (fd), cdb_datalen(cdbp), cdb_datapos(cdbp))
+#define cdb_sendkey(cdbp, fd) \
+        cdb_send((cdbp), (fd), cdb_keylen(cdbp), cdb_keypos(cdbp))
+
 const void *cdb_get(const struct cdb *cdbp, unsigned len, unsigned pos);
 #define cdb_getdata(cdbp) \
         cdb_get((cdbp), cdb_datalen(cdbp), cdb_datapos(cdbp))
@@ -71,6 +122,20 @@ const void *cdb_get(const struct cdb *cdbp, unsigned len, unsigned pos);
         cdb_get((cdbp), cdb_keylen(cdbp), cdb_keypos(cdbp))
 
 int cdb_find(struct cdb *cdbp, const void *key, unsigned klen);
+/* hash value of a key in the format of the database */
+unsigned cdb_hashkey(const struct cdb *cdbp, const void *key, unsigned klen);
+
+unsigned cdb_crc32c(unsigned crc, const void *buf, unsigned len);
+/* verify part of nparts of checksummed chunks: 1 if ok, 0 if no checksums */
+int cdb_verify(const struct cdb *cdbp, unsigned part, unsigned nparts);
+
+struct cdb_query {
+  const void *key;      /* key to find */
+  unsigned klen;
+  unsigned vpos, vlen;  /* value of the first record found, or zeros */
+};
+
+int cdb_findv(struct cdb *cdbp, struct cdb_query *qv, unsigned n);
 
 struct cdb_find {
   struct cdb *cdb_cdbp;
@@ -85,6 +150,62 @@ int cdb_findinit(struct cdb_find *cdbfp, struct cdb *cdbp,
                  const void *key, unsigned klen);
 int cdb_findnext(struct cdb_find *cdbfp);
 
+/* sharded databases: a manifest and a set of cdb files */
+struct cdb_sharded {
+  unsigned cdb_nshards;
+  struct cdb *cdb_shards;
+};
+
+#define CDB_SHARDS_MAGIC "cdb-shards"
+/* shard of a key with hash value hval */
+#define cdb_shardof(hval, nshards) ((hval) % (nshards))
+
+int cdb_sharded_init(struct cdb_sharded *cdbsp, const char *manifest);
+void cdb_sharded_free(struct cdb_sharded *cdbsp);
+int cdb_sharded_find(struct cdb_sharded *cdbsp, const void *key, unsigned klen,
+                     struct cdb **cdbpp);
+int cdb_sharded_findinit(struct cdb_find *cdbfp, struct cdb_sharded *cdbsp,
+                         const void *key, unsigned klen);
+
+/* overlays: a manifest and a stack of cdb files, the base first and
+ * newer layers (deltas) after it */
+struct cdb_layer {
+  unsigned cdb_tomb, cdb_ntomb;  /* positions of tombstone records */
+  unsigned cdb_filter;  /* membership filter position, or 0 */
+  unsigned cdb_fblocks, cdb_fk;  /* its 64-byte blocks, bits set per key */
+};
+
+struct cdb_overlay {
+  unsigned cdb_nlayers;
+  struct cdb *cdb_layers;       /* oldest first */
+  struct cdb_layer *cdb_linfo;
+};
+
+#define CDB_OVERLAY_MAGIC "cdb-overlay"
+
+int cdb_overlay_init(struct cdb_overlay *cdbop, const char *manifest);
+void cdb_overlay_free(struct cdb_overlay *cdbop);
+int cdb_overlay_find(struct cdb_overlay *cdbop, const void *key, unsigned klen,
+                     struct cdb **cdbpp);
+int cdb_layer_init(const struct cdb *cdbp, struct cdb_layer *lp);
+
+/* lookup statistics, when the library is compiled with CDB_STATS */
+#define CDB_STATS_NPROBE 16
+struct cdb_stats {
+  unsigned long long lookups;     /* cdb_find() and cdb_findnext() calls */
+  unsigned long long hits, misses, errors;
+  unsigned long long probes;      /* hash table slots examined */
+  unsigned long long collisions;  /* hash value matched but key did not */
+  unsigned long long seqs;        /* records returned by cdb_seqnext() */
+  unsigned long long bytes[3];    /* accessed: other, hash tables, data */
+  /* lookups by slots examined, the last one is for NPROBE-1 or more */
+  unsigned long long probehist[CDB_STATS_NPROBE];
+  unsigned long long pmark;       /* private */
+};
+
+int cdb_stats_attach(struct cdb *cdbp, struct cdb_stats *stats);
+void cdb_stats_add(struct cdb_stats *sum, const struct cdb_stats *stats);
+
 #define cdb_seqinit(cptr, cdbp) ((*(cptr))=2048)
 int cdb_seqnext(unsigned *cptr, struct cdb *cdbp);
 
@@ -104,8 +225,32 @@ struct cdb_make {
   struct cdb_rl *cdb_rec[256];  /* list of arrays of record infos */
 
   struct cdb_file *file;
+
+  unsigned cdb_flags;   /* CDB_MAKE_xxx */
+  unsigned cdb_crcchunk;  /* checksummed chunk size */
+  unsigned cdb_crcpos;  /* data checksummed so far, ~0 if rewritten */
+  unsigned cdb_crc;     /* CRC-32C of the current chunk */
+  unsigned *cdb_crcs, cdb_ncrc, cdb_acrc;  /* of the chunks done */
+
+  unsigned cdb_fmt;     /* CDB_FMT_xxx, 0 for the classic format */
+  unsigned cdb_fklen;   /* key length with CDB_FMT_FIXKEY */
+  unsigned cdb_fvlen;   /* value length with CDB_FMT_DENSE */
+  unsigned cdb_cklen, cdb_cvlen;  /* lengths common to all records, or ~0 */
+  unsigned cdb_fend;    /* end of data written, if ever beyond cdb_dpos */
+  unsigned cdb_hfn;     /* CDB_HASH_xxx with CDB_FMT_HASH */
+  unsigned char cdb_hkey[16];  /* key of a keyed hash function */
+  unsigned cdb_tbits;   /* 2^cdb_tbits tables with CDB_FMT_POW2 */
+  unsigned cdb_load;    /* hash table load in percents, 0 for 50 */
+  unsigned cdb_fbits;   /* membership filter bits per key, or 0 */
+  unsigned *cdb_tomb;   /* positions of tombstone records, ascending */
+  unsigned cdb_ntomb, cdb_atomb;
 };
 
+#define CDB_MAKE_STREAM 0x01  /* write toc to the end, never seek */
+#define CDB_MAKE_CRC    0x02  /* write checksums */
+#define CDB_MAKE_COMPACT 0x04 /* pick the smallest format at finish */
+#define CDB_CRC_CHUNK   (1u << 20)  /* default checksummed chunk size */
+
 enum cdb_put_mode {
   CDB_PUT_ADD = 0,  /* add unconditionnaly, like cdb_make_add() */
 #define CDB_PUT_ADD  CDB_PUT_ADD
@@ -127,6 +272,12 @@ int cdb_make_start_with_file(struct cdb_make *cdbmp, struct cdb_file *file);
 int cdb_make_add(struct cdb_make *cdbmp,
                  const void *key, unsigned klen,
                  const void *val, unsigned vlen);
+int cdb_make_addv(struct cdb_make *cdbmp,
+                  const void *key, unsigned klen,
+                  const struct iovec *iov, int iovcnt);
+int cdb_make_addfd(struct cdb_make *cdbmp,
+                   const void *key, unsigned klen,
+                   int fd, unsigned long long pos, unsigned vlen);
 int cdb_make_exists(struct cdb_make *cdbmp,
                     const void *key, unsigned klen);
 int cdb_make_find(struct cdb_make *cdbmp,
@@ -136,6 +287,36 @@ int cdb_make_put(struct cdb_make *cdbmp,
                  const void *key, unsigned klen,
                  const void *val, unsigned vlen,
                  enum cdb_put_mode mode);
+int cdb_make_puth(struct cdb_make *cdbmp, unsigned hval,
+                  const void *key, unsigned klen,
+                  const void *val, unsigned vlen,
+                  enum cdb_put_mode mode);
+int cdb_make_merge(struct cdb_make *cdbmp, struct cdb *cdbp,
+                   enum cdb_put_mode mode);
+
+struct cdb_delta {
+  const void *key;      /* key to change */
+  unsigned klen;
+  const void *val;      /* new value, or NULL to delete the key */
+  unsigned vlen;
+};
+
+int cdb_make_update(struct cdb_make *cdbmp, struct cdb *cdbp,
+                    const struct cdb_delta *delta, unsigned n);
+int cdb_make_stream(struct cdb_make *cdbmp);
+int cdb_make_checksum(struct cdb_make *cdbmp, unsigned chunk);
+int cdb_make_fixkey(struct cdb_make *cdbmp, unsigned klen);
+int cdb_make_dense(struct cdb_make *cdbmp, unsigned klen, unsigned vlen);
+int cdb_make_compact(struct cdb_make *cdbmp);
+int cdb_make_hash(struct cdb_make *cdbmp, unsigned fn, const void *key);
+int cdb_make_tables(struct cdb_make *cdbmp, unsigned ntables, unsigned load);
+int cdb_make_filter(struct cdb_make *cdbmp, unsigned bits);
+int cdb_make_delete(struct cdb_make *cdbmp, const void *key, unsigned klen);
+int cdb_make_overlay(struct cdb_make *cdbmp, struct cdb_overlay *cdbop,
+                     unsigned first);
+/* hash value of a key in the format of the database, for cdb_make_puth() */
+unsigned cdb_make_hashkey(const struct cdb_make *cdbmp,
+                          const void *key, unsigned klen);
 int cdb_make_finish(struct cdb_make *cdbmp);
 
 #ifdef __cplusplus
@@ -0,0 +1,762 @@
+/* cdb.hpp: C++ interface to tinycdb
+ *
+ * tinycdb::reader<Backend> looks records up in a database opened with
+ * the C library.  With mmap_backend (the default) every access to the
+ * file is pointer arithmetic on the mapping, inlined into the lookup
+ * loop, and keys and values are returned as std::string_view into the
+ * mapping, valid as long as the reader.  file_backend goes through the
+ * struct cdb_file of the handle instead, so it works with any file
+ * implementation, but a view it returns is only valid until the next
+ * call on the same reader.
+ *
+ * Errors are reported by std::system_error exceptions; a corrupt
+ * database gives EPROTO.  tinycdb::builder is a move-only wrapper of
+ * struct cdb_make.
+ *
+ * With C++20 coroutines, tinycdb::interleaver looks up many keys at once
+ * on one mmap_backend reader: every lookup is a coroutine which
+ * prefetches the next hash table slot or record and suspends instead of
+ * waiting for it, and the interleaver resumes a group of them in turn,
+ * so that cache misses of different keys overlap.
+ *
+ * Needs C++17, or C++20 for the interleaver.
+ *
+ * This file is a part of tinycdb package by Michael Tokarev, mjt@corpit.ru.
+ * Public domain.
+ */
+
+#ifndef TINYCDB_HPP
+#define TINYCDB_HPP
+
+#include <cerrno>
+#include <cstring>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <utility>
+#include <fcntl.h>
+#include <unistd.h>
+#include "cdb.h"
+
+#if __cplusplus >= 202002L && defined(__has_include)
+# if __has_include(<coroutine>)
+#  include <chrono>
+#  include <coroutine>
+#  define TINYCDB_COROUTINES 1
+# endif
+#endif
+
+namespace tinycdb {
+
+[[noreturn]] inline void
+throw_errno(int err, const char *what)
+{
+  throw std::system_error(err, std::generic_category(), what);
+}
+
+inline unsigned
+hash(std::string_view key) noexcept
+{
+  const unsigned char *p = reinterpret_cast<const unsigned char*>(key.data());
+  const unsigned char *end = p + key.size();
+  unsigned h = 5381;
+  while(p < end)
+    h = (h + (h << 5)) ^ *p++;
+  return h;
+}
+
+inline unsigned
+unpack(const unsigned char *p) noexcept
+{
+  return p[0] | (unsigned)p[1] << 8 | (unsigned)p[2] << 16
+       | (unsigned)p[3] << 24;
+}
+
+/* the whole file is mapped, get() is an address in the mapping */
+class mmap_backend {
+  const unsigned char *base_ = nullptr;
+public:
+  static constexpr bool stable = true;  /* views live as long as reader */
+  void attach(struct cdb *cdbp) {
+    base_ = static_cast<const unsigned char*>(cdb_get(cdbp, cdbp->file->fsize, 0));
+    if (!base_)
+      throw_errno(errno, "cdb_get");
+  }
+  const unsigned char *get(const struct cdb *, unsigned pos, unsigned) const
+    noexcept { return base_ + pos; }
+};
+
+/* any struct cdb_file, through cdb_get() */
+class file_backend {
+public:
+  static constexpr bool stable = false;  /* views live until next get() */
+  void attach(struct cdb *) {}
+  const unsigned char *get(const struct cdb *cdbp, unsigned pos,
+                           unsigned len) const {
+    const void *p = cdb_get(cdbp, len, pos);
+    if (!p)
+      throw_errno(errno, "cdb_get");
+    return static_cast<const unsigned char*>(p);
+  }
+};
+
+#ifdef TINYCDB_COROUTINES
+
+namespace detail {
+
+#ifdef __GNUC__
+inline void prefetch(const void *p) noexcept { __builtin_prefetch(p); }
+#else
+inline void prefetch(const void *) noexcept {}
+#endif
+
+/* Coroutine frames of one size, recycled per thread: the interleaver
+ * starts a lookup coroutine for every key, and going to the heap for
+ * each would cost more than the lookup itself. */
+class frame_pool {
+  static constexpr unsigned max = 64;
+  std::size_t size_ = 0;
+  unsigned n_ = 0;
+  void *free_[max];
+  static frame_pool &local() noexcept {
+    thread_local frame_pool fp;
+    return fp;
+  }
+public:
+  ~frame_pool() {
+    while(n_)
+      ::operator delete(free_[--n_]);
+  }
+  static void *get(std::size_t size) {
+    frame_pool &fp = local();
+    if (fp.n_ && fp.size_ == size)
+      return fp.free_[--fp.n_];
+    return ::operator new(size);
+  }
+  static void put(void *p, std::size_t size) noexcept {
+    frame_pool &fp = local();
+    if (!fp.n_)
+      fp.size_ = size;
+    if (fp.n_ < max && fp.size_ == size)
+      fp.free_[fp.n_++] = p;
+    else
+      ::operator delete(p);
+  }
+};
+
+/* a single lookup, resumed by the interleaver until done() */
+struct lookup {
+  struct promise_type {
+    std::optional<std::string_view> value;
+    lookup get_return_object() noexcept
+      { return lookup{handle::from_promise(*this)}; }
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    std::suspend_always final_suspend() noexcept { return {}; }
+    void return_value(std::optional<std::string_view> v) noexcept
+      { value = v; }
+    void unhandled_exception() { throw; }  /* out of resume() */
+    static void *operator new(std::size_t size)
+      { return frame_pool::get(size); }
+    static void operator delete(void *p, std::size_t size) noexcept
+      { frame_pool::put(p, size); }
+  };
+  using handle = std::coroutine_handle<promise_type>;
+  handle h;
+};
+
+} /* namespace detail */
+
+class interleaver;
+
+#endif /* TINYCDB_COROUTINES */
+
+template <class Backend = mmap_backend>
+class reader {
+  struct probe {        /* position in a hash table, as in cdb_find */
+    unsigned hval, htab, htend, htp, todo;
+  };
+
+public:
+  using record = std::pair<std::string_view, std::string_view>;
+
+  /* open a file by name */
+  explicit reader(const char *path) {
+    int fd = ::open(path, O_RDONLY);
+    if (fd < 0)
+      throw_errno(errno, path);
+    init(fd, true);
+  }
+  explicit reader(const std::string &path) : reader(path.c_str()) {}
+  /* use an open file, which the reader does not close */
+  explicit reader(int fd) { init(fd, false); }
+  /* use a custom file implementation (file_backend only) */
+  explicit reader(struct cdb_file *file) {
+    if (cdb_init_with_file(&cdb_, file) != 0)
+      throw_errno(errno, "cdb_init_with_file");
+    attach();
+  }
+
+  reader(reader &&o) noexcept
+    : cdb_(o.cdb_), be_(o.be_), fd_(o.fd_) {
+    o.cdb_.file = nullptr;
+    o.fd_ = -1;
+  }
+  reader &operator=(reader &&o) noexcept {
+    if (this != &o) {
+      close();
+      cdb_ = o.cdb_;
+      be_ = o.be_;
+      fd_ = o.fd_;
+      o.cdb_.file = nullptr;
+      o.fd_ = -1;
+    }
+    return *this;
+  }
+  reader(const reader &) = delete;
+  reader &operator=(const reader &) = delete;
+  ~reader() { close(); }
+
+  /* the C handle, for everything else */
+  struct cdb *handle() noexcept { return &cdb_; }
+
+  /* value of the first record with this key */
+  std::optional<std::string_view> find(std::string_view key) const {
+    probe p;
+    unsigned vpos, vlen;
+    if (!start(p, key) || !next(p, key, vpos, vlen))
+      return std::nullopt;
+    return view(vpos, vlen);
+  }
+  bool contains(std::string_view key) const {
+    probe p;
+    unsigned vpos, vlen;
+    return start(p, key) && next(p, key, vpos, vlen);
+  }
+
+  /* values of all records with this key, as a range.
+   * The key is not copied, it should outlive the range. */
+  class value_iterator {
+    friend class reader;
+    const reader *r_ = nullptr;
+    std::string_view key_;
+    probe p_;
+    std::string_view v_;
+    void advance() {
+      unsigned vpos, vlen;
+      if (r_->next(p_, key_, vpos, vlen))
+        v_ = r_->view(vpos, vlen);
+      else
+        r_ = nullptr;
+    }
+  public:
+    using iterator_category = std::input_iterator_tag;
+    using value_type = std::string_view;
+    using difference_type = std::ptrdiff_t;
+    using pointer = const std::string_view*;
+    using reference = const std::string_view&;
+    value_iterator() = default;
+    reference operator*() const noexcept { return v_; }
+    pointer operator->() const noexcept { return &v_; }
+    value_iterator &operator++() { advance(); return *this; }
+    void operator++(int) { advance(); }
+    bool operator==(const value_iterator &o) const noexcept
+      { return r_ == o.r_; }
+    bool operator!=(const value_iterator &o) const noexcept
+      { return r_ != o.r_; }
+  };
+  struct value_range {
+    value_iterator b;
+    value_iterator begin() const noexcept { return b; }
+    value_iterator end() const noexcept { return value_iterator(); }
+  };
+  value_range find_all(std::string_view key) const {
+    value_range vr;
+    vr.b.key_ = key;
+    if (start(vr.b.p_, key)) {
+      vr.b.r_ = this;
+      vr.b.advance();
+    }
+    return vr;
+  }
+
+  /* all records in file order, as a range of (key, value) pairs */
+  class record_iterator {
+    friend class reader;
+    const reader *r_ = nullptr;
+    unsigned pos_ = 0;
+    record rec_;
+    void advance() {
+      unsigned dend = r_->cdb_.cdb_dend, rh = r_->rhdr(), klen, vlen;
+      const unsigned char *p;
+      if (pos_ >= dend || pos_ > dend - rh) {
+        r_ = nullptr;
+        return;
+      }
+      p = r_->be_.get(&r_->cdb_, pos_, rh);
+      klen = rh < 8 ? r_->cdb_.cdb_fklen : unpack(p);
+      vlen = r_->rvlen(p, rh);
+      pos_ += rh;
+      if (dend - klen < pos_ || dend - vlen < pos_ + klen)
+        throw_errno(EPROTO, "cdb");
+      p = r_->be_.get(&r_->cdb_, pos_, klen + vlen);
+      rec_.first = std::string_view(reinterpret_cast<const char*>(p), klen);
+      rec_.second = std::string_view(reinterpret_cast<const char*>(p) + klen,
+                                     vlen);
+      pos_ += klen + vlen;
+    }
+  public:
+    using iterator_category = std::input_iterator_tag;
+    using value_type = record;
+    using difference_type = std::ptrdiff_t;
+    using pointer = const record*;
+    using reference = const record&;
+    record_iterator() = default;
+    reference operator*() const noexcept { return rec_; }
+    pointer operator->() const noexcept { return &rec_; }
+    record_iterator &operator++() { advance(); return *this; }
+    void operator++(int) { advance(); }
+    bool operator==(const record_iterator &o) const noexcept
+      { return r_ == o.r_ && (!r_ || pos_ == o.pos_); }
+    bool operator!=(const record_iterator &o) const noexcept
+      { return !(*this == o); }
+  };
+  struct record_range {
+    record_iterator b;
+    record_iterator begin() const noexcept { return b; }
+    record_iterator end() const noexcept { return record_iterator(); }
+  };
+  record_range records() const {
+    record_range rr;
+    rr.b.r_ = this;
+    rr.b.pos_ = 2048;
+    rr.b.advance();
+    return rr;
+  }
+
+private:
+  struct cdb cdb_ = CDB_STATIC_INIT;
+  Backend be_;
+  int fd_ = -1;         /* owned descriptor, if any */
+
+#ifdef TINYCDB_COROUTINES
+  friend class interleaver;
+
+  /* find() as a coroutine: suspends after prefetching each hash table
+   * cache line and each candidate record.  The toc is not waited for,
+   * it stays in cache when lookups are frequent. */
+  detail::lookup lookup(std::string_view key) const {
+    unsigned fsize = cdb_.file->fsize, dend = cdb_.cdb_dend, rh = rhdr();
+    unsigned klen = key.size(), hval = hashkey(key);
+    unsigned ss = hslot(), hm = hmask();
+    unsigned htab, htend, htp, todo, n, h, pos;
+    const unsigned char *s;
+    if (klen >= dend || !klenok(klen))
+      co_return std::nullopt;
+    s = be_.get(&cdb_, tocent(hval), 8);
+    htab = unpack(s);
+    n = unpack(s + 4);
+    if (!n)
+      co_return std::nullopt;
+    if (n > fsize / ss || htab < dend || htab > fsize
+        || n * ss > fsize - htab)
+      throw_errno(EPROTO, "cdb");
+    htend = htab + n * ss;
+    htp = htab + hstart(hval, n) * ss;
+    s = be_.get(&cdb_, htp, ss);
+    detail::prefetch(s);
+    co_await std::suspend_always{};
+    for (todo = n * ss; todo; todo -= ss) {
+      pos = slot(s, h);
+      if (!pos)
+        break;
+      if ((htp += ss) >= htend)
+        htp = htab;
+      if (!((h ^ hval) & hm)) {
+        if (pos > dend - rh)
+          throw_errno(EPROTO, "cdb");
+        const unsigned char *r = be_.get(&cdb_, pos, rh);
+        detail::prefetch(r);
+        detail::prefetch(r + rh + klen);
+        co_await std::suspend_always{};
+        if (rh < 8 || unpack(r) == klen) {
+          if (dend - klen < pos + rh)
+            throw_errno(EPROTO, "cdb");
+          if (std::memcmp(key.data(), r + rh, klen) == 0) {
+            unsigned vlen = rvlen(r, rh);
+            if (dend < vlen || dend - vlen < pos + rh + klen)
+              throw_errno(EPROTO, "cdb");
+            co_return view(pos + rh + klen, vlen);
+          }
+        }
+      }
+      s = be_.get(&cdb_, htp, ss);
+      if (!(reinterpret_cast<std::uintptr_t>(s) & 63)) {
+        detail::prefetch(s);
+        co_await std::suspend_always{};
+      }
+    }
+    co_return std::nullopt;
+  }
+#endif
+
+  void init(int fd, bool own) {
+    if (cdb_init(&cdb_, fd) != 0) {
+      int err = errno;
+      if (own)
+        ::close(fd);
+      throw_errno(err, "cdb_init");
+    }
+    if (own)
+      fd_ = fd;
+    attach();
+  }
+  void attach() {
+    try {
+      be_.attach(&cdb_);
+    }
+    catch(...) {
+      close();
+      throw;
+    }
+  }
+  void close() noexcept {
+    if (cdb_.file) {
+      cdb_free(&cdb_);
+      cdb_.file = nullptr;
+    }
+    if (fd_ >= 0) {
+      ::close(fd_);
+      fd_ = -1;
+    }
+  }
+
+  /* Hash value and record header length in the format of the file.
+   * With CDB_FMT_FIXKEY, records have no key length, and keys of other
+   * lengths are never found.  With CDB_FMT_DENSE, records have no
+   * header at all. */
+  unsigned hashkey(std::string_view key) const noexcept {
+    return cdb_.cdb_fmt ? cdb_hashkey(&cdb_, key.data(), key.size())
+                        : hash(key);
+  }
+  unsigned rhdr() const noexcept {
+    return cdb_.cdb_fmt & CDB_FMT_DENSE ? 0 :
+           cdb_.cdb_fmt & CDB_FMT_FIXKEY ? 4 : 8;
+  }
+  unsigned rvlen(const unsigned char *r, unsigned rh) const noexcept
+    { return rh ? unpack(r + rh - 4) : cdb_.cdb_fvlen; }
+  bool klenok(unsigned klen) const noexcept
+    { return !(cdb_.cdb_fmt & CDB_FMT_FIXKEY) || klen == cdb_.cdb_fklen; }
+
+  /* Hash table slot size, and the bits of the hash value a slot has.
+   * A CDB_FMT_DENSE slot is the record number + 1 in its low cdb_ibits
+   * bits, and the hash value above them. */
+  unsigned hslot() const noexcept
+    { return cdb_.cdb_fmt & CDB_FMT_DENSE ? 4 : 8; }
+  unsigned hmask() const noexcept {
+    return cdb_.cdb_fmt & CDB_FMT_DENSE ? ~((1u << cdb_.cdb_ibits) - 1)
+                                        : ~0u;
+  }
+  /* Toc entry of a hash value, and the slot of a table of n slots to
+   * start from: the low 8 bits pick one of 256 tables and the rest
+   * modulo n the slot, or masks do with CDB_FMT_POW2. */
+  unsigned tocent(unsigned hval) const noexcept {
+    unsigned nt = cdb_.cdb_fmt & CDB_FMT_POW2 ? 1u << cdb_.cdb_tbits : 256;
+    return cdb_.cdb_toc + ((hval & (nt - 1)) << 3);
+  }
+  unsigned hstart(unsigned hval, unsigned n) const noexcept {
+    return cdb_.cdb_fmt & CDB_FMT_POW2 ? (hval >> cdb_.cdb_tbits) & (n - 1)
+                                       : (hval >> 8) % n;
+  }
+  /* record position of slot s, 0 if it is empty, and its hash value */
+  unsigned slot(const unsigned char *s, unsigned &h) const {
+    unsigned rlen = cdb_.cdb_fklen + cdb_.cdb_fvlen, i;
+    h = unpack(s);
+    if (!(cdb_.cdb_fmt & CDB_FMT_DENSE))
+      return unpack(s + 4);
+    if (!h)
+      return 0;
+    i = h & ((1u << cdb_.cdb_ibits) - 1);
+    if (i - 1 >= (cdb_.cdb_dend - 2048) / rlen)
+      throw_errno(EPROTO, "cdb");
+    return 2048 + (i - 1) * rlen;
+  }
+
+  std::string_view view(unsigned pos, unsigned len) const {
+    return std::string_view(
+      reinterpret_cast<const char*>(be_.get(&cdb_, pos, len)), len);
+  }
+
+  /* find the hash table slot to start from, false if the table is empty */
+  bool start(probe &p, std::string_view key) const {
+    unsigned fsize = cdb_.file->fsize, dend = cdb_.cdb_dend, pos, n;
+    unsigned ss = hslot();
+    const unsigned char *t;
+    p.hval = hashkey(key);
+    if (key.size() >= dend || !klenok(key.size()))
+      return false;
+    t = be_.get(&cdb_, tocent(p.hval), 8);
+    pos = unpack(t);
+    n = unpack(t + 4);
+    if (!n)
+      return false;
+    if (n > fsize / ss || pos < dend || pos > fsize
+        || n * ss > fsize - pos)
+      throw_errno(EPROTO, "cdb");
+    p.htab = pos;
+    p.htend = pos + n * ss;
+    p.htp = pos + hstart(p.hval, n) * ss;
+    p.todo = n * ss;
+    return true;
+  }
+
+  /* next record with this key: its value position and length */
+  bool next(probe &p, std::string_view key,
+            unsigned &vpos, unsigned &vlen) const {
+    unsigned dend = cdb_.cdb_dend, klen = key.size(), rh = rhdr(), h, pos;
+    unsigned ss = hslot(), hm = hmask();
+    const unsigned char *s;
+    while(p.todo) {
+      s = be_.get(&cdb_, p.htp, ss);
+      pos = slot(s, h);
+      if (!pos) {
+        p.todo = 0;
+        break;
+      }
+      p.todo -= ss;
+      if ((p.htp += ss) >= p.htend)
+        p.htp = p.htab;
+      if ((h ^ p.hval) & hm)
+        continue;
+      if (pos > dend - rh)
+        throw_errno(EPROTO, "cdb");
+      s = be_.get(&cdb_, pos, rh);
+      if (rh == 8 && unpack(s) != klen)
+        continue;
+      vlen = rvlen(s, rh);
+      if (dend - klen < pos + rh)
+        throw_errno(EPROTO, "cdb");
+      if (std::memcmp(key.data(), be_.get(&cdb_, pos + rh, klen), klen) != 0)
+        continue;
+      if (dend < vlen || dend - vlen < pos + rh + klen)
+        throw_errno(EPROTO, "cdb");
+      vpos = pos + rh + klen;
+      return true;
+    }
+    return false;
+  }
+};
+
+/* builds a database.  Given a name, it is written to name.tmp, renamed
+ * over name by finish(), and removed if the builder is destroyed before
+ * that.  Given a descriptor, the caller creates and closes the file. */
+class builder {
+public:
+  explicit builder(int fd) : cm_(new struct cdb_make) { start(fd); }
+  explicit builder(const std::string &path)
+    : cm_(new struct cdb_make), path_(path), tmp_(path + ".tmp") {
+    ::unlink(tmp_.c_str());
+    fd_ = ::open(tmp_.c_str(), O_RDWR|O_CREAT|O_EXCL, 0666);
+    if (fd_ < 0)
+      throw_errno(errno, tmp_.c_str());
+    start(fd_);
+  }
+  builder(builder &&o) noexcept
+    : cm_(std::move(o.cm_)), fd_(o.fd_), path_(std::move(o.path_)),
+      tmp_(std::move(o.tmp_)), active_(o.active_) {
+    o.fd_ = -1;
+    o.active_ = false;
+  }
+  builder &operator=(builder &&o) noexcept {
+    if (this != &o) {
+      abandon();
+      cm_ = std::move(o.cm_);
+      fd_ = o.fd_;
+      path_ = std::move(o.path_);
+      tmp_ = std::move(o.tmp_);
+      active_ = o.active_;
+      o.fd_ = -1;
+      o.active_ = false;
+    }
+    return *this;
+  }
+  builder(const builder &) = delete;
+  builder &operator=(const builder &) = delete;
+  ~builder() { abandon(); }
+
+  struct cdb_make *handle() noexcept { return cm_.get(); }
+
+  void add(std::string_view key, std::string_view val) {
+    if (cdb_make_add(cm_.get(), key.data(), key.size(),
+                     val.data(), val.size()) != 0)
+      throw_errno(errno, "cdb_make_add");
+  }
+  /* cdb_make_put(): true if a record with this key existed before */
+  bool put(std::string_view key, std::string_view val,
+           enum cdb_put_mode mode = CDB_PUT_REPLACE) {
+    int r = cdb_make_put(cm_.get(), key.data(), key.size(),
+                         val.data(), val.size(), mode);
+    if (r < 0)
+      throw_errno(errno, "cdb_make_put");
+    return r > 0;
+  }
+  void finish() {
+    int r = cdb_make_finish(cm_.get()), err = errno;
+    active_ = false;
+    if (r != 0) {
+      abandon();
+      throw_errno(err, "cdb_make_finish");
+    }
+    if (fd_ >= 0) {
+      ::close(fd_);
+      fd_ = -1;
+      if (::rename(tmp_.c_str(), path_.c_str()) != 0) {
+        err = errno;
+        ::unlink(tmp_.c_str());
+        throw_errno(err, path_.c_str());
+      }
+    }
+  }
+
+private:
+  std::unique_ptr<struct cdb_make> cm_;  /* not movable: points into itself */
+  int fd_ = -1;
+  std::string path_, tmp_;
+  bool active_ = false;
+
+  void start(int fd) {
+    if (cdb_make_start(cm_.get(), fd) != 0) {
+      int err = errno;
+      if (fd_ >= 0) {
+        ::close(fd_);
+        ::unlink(tmp_.c_str());
+        fd_ = -1;
+      }
+      throw_errno(err, "cdb_make_start");
+    }
+    active_ = true;
+  }
+  void abandon() noexcept {
+    if (active_) {
+      cdb_make_finish(cm_.get());  /* the only way to release it */
+      active_ = false;
+    }
+    if (fd_ >= 0) {
+      ::close(fd_);
+      ::unlink(tmp_.c_str());
+      fd_ = -1;
+    }
+  }
+};
+
+#ifdef TINYCDB_COROUTINES
+
+/* Looks up a sequence of keys, keeping a group of lookups in flight and
+ * switching between them at every cache miss.  With group 0 the group
+ * size is adaptive: the time per lookup is measured over windows of
+ * lookups, and the size moves in the direction which made it shorter,
+ * down to 1 (plain find()) when the database fits in cache.  The size
+ * is kept between calls of find().  Results are passed to a callback,
+ * in the order in which lookups complete, as
+ *   f(index of the key, std::optional<std::string_view> value)
+ */
+class interleaver {
+public:
+  static constexpr unsigned max_group = 64;
+
+  explicit interleaver(const reader<mmap_backend> &r, unsigned group = 0)
+    noexcept
+    : r_(r), adaptive_(!group),
+      group_(!group ? 8 : group < max_group ? group : max_group) {}
+
+  /* current group size */
+  unsigned group() const noexcept { return group_; }
+
+  template <class Range, class F>
+  void find(const Range &keys, F &&f) {
+    auto it = std::begin(keys);
+    auto end = std::end(keys);
+    std::size_t idx = 0;
+    if (group_ <= 1 && !adaptive_) {
+      for (; it != end; ++it)
+        f(idx++, r_.find(std::string_view(*it)));
+      return;
+    }
+
+    struct flight {
+      detail::lookup::handle h;
+      std::size_t idx;
+    } fv[max_group];
+    struct guard {         /* destroys lookups left by an exception */
+      flight *fv;
+      unsigned n = 0;
+      ~guard() { while(n) fv[--n].h.destroy(); }
+    } g{fv};
+    std::chrono::steady_clock::time_point t0 =
+      std::chrono::steady_clock::now();
+    unsigned done = 0, k;
+
+    for (;;) {
+      while(g.n < group_ && it != end) {
+        fv[g.n].h = r_.lookup(std::string_view(*it++)).h;
+        fv[g.n++].idx = idx++;
+      }
+      if (!g.n)
+        break;
+      for (k = 0; k < g.n; ) {
+        fv[k].h.resume();
+        if (!fv[k].h.done()) {
+          ++k;
+          continue;
+        }
+        std::optional<std::string_view> v = fv[k].h.promise().value;
+        std::size_t i = fv[k].idx;
+        fv[k].h.destroy();
+        fv[k] = fv[--g.n];
+        if (g.n < group_ && it != end) {
+          fv[g.n].h = r_.lookup(std::string_view(*it++)).h;
+          fv[g.n++].idx = idx++;
+        }
+        f(i, v);
+        if (adaptive_ && ++done == window) {
+          std::chrono::steady_clock::time_point t1 =
+            std::chrono::steady_clock::now();
+          adapt(std::chrono::duration<double>(t1 - t0).count());
+          t0 = t1;
+          done = 0;
+        }
+      }
+    }
+  }
+
+private:
+  static constexpr unsigned window = 1024;  /* lookups per measurement */
+  const reader<mmap_backend> &r_;
+  bool adaptive_;
+  unsigned group_;
+  bool grow_ = true;    /* direction of the last change */
+  double last_ = 0;     /* time of the previous window */
+
+  /* one step of hill climbing: continue in the same direction while
+   * it gets faster, turn back when it does not */
+  void adapt(double t) {
+    unsigned step = group_ / 4 ? group_ / 4 : 1;
+    if (last_ && t > last_)
+      grow_ = !grow_;
+    last_ = t;
+    if (grow_)
+      group_ = group_ + step < max_group ? group_ + step : max_group;
+    else
+      group_ = group_ > step ? group_ - step : 1;
+  }
+};
+
+#endif /* TINYCDB_COROUTINES */
+
+} /* namespace tinycdb */
+
+#endif /* include guard */
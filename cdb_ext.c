@@ -0,0 +1,163 @@
+/* cdb_ext.c: extension section of a cdb file
+ *
+ * An extension section may follow the hash tables.  It is a series of
+ * (tag, length, data) records, 4-byte tag and 4-byte length each, and
+ * is located by a footer at the very end of the file: its position,
+ * its length and CDB_EXT_MAGIC.  Readers not aware of it never look
+ * past the hash tables.
+ *
+ * A file in other than the classic format has a zero toc at the
+ * beginning, like a streamed one, and a CDB_EXT_FMT record: length of
+ * the header which follows, CDB_FMT_xxx flags and format parameters
+ * (key length; value length and record number bits of CDB_FMT_DENSE;
+ * hash function and its 16-byte key with CDB_FMT_HASH), all 4-byte
+ * integers but the key, then the toc.  Newer formats may
+ * add parameters to the header; unknown flags make the file unreadable.
+ *
+ * This file is a part of tinycdb package by Michael Tokarev, mjt@corpit.ru.
+ * Public domain.
+ */
+
+#include "cdb_int.h"
+
+void internal_function
+_cdb_ext_init(struct cdb *cdbp)
+{
+  unsigned fsize = cdbp->file->fsize;
+  unsigned pos, len;
+  const unsigned char *p;
+
+  cdbp->cdb_ext = cdbp->cdb_extlen = 0;
+  if (fsize < 2048 + CDB_EXT_FOOTER)
+    return;
+  fsize -= CDB_EXT_FOOTER;
+  p = (const unsigned char*)_cdb_get(cdbp, CDB_EXT_FOOTER, fsize,
+                                     cdb_buf_default);
+  if (!p || memcmp(p + 8, CDB_EXT_MAGIC, 8) != 0)
+    return;
+  pos = cdb_unpack(p);
+  len = cdb_unpack(p + 4);
+  if (pos < 2048 || pos > fsize || len != fsize - pos)
+    return;
+  cdbp->cdb_ext = pos;
+  cdbp->cdb_extlen = len;
+}
+
+/* find extension record with a given tag, return position of its data */
+unsigned internal_function
+_cdb_ext_find(const struct cdb *cdbp, const char *tag, unsigned *lenp)
+{
+  unsigned pos = cdbp->cdb_ext;
+  unsigned end = pos + cdbp->cdb_extlen;
+  unsigned len;
+  const unsigned char *p;
+
+  while(end - pos >= 8) {
+    if (!(p = (const unsigned char*)_cdb_get(cdbp, 8, pos, cdb_buf_default)))
+      return 0;
+    len = cdb_unpack(p + 4);
+    if (len > end - pos - 8)
+      return 0;
+    if (memcmp(p, tag, 4) == 0) {
+      *lenp = len;
+      return pos + 8;
+    }
+    pos += 8 + len;
+  }
+  return 0;
+}
+
+/* Set up the format of cdbp from header p of a CDB_EXT_FMT record,
+ * hlen bytes long, of which the first _cdb_fmthdr(hlen) are at p. */
+int internal_function
+_cdb_fmt_decode(struct cdb *cdbp, const unsigned char *p, unsigned hlen)
+{
+  unsigned fmt = cdb_unpack(p + 4), fklen = 0, fvlen = 0, ibits = 0, hfn = 0;
+  unsigned tbits = 0;
+
+  if (hlen < 12 || (hlen & 3) ||
+      (fmt & ~(CDB_FMT_FIXKEY|CDB_FMT_DENSE|CDB_FMT_HASH|CDB_FMT_POW2)))
+    return errno = EPROTO, -1;
+  if (fmt & CDB_FMT_FIXKEY) {
+    fklen = cdb_unpack(p + 8);
+    if (fklen != 4 && fklen != 8 && fklen != 16)
+      return errno = EPROTO, -1;
+  }
+  if (fmt & CDB_FMT_DENSE) {
+    if (!(fmt & CDB_FMT_FIXKEY) || hlen < 20)
+      return errno = EPROTO, -1;
+    fvlen = cdb_unpack(p + 12);
+    ibits = cdb_unpack(p + 16);
+    if (fvlen > 0xffffffff - 2048 - fklen || !ibits || ibits > 31)
+      return errno = EPROTO, -1;
+  }
+  if (fmt & CDB_FMT_HASH) {
+    if (hlen < 40)
+      return errno = EPROTO, -1;
+    hfn = cdb_unpack(p + 20);
+    if (hfn < CDB_HASH_XXH64 || hfn > CDB_HASH_HALFSIP)
+      return errno = EPROTO, -1;
+    memcpy(cdbp->cdb_hkey, p + 24, 16);
+  }
+  else
+    memset(cdbp->cdb_hkey, 0, 16);
+  if (fmt & CDB_FMT_POW2) {
+    if (hlen < 44 || (tbits = cdb_unpack(p + 40)) > 16)
+      return errno = EPROTO, -1;
+  }
+  cdbp->cdb_fmt = fmt;
+  cdbp->cdb_fklen = fklen;
+  cdbp->cdb_fvlen = fvlen;
+  cdbp->cdb_ibits = ibits;
+  cdbp->cdb_hfn = hfn;
+  cdbp->cdb_tbits = tbits;
+  return 0;
+}
+
+/* set up the format from CDB_EXT_FMT record at pos */
+int internal_function
+_cdb_ext_fmt(struct cdb *cdbp, unsigned pos, unsigned len)
+{
+  const unsigned char *p;
+  unsigned hlen;
+
+  if (len < 12 ||
+      !(p = (const unsigned char*)_cdb_get(cdbp, 4, pos, cdb_buf_default)))
+    return errno = EPROTO, -1;
+  hlen = cdb_unpack(p);
+  if (hlen < 12 || hlen > len ||
+      !(p = (const unsigned char*)_cdb_get(cdbp, _cdb_fmthdr(hlen), pos,
+                                           cdb_buf_default)) ||
+      _cdb_fmt_decode(cdbp, p, hlen) < 0 ||
+      len - hlen != _cdb_toclen(cdbp))
+    return errno = EPROTO, -1;
+  cdbp->cdb_toc = pos + hlen;
+  return 0;
+}
+
+/* Decode hash table slot at pos: return the record position, or 0 if
+ * the slot is empty, and set *hvalp.  CDB_FMT_DENSE slots have only a
+ * part of the hash value, so the key is hashed again.  The position is
+ * not checked, except that a bad record number gives 1. */
+unsigned internal_function
+_cdb_slot(const struct cdb *cdbp, unsigned pos, unsigned *hvalp)
+{
+  unsigned rpos, rlen;
+  const void *key;
+
+  if (!(cdbp->cdb_fmt & CDB_FMT_DENSE)) {
+    rpos = _cdb_unpack(cdbp, pos + 4, cdb_buf_htab);
+    *hvalp = _cdb_unpack(cdbp, pos, cdb_buf_htab);
+    return rpos;
+  }
+  if (!(rpos = _cdb_unpack(cdbp, pos, cdb_buf_htab) & _cdb_imask(cdbp)))
+    return 0;
+  rlen = cdbp->cdb_fklen + cdbp->cdb_fvlen;
+  if (rpos - 1 >= (cdbp->cdb_dend - 2048) / rlen)
+    return 1;
+  rpos = 2048 + (rpos - 1) * rlen;
+  if (!(key = _cdb_get(cdbp, cdbp->cdb_fklen, rpos, cdb_buf_data)))
+    return 1;
+  *hvalp = _cdb_hashkey(cdbp, key, cdbp->cdb_fklen);
+  return rpos;
+}
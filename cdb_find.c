@@ -6,8 +6,31 @@
 
 #include "cdb_int.h"
 
+#ifdef __GNUC__
+# define always_inline __inline__ __attribute__((always_inline))
+#else
+# define always_inline
+#endif
+
+/* fixed-length keys a and b, K bytes, are equal */
+#define KEYEQ(a, b, K) \
+  ((K) == 4 ? _cdb_ld32(a) == _cdb_ld32(b) : \
+   _cdb_ld64(a) == _cdb_ld64(b) && \
+   ((K) == 8 || _cdb_ld64((a) + 8) == _cdb_ld64((b) + 8)))
+
 int
 cdb_find(struct cdb *cdbp, const void *key, unsigned klen)
+{
+  return _cdb_find(cdbp, key, klen, _cdb_hashkey(cdbp, key, klen));
+}
+
+/* K is 0 for the classic format, or the key length of CDB_FMT_FIXKEY.
+ * find() is expanded for every K separately, so that with fixed-length
+ * keys the record layout is known at compile time, and keys are
+ * compared a word at a time. */
+static always_inline int
+find(struct cdb *cdbp, const void *key, unsigned klen, unsigned hval,
+     const unsigned K)
 {
   unsigned htp;    /* hash table pointer */
   unsigned htab;    /* hash table */
@@ -15,17 +38,12 @@ cdb_find(struct cdb *cdbp, const void *key, unsigned klen)
   unsigned httodo;        /* ht bytes left to look */
   unsigned pos, n;
 
-  unsigned hval;
-
   if (klen >= cdbp->cdb_dend)    /* if key size is too large */
     return 0;
 
-  hval = cdb_hash(key, klen);
-
   /* find (pos,n) hash table to use */
-  /* first 2048 bytes (toc) are always available */
-  /* (hval % 256) * 8 */
-  htp = ((hval << 3) & 2047); /* index in toc (256x8) */
+  /* (hval % 256) * 8, or a mask of hval with CDB_FMT_POW2 */
+  htp = _cdb_tocent(cdbp, hval); /* index in toc */
   n = _cdb_unpack(cdbp, htp + 4, cdb_buf_htab);    /* table size */
   if (!n)            /* empty table */
     return 0;            /* not found */
@@ -40,30 +58,53 @@ cdb_find(struct cdb *cdbp, const void *key, unsigned klen)
   htab = pos;    /* htab pointer */
   htend = htab + httodo;    /* after end of htab */
   /* htab starting position: rest of hval modulo htsize, 8bytes per elt */
-  htp = htab + (((hval >> 8) % n) << 3);
+  htp = htab + (_cdb_hstart(cdbp, hval, n) << 3);
 
   for(;;) {
+    CDB_STAT(cdbp, probes++);
     pos = _cdb_unpack(cdbp, htp + 4, cdb_buf_htab);    /* record position */
     if (!pos)
       return 0;
     if (_cdb_unpack(cdbp, htp, cdb_buf_htab) == hval) {
-      if (pos > cdbp->cdb_dend - 8) /* key+val lengths */
-        return errno = EPROTO, -1;
-      if (_cdb_unpack(cdbp, pos, cdb_buf_data) == klen) {
-        if (cdbp->cdb_dend - klen < pos + 8)
+      if (K) { /* value length, key */
+        const unsigned char *r;
+        if (pos > cdbp->cdb_dend - 4 - K)
           return errno = EPROTO, -1;
-        if (memcmp(key, _cdb_get(cdbp, klen, pos + 8, cdb_buf_data), klen) == 0) {
-          n = _cdb_unpack(cdbp, pos + 4, cdb_buf_data);
-          pos += 8;
-          if (cdbp->cdb_dend < n || cdbp->cdb_dend - n < pos + klen)
+        if (!(r = (const unsigned char*)_cdb_get(cdbp, 4 + K, pos,
+                                                 cdb_buf_data)))
+          return -1;
+        if (KEYEQ(r + 4, (const unsigned char*)key, K)) {
+          n = _cdb_ld32(r);
+          pos += 4;
+          if (cdbp->cdb_dend - pos - K < n)
             return errno = EPROTO, -1;
           cdbp->cdb_kpos = pos;
-          cdbp->cdb_klen = klen;
-          cdbp->cdb_vpos = pos + klen;
+          cdbp->cdb_klen = K;
+          cdbp->cdb_vpos = pos + K;
           cdbp->cdb_vlen = n;
           return 1;
         }
       }
+      else {
+        if (pos > cdbp->cdb_dend - 8) /* key+val lengths */
+          return errno = EPROTO, -1;
+        if (_cdb_unpack(cdbp, pos, cdb_buf_data) == klen) {
+          if (cdbp->cdb_dend - klen < pos + 8)
+            return errno = EPROTO, -1;
+          if (memcmp(key, _cdb_get(cdbp, klen, pos + 8, cdb_buf_data), klen) == 0) {
+            n = _cdb_unpack(cdbp, pos + 4, cdb_buf_data);
+            pos += 8;
+            if (cdbp->cdb_dend < n || cdbp->cdb_dend - n < pos + klen)
+              return errno = EPROTO, -1;
+            cdbp->cdb_kpos = pos;
+            cdbp->cdb_klen = klen;
+            cdbp->cdb_vpos = pos + klen;
+            cdbp->cdb_vlen = n;
+            return 1;
+          }
+        }
+      }
+      CDB_STAT(cdbp, collisions++);
     }
     httodo -= 8;
     if (!httodo)
@@ -73,3 +114,80 @@ cdb_find(struct cdb *cdbp, const void *key, unsigned klen)
   }
 
 }
+
+/* CDB_FMT_DENSE: 4-byte slots, and records of K + cdb_fvlen bytes
+ * without headers, located by their number */
+static always_inline int
+find_dense(struct cdb *cdbp, const void *key, unsigned hval, const unsigned K)
+{
+  unsigned htp, htab, htend, httodo, pos, n, w;
+  unsigned mask = _cdb_imask(cdbp);
+  unsigned rlen = K + cdbp->cdb_fvlen;
+  unsigned nrec = (cdbp->cdb_dend - 2048) / rlen;
+  const unsigned char *r;
+
+  htp = _cdb_tocent(cdbp, hval);
+  n = _cdb_unpack(cdbp, htp + 4, cdb_buf_htab);
+  if (!n)
+    return 0;
+  httodo = n << 2;
+  pos = _cdb_unpack(cdbp, htp, cdb_buf_htab);
+  if (n > (cdbp->file->fsize >> 2)
+      || pos < cdbp->cdb_dend
+      || pos > cdbp->file->fsize
+      || httodo > cdbp->file->fsize - pos)
+    return errno = EPROTO, -1;
+
+  htab = pos;
+  htend = htab + httodo;
+  htp = htab + (_cdb_hstart(cdbp, hval, n) << 2);
+
+  for(;;) {
+    CDB_STAT(cdbp, probes++);
+    w = _cdb_unpack(cdbp, htp, cdb_buf_htab);
+    if (!w)
+      return 0;
+    if (!((w ^ hval) & ~mask)) {
+      if ((w & mask) - 1 >= nrec)
+        return errno = EPROTO, -1;
+      pos = 2048 + ((w & mask) - 1) * rlen;
+      if (!(r = (const unsigned char*)_cdb_get(cdbp, K, pos, cdb_buf_data)))
+        return -1;
+      if (KEYEQ(r, (const unsigned char*)key, K)) {
+        cdbp->cdb_kpos = pos;
+        cdbp->cdb_klen = K;
+        cdbp->cdb_vpos = pos + K;
+        cdbp->cdb_vlen = rlen - K;
+        return 1;
+      }
+      CDB_STAT(cdbp, collisions++);
+    }
+    httodo -= 4;
+    if (!httodo)
+      return 0;
+    if ((htp += 4) >= htend)
+      htp = htab;
+  }
+}
+
+int internal_function
+_cdb_find(struct cdb *cdbp, const void *key, unsigned klen, unsigned hval)
+{
+  int r;
+  if (!(cdbp->cdb_fmt & CDB_FMT_FIXKEY))
+    r = find(cdbp, key, klen, hval, 0);
+  else if (klen != cdbp->cdb_fklen)
+    r = 0;
+  else if (cdbp->cdb_fmt & CDB_FMT_DENSE)
+    r = klen == 4 ? find_dense(cdbp, key, hval, 4) :
+        klen == 8 ? find_dense(cdbp, key, hval, 8) :
+        find_dense(cdbp, key, hval, 16);
+  else if (klen == 4)
+    r = find(cdbp, key, klen, hval, 4);
+  else if (klen == 8)
+    r = find(cdbp, key, klen, hval, 8);
+  else
+    r = find(cdbp, key, klen, hval, 16);
+  CDB_STAT_FIND(cdbp, r);
+  return r;
+}
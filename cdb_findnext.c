@@ -12,20 +12,31 @@ int
 cdb_findinit(struct cdb_find *cdbfp, struct cdb *cdbp,
              const void *key, unsigned klen)
 {
-  unsigned n, pos;
+  return _cdb_findinit(cdbfp, cdbp, key, klen, _cdb_hashkey(cdbp, key, klen));
+}
+
+int internal_function
+_cdb_findinit(struct cdb_find *cdbfp, struct cdb *cdbp,
+              const void *key, unsigned klen, unsigned hval)
+{
+  unsigned n, pos, ss = _cdb_hslot(cdbp->cdb_fmt);  /* slot size */
 
   cdbfp->cdb_cdbp = cdbp;
   cdbfp->cdb_key = key;
   cdbfp->cdb_klen = klen;
-  cdbfp->cdb_hval = cdb_hash(key, klen);
+  cdbfp->cdb_hval = hval;
 
-  cdbfp->cdb_htp = ((cdbfp->cdb_hval << 3) & 2047);
+  cdbfp->cdb_htp = _cdb_tocent(cdbp, hval);
   n = _cdb_unpack(cdbp, cdbfp->cdb_htp + 4, cdb_buf_htab);
-  cdbfp->cdb_httodo = n << 3;
-  if (!n)
+  if ((cdbp->cdb_fmt & CDB_FMT_FIXKEY) && klen != cdbp->cdb_fklen)
+    n = 0;    /* no key of this length can be there */
+  cdbfp->cdb_httodo = n * ss;
+  if (!n) {
+    CDB_STAT_FIND(cdbp, 0);  /* cdb_findnext() will not be called */
     return 0;
+  }
   pos = _cdb_unpack(cdbp, cdbfp->cdb_htp, cdb_buf_htab);
-  if (n > (cdbp->file->fsize >> 3)
+  if (n > cdbp->file->fsize / ss
       || pos < cdbp->cdb_dend
       || pos > cdbp->file->fsize
       || cdbfp->cdb_httodo > cdbp->file->fsize - pos)
@@ -33,35 +44,52 @@ cdb_findinit(struct cdb_find *cdbfp, struct cdb *cdbp,
 
   cdbfp->cdb_htab = pos;
   cdbfp->cdb_htend = cdbfp->cdb_htab + cdbfp->cdb_httodo;
-  cdbfp->cdb_htp = cdbfp->cdb_htab + (((cdbfp->cdb_hval >> 8) % n) << 3);
+  cdbfp->cdb_htp = cdbfp->cdb_htab + _cdb_hstart(cdbp, hval, n) * ss;
 
   return 1;
 }
 
-int
-cdb_findnext(struct cdb_find *cdbfp) {
+static int
+findnext(struct cdb_find *cdbfp) {
   struct cdb *cdbp = cdbfp->cdb_cdbp;
   unsigned pos, n;
   unsigned klen = cdbfp->cdb_klen;
+  unsigned hlen = _cdb_rhdr(cdbp->cdb_fmt);  /* record header length */
+  unsigned ss = _cdb_hslot(cdbp->cdb_fmt);   /* hash table slot size */
 
   while(cdbfp->cdb_httodo) {
-    pos = _cdb_unpack(cdbp, cdbfp->cdb_htp + 4, cdb_buf_htab);
-    if (!pos)
-      return 0;
-    n = _cdb_unpack(cdbp, cdbfp->cdb_htp, cdb_buf_htab) == cdbfp->cdb_hval;
-    if ((cdbfp->cdb_htp += 8) >= cdbfp->cdb_htend)
+    CDB_STAT(cdbp, probes++);
+    if (ss == 4) {  /* CDB_FMT_DENSE: hash bits and record number */
+      unsigned mask = _cdb_imask(cdbp), rlen = klen + cdbp->cdb_fvlen;
+      pos = _cdb_unpack(cdbp, cdbfp->cdb_htp, cdb_buf_htab);
+      if (!pos)
+        return 0;
+      n = !((pos ^ cdbfp->cdb_hval) & ~mask);
+      pos &= mask;
+      if (n && pos - 1 >= (cdbp->cdb_dend - 2048) / rlen)
+        return errno = EPROTO, -1;
+      pos = 2048 + (pos - 1) * rlen;
+    }
+    else {
+      pos = _cdb_unpack(cdbp, cdbfp->cdb_htp + 4, cdb_buf_htab);
+      if (!pos)
+        return 0;
+      n = _cdb_unpack(cdbp, cdbfp->cdb_htp, cdb_buf_htab) == cdbfp->cdb_hval;
+    }
+    if ((cdbfp->cdb_htp += ss) >= cdbfp->cdb_htend)
       cdbfp->cdb_htp = cdbfp->cdb_htab;
-    cdbfp->cdb_httodo -= 8;
+    cdbfp->cdb_httodo -= ss;
     if (n) {
-      if (pos > cdbp->file->fsize - 8)
+      if (pos > cdbp->file->fsize - hlen)
         return errno = EPROTO, -1;
-      if (_cdb_unpack(cdbp, pos, cdb_buf_data) == klen) {
-        if (cdbp->file->fsize - klen < pos + 8)
+      /* fixed-length records have no key length */
+      if (hlen < 8 || _cdb_unpack(cdbp, pos, cdb_buf_data) == klen) {
+        if (cdbp->file->fsize - klen < pos + hlen)
           return errno = EPROTO, -1;
         if (memcmp(cdbfp->cdb_key,
-            _cdb_get(cdbp, klen, pos + 8, cdb_buf_data), klen) == 0) {
-          n = _cdb_unpack(cdbp, pos + 4, cdb_buf_data);
-          pos += 8;
+            _cdb_get(cdbp, klen, pos + hlen, cdb_buf_data), klen) == 0) {
+          n = _cdb_rvlen(cdbp, hlen, pos);
+          pos += hlen;
           if (cdbp->file->fsize < n ||
               cdbp->file->fsize - n < pos + klen)
             return errno = EPROTO, -1;
@@ -72,8 +100,16 @@ cdb_findnext(struct cdb_find *cdbfp) {
           return 1;
         }
       }
+      CDB_STAT(cdbp, collisions++);
     }
   }
 
   return 0;
 }
+
+int
+cdb_findnext(struct cdb_find *cdbfp) {
+  int r = findnext(cdbfp);
+  CDB_STAT_FIND(cdbfp->cdb_cdbp, r);
+  return r;
+}
@@ -0,0 +1,85 @@
+/* cdb_findv.c: cdb_findv routine
+ *
+ * Looks up a vector of keys at once.  Keys are processed in groups, and
+ * for every group the toc entries, then hash table slots and then the
+ * records are prefetched for all keys before the next step, so that
+ * cache misses of different keys overlap instead of being serialized.
+ * The lookups themselves are done by _cdb_find(), prefetching is only
+ * a hint.
+ *
+ * This file is a part of tinycdb package by Michael Tokarev, mjt@corpit.ru.
+ * Public domain.
+ */
+
+#include "cdb_int.h"
+
+#ifdef __GNUC__
+# define prefetch(p) __builtin_prefetch(p)
+#else
+# define prefetch(p) ((void)(p))
+#endif
+
+#define GROUP 16  /* keys in flight */
+
+int
+cdb_findv(struct cdb *cdbp, struct cdb_query *qv, unsigned n)
+{
+  unsigned hval[GROUP], slot[GROUP];
+  unsigned fsize = cdbp->file->fsize;
+  unsigned i, m, pos, cnt, found = 0;
+  unsigned ss = _cdb_hslot(cdbp->cdb_fmt);  /* hash table slot size */
+  unsigned rlen = cdbp->cdb_fklen + cdbp->cdb_fvlen;  /* of CDB_FMT_DENSE */
+  /* only a memory-mapped file can be prefetched, and a get from it
+   * costs nothing */
+  int mapped = _cdb_posix_file_fd(cdbp->file) >= 0;
+  int r;
+
+  for (; n; qv += m, n -= m) {
+    m = n < GROUP ? n : GROUP;
+    for (i = 0; i < m; ++i)
+      hval[i] = _cdb_hashkey(cdbp, qv[i].key, qv[i].klen);
+    if (mapped) {
+      for (i = 0; i < m; ++i) {
+        unsigned htp = _cdb_tocent(cdbp, hval[i]);
+        slot[i] = 0;
+        cnt = _cdb_unpack(cdbp, htp + 4, cdb_buf_htab);
+        pos = _cdb_unpack(cdbp, htp, cdb_buf_htab);
+        if (!cnt || cnt > fsize / ss || pos < cdbp->cdb_dend ||
+            pos > fsize || cnt * ss > fsize - pos)
+          continue;
+        slot[i] = pos + _cdb_hstart(cdbp, hval[i], cnt) * ss;
+        prefetch(_cdb_get(cdbp, ss, slot[i], cdb_buf_htab));
+      }
+      for (i = 0; i < m; ++i) {
+        if (!slot[i])
+          continue;
+        if (ss == 4) {
+          unsigned mask = _cdb_imask(cdbp);
+          pos = _cdb_unpack(cdbp, slot[i], cdb_buf_htab);
+          if (!pos || ((pos ^ hval[i]) & ~mask) ||
+              (pos & mask) - 1 >= (cdbp->cdb_dend - 2048) / rlen)
+            continue;
+          pos = 2048 + ((pos & mask) - 1) * rlen;
+        }
+        else if (_cdb_unpack(cdbp, slot[i], cdb_buf_htab) != hval[i])
+          continue;
+        else
+          pos = _cdb_unpack(cdbp, slot[i] + 4, cdb_buf_htab);
+        if (pos && pos <= cdbp->cdb_dend - 8)
+          prefetch(_cdb_get(cdbp, 8, pos, cdb_buf_data));
+      }
+    }
+    for (i = 0; i < m; ++i) {
+      if ((r = _cdb_find(cdbp, qv[i].key, qv[i].klen, hval[i])) < 0)
+        return -1;
+      if (r) {
+        qv[i].vpos = cdb_datapos(cdbp);
+        qv[i].vlen = cdb_datalen(cdbp);
+        ++found;
+      }
+      else
+        qv[i].vpos = qv[i].vlen = 0;
+    }
+  }
+  return found;
+}
@@ -1,10 +1,10 @@
-/* cdb_hash.c: cdb hashing routine
+/* cdb_hash.c: cdb hashing routines
  *
  * This file is a part of tinycdb package by Michael Tokarev, mjt@corpit.ru.
  * Public domain.
  */
 
-#include "cdb.h"
+#include "cdb_int.h"
 
 unsigned
 cdb_hash(const void *buf, unsigned len)
@@ -16,3 +16,174 @@ cdb_hash(const void *buf, unsigned len)
     hash = (hash + (hash << 5)) ^ *p++;
   return hash;
 }
+
+/* Keys of CDB_FMT_FIXKEY files are hashed a word at a time.  Every bit
+ * of the result depends on every bit of the key, so both the table
+ * (low 8 bits) and the slot are well spread even for sequential
+ * integers, unlike with cdb_hash() where the last byte picks the table. */
+unsigned internal_function
+_cdb_hash_fixed(const void *buf, unsigned len)
+{
+  const unsigned char *p = (const unsigned char *)buf;
+  unsigned long long x;
+  if (len != 4 && len != 8 && len != 16)
+    return cdb_hash(buf, len);  /* will not be found anyway */
+  x = _cdb_fixword(p, len);
+  return _cdb_fmix(x);
+}
+
+#define ROTL64(x, r) ((x) << (r) | (x) >> (64 - (r)))
+#define ROTL32(x, r) ((x) << (r) | (x) >> (32 - (r)))
+
+/* XXH64 with seed 0, see https://github.com/Cyan4973/xxHash.  Four
+ * independent lanes take 32 bytes per round, so unlike cdb_hash(),
+ * where every byte waits for the previous one, long keys go at the
+ * speed of the multipliers. */
+#define XXP1 0x9e3779b185ebca87ULL
+#define XXP2 0xc2b2ae3d27d4eb4fULL
+#define XXP3 0x165667b19e3779f9ULL
+#define XXP4 0x85ebca77c2b2ae63ULL
+#define XXP5 0x27d4eb2f165667c5ULL
+#define XXROUND(acc, w) \
+  ((acc) += (w) * XXP2, (acc) = ROTL64(acc, 31), (acc) *= XXP1)
+#define XXMERGE(h, v) \
+  ((v) *= XXP2, (v) = ROTL64(v, 31), (v) *= XXP1, \
+   (h) ^= (v), (h) = (h) * XXP1 + XXP4)
+
+static unsigned
+hash_xxh64(const unsigned char *p, unsigned len)
+{
+  const unsigned char *end = p + len;
+  unsigned long long h, k;
+
+  if (len >= 32) {
+    unsigned long long v1 = XXP1 + XXP2, v2 = XXP2, v3 = 0, v4 = 0 - XXP1;
+    do {
+      XXROUND(v1, _cdb_ld64(p));
+      XXROUND(v2, _cdb_ld64(p + 8));
+      XXROUND(v3, _cdb_ld64(p + 16));
+      XXROUND(v4, _cdb_ld64(p + 24));
+      p += 32;
+    } while (end - p >= 32);
+    h = ROTL64(v1, 1) + ROTL64(v2, 7) + ROTL64(v3, 12) + ROTL64(v4, 18);
+    XXMERGE(h, v1); XXMERGE(h, v2); XXMERGE(h, v3); XXMERGE(h, v4);
+  }
+  else
+    h = XXP5;
+  h += len;
+  for (; end - p >= 8; p += 8) {
+    k = 0;
+    XXROUND(k, _cdb_ld64(p));
+    h ^= k;
+    h = ROTL64(h, 27) * XXP1 + XXP4;
+  }
+  if (end - p >= 4) {
+    h ^= _cdb_ld32(p) * XXP1;
+    h = ROTL64(h, 23) * XXP2 + XXP3;
+    p += 4;
+  }
+  while (p < end) {
+    h ^= *p++ * XXP5;
+    h = ROTL64(h, 11) * XXP1;
+  }
+  h ^= h >> 33; h *= XXP2;
+  h ^= h >> 29; h *= XXP3;
+  h ^= h >> 32;
+  return (unsigned)h;
+}
+
+/* SipHash-2-4 by Aumasson and Bernstein, keyed by 16 bytes.  Without
+ * the key, nobody can choose keys which all land in the same slots. */
+#define SIPROUND \
+  (v0 += v1, v1 = ROTL64(v1, 13), v1 ^= v0, v0 = ROTL64(v0, 32), \
+   v2 += v3, v3 = ROTL64(v3, 16), v3 ^= v2, \
+   v0 += v3, v3 = ROTL64(v3, 21), v3 ^= v0, \
+   v2 += v1, v1 = ROTL64(v1, 17), v1 ^= v2, v2 = ROTL64(v2, 32))
+
+static unsigned
+hash_siphash(const unsigned char *hkey, const unsigned char *p, unsigned len)
+{
+  unsigned long long k0 = _cdb_ld64(hkey), k1 = _cdb_ld64(hkey + 8), m;
+  unsigned long long v0 = k0 ^ 0x736f6d6570736575ULL;
+  unsigned long long v1 = k1 ^ 0x646f72616e646f6dULL;
+  unsigned long long v2 = k0 ^ 0x6c7967656e657261ULL;
+  unsigned long long v3 = k1 ^ 0x7465646279746573ULL;
+  const unsigned char *end = p + (len & ~7u);
+  unsigned i;
+
+  for (; p < end; p += 8) {
+    m = _cdb_ld64(p);
+    v3 ^= m;
+    SIPROUND; SIPROUND;
+    v0 ^= m;
+  }
+  m = (unsigned long long)len << 56;
+  for (i = len & 7; i; --i)
+    m |= (unsigned long long)p[i - 1] << (8 * (i - 1));
+  v3 ^= m;
+  SIPROUND; SIPROUND;
+  v0 ^= m;
+  v2 ^= 0xff;
+  SIPROUND; SIPROUND; SIPROUND; SIPROUND;
+  return (unsigned)(v0 ^ v1 ^ v2 ^ v3);
+}
+
+/* HalfSipHash-2-4 with 32-bit output, keyed by the first 8 bytes:
+ * the 32-bit variant, cheaper where 64-bit multiplies are not. */
+#define HSIPROUND \
+  (v0 += v1, v1 = ROTL32(v1, 5), v1 ^= v0, v0 = ROTL32(v0, 16), \
+   v2 += v3, v3 = ROTL32(v3, 8), v3 ^= v2, \
+   v0 += v3, v3 = ROTL32(v3, 7), v3 ^= v0, \
+   v2 += v1, v1 = ROTL32(v1, 13), v1 ^= v2, v2 = ROTL32(v2, 16))
+
+static unsigned
+hash_halfsip(const unsigned char *hkey, const unsigned char *p, unsigned len)
+{
+  unsigned k0 = _cdb_ld32(hkey), k1 = _cdb_ld32(hkey + 4), m;
+  unsigned v0 = k0, v1 = k1;
+  unsigned v2 = k0 ^ 0x6c796765, v3 = k1 ^ 0x74656462;
+  const unsigned char *end = p + (len & ~3u);
+  unsigned i;
+
+  for (; p < end; p += 4) {
+    m = _cdb_ld32(p);
+    v3 ^= m;
+    HSIPROUND; HSIPROUND;
+    v0 ^= m;
+  }
+  m = len << 24;
+  for (i = len & 3; i; --i)
+    m |= (unsigned)p[i - 1] << (8 * (i - 1));
+  v3 ^= m;
+  HSIPROUND; HSIPROUND;
+  v0 ^= m;
+  v2 ^= 0xff;
+  HSIPROUND; HSIPROUND; HSIPROUND; HSIPROUND;
+  return v1 ^ v3;
+}
+
+/* hash function fn of CDB_FMT_HASH, keyed by hkey if it needs a key */
+unsigned internal_function
+_cdb_hashfn(unsigned fn, const unsigned char *hkey,
+            const void *buf, unsigned len)
+{
+  const unsigned char *p = (const unsigned char *)buf;
+  switch(fn) {
+  case CDB_HASH_XXH64: return hash_xxh64(p, len);
+  case CDB_HASH_SIPHASH: return hash_siphash(hkey, p, len);
+  case CDB_HASH_HALFSIP: return hash_halfsip(hkey, p, len);
+  default: return cdb_hash(buf, len);
+  }
+}
+
+unsigned
+cdb_hashkey(const struct cdb *cdbp, const void *key, unsigned klen)
+{
+  return _cdb_hashkey(cdbp, key, klen);
+}
+
+unsigned
+cdb_make_hashkey(const struct cdb_make *cdbmp, const void *key, unsigned klen)
+{
+  return _cdb_hashkey(cdbmp, key, klen);
+}
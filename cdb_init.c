@@ -32,6 +32,19 @@ cdb_init_locked(struct cdb *cdbp, int fd)
   return rc;
 }
 
+int
+cdb_init_verified(struct cdb *cdbp, int fd)
+{
+  int rc;
+  if ((rc = cdb_init(cdbp, fd)) == 0 && cdb_verify(cdbp, 0, 1) < 0) {
+    int err = errno;
+    cdb_free(cdbp);
+    errno = err;
+    rc = -1;
+  }
+  return rc;
+}
+
 int
 cdb_init_with_file(struct cdb *cdbp, struct cdb_file *file)
 {
@@ -42,9 +55,23 @@ cdb_init_with_file(struct cdb *cdbp, struct cdb_file *file)
   if ((rc = cdbp->file->open(file)) == 0) {
     cdbp->cdb_vpos = cdbp->cdb_vlen = 0;
     cdbp->cdb_kpos = cdbp->cdb_klen = 0;
+    _cdb_ext_init(cdbp);
     dend = cdb_unpack(cdb_get(cdbp, 4, 0));
+    if (!dend) { /* a streamed file or another format, toc at the end */
+      unsigned len, toc = _cdb_ext_find(cdbp, CDB_EXT_TOC, &len);
+      if (toc && len == 2048)
+        cdbp->cdb_toc = toc;
+      else if ((toc = _cdb_ext_find(cdbp, CDB_EXT_FMT, &len)) != 0 &&
+               _cdb_ext_fmt(cdbp, toc, len) < 0) {
+        file->close(file);
+        return -1;  /* a format we do not know */
+      }
+      if (cdbp->cdb_toc)
+        dend = cdb_unpack(cdb_get(cdbp, 4, cdbp->cdb_toc));
+    }
     if (dend < 2048) dend = 2048;
     else if (dend >= cdbp->file->fsize) dend = file->fsize;
+    if (cdbp->cdb_ext && dend > cdbp->cdb_ext) dend = cdbp->cdb_ext;
     cdbp->cdb_dend = dend;
   }
   return rc;
@@ -56,9 +83,16 @@ cdb_free(struct cdb *cdbp)
   cdbp->file->close(cdbp->file);
 }
 
+int
+cdb_fileno(const struct cdb *cdbp)
+{
+  return _cdb_posix_file_fd(cdbp->file);
+}
+
 const void *
 _cdb_get(const struct cdb *cdbp, unsigned len, unsigned pos, unsigned bufid)
 {
+  CDB_STAT(cdbp, bytes[bufid] += len);
   return cdbp->file->get(cdbp->file, len, pos, bufid);
 }
 
@@ -69,11 +103,13 @@ cdb_get(const struct cdb *cdbp, unsigned len, unsigned pos)
     errno = EPROTO;
     return NULL;
   }
+  CDB_STAT(cdbp, bytes[cdb_buf_default] += len);
   return cdbp->file->get(cdbp->file, len, pos, cdb_buf_default);
 }
 
 int
 cdb_read(const struct cdb *cdbp, void *buf, unsigned len, unsigned pos)
 {
+  CDB_STAT(cdbp, bytes[cdb_buf_default] += len);
   return cdbp->file->pread(cdbp->file, buf, len, pos);
 }
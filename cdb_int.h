@@ -35,6 +35,18 @@ int _cdb_make_write(struct cdb_make *cdbmp,
         const unsigned char *ptr, unsigned len);
 int _cdb_make_fullwrite(struct cdb_make *cdbmp, const unsigned char *buf, unsigned len);
 int _cdb_make_flush(struct cdb_make *cdbmp);
+void _cdb_make_crc(struct cdb_make *cdbmp, unsigned pos,
+                   const void *ptr, unsigned len);
+/* are checksums computed as the data is written (see cdb_make.c) */
+#define _cdb_make_crcing(cdbmp) \
+  (((cdbmp)->cdb_flags & CDB_MAKE_CRC) && (cdbmp)->cdb_crcpos != ~0u)
+int _cdb_make_findrec(struct cdb_make *cdbmp,
+                      const void *key, unsigned klen, unsigned hval,
+                      enum cdb_put_mode mode);
+int _cdb_make_copy(struct cdb_make *cdbmp, const struct cdb *cdbp, int fd,
+                   unsigned pos, unsigned len);
+int _cdb_make_addrec(struct cdb_make *cdbmp, unsigned hval, unsigned rpos);
+int _cdb_make_check(struct cdb_make *cdbmp, unsigned klen, unsigned vlen);
 int _cdb_make_add(struct cdb_make *cdbmp, unsigned hval,
                   const void *key, unsigned klen,
                   const void *val, unsigned vlen);
@@ -43,8 +55,108 @@ int _cdb_make_add(struct cdb_make *cdbmp, unsigned hval,
 #define cdb_buf_htab 1
 #define cdb_buf_data 2
 
+#ifdef CDB_STATS
+void _cdb_stat_find(struct cdb_stats *stats, int r);
+# define CDB_STAT(cdbp, expr) \
+  do { if ((cdbp)->cdb_stats) (cdbp)->cdb_stats->expr; } while(0)
+# define CDB_STAT_FIND(cdbp, r) \
+  do { if ((cdbp)->cdb_stats) _cdb_stat_find((cdbp)->cdb_stats, r); } while(0)
+#else
+# define CDB_STAT(cdbp, expr) do {} while(0)
+# define CDB_STAT_FIND(cdbp, r) do {} while(0)
+#endif
+
+/* Records are key length, value length, key and value.  With
+ * CDB_FMT_FIXKEY all keys are cdb_fklen long, and the header is just
+ * the value length.  With CDB_FMT_DENSE all values are cdb_fvlen long
+ * too, and there is no header at all. */
+#define _cdb_rhdr(fmt) \
+  ((fmt) & CDB_FMT_DENSE ? 0 : (fmt) & CDB_FMT_FIXKEY ? 4 : 8)
+#define _cdb_rklen(cdbp, hlen, pos) ((hlen) == 8 ? \
+  _cdb_unpack(cdbp, pos, cdb_buf_data) : (cdbp)->cdb_fklen)
+#define _cdb_rvlen(cdbp, hlen, pos) ((hlen) ? \
+  _cdb_unpack(cdbp, (pos) + (hlen) - 4, cdb_buf_data) : (cdbp)->cdb_fvlen)
+/* Hash table slots are hash value and record position.  With
+ * CDB_FMT_DENSE records are all the same size and follow one another
+ * from 2048, so a slot is 4 bytes: the record number + 1 in the low
+ * cdb_ibits bits (0 in an empty slot), and the bits of the hash value
+ * above them. */
+#define _cdb_hslot(fmt) ((fmt) & CDB_FMT_DENSE ? 4 : 8)
+#define _cdb_imask(cdbp) ((1u << (cdbp)->cdb_ibits) - 1)
+/* The low 8 bits of the hash value pick one of 256 tables in the toc,
+ * and the rest of it modulo the table size the first slot to probe.
+ * With CDB_FMT_POW2 there are 2^cdb_tbits tables, all of 2^k slots,
+ * and both are picked by masks, without a division. */
+#define _cdb_ntables(cdbp) \
+  ((cdbp)->cdb_fmt & CDB_FMT_POW2 ? 1u << (cdbp)->cdb_tbits : 256u)
+#define _cdb_toclen(cdbp) (_cdb_ntables(cdbp) << 3)
+#define _cdb_tocent(cdbp, hval) \
+  ((cdbp)->cdb_toc + (((hval) & (_cdb_ntables(cdbp) - 1)) << 3))
+#define _cdb_hstart(cdbp, hval, n) ((cdbp)->cdb_fmt & CDB_FMT_POW2 ? \
+  ((hval) >> (cdbp)->cdb_tbits) & ((n) - 1) : ((hval) >> 8) % (n))
+/* keys are hashed the same way in both databases */
+#define _cdb_samehash(a, b) \
+  ((((a)->cdb_fmt ^ (b)->cdb_fmt) & (CDB_FMT_FIXKEY|CDB_FMT_HASH)) == 0 && \
+   (a)->cdb_fklen == (b)->cdb_fklen && (a)->cdb_hfn == (b)->cdb_hfn && \
+   memcmp((a)->cdb_hkey, (b)->cdb_hkey, 16) == 0)
+/* records of one database may be copied as is to another, whatever
+ * the layout of their hash tables */
+#define _cdb_samefmt(a, b) \
+  ((((a)->cdb_fmt ^ (b)->cdb_fmt) & ~CDB_FMT_POW2) == 0 && \
+   (a)->cdb_fvlen == (b)->cdb_fvlen && _cdb_samehash(a, b))
+
+/* Fixed-length keys are loaded as little-endian words (the byte loads
+ * are merged into one by the compiler) and mixed by the MurmurHash3
+ * finalizer, which modifies x. */
+#define _cdb_ld32(p) ((unsigned)(p)[0] | (unsigned)(p)[1] << 8 | \
+                      (unsigned)(p)[2] << 16 | (unsigned)(p)[3] << 24)
+#define _cdb_ld64(p) (_cdb_ld32(p) | (unsigned long long)_cdb_ld32((p) + 4) << 32)
+#define _cdb_fixword(p, klen) \
+  ((klen) == 4 ? (unsigned long long)_cdb_ld32(p) : (klen) == 8 ? _cdb_ld64(p) : \
+   _cdb_ld64(p) ^ _cdb_ld64((p) + 8) * 0x9e3779b97f4a7c15ULL)
+#define _cdb_fmix(x) ((x) ^= (x) >> 33, (x) *= 0xff51afd7ed558ccdULL, \
+  (x) ^= (x) >> 33, (x) *= 0xc4ceb9fe1a85ec53ULL, (unsigned)((x) ^ (x) >> 33))
+unsigned _cdb_hash_fixed(const void *buf, unsigned len);
+unsigned _cdb_hashfn(unsigned fn, const unsigned char *hkey,
+                     const void *buf, unsigned len);
+/* hash value of a key in the format of a cdb or cdb_make */
+#define _cdb_hashkey(cdbp, key, klen) \
+  ((cdbp)->cdb_fmt & CDB_FMT_HASH ? \
+   _cdb_hashfn((cdbp)->cdb_hfn, (cdbp)->cdb_hkey, key, klen) : \
+   (cdbp)->cdb_fmt & CDB_FMT_FIXKEY ? \
+   _cdb_hash_fixed(key, klen) : cdb_hash(key, klen))
+
+int _cdb_find(struct cdb *cdbp, const void *key, unsigned klen, unsigned hval);
+int _cdb_findinit(struct cdb_find *cdbfp, struct cdb *cdbp,
+                  const void *key, unsigned klen, unsigned hval);
+void _cdb_ext_init(struct cdb *cdbp);
+unsigned _cdb_ext_find(const struct cdb *cdbp, const char *tag, unsigned *lenp);
+int _cdb_ext_fmt(struct cdb *cdbp, unsigned pos, unsigned len);
+/* bytes of a CDB_EXT_FMT header of length hlen _cdb_fmt_decode() needs */
+#define _cdb_fmthdr(hlen) ((hlen) < 44 ? (hlen) : 44)
+int _cdb_fmt_decode(struct cdb *cdbp, const unsigned char *p, unsigned hlen);
+unsigned _cdb_slot(const struct cdb *cdbp, unsigned pos, unsigned *hvalp);
 const void *_cdb_get(const struct cdb *cdbp, unsigned len, unsigned pos, unsigned bufid);
 unsigned _cdb_unpack(const struct cdb *cdbp, unsigned at, unsigned bufid);
 
+struct cdb *_cdb_manifest_open(const char *manifest, const char *magic,
+                               unsigned *np);
+void _cdb_manifest_free(struct cdb *cdbs, unsigned n);
+
+/* Membership filter of an overlay layer: a key sets cdb_fk bits of one
+ * 64-byte block, all picked from its hash value, see cdb_overlay.c. */
+#define CDB_FBLOCK 64
+void _cdb_filter_add(unsigned char *f, unsigned nblocks, unsigned k,
+                     unsigned hval);
+int _cdb_filter_test(const struct cdb *cdbp, const struct cdb_layer *lp,
+                     unsigned hval);
+int _cdb_layer_tomb(const struct cdb *cdbp, const struct cdb_layer *lp,
+                    unsigned rpos);
+struct cdb_rec *_cdb_getrecs(const struct cdb *cdbp, unsigned *cntp);
+int _cdb_make_run(struct cdb_make *cdbmp, const struct cdb *cdbp, int fd,
+                  const struct cdb_rec *recs, unsigned b, unsigned e,
+                  unsigned pos, unsigned end);
+
 struct cdb_file *_cdb_posix_file_create_from_fd(int fd);
 int _cdb_posix_file_mlock(struct cdb_file *file);
+int _cdb_posix_file_fd(const struct cdb_file *file);
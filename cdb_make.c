@@ -64,10 +64,60 @@ _cdb_make_flush(struct cdb_make *cdbmp) {
   return 0;
 }
 
+/* end the current chunk */
+static int
+crcpush(struct cdb_make *cdbmp)
+{
+  if (cdbmp->cdb_ncrc >= cdbmp->cdb_acrc) {
+    unsigned a = cdbmp->cdb_acrc ? cdbmp->cdb_acrc << 1 : 64;
+    unsigned *c = (unsigned*)realloc(cdbmp->cdb_crcs, a * sizeof(unsigned));
+    if (!c)
+      return -1;
+    cdbmp->cdb_crcs = c;
+    cdbmp->cdb_acrc = a;
+  }
+  cdbmp->cdb_crcs[cdbmp->cdb_ncrc++] = cdbmp->cdb_crc;
+  cdbmp->cdb_crc = 0;
+  return 0;
+}
+
+/* Checksums are computed from the data as it is written, so that the
+ * file is never read back: len bytes at ptr are what goes to position
+ * pos.  Any other position means some data was written elsewhere or
+ * rewritten, and the checksums are left to make_crc() to compute from
+ * the file.  Chunks start at 2048. */
+void internal_function
+_cdb_make_crc(struct cdb_make *cdbmp, unsigned pos,
+              const void *ptr, unsigned len)
+{
+  const unsigned char *p = (const unsigned char*)ptr;
+  unsigned mask = cdbmp->cdb_crcchunk - 1, l;
+  if (!_cdb_make_crcing(cdbmp))
+    return;
+  if (pos != cdbmp->cdb_crcpos) {
+    cdbmp->cdb_crcpos = ~0u;
+    return;
+  }
+  while(len) {
+    l = mask + 1 - ((pos - 2048) & mask);
+    if (l > len)
+      l = len;
+    cdbmp->cdb_crc = cdb_crc32c(cdbmp->cdb_crc, p, l);
+    p += l; pos += l; len -= l;
+    if (!((pos - 2048) & mask) && crcpush(cdbmp) < 0) {
+      cdbmp->cdb_crcpos = ~0u;  /* make_crc() will do */
+      return;
+    }
+  }
+  cdbmp->cdb_crcpos = pos;
+}
+
 int internal_function
 _cdb_make_write(struct cdb_make *cdbmp, const unsigned char *ptr, unsigned len)
 {
   unsigned l = sizeof(cdbmp->cdb_buf) - (cdbmp->cdb_bpos - cdbmp->cdb_buf);
+  if (cdbmp->cdb_flags & CDB_MAKE_CRC)
+    _cdb_make_crc(cdbmp, cdbmp->cdb_dpos, ptr, len);
   cdbmp->cdb_dpos += len;
   if (len > l) {
     memcpy(cdbmp->cdb_bpos, ptr, l);
@@ -90,82 +140,595 @@ _cdb_make_write(struct cdb_make *cdbmp, const unsigned char *ptr, unsigned len)
   return 0;
 }
 
+/* Checksum the toc and n chunks of everything from the end of the toc
+ * to the end of the hash tables, see cdb_verify.c.  The checksums of
+ * chunks are those computed as they were written if known, or else
+ * they are read back, which needs a readable file. */
+static int
+make_crc(struct cdb_make *cdbmp, const unsigned char *toc, unsigned toclen,
+         unsigned end, unsigned n, int known)
+{
+  unsigned chunk = cdbmp->cdb_crcchunk, pos, len, i;
+  unsigned char hdr[16], *b = NULL;
+
+  if (!known && !(b = (unsigned char*)malloc(chunk)))
+    return errno = ENOMEM, -1;
+  memcpy(hdr, CDB_EXT_CRC, 4);
+  cdb_pack(8 + (n << 2), hdr + 4);
+  cdb_pack(chunk, hdr + 8);
+  cdb_pack(cdb_crc32c(0, toc, toclen), hdr + 12);
+  if (_cdb_make_write(cdbmp, hdr, 16) < 0)
+    goto err;
+  for (i = 0, pos = 2048; pos < end; pos += len, ++i) {
+    len = end - pos < chunk ? end - pos : chunk;
+    if (known)
+      cdb_pack(cdbmp->cdb_crcs[i], hdr);
+    else if (cdbmp->file->pread(cdbmp->file, b, len, pos) != 0)
+      goto err;
+    else
+      cdb_pack(cdb_crc32c(0, b, len), hdr);
+    if (_cdb_make_write(cdbmp, hdr, 4) < 0)
+      goto err;
+  }
+  free(b);
+  return 0;
+err:
+  free(b);
+  return -1;
+}
+
+static int
+cmpu(const void *a, const void *b)
+{
+  unsigned x = *(const unsigned*)a, y = *(const unsigned*)b;
+  return x < y ? -1 : x > y;
+}
+
+#define CCHUNK 65536  /* read buffer of compact() */
+
+/* return [pos, pos+len) of the data up to end, len <= CCHUNK, reading
+ * it into b which holds [*bpos, *bpos + *blen) if it is not there */
+static const unsigned char *
+need(struct cdb_file *file, unsigned char *b, unsigned *bpos, unsigned *blen,
+     unsigned end, unsigned pos, unsigned len)
+{
+  if (pos + len > *bpos + *blen) {
+    *bpos = pos;
+    *blen = end - pos < CCHUNK ? end - pos : CCHUNK;
+    if (file->pread(file, b, *blen, pos) != 0)
+      return NULL;
+  }
+  return b + (pos - *bpos);
+}
+
+/* With CDB_MAKE_COMPACT, rewrite the data section in place in the
+ * smallest format all records allow: CDB_FMT_DENSE if all keys are 4,
+ * 8 or 16 bytes and all values are the same size, CDB_FMT_FIXKEY if
+ * only the keys are.  Records only get shorter, so everything is read
+ * before it is overwritten.  Records not in the index (zero-filled
+ * ones) are kept, as zeros.  Positions of tombstones are updated. */
+static int
+compact(struct cdb_make *cdbmp)
+{
+  struct cdb_file *file = cdbmp->file;
+  unsigned ohlen = _cdb_rhdr(cdbmp->cdb_fmt), hlen, klen, vlen;
+  unsigned *ipos = NULL, n = cdbmp->cdb_rcnt, i, t;
+  unsigned src, end, bpos = 0, blen = 0, rk, rv, l, opos, j = 0;
+  unsigned char *b = NULL, hdr[4];
+  const unsigned char *p;
+  struct cdb_rl *rl;
+  int r = -1;
+
+  klen = cdbmp->cdb_fmt & CDB_FMT_FIXKEY ? cdbmp->cdb_fklen : cdbmp->cdb_cklen;
+  vlen = cdbmp->cdb_cvlen;
+  if ((cdbmp->cdb_flags & CDB_MAKE_STREAM) ||
+      (cdbmp->cdb_fmt & CDB_FMT_DENSE) || !n ||
+      (klen != 4 && klen != 8 && klen != 16) ||
+      (vlen == ~0u && (cdbmp->cdb_fmt & CDB_FMT_FIXKEY)))
+    return 0;  /* nothing to gain */
+
+  if (!(ipos = (unsigned*)malloc(n * sizeof(unsigned))) ||
+      !(b = (unsigned char*)malloc(CCHUNK))) {
+    errno = ENOMEM;
+    goto err;
+  }
+  for (i = t = 0; t < 256; ++t)
+    while((rl = cdbmp->cdb_rec[t]) != NULL) {
+      for (l = 0; l < rl->cnt; ++l)
+        ipos[i++] = rl->rec[l].rpos;
+      cdbmp->cdb_rec[t] = rl->next;
+      free(rl);
+    }
+  cdbmp->cdb_rcnt = 0;
+  qsort(ipos, n, sizeof(unsigned), cmpu);
+
+  cdbmp->cdb_fmt |= CDB_FMT_FIXKEY;
+  cdbmp->cdb_fklen = klen;
+  if (vlen != ~0u) {
+    cdbmp->cdb_fmt |= CDB_FMT_DENSE;
+    cdbmp->cdb_fvlen = vlen;
+  }
+  hlen = _cdb_rhdr(cdbmp->cdb_fmt);
+
+  if (_cdb_make_flush(cdbmp) < 0 || file->seek(file, 2048) < 0)
+    goto err;
+  end = cdbmp->cdb_dpos;
+  if (cdbmp->cdb_fend < end)
+    cdbmp->cdb_fend = end;
+  cdbmp->cdb_dpos = 2048;
+  /* everything is written again, and checksummed on the way */
+  cdbmp->cdb_crcpos = 2048;
+  cdbmp->cdb_crc = cdbmp->cdb_ncrc = 0;
+
+  for (i = 0, src = 2048; src < end; ) {
+    opos = src;
+    if (end - src < ohlen)
+      goto bad;
+    if (!(p = need(file, b, &bpos, &blen, end, src, ohlen)))
+      goto err;
+    rk = ohlen == 8 ? cdb_unpack(p) : cdbmp->cdb_fklen;
+    rv = cdb_unpack(p + ohlen - 4);
+    if (rk > end - src - ohlen || rv > end - src - ohlen - rk)
+      goto bad;
+    src += ohlen;
+    if (i < n && ipos[i] == src - ohlen) {
+      /* indexed: the key is what is expected, and gets a new hash */
+      if (rk != klen || (hlen == 0 && rv != vlen))
+        goto bad;
+      if (!(p = need(file, b, &bpos, &blen, end, src, klen)))
+        goto err;
+      if (_cdb_make_addrec(cdbmp, _cdb_hashkey(cdbmp, p, klen),
+                           cdbmp->cdb_dpos) < 0)
+        goto err;
+      ++i;
+    }
+    else if (rk + rv < klen || (hlen == 0 && rk + rv != klen + vlen))
+      goto bad;
+    else { /* zeros, all of the rest is value */
+      rv = rk + rv - klen;
+      rk = klen;
+    }
+    /* tombstones move with their records */
+    if (j < cdbmp->cdb_ntomb && cdbmp->cdb_tomb[j] == opos)
+      cdbmp->cdb_tomb[j++] = cdbmp->cdb_dpos;
+    cdb_pack(rv, hdr);
+    if (_cdb_make_write(cdbmp, hdr, hlen) < 0)
+      goto err;
+    for (l = rk + rv; l; l -= t, src += t) {
+      if (!(p = need(file, b, &bpos, &blen, end, src, 1)))
+        goto err;
+      t = bpos + blen - src < l ? bpos + blen - src : l;
+      if (_cdb_make_write(cdbmp, p, t) < 0)
+        goto err;
+    }
+  }
+  if (i != n)
+    goto bad;
+  r = 0;
+  goto err;
+
+bad:
+  errno = EPROTO;  /* someone changed our file? */
+err:
+  free(ipos);
+  free(b);
+  return r;
+}
+
+/* Size of a hash table for cnt records: at least cnt * 100 / load
+ * slots, 2 * cnt by default, rounded up to a power of two with
+ * CDB_FMT_POW2. */
+static unsigned long long
+tsize(const struct cdb_make *cdbmp, unsigned cnt)
+{
+  unsigned load = cdbmp->cdb_load ? cdbmp->cdb_load : 50;
+  unsigned long long n = ((unsigned long long)cnt * 100 + load - 1) / load;
+  unsigned long long p;
+  if (!n || !(cdbmp->cdb_fmt & CDB_FMT_POW2))
+    return n;
+  for (p = 1; p < n; p <<= 1)
+    ;
+  return p;
+}
+
+/* place a record into the first free slot of htab of len slots */
+static void
+place(const struct cdb_make *cdbmp, struct cdb_rec *htab, unsigned len,
+      const struct cdb_rec *rec)
+{
+  unsigned hi = _cdb_hstart(cdbmp, rec->hval, len);
+  while(htab[hi].rpos)
+    if (++hi == len)
+      hi = 0;
+  htab[hi] = *rec;
+}
+
 static int
 cdb_make_finish_internal(struct cdb_make *cdbmp)
 {
-  unsigned hcnt[256];    /* hash table counts */
-  unsigned hpos[256];    /* hash table positions */
-  struct cdb_rec *htab;
-  unsigned char *p;
+  unsigned *hcnt;        /* hash table counts, then sizes */
+  unsigned *hpos;        /* hash table positions */
+  unsigned *hrec;        /* first record of every table in recs */
+  unsigned char *toc, hdr[8 + 44];
+  struct cdb_rec *htab = NULL, *recs = NULL;
+  unsigned char *p = NULL;
   struct cdb_rl *rl;
-  unsigned hsize;
-  unsigned t, i;
+  unsigned long long hsize, htot;
+  unsigned nt, toclen, t, l, i, ext, elen, n = 0;
+  unsigned ss, hlen = 12, ibits = 0, mask = 0, rlen = 0, pad = 0;
+  unsigned nblocks = 0, k = 0;
+  unsigned long long olen = 0;
+  unsigned char *filter = NULL;
+  int r = -1, crcok = 0;
+
+  if ((cdbmp->cdb_flags & CDB_MAKE_COMPACT) && compact(cdbmp) < 0)
+    return -1;
+  ss = cdbmp->cdb_fmt & CDB_FMT_DENSE ? 4 : 8;
+  if (cdbmp->cdb_fmt & CDB_FMT_DENSE) {
+    /* enough bits for the number + 1 of every record, indexed or not */
+    hlen = 20;
+    rlen = cdbmp->cdb_fklen + cdbmp->cdb_fvlen;
+    if ((cdbmp->cdb_dpos - 2048) % rlen)
+      return errno = EPROTO, -1;
+    for (ibits = 1; ((1u << ibits) - 1) < (cdbmp->cdb_dpos - 2048) / rlen; )
+      ++ibits;
+    mask = (1u << ibits) - 1;
+  }
+  if (cdbmp->cdb_fmt & CDB_FMT_HASH)
+    hlen = 40;
+  if (cdbmp->cdb_fmt & CDB_FMT_POW2)
+    hlen = 44;
+  nt = _cdb_ntables(cdbmp);
+  toclen = nt << 3;
 
-  if (((0xffffffff - cdbmp->cdb_dpos) >> 3) < cdbmp->cdb_rcnt)
+  hcnt = (unsigned*)malloc((3 * nt + 1) * sizeof(unsigned) + toclen);
+  if (!hcnt)
     return errno = ENOMEM, -1;
+  hpos = hcnt + nt;
+  hrec = hpos + nt;
+  toc = (unsigned char*)(hrec + nt + 1);
+  memset(hcnt, 0, nt * sizeof(unsigned));
 
-  /* count htab sizes and reorder reclists */
-  hsize = 0;
-  for (t = 0; t < 256; ++t) {
+  /* count records of every table and reorder reclists */
+  for (l = 0; l < 256; ++l) {
     struct cdb_rl *rlt = NULL;
-    i = 0;
-    rl = cdbmp->cdb_rec[t];
+    rl = cdbmp->cdb_rec[l];
     while(rl) {
       struct cdb_rl *rln = rl->next;
       rl->next = rlt;
       rlt = rl;
-      i += rl->cnt;
+      for (i = 0; i < rl->cnt; ++i)
+        ++hcnt[rl->rec[i].hval & (nt - 1)];
       rl = rln;
     }
-    cdbmp->cdb_rec[t] = rlt;
-    if (hsize < (hcnt[t] = i << 1))
-      hsize = hcnt[t];
+    cdbmp->cdb_rec[l] = rlt;
+  }
+
+  /* Records of a table are in the lists of the same low 8 bits of
+   * the hash value.  With more than 256 tables, one list holds records
+   * of several tables: sort them by table, keeping their order. */
+  if (nt > 256) {
+    for (t = i = 0; t < nt; ++t) {
+      hrec[t] = hpos[t] = i;
+      i += hcnt[t];
+    }
+    hrec[nt] = i;
+    if (!(recs = (struct cdb_rec*)malloc((i ? i : 1) * sizeof(*recs)))) {
+      errno = ENOMEM;
+      goto err;
+    }
+    for (l = 0; l < 256; ++l)
+      for (rl = cdbmp->cdb_rec[l]; rl; rl = rl->next)
+        for (i = 0; i < rl->cnt; ++i)
+          recs[hpos[rl->rec[i].hval & (nt - 1)]++] = rl->rec[i];
   }
 
+  /* size hash tables */
+  hsize = htot = 0;
+  for (t = 0; t < nt; ++t) {
+    unsigned long long len = tsize(cdbmp, hcnt[t]);
+    if (hsize < len)
+      hsize = len;
+    htot += len;
+  }
+  if (htot * ss > 0xffffffff - cdbmp->cdb_dpos) {
+    errno = ENOMEM;
+    goto err;
+  }
+  for (t = 0; t < nt; ++t)
+    hcnt[t] = (unsigned)tsize(cdbmp, hcnt[t]);
+
   /* allocate memory to hold max htable */
   htab = (struct cdb_rec*)malloc((hsize + 2) * sizeof(struct cdb_rec));
-  if (!htab)
-    return errno = ENOENT, -1;
+  if (!htab) {
+    errno = ENOMEM;
+    goto err;
+  }
   p = (unsigned char *)htab;
   htab += 2;
 
   /* build hash tables */
-  for (t = 0; t < 256; ++t) {
-    unsigned len, hi;
+  for (t = 0; t < nt; ++t) {
+    unsigned len;
     hpos[t] = cdbmp->cdb_dpos;
     if ((len = hcnt[t]) == 0)
       continue;
     for (i = 0; i < len; ++i)
       htab[i].hval = htab[i].rpos = 0;
-    for (rl = cdbmp->cdb_rec[t]; rl; rl = rl->next)
-      for (i = 0; i < rl->cnt; ++i) {
-       hi = (rl->rec[i].hval >> 8) % len;
-        while(htab[hi].rpos)
-          if (++hi == len)
-            hi = 0;
-        htab[hi] = rl->rec[i];
+    if (recs)
+      for (i = hrec[t]; i < hrec[t + 1]; ++i)
+        place(cdbmp, htab, len, &recs[i]);
+    else
+      for (l = t; l < 256; l += nt)
+        for (rl = cdbmp->cdb_rec[l]; rl; rl = rl->next)
+          for (i = 0; i < rl->cnt; ++i)
+            place(cdbmp, htab, len, &rl->rec[i]);
+    if (ss == 4)
+      for (i = 0; i < len; ++i)
+        cdb_pack(htab[i].rpos ? (htab[i].hval & ~mask) |
+                 ((htab[i].rpos - 2048) / rlen + 1) : 0, p + (i << 2));
+    else
+      for (i = 0; i < len; ++i) {
+        cdb_pack(htab[i].hval, p + (i << 3));
+        cdb_pack(htab[i].rpos, p + (i << 3) + 4);
       }
-    for (i = 0; i < len; ++i) {
-      cdb_pack(htab[i].hval, p + (i << 3));
-      cdb_pack(htab[i].rpos, p + (i << 3) + 4);
+    if (_cdb_make_write(cdbmp, p, len * ss) < 0)
+      goto err;
+  }
+  if (_cdb_make_flush(cdbmp) < 0)
+    goto err;
+
+  for (t = 0; t < nt; ++t) {
+    cdb_pack(hpos[t], toc + (t << 3));
+    cdb_pack(hcnt[t], toc + (t << 3) + 4);
+  }
+  ext = cdbmp->cdb_dpos;
+  /* the last chunk may be short */
+  crcok = _cdb_make_crcing(cdbmp) && cdbmp->cdb_crcpos == ext &&
+    (!((ext - 2048) & (cdbmp->cdb_crcchunk - 1)) || crcpush(cdbmp) == 0);
+  cdbmp->cdb_crcpos = ~0u;  /* the extension section is not covered */
+  if (cdbmp->cdb_fmt)
+    elen = 8 + hlen + toclen;
+  else
+    elen = cdbmp->cdb_flags & CDB_MAKE_STREAM ? 8 + 2048 : 0;
+  if (cdbmp->cdb_fbits && cdbmp->cdb_rcnt) {
+    /* about cdb_fbits bits per key, ln 2 of them set by every key */
+    unsigned long long fbits =
+      (unsigned long long)cdbmp->cdb_rcnt * cdbmp->cdb_fbits;
+    if (fbits > 0xffffffffULL)
+      fbits = 0xffffffffULL;
+    nblocks = (unsigned)((fbits + CDB_FBLOCK * 8 - 1) / (CDB_FBLOCK * 8));
+    k = (cdbmp->cdb_fbits * 69 + 50) / 100;
+    k = k < 1 ? 1 : k > 16 ? 16 : k;
+  }
+  if (cdbmp->cdb_ntomb || nblocks) {
+    olen = 8 + 16 + ((unsigned long long)cdbmp->cdb_ntomb << 2) +
+           (unsigned long long)nblocks * CDB_FBLOCK;
+    if ((unsigned long long)ext + CDB_EXT_FOOTER + elen + olen > 0xffffffff) {
+      errno = ENOMEM;
+      goto err;
     }
-    if (_cdb_make_write(cdbmp, p, len << 3) < 0) {
-      free(p);
-      return -1;
+    elen += (unsigned)olen;
+  }
+  if (cdbmp->cdb_flags & CDB_MAKE_CRC) {
+    n = (ext - 2048) / cdbmp->cdb_crcchunk +
+        ((ext - 2048) % cdbmp->cdb_crcchunk != 0);
+    elen += 16 + (n << 2);
+  }
+  if (elen && 0xffffffff - ext - CDB_EXT_FOOTER < elen) {
+    errno = ENOMEM;
+    goto err;
+  }
+  /* The footer should be at the very end of the file, but records
+   * removed or compacted might have left more data past it.  Cover
+   * that by a filler record. */
+  if (elen && cdbmp->cdb_fend > ext + elen + CDB_EXT_FOOTER) {
+    pad = cdbmp->cdb_fend - (ext + elen + CDB_EXT_FOOTER);
+    if (pad < 8)
+      pad = 8;
+    elen += pad;
+  }
+  if (cdbmp->cdb_fmt) {
+    /* Like with a streamed file, the toc at the beginning stays zero,
+     * so that readers not knowing the format find nothing. */
+    memcpy(hdr, CDB_EXT_FMT, 4);
+    cdb_pack(hlen + toclen, hdr + 4);
+    cdb_pack(hlen, hdr + 8);
+    cdb_pack(cdbmp->cdb_fmt, hdr + 12);
+    cdb_pack(cdbmp->cdb_fklen, hdr + 16);
+    cdb_pack(cdbmp->cdb_fvlen, hdr + 20);
+    cdb_pack(ibits, hdr + 24);
+    cdb_pack(cdbmp->cdb_hfn, hdr + 28);
+    memcpy(hdr + 32, cdbmp->cdb_hkey, 16);
+    cdb_pack(cdbmp->cdb_tbits, hdr + 48);
+    if (_cdb_make_write(cdbmp, hdr, 8 + hlen) < 0 ||
+        _cdb_make_write(cdbmp, toc, toclen) < 0)
+      goto err;
+  }
+  else if (cdbmp->cdb_flags & CDB_MAKE_STREAM) {
+    /* The toc at the beginning stays zero; the real one goes to the
+     * extension section, and everything is written sequentially. */
+    memcpy(hdr, CDB_EXT_TOC, 4);
+    cdb_pack(2048, hdr + 4);
+    if (_cdb_make_write(cdbmp, hdr, 8) < 0 ||
+        _cdb_make_write(cdbmp, toc, 2048) < 0)
+      goto err;
+  }
+  if (olen) {
+    /* tombstones, then the filter of all keys, see cdb_overlay.c */
+    memcpy(hdr, CDB_EXT_OVLY, 4);
+    cdb_pack((unsigned)olen - 8, hdr + 4);
+    cdb_pack(16, hdr + 8);
+    cdb_pack(cdbmp->cdb_ntomb, hdr + 12);
+    cdb_pack(nblocks, hdr + 16);
+    cdb_pack(k, hdr + 20);
+    if (_cdb_make_write(cdbmp, hdr, 8 + 16) < 0)
+      goto err;
+    for (i = 0; i < cdbmp->cdb_ntomb; ++i) {
+      cdb_pack(cdbmp->cdb_tomb[i], hdr);
+      if (_cdb_make_write(cdbmp, hdr, 4) < 0)
+        goto err;
+    }
+    if (nblocks) {
+      if (!(filter = (unsigned char*)calloc(nblocks, CDB_FBLOCK))) {
+        errno = ENOMEM;
+        goto err;
+      }
+      for (l = 0; l < 256; ++l)
+        for (rl = cdbmp->cdb_rec[l]; rl; rl = rl->next)
+          for (i = 0; i < rl->cnt; ++i)
+            _cdb_filter_add(filter, nblocks, k, rl->rec[i].hval);
+      if (_cdb_make_write(cdbmp, filter, nblocks * CDB_FBLOCK) < 0)
+        goto err;
+    }
+  }
+  if ((cdbmp->cdb_flags & CDB_MAKE_CRC) &&
+      make_crc(cdbmp, toc, toclen, ext, n, crcok) < 0)
+    goto err;
+  if (pad) {
+    static const unsigned char zero[1024];
+    memcpy(hdr, CDB_EXT_PAD, 4);
+    cdb_pack(pad - 8, hdr + 4);
+    if (_cdb_make_write(cdbmp, hdr, 8) < 0)
+      goto err;
+    for (pad -= 8; pad; pad -= i) {
+      i = pad < sizeof(zero) ? pad : sizeof(zero);
+      if (_cdb_make_write(cdbmp, zero, i) < 0)
+        goto err;
     }
   }
+  if (elen) {
+    cdb_pack(ext, hdr);
+    cdb_pack(elen, hdr + 4);
+    memcpy(hdr + 8, CDB_EXT_MAGIC, 8);
+    if (_cdb_make_write(cdbmp, hdr, CDB_EXT_FOOTER) < 0 ||
+        _cdb_make_flush(cdbmp) < 0)
+      goto err;
+  }
+  if (!(cdbmp->cdb_flags & CDB_MAKE_STREAM) && !cdbmp->cdb_fmt &&
+      (cdbmp->file->seek(cdbmp->file, 0) != 0 ||
+       _cdb_make_fullwrite(cdbmp, toc, 2048) != 0))
+    goto err;
+  r = 0;
+
+err:
+  free(filter);
   free(p);
-  if (_cdb_make_flush(cdbmp) < 0)
-    return -1;
-  p = cdbmp->cdb_buf;
-  for (t = 0; t < 256; ++t) {
-    cdb_pack(hpos[t], p + (t << 3));
-    cdb_pack(hcnt[t], p + (t << 3) + 4);
+  free(recs);
+  free(hcnt);
+  return r;
+}
+
+/* produce a streamed file: finish without seeking back to the toc */
+int
+cdb_make_stream(struct cdb_make *cdbmp)
+{
+  cdbmp->cdb_flags |= CDB_MAKE_STREAM;
+  return 0;
+}
+
+/* write checksums of chunks of a given size (0 for the default) */
+int
+cdb_make_checksum(struct cdb_make *cdbmp, unsigned chunk)
+{
+  if (!chunk)
+    chunk = CDB_CRC_CHUNK;
+  if (chunk < 4096 || (chunk & (chunk - 1)))
+    return errno = EINVAL, -1;
+  cdbmp->cdb_crcchunk = chunk;
+  cdbmp->cdb_flags |= CDB_MAKE_CRC;
+  /* records added already are checksummed at the end, reading them */
+  cdbmp->cdb_crcpos = cdbmp->cdb_dpos == 2048 ? 2048 : ~0u;
+  cdbmp->cdb_crc = cdbmp->cdb_ncrc = 0;
+  return 0;
+}
+
+/* Make all keys klen (4, 8 or 16) bytes long, in CDB_FMT_FIXKEY format.
+ * Should be called before the first record is added. */
+int
+cdb_make_fixkey(struct cdb_make *cdbmp, unsigned klen)
+{
+  if ((klen != 4 && klen != 8 && klen != 16) || cdbmp->cdb_dpos != 2048)
+    return errno = EINVAL, -1;
+  cdbmp->cdb_fmt |= CDB_FMT_FIXKEY;
+  cdbmp->cdb_fklen = klen;
+  return 0;
+}
+
+/* Make all keys klen (4, 8 or 16) and all values vlen bytes long, in
+ * CDB_FMT_DENSE format.  Should be called before the first record is
+ * added. */
+int
+cdb_make_dense(struct cdb_make *cdbmp, unsigned klen, unsigned vlen)
+{
+  if (vlen > 0xffffffff - 2048 - 16 || cdb_make_fixkey(cdbmp, klen) < 0)
+    return errno = EINVAL, -1;
+  cdbmp->cdb_fmt |= CDB_FMT_DENSE;
+  cdbmp->cdb_fvlen = vlen;
+  return 0;
+}
+
+/* Hash keys by function fn (CDB_HASH_xxx), keyed by 16 bytes at key
+ * (zeros if NULL) if it needs a key, in CDB_FMT_HASH format, or by the
+ * one of the format with CDB_HASH_DEFAULT.  Should be called before the
+ * first record is added. */
+int
+cdb_make_hash(struct cdb_make *cdbmp, unsigned fn, const void *key)
+{
+  if (fn > CDB_HASH_HALFSIP || cdbmp->cdb_dpos != 2048)
+    return errno = EINVAL, -1;
+  if (fn == CDB_HASH_DEFAULT)
+    cdbmp->cdb_fmt &= ~CDB_FMT_HASH;
+  else
+    cdbmp->cdb_fmt |= CDB_FMT_HASH;
+  cdbmp->cdb_hfn = fn;
+  if (key && fn != CDB_HASH_DEFAULT && fn != CDB_HASH_XXH64)
+    memcpy(cdbmp->cdb_hkey, key, 16);
+  else
+    memset(cdbmp->cdb_hkey, 0, 16);
+  return 0;
+}
+
+/* Spread records over ntables hash tables, a power of two up to 65536,
+ * in CDB_FMT_POW2 format, or over the classic 256 if ntables is 0, and
+ * size the tables for a load of load percents (1 to 100, 0 for 50).
+ * May be called any time before cdb_make_finish(). */
+int
+cdb_make_tables(struct cdb_make *cdbmp, unsigned ntables, unsigned load)
+{
+  unsigned tbits = 0;
+  if (ntables > 65536 || (ntables & (ntables - 1)) || load > 100)
+    return errno = EINVAL, -1;
+  if (!ntables)
+    cdbmp->cdb_fmt &= ~CDB_FMT_POW2;
+  else {
+    while((1u << tbits) < ntables)
+      ++tbits;
+    cdbmp->cdb_fmt |= CDB_FMT_POW2;
   }
-  if (cdbmp->file->seek(cdbmp->file, 0) != 0 ||
-      _cdb_make_fullwrite(cdbmp, p, 2048) != 0)
-    return -1;
+  cdbmp->cdb_tbits = tbits;
+  cdbmp->cdb_load = load;
+  return 0;
+}
+
+/* Write a membership filter of about bits (1 to 32) bits per key for
+ * an overlay, or none if bits is 0.  May be called any time before
+ * cdb_make_finish(). */
+int
+cdb_make_filter(struct cdb_make *cdbmp, unsigned bits)
+{
+  if (bits > 32)
+    return errno = EINVAL, -1;
+  cdbmp->cdb_fbits = bits;
+  return 0;
+}
 
+/* Pick the smallest format records allow when finishing, see compact().
+ * Has no effect on a streamed file. */
+int
+cdb_make_compact(struct cdb_make *cdbmp)
+{
+  cdbmp->cdb_flags |= CDB_MAKE_COMPACT;
   return 0;
 }
 
@@ -182,6 +745,8 @@ cdb_make_free(struct cdb_make *cdbmp)
     }
   }
 
+  free(cdbmp->cdb_tomb);
+  free(cdbmp->cdb_crcs);
   cdbmp->file->close(cdbmp->file);
 }
 
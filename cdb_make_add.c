@@ -8,16 +8,10 @@
 #include "cdb_int.h"
 
 int internal_function
-_cdb_make_add(struct cdb_make *cdbmp, unsigned hval,
-              const void *key, unsigned klen,
-              const void *val, unsigned vlen)
+_cdb_make_addrec(struct cdb_make *cdbmp, unsigned hval, unsigned rpos)
 {
-  unsigned char rlen[8];
   struct cdb_rl *rl;
   unsigned i;
-  if (klen > 0xffffffff - (cdbmp->cdb_dpos + 8) ||
-      vlen > 0xffffffff - (cdbmp->cdb_dpos + klen + 8))
-    return errno = ENOMEM, -1;
   i = hval & 255;
   rl = cdbmp->cdb_rec[i];
   if (!rl || rl->cnt >= sizeof(rl->rec)/sizeof(rl->rec[0])) {
@@ -30,11 +24,52 @@ _cdb_make_add(struct cdb_make *cdbmp, unsigned hval,
   }
   i = rl->cnt++;
   rl->rec[i].hval = hval;
-  rl->rec[i].rpos = cdbmp->cdb_dpos;
+  rl->rec[i].rpos = rpos;
   ++cdbmp->cdb_rcnt;
+  return 0;
+}
+
+/* check lengths of a new record against the format and the file size
+ * limit, and note them for cdb_make_compact() */
+int internal_function
+_cdb_make_check(struct cdb_make *cdbmp, unsigned klen, unsigned vlen)
+{
+  unsigned hlen = _cdb_rhdr(cdbmp->cdb_fmt);
+  if ((cdbmp->cdb_fmt & CDB_FMT_FIXKEY) && klen != cdbmp->cdb_fklen)
+    return errno = EINVAL, -1;
+  if ((cdbmp->cdb_fmt & CDB_FMT_DENSE) && vlen != cdbmp->cdb_fvlen)
+    return errno = EINVAL, -1;
+  if (klen > 0xffffffff - (cdbmp->cdb_dpos + hlen) ||
+      vlen > 0xffffffff - (cdbmp->cdb_dpos + klen + hlen))
+    return errno = ENOMEM, -1;
+  if (cdbmp->cdb_dpos == 2048) {
+    cdbmp->cdb_cklen = klen;
+    cdbmp->cdb_cvlen = vlen;
+  }
+  else {
+    if (cdbmp->cdb_cklen != klen)
+      cdbmp->cdb_cklen = ~0u;
+    if (cdbmp->cdb_cvlen != vlen)
+      cdbmp->cdb_cvlen = ~0u;
+  }
+  return 0;
+}
+
+int internal_function
+_cdb_make_add(struct cdb_make *cdbmp, unsigned hval,
+              const void *key, unsigned klen,
+              const void *val, unsigned vlen)
+{
+  unsigned char rlen[8];
+  unsigned hlen = _cdb_rhdr(cdbmp->cdb_fmt);
+  if (_cdb_make_check(cdbmp, klen, vlen) < 0)
+    return -1;
+  if (_cdb_make_addrec(cdbmp, hval, cdbmp->cdb_dpos) < 0)
+    return -1;
   cdb_pack(klen, rlen);
   cdb_pack(vlen, rlen + 4);
-  if (_cdb_make_write(cdbmp, rlen, 8) < 0 ||
+  /* fixed-length key records have no key length, dense ones nothing */
+  if (_cdb_make_write(cdbmp, rlen + 8 - hlen, hlen) < 0 ||
       _cdb_make_write(cdbmp, key, klen) < 0 ||
       _cdb_make_write(cdbmp, val, vlen) < 0)
     return -1;
@@ -45,5 +80,5 @@ int
 cdb_make_add(struct cdb_make *cdbmp,
              const void *key, unsigned klen,
              const void *val, unsigned vlen) {
-  return _cdb_make_add(cdbmp, cdb_hash(key, klen), key, klen, val, vlen);
+  return _cdb_make_add(cdbmp, _cdb_hashkey(cdbmp, key, klen), key, klen, val, vlen);
 }
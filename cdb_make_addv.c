@@ -0,0 +1,160 @@
+/* cdb_make_addv.c: cdb_make_addv and cdb_make_addfd routines
+ *
+ * Large values bypass the cdb_buf staging buffer: the pending buffer
+ * (record header and key) and the value go out in a single writev(),
+ * or the value is copied from a file descriptor by the file's copy
+ * method (copy_file_range for posix files).
+ *
+ * This file is a part of tinycdb package by Michael Tokarev, mjt@corpit.ru.
+ * Public domain.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include "cdb_int.h"
+
+#define IOVCHUNK 64  /* iovecs per writev() call */
+
+/* write out iov[0..iovcnt) completely, modifying iov in place */
+static int
+fullwritev(struct cdb_make *cdbmp, struct iovec *iov, int iovcnt)
+{
+  struct cdb_file *file = cdbmp->file;
+  while(iovcnt) {
+    int l = file->writev(file, iov, iovcnt > IOVCHUNK ? IOVCHUNK : iovcnt);
+    if (l < 0) {
+      if (errno != EINTR)
+        return -1;
+      continue;
+    }
+    while(iovcnt && (size_t)l >= iov->iov_len) {
+      l -= iov->iov_len;
+      ++iov; --iovcnt;
+    }
+    if (l) {
+      iov->iov_base = (char*)iov->iov_base + l;
+      iov->iov_len -= l;
+    }
+  }
+  return 0;
+}
+
+/* queue record header and key, returning 0 or -1 */
+static int
+addhdr(struct cdb_make *cdbmp, const void *key, unsigned klen, unsigned vlen)
+{
+  unsigned char rlen[8];
+  unsigned hlen = _cdb_rhdr(cdbmp->cdb_fmt);
+  if (_cdb_make_check(cdbmp, klen, vlen) < 0)
+    return -1;
+  if (_cdb_make_addrec(cdbmp, _cdb_hashkey(cdbmp, key, klen), cdbmp->cdb_dpos) < 0)
+    return -1;
+  cdb_pack(klen, rlen);
+  cdb_pack(vlen, rlen + 4);
+  /* fixed-length key records have no key length, dense ones nothing */
+  if (_cdb_make_write(cdbmp, rlen + 8 - hlen, hlen) < 0 ||
+      _cdb_make_write(cdbmp, key, klen) < 0)
+    return -1;
+  return 0;
+}
+
+int
+cdb_make_addv(struct cdb_make *cdbmp,
+              const void *key, unsigned klen,
+              const struct iovec *iov, int iovcnt)
+{
+  struct iovec siov[IOVCHUNK], *viov;
+  unsigned vlen = 0, pos;
+  int i, r;
+
+  for (i = 0; i < iovcnt; ++i) {
+    if (iov[i].iov_len > 0xffffffff - vlen)
+      return errno = ENOMEM, -1;
+    vlen += iov[i].iov_len;
+  }
+  if (addhdr(cdbmp, key, klen, vlen) < 0)
+    return -1;
+
+  if (vlen < sizeof(cdbmp->cdb_buf) || !cdbmp->file->writev) {
+    for (i = 0; i < iovcnt; ++i)
+      if (_cdb_make_write(cdbmp, iov[i].iov_base, iov[i].iov_len) < 0)
+        return -1;
+    return 0;
+  }
+
+  for (i = 0, pos = cdbmp->cdb_dpos; i < iovcnt; pos += iov[i++].iov_len)
+    _cdb_make_crc(cdbmp, pos, iov[i].iov_base, iov[i].iov_len);
+  /* pending buffer goes first, then the value pieces */
+  if (iovcnt < IOVCHUNK)
+    viov = siov;
+  else if (!(viov = (struct iovec*)malloc((iovcnt + 1) * sizeof(*viov))))
+    return errno = ENOMEM, -1;
+  viov[0].iov_base = cdbmp->cdb_buf;
+  viov[0].iov_len = cdbmp->cdb_bpos - cdbmp->cdb_buf;
+  memcpy(viov + 1, iov, iovcnt * sizeof(*viov));
+  r = fullwritev(cdbmp, viov, iovcnt + 1);
+  if (viov != siov)
+    free(viov);
+  if (r < 0)
+    return -1;
+  cdbmp->cdb_bpos = cdbmp->cdb_buf;
+  cdbmp->cdb_dpos += vlen;
+  return 0;
+}
+
+int
+cdb_make_addfd(struct cdb_make *cdbmp,
+               const void *key, unsigned klen,
+               int fd, unsigned long long pos, unsigned vlen)
+{
+  struct cdb_file *file = cdbmp->file;
+  int l;
+
+  if (addhdr(cdbmp, key, klen, vlen) < 0)
+    return -1;
+  /* the copy method is not used when the data is to be checksummed */
+  if (vlen >= sizeof(cdbmp->cdb_buf) && file->copy &&
+      !_cdb_make_crcing(cdbmp)) {
+    if (_cdb_make_flush(cdbmp) < 0)
+      return -1;
+    cdbmp->cdb_dpos += vlen;
+    while(vlen) {
+      l = file->copy(file, fd, pos, vlen);
+      if (l > 0) {
+        pos += l;
+        vlen -= l;
+      }
+      else if (!l)
+        return errno = EIO, -1;  /* source file is too short */
+      else if (errno != EINTR)
+        return -1;
+    }
+    return 0;
+  }
+
+  /* small value or no copy method: stage it through cdb_buf */
+  while(vlen) {
+    unsigned r = sizeof(cdbmp->cdb_buf) - (cdbmp->cdb_bpos - cdbmp->cdb_buf);
+    if (!r) {
+      if (_cdb_make_flush(cdbmp) < 0)
+        return -1;
+      continue;
+    }
+    if (r > vlen)
+      r = vlen;
+    l = pread(fd, cdbmp->cdb_bpos, r, pos);
+    if (l > 0) {
+      _cdb_make_crc(cdbmp, cdbmp->cdb_dpos, cdbmp->cdb_bpos, l);
+      cdbmp->cdb_bpos += l;
+      cdbmp->cdb_dpos += l;
+      pos += l;
+      vlen -= l;
+    }
+    else if (!l)
+      return errno = EIO, -1;
+    else if (errno != EINTR)
+      return -1;
+  }
+  return 0;
+}
@@ -0,0 +1,266 @@
+/* cdb_make_merge.c: cdb_make_merge routine
+ *
+ * Appends all records of an existing cdb file to the database being
+ * created.  Record data is copied as-is (file-to-file where possible),
+ * and hash values are taken from the source hash tables, so keys are
+ * never rehashed nor reparsed, unless the source is in another format
+ * (see cdb_make_fixkey()).
+ *
+ * This file is a part of tinycdb package by Michael Tokarev, mjt@corpit.ru.
+ * Public domain.
+ */
+
+#include <stdlib.h>
+#include "cdb_int.h"
+
+#define COPYCHUNK 65536  /* for sources without file descriptor */
+
+static int
+cmprpos(const void *a, const void *b)
+{
+  unsigned x = ((const struct cdb_rec*)a)->rpos;
+  unsigned y = ((const struct cdb_rec*)b)->rpos;
+  return x < y ? -1 : x > y;
+}
+
+/* collect all (hval,rpos) pairs of source hash tables, ordered by rpos */
+struct cdb_rec *
+_cdb_getrecs(const struct cdb *cdbp, unsigned *cntp)
+{
+  struct cdb_rec *recs;
+  unsigned t, i, n, pos, hval, cnt = 0, todo = 0;
+  unsigned ss = _cdb_hslot(cdbp->cdb_fmt);
+
+  for (t = 0; t < _cdb_ntables(cdbp); ++t) {
+    n = _cdb_unpack(cdbp, cdbp->cdb_toc + (t << 3) + 4, cdb_buf_htab);
+    pos = _cdb_unpack(cdbp, cdbp->cdb_toc + (t << 3), cdb_buf_htab);
+    if (n > cdbp->file->fsize / ss || pos < cdbp->cdb_dend ||
+        pos > cdbp->file->fsize || n * ss > cdbp->file->fsize - pos)
+      return errno = EPROTO, NULL;
+    todo += n;
+  }
+  recs = (struct cdb_rec*)malloc((todo ? todo : 1) * sizeof(*recs));
+  if (!recs)
+    return errno = ENOMEM, NULL;
+  for (t = 0; t < _cdb_ntables(cdbp); ++t) {
+    n = _cdb_unpack(cdbp, cdbp->cdb_toc + (t << 3) + 4, cdb_buf_htab);
+    pos = _cdb_unpack(cdbp, cdbp->cdb_toc + (t << 3), cdb_buf_htab);
+    for (i = 0; i < n; ++i, pos += ss) {
+      unsigned rpos = _cdb_slot(cdbp, pos, &hval);
+      if (!rpos)
+        continue;
+      if (rpos < 2048 || rpos > cdbp->cdb_dend - _cdb_rhdr(cdbp->cdb_fmt)) {
+        free(recs);
+        return errno = EPROTO, NULL;
+      }
+      recs[cnt].hval = hval;
+      recs[cnt].rpos = rpos;
+      ++cnt;
+    }
+  }
+  qsort(recs, cnt, sizeof(*recs), cmprpos);
+  *cntp = cnt;
+  return recs;
+}
+
+/* append len bytes at pos of the source (with descriptor fd or -1)
+ * to the database */
+int internal_function
+_cdb_make_copy(struct cdb_make *cdbmp, const struct cdb *cdbp, int fd,
+               unsigned pos, unsigned len)
+{
+  struct cdb_file *file = cdbmp->file;
+  unsigned at = cdbmp->cdb_dpos;
+  int l;
+
+  if (len > 0xffffffff - cdbmp->cdb_dpos)
+    return errno = ENOMEM, -1;
+  if (_cdb_make_flush(cdbmp) < 0)
+    return -1;
+  /* lengths of the records copied are not known */
+  cdbmp->cdb_cklen = cdbmp->cdb_cvlen = ~0u;
+  cdbmp->cdb_dpos += len;
+  /* data to be checksummed is copied through memory */
+  if (_cdb_make_crcing(cdbmp))
+    fd = -1;
+  while(len) {
+    if (fd >= 0 && file->copy) {
+      l = file->copy(file, fd, pos, len);
+      if (!l)
+        return errno = EIO, -1;
+      if (l < 0) {
+        if (errno == EINTR)
+          continue;
+        return -1;
+      }
+    }
+    else {
+      const void *p;
+      l = len > COPYCHUNK ? COPYCHUNK : len;
+      if (!(p = _cdb_get(cdbp, l, pos, cdb_buf_data)) ||
+          _cdb_make_fullwrite(cdbmp, p, l) < 0)
+        return -1;
+      _cdb_make_crc(cdbmp, at, p, l);
+    }
+    pos += l;
+    at += l;
+    len -= l;
+  }
+  return 0;
+}
+
+/* Records of a source in another format are re-added one by one in
+ * source order, with their keys rehashed.  So are records of any
+ * source with cdb_make_compact(), which needs to know their lengths. */
+static int
+readd(struct cdb_make *cdbmp, struct cdb *cdbp, const struct cdb_rec *recs,
+      unsigned cnt, enum cdb_put_mode mode)
+{
+  unsigned i, hlen = _cdb_rhdr(cdbp->cdb_fmt), klen, vlen, rpos;
+  const void *key, *val;
+  int ret = 0, r;
+
+  for (i = 0; i < cnt; ++i) {
+    rpos = recs[i].rpos;
+    klen = _cdb_rklen(cdbp, hlen, rpos);
+    vlen = _cdb_rvlen(cdbp, hlen, rpos);
+    if (klen > cdbp->cdb_dend - rpos - hlen ||
+        vlen > cdbp->cdb_dend - rpos - hlen - klen)
+      return errno = EPROTO, -1;
+    /* separate buffers, so that the key stays while the value is read */
+    if (!(key = _cdb_get(cdbp, klen, rpos + hlen, cdb_buf_default)) ||
+        !(val = _cdb_get(cdbp, vlen, rpos + hlen + klen, cdb_buf_data)))
+      return -1;
+    r = cdb_make_put(cdbmp, key, klen, val, vlen, mode);
+    if (r < 0)
+      return -1;
+    if (r)
+      ret = 1;
+  }
+  return ret;
+}
+
+/* emit pending run recs[b..e) which occupies [pos,end) in the source */
+int internal_function
+_cdb_make_run(struct cdb_make *cdbmp, const struct cdb *cdbp, int fd,
+              const struct cdb_rec *recs, unsigned b, unsigned e,
+              unsigned pos, unsigned end)
+{
+  unsigned dpos = cdbmp->cdb_dpos;
+  if (b == e)
+    return 0;
+  if (_cdb_make_copy(cdbmp, cdbp, fd, pos, end - pos) < 0)
+    return -1;
+  for (; b < e; ++b)
+    if (_cdb_make_addrec(cdbmp, recs[b].hval, dpos + recs[b].rpos - pos) < 0)
+      return -1;
+  return 0;
+}
+
+int
+cdb_make_merge(struct cdb_make *cdbmp, struct cdb *cdbp,
+               enum cdb_put_mode mode)
+{
+  struct cdb_rec *recs;
+  unsigned cnt, i, b;
+  unsigned rpos, rend, runpos, runend;
+  unsigned char seen[512]; /* hvals of the pending run */
+  unsigned hlen = _cdb_rhdr(cdbp->cdb_fmt);
+  int fd = _cdb_posix_file_fd(cdbp->file);
+  int ret = 0, r;
+
+  switch(mode) {
+    case CDB_PUT_ADD: case CDB_PUT_REPLACE: case CDB_PUT_INSERT:
+    case CDB_PUT_WARN: case CDB_PUT_REPLACE0:
+      break;
+    default:
+      return errno = EINVAL, -1;
+  }
+
+  if (!(recs = _cdb_getrecs(cdbp, &cnt)))
+    return -1;
+
+  if (!_cdb_samefmt(cdbmp, cdbp) || (cdbmp->cdb_flags & CDB_MAKE_COMPACT)) {
+    r = readd(cdbmp, cdbp, recs, cnt, mode);
+    free(recs);
+    return r;
+  }
+
+  if (mode == CDB_PUT_ADD) {
+    /* the whole data section, as is, in one go */
+    r = _cdb_make_run(cdbmp, cdbp, fd, recs, 0, cnt, 2048, cdbp->cdb_dend);
+    free(recs);
+    return r;
+  }
+
+  /* Check every record against the ones already in the database, in
+   * source order, exactly like cdb_make_put() would do.  Records which
+   * are kept are accumulated into runs of adjacent source records, and
+   * a run is written out before a record whose hash value might match
+   * one in the run, so that _cdb_make_findrec() sees it. */
+  memset(seen, 0, sizeof(seen));
+  b = 0;
+  runpos = runend = 0;
+  for (i = 0; i < cnt; ++i) {
+    unsigned klen, hval = recs[i].hval;
+    const void *key;
+
+    rpos = recs[i].rpos;
+    klen = _cdb_rklen(cdbp, hlen, rpos);
+    rend = _cdb_rvlen(cdbp, hlen, rpos);
+    if (klen > cdbp->cdb_dend - rpos - hlen ||
+        rend > cdbp->cdb_dend - rpos - hlen - klen) {
+      errno = EPROTO;
+      goto err;
+    }
+    rend += rpos + hlen + klen;
+    if (!(key = _cdb_get(cdbp, klen, rpos + hlen, cdb_buf_data)))
+      goto err;
+
+    if (b < i && (rpos != runend ||
+                  (seen[(hval >> 3) & 511] & (1 << (hval & 7))))) {
+      if (_cdb_make_run(cdbmp, cdbp, fd, recs, b, i, runpos, runend) < 0)
+        goto err;
+      memset(seen, 0, sizeof(seen));
+      b = i;
+    }
+    /* zero-filling treats the last written record specially, so the
+     * run should be in place if there is anything to zero-fill */
+    if (mode == CDB_PUT_REPLACE0 && b < i) {
+      if ((r = _cdb_make_findrec(cdbmp, key, klen, hval, CDB_FIND)) < 0)
+        goto err;
+      if (r) {
+        if (_cdb_make_run(cdbmp, cdbp, fd, recs, b, i, runpos, runend) < 0)
+          goto err;
+        memset(seen, 0, sizeof(seen));
+        b = i;
+      }
+    }
+    r = _cdb_make_findrec(cdbmp, key, klen, hval, mode);
+    if (r < 0)
+      goto err;
+    if (r) {
+      ret = 1;
+      if (mode == CDB_PUT_INSERT) {
+        /* skip it; the run, if any, ends here */
+        if (_cdb_make_run(cdbmp, cdbp, fd, recs, b, i, runpos, runend) < 0)
+          goto err;
+        memset(seen, 0, sizeof(seen));
+        b = i + 1;
+        continue;
+      }
+    }
+    if (b == i)
+      runpos = rpos;
+    runend = rend;
+    seen[(hval >> 3) & 511] |= 1 << (hval & 7);
+  }
+  if (_cdb_make_run(cdbmp, cdbp, fd, recs, b, cnt, runpos, runend) < 0)
+    goto err;
+  free(recs);
+  return ret;
+
+err:
+  free(recs);
+  return -1;
+}
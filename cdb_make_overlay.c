@@ -0,0 +1,172 @@
+/* cdb_make_overlay.c: cdb_make_delete and cdb_make_overlay routines
+ *
+ * Layers of an overlay (see cdb_overlay.c) are built with cdb_make
+ * like any other database, with tombstones for the keys they delete.
+ * cdb_make_overlay() merges the top layers of an overlay, or all of
+ * it into a new base.  Layers are read in order, oldest first, and
+ * records whose keys are in newer layers are skipped; all others are
+ * copied as is in runs of adjacent records (file-to-file where
+ * possible), like with cdb_make_merge(), so the data is streamed, and
+ * only hash values and positions of records are kept in memory.
+ *
+ * This file is a part of tinycdb package by Michael Tokarev, mjt@corpit.ru.
+ * Public domain.
+ */
+
+#include <stdlib.h>
+#include "cdb_int.h"
+
+/* Add a tombstone: a record of the key with an empty value (zeros with
+ * CDB_FMT_DENSE) which hides the key in older layers of an overlay.
+ * Other records of the key in this database stay visible. */
+int
+cdb_make_delete(struct cdb_make *cdbmp, const void *key, unsigned klen)
+{
+  static const unsigned char zero[1024];
+  unsigned char rlen[8];
+  unsigned hlen = _cdb_rhdr(cdbmp->cdb_fmt);
+  unsigned vlen = cdbmp->cdb_fmt & CDB_FMT_DENSE ? cdbmp->cdb_fvlen : 0;
+  unsigned l;
+
+  if (cdbmp->cdb_ntomb >= cdbmp->cdb_atomb) {
+    unsigned a = cdbmp->cdb_atomb ? cdbmp->cdb_atomb << 1 : 64;
+    unsigned *t = (unsigned*)realloc(cdbmp->cdb_tomb, a * sizeof(unsigned));
+    if (!t)
+      return errno = ENOMEM, -1;
+    cdbmp->cdb_tomb = t;
+    cdbmp->cdb_atomb = a;
+  }
+  if (_cdb_make_check(cdbmp, klen, vlen) < 0 ||
+      _cdb_make_addrec(cdbmp, _cdb_hashkey(cdbmp, key, klen),
+                       cdbmp->cdb_dpos) < 0)
+    return -1;
+  cdbmp->cdb_tomb[cdbmp->cdb_ntomb++] = cdbmp->cdb_dpos;
+  cdb_pack(klen, rlen);
+  cdb_pack(vlen, rlen + 4);
+  if (_cdb_make_write(cdbmp, rlen + 8 - hlen, hlen) < 0 ||
+      _cdb_make_write(cdbmp, key, klen) < 0)
+    return -1;
+  for (; vlen; vlen -= l) {
+    l = vlen < sizeof(zero) ? vlen : sizeof(zero);
+    if (_cdb_make_write(cdbmp, zero, l) < 0)
+      return -1;
+  }
+  return 0;
+}
+
+/* is the key of a record of layer l, with hash value hval in its
+ * format, in a newer layer: 1 if yes, 0 if no, -1 on error */
+static int
+shadowed(struct cdb_overlay *cdbop, unsigned l,
+         const void *key, unsigned klen, unsigned hval)
+{
+  const struct cdb *hcdbp = &cdbop->cdb_layers[l];
+  struct cdb *cdbp;
+  unsigned m;
+  int r;
+
+  for (m = l + 1; m < cdbop->cdb_nlayers; ++m) {
+    cdbp = &cdbop->cdb_layers[m];
+    if (!_cdb_samehash(cdbp, hcdbp)) {
+      hval = _cdb_hashkey(cdbp, key, klen);
+      hcdbp = cdbp;
+    }
+    if (cdbop->cdb_linfo[m].cdb_fblocks &&
+        !_cdb_filter_test(cdbp, &cdbop->cdb_linfo[m], hval))
+      continue;
+    if ((r = _cdb_find(cdbp, key, klen, hval)) != 0)
+      return r;
+  }
+  return 0;
+}
+
+/* add visible records of layer l, and its tombstones if keep */
+static int
+addlayer(struct cdb_make *cdbmp, struct cdb_overlay *cdbop, unsigned l,
+         int keep)
+{
+  struct cdb *cdbp = &cdbop->cdb_layers[l];
+  const struct cdb_layer *lp = &cdbop->cdb_linfo[l];
+  struct cdb_rec *recs;
+  unsigned cnt, i, b, t = 0, tpos = 0;
+  unsigned rpos, klen, vlen, runpos = 0, runend = 0;
+  unsigned hlen = _cdb_rhdr(cdbp->cdb_fmt);
+  int fd = _cdb_posix_file_fd(cdbp->file);
+  int copy = _cdb_samefmt(cdbmp, cdbp) &&
+             !(cdbmp->cdb_flags & CDB_MAKE_COMPACT);
+  int r, tomb;
+  const void *key, *val;
+
+  if (!(recs = _cdb_getrecs(cdbp, &cnt)))
+    return -1;
+  if (lp->cdb_ntomb)
+    tpos = _cdb_unpack(cdbp, lp->cdb_tomb, cdb_buf_default);
+  for (i = b = 0; i < cnt; ++i) {
+    rpos = recs[i].rpos;
+    klen = _cdb_rklen(cdbp, hlen, rpos);
+    vlen = _cdb_rvlen(cdbp, hlen, rpos);
+    if (klen > cdbp->cdb_dend - rpos - hlen ||
+        vlen > cdbp->cdb_dend - rpos - hlen - klen) {
+      errno = EPROTO;
+      goto err;
+    }
+    /* tombstones and records are both in ascending order */
+    while(t < lp->cdb_ntomb && tpos < rpos)
+      if (++t < lp->cdb_ntomb)
+        tpos = _cdb_unpack(cdbp, lp->cdb_tomb + (t << 2), cdb_buf_default);
+    tomb = t < lp->cdb_ntomb && tpos == rpos;
+    if (!(key = _cdb_get(cdbp, klen, rpos + hlen, cdb_buf_default)) ||
+        (r = shadowed(cdbop, l, key, klen, recs[i].hval)) < 0)
+      goto err;
+
+    if (copy && !r && !tomb) {
+      /* extend the run, or start a new one */
+      if (b < i && rpos != runend) {
+        if (_cdb_make_run(cdbmp, cdbp, fd, recs, b, i, runpos, runend) < 0)
+          goto err;
+        b = i;
+      }
+      if (b == i)
+        runpos = rpos;
+      runend = rpos + hlen + klen + vlen;
+      continue;
+    }
+    if (_cdb_make_run(cdbmp, cdbp, fd, recs, b, i, runpos, runend) < 0)
+      goto err;
+    b = i + 1;
+    if (r || (tomb && !keep))
+      continue;
+    if (tomb)
+      r = cdb_make_delete(cdbmp, key, klen);
+    else if ((val = _cdb_get(cdbp, vlen, rpos + hlen + klen, cdb_buf_data)))
+      r = cdb_make_add(cdbmp, key, klen, val, vlen);
+    else
+      r = -1;
+    if (r < 0)
+      goto err;
+  }
+  if (_cdb_make_run(cdbmp, cdbp, fd, recs, b, cnt, runpos, runend) < 0)
+    goto err;
+  free(recs);
+  return 0;
+
+err:
+  free(recs);
+  return -1;
+}
+
+/* Merge layers first and up of an overlay into the database, so that
+ * it may replace them.  Tombstones are kept unless the base is merged
+ * too (first is 0), and are dropped with the records they hide. */
+int
+cdb_make_overlay(struct cdb_make *cdbmp, struct cdb_overlay *cdbop,
+                 unsigned first)
+{
+  unsigned l;
+  if (first >= cdbop->cdb_nlayers)
+    return errno = EINVAL, -1;
+  for (l = first; l < cdbop->cdb_nlayers; ++l)
+    if (addlayer(cdbmp, cdbop, l, first > 0) < 0)
+      return -1;
+  return 0;
+}
@@ -9,18 +9,18 @@
 #include <assert.h>
 #include "cdb_int.h"
 
+/* Records are not necessarily in file order here (see cdb_make_update),
+ * so look at all of them.  It is cheap compared with moving the data. */
 static void
 fixup_rpos(struct cdb_make *cdbmp, unsigned rpos, unsigned rlen) {
   unsigned i;
   struct cdb_rl *rl;
   register struct cdb_rec *rp, *rs;
-  for (i = 0; i < 256; ++i) {
+  for (i = 0; i < 256; ++i)
     for (rl = cdbmp->cdb_rec[i]; rl; rl = rl->next)
       for (rs = rl->rec, rp = rs + rl->cnt; --rp >= rs;)
-        if (rp->rpos <= rpos) goto nexthash;
-        else rp->rpos -= rlen;
-nexthash:;
-  }
+        if (rp->rpos > rpos)
+          rp->rpos -= rlen;
 }
 
 static int
@@ -29,7 +29,10 @@ remove_record(struct cdb_make *cdbmp, unsigned rpos, unsigned rlen) {
   int r;
   struct cdb_file *file = cdbmp->file;
 
+  cdbmp->cdb_crcpos = ~0u;  /* checksummed data moves */
   len = cdbmp->cdb_dpos - rpos - rlen;
+  if (cdbmp->cdb_fend < cdbmp->cdb_dpos)
+    cdbmp->cdb_fend = cdbmp->cdb_dpos;
   cdbmp->cdb_dpos -= rlen;
   if (!len)
     return 0;  /* it was the last record, nothing to do */
@@ -52,21 +55,27 @@ remove_record(struct cdb_make *cdbmp, unsigned rpos, unsigned rlen) {
 
 static int
 zerofill_record(struct cdb_make *cdbmp, unsigned rpos, unsigned rlen) {
+  unsigned hlen = _cdb_rhdr(cdbmp->cdb_fmt);
+  cdbmp->cdb_crcpos = ~0u;  /* checksummed data changes */
   if (rpos + rlen == cdbmp->cdb_dpos) {
+    if (cdbmp->cdb_fend < cdbmp->cdb_dpos)
+      cdbmp->cdb_fend = cdbmp->cdb_dpos;
     cdbmp->cdb_dpos = rpos;
     return 0;
   }
   if (cdbmp->file->seek(cdbmp->file, rpos) < 0)
     return -1;
   memset(cdbmp->cdb_buf, 0, sizeof(cdbmp->cdb_buf));
-  cdb_pack(rlen - 8, cdbmp->cdb_buf + 4);
+  /* a record with zero key and all of the rest as value */
+  if (hlen)
+    cdb_pack(rlen - hlen - cdbmp->cdb_fklen, cdbmp->cdb_buf + hlen - 4);
   for(;;) {
     rpos = rlen > sizeof(cdbmp->cdb_buf) ? sizeof(cdbmp->cdb_buf) : rlen;
     if (_cdb_make_fullwrite(cdbmp, cdbmp->cdb_buf, rpos) < 0)
       return -1;
     rlen -= rpos;
     if (!rlen) return 0;
-    memset(cdbmp->cdb_buf + 4, 0, 4);
+    memset(cdbmp->cdb_buf, 0, hlen);
   }
 }
 
@@ -75,20 +84,20 @@ static unsigned
 match(struct cdb_make *cdbmp, unsigned pos, const char *key, unsigned klen)
 {
   int len;
-  unsigned rlen;
+  unsigned rlen, hlen = _cdb_rhdr(cdbmp->cdb_fmt);
   struct cdb_file *file = cdbmp->file;
   if (cdbmp->file->seek(cdbmp->file, pos) < 0)
     return 1;
-  if (file->read(file, cdbmp->cdb_buf, 8) != 8)
+  if (file->read(file, cdbmp->cdb_buf, hlen) != (int)hlen)
     return 1;
-  if (cdb_unpack(cdbmp->cdb_buf) != klen)
+  if (hlen == 8 && cdb_unpack(cdbmp->cdb_buf) != klen)
     return 0;
 
   /* record length; check its validity */
-  rlen = cdb_unpack(cdbmp->cdb_buf + 4);
-  if (rlen > cdbmp->cdb_dpos - pos - klen - 8)
+  rlen = hlen ? cdb_unpack(cdbmp->cdb_buf + hlen - 4) : cdbmp->cdb_fvlen;
+  if (rlen > cdbmp->cdb_dpos - pos - klen - hlen)
     return errno = EPROTO, 1;  /* someone changed our file? */
-  rlen += klen + 8;
+  rlen += klen + hlen;
 
   while(klen) {
     len = klen > sizeof(cdbmp->cdb_buf) ? sizeof(cdbmp->cdb_buf) : klen;
@@ -104,8 +113,8 @@ match(struct cdb_make *cdbmp, unsigned pos, const char *key, unsigned klen)
   return rlen;
 }
 
-static int
-findrec(struct cdb_make *cdbmp,
+int internal_function
+_cdb_make_findrec(struct cdb_make *cdbmp,
         const void *key, unsigned klen, unsigned hval,
         enum cdb_put_mode mode)
 {
@@ -114,6 +123,8 @@ findrec(struct cdb_make *cdbmp,
   unsigned r;
   int seeked = 0;
   int ret = 0;
+  if ((cdbmp->cdb_fmt & CDB_FMT_FIXKEY) && klen != cdbmp->cdb_fklen)
+    return 0;
   for(rl = cdbmp->cdb_rec[hval&255]; rl; rl = rl->next)
     for(rs = rl->rec, rp = rs + rl->cnt; --rp >= rs;) {
       if (rp->hval != hval)
@@ -157,7 +168,8 @@ cdb_make_find(struct cdb_make *cdbmp,
               const void *key, unsigned klen,
               enum cdb_put_mode mode)
 {
-  return findrec(cdbmp, key, klen, cdb_hash(key, klen), mode);
+  return _cdb_make_findrec(cdbmp, key, klen,
+                           _cdb_hashkey(cdbmp, key, klen), mode);
 }
 
 int
@@ -173,7 +185,16 @@ cdb_make_put(struct cdb_make *cdbmp,
        const void *val, unsigned vlen,
        enum cdb_put_mode mode)
 {
-  unsigned hval = cdb_hash(key, klen);
+  return cdb_make_puth(cdbmp, _cdb_hashkey(cdbmp, key, klen),
+                       key, klen, val, vlen, mode);
+}
+
+int
+cdb_make_puth(struct cdb_make *cdbmp, unsigned hval,
+              const void *key, unsigned klen,
+              const void *val, unsigned vlen,
+              enum cdb_put_mode mode)
+{
   int r;
 
   switch(mode) {
@@ -181,7 +202,7 @@ cdb_make_put(struct cdb_make *cdbmp,
     case CDB_PUT_INSERT:
     case CDB_PUT_WARN:
     case CDB_PUT_REPLACE0:
-      r = findrec(cdbmp, key, klen, hval, mode);
+      r = _cdb_make_findrec(cdbmp, key, klen, hval, mode);
       if (r < 0)
         return -1;
       if (r && mode == CDB_PUT_INSERT)
@@ -0,0 +1,211 @@
+/* cdb_make_update.c: cdb_make_update routine
+ *
+ * Builds a new database from an old one plus a set of changes.
+ * Unchanged records are copied from the old data section in large
+ * runs, and keep the hash values stored in the old hash tables;
+ * only the changed keys are hashed and looked up.
+ *
+ * This file is a part of tinycdb package by Michael Tokarev, mjt@corpit.ru.
+ * Public domain.
+ */
+
+#include <stdlib.h>
+#include "cdb_int.h"
+
+struct dref {
+  unsigned hval;
+  unsigned idx;
+  const struct cdb_delta *d;
+};
+
+struct drop {
+  unsigned rpos;
+  unsigned rlen;  /* and later, total length of drops before this one */
+};
+
+static int
+cmpkey(const struct dref *x, const struct dref *y)
+{
+  if (x->hval != y->hval)
+    return x->hval < y->hval ? -1 : 1;
+  if (x->d->klen != y->d->klen)
+    return x->d->klen < y->d->klen ? -1 : 1;
+  return memcmp(x->d->key, y->d->key, x->d->klen);
+}
+
+static int
+cmpdref(const void *a, const void *b)
+{
+  const struct dref *x = (const struct dref*)a, *y = (const struct dref*)b;
+  int r = cmpkey(x, y);
+  if (r)
+    return r;
+  return x->idx < y->idx ? -1 : x->idx > y->idx;
+}
+
+static int
+cmpidx(const void *a, const void *b)
+{
+  unsigned x = ((const struct dref*)a)->idx, y = ((const struct dref*)b)->idx;
+  return x < y ? -1 : x > y;
+}
+
+static int
+cmpdrop(const void *a, const void *b)
+{
+  unsigned x = ((const struct drop*)a)->rpos, y = ((const struct drop*)b)->rpos;
+  return x < y ? -1 : x > y;
+}
+
+/* index of first drop with rpos >= pos */
+static unsigned
+lookup(const struct drop *drops, unsigned ndrops, unsigned pos)
+{
+  unsigned lo = 0, hi = ndrops;
+  while(lo < hi) {
+    unsigned m = lo + ((hi - lo) >> 1);
+    if (drops[m].rpos < pos)
+      lo = m + 1;
+    else
+      hi = m;
+  }
+  return lo;
+}
+
+/* register all old records except dropped ones, with rebased positions */
+static int
+addold(struct cdb_make *cdbmp, const struct cdb *cdbp, unsigned base,
+       const struct drop *drops, unsigned ndrops)
+{
+  unsigned t, i, n, pos, s, rpos, d, hval;
+  unsigned ss = _cdb_hslot(cdbp->cdb_fmt);
+  for (t = 0; t < _cdb_ntables(cdbp); ++t) {
+    n = _cdb_unpack(cdbp, cdbp->cdb_toc + (t << 3) + 4, cdb_buf_htab);
+    pos = _cdb_unpack(cdbp, cdbp->cdb_toc + (t << 3), cdb_buf_htab);
+    if (!n)
+      continue;
+    if (n > cdbp->file->fsize / ss || pos < cdbp->cdb_dend ||
+        pos > cdbp->file->fsize || n * ss > cdbp->file->fsize - pos)
+      return errno = EPROTO, -1;
+    /* Walk the table starting right after an empty slot: records with
+     * equal keys then come in their original order even if the probe
+     * sequence wrapped around the end of the table. */
+    for (s = 0; s < n; ++s)
+      if (!_cdb_slot(cdbp, pos + s * ss, &hval))
+        break;
+    for (i = 0; i < n; ++i) {
+      if (++s >= n)
+        s = 0;
+      rpos = _cdb_slot(cdbp, pos + s * ss, &hval);
+      if (!rpos)
+        continue;
+      if (rpos < 2048 || rpos > cdbp->cdb_dend - _cdb_rhdr(cdbp->cdb_fmt))
+        return errno = EPROTO, -1;
+      d = lookup(drops, ndrops, rpos);
+      if (d < ndrops && drops[d].rpos == rpos)
+        continue;
+      rpos = base + (rpos - 2048) - (d ? drops[d-1].rlen : 0);
+      if (_cdb_make_addrec(cdbmp, hval, rpos) < 0)
+        return -1;
+    }
+  }
+  return 0;
+}
+
+int
+cdb_make_update(struct cdb_make *cdbmp, struct cdb *cdbp,
+                const struct cdb_delta *delta, unsigned n)
+{
+  struct dref *refs = NULL;
+  struct drop *drops = NULL;
+  unsigned ndrops = 0, adrops = 0;
+  unsigned i, j, pos, base;
+  unsigned hlen = _cdb_rhdr(cdbp->cdb_fmt);
+  int fd = _cdb_posix_file_fd(cdbp->file);
+  int r;
+
+  /* old records are copied as is */
+  if (!_cdb_samefmt(cdbmp, cdbp))
+    return errno = EINVAL, -1;
+  if (n && !(refs = (struct dref*)malloc(n * sizeof(*refs))))
+    return errno = ENOMEM, -1;
+  for (i = 0; i < n; ++i) {
+    refs[i].hval = _cdb_hashkey(cdbp, delta[i].key, delta[i].klen);
+    refs[i].idx = i;
+    refs[i].d = delta + i;
+  }
+
+  /* group changes by key; the last change of every key wins */
+  qsort(refs, n, sizeof(*refs), cmpdref);
+  for (i = j = 0; i < n; ++i) {
+    if (i + 1 < n && !cmpkey(refs + i, refs + i + 1))
+      continue;
+    refs[j++] = refs[i];
+  }
+  n = j;
+
+  /* find old records of every changed key */
+  for (i = 0; i < n; ++i) {
+    struct cdb_find cdbf;
+    const struct cdb_delta *d = refs[i].d;
+    r = _cdb_findinit(&cdbf, cdbp, d->key, d->klen, refs[i].hval);
+    while(r > 0 && (r = cdb_findnext(&cdbf)) > 0) {
+      if (ndrops >= adrops) {
+        struct drop *t;
+        adrops = adrops ? adrops << 1 : 64;
+        t = (struct drop*)realloc(drops, adrops * sizeof(*drops));
+        if (!t) {
+          errno = ENOMEM;
+          goto err;
+        }
+        drops = t;
+      }
+      drops[ndrops].rpos = cdb_keypos(cdbp) - hlen;
+      drops[ndrops].rlen = hlen + cdb_keylen(cdbp) + cdb_datalen(cdbp);
+      ++ndrops;
+    }
+    if (r < 0)
+      goto err;
+  }
+  qsort(drops, ndrops, sizeof(*drops), cmpdrop);
+
+  /* copy everything in between, in as few pieces as possible */
+  base = cdbmp->cdb_dpos;
+  pos = 2048;
+  for (i = j = 0; i < ndrops; ++i) {
+    if (drops[i].rpos < pos)  /* same record found twice */
+      continue;
+    if (drops[i].rpos > pos &&
+        _cdb_make_copy(cdbmp, cdbp, fd, pos, drops[i].rpos - pos) < 0)
+      goto err;
+    pos = drops[i].rpos + drops[i].rlen;
+    /* rlen now accumulates */
+    drops[j].rpos = drops[i].rpos;
+    drops[j].rlen = drops[i].rlen + (j ? drops[j-1].rlen : 0);
+    ++j;
+  }
+  ndrops = j;
+  if (pos < cdbp->cdb_dend &&
+      _cdb_make_copy(cdbmp, cdbp, fd, pos, cdbp->cdb_dend - pos) < 0)
+    goto err;
+  if (addold(cdbmp, cdbp, base, drops, ndrops) < 0)
+    goto err;
+
+  /* and the new records, in the order they were given */
+  qsort(refs, n, sizeof(*refs), cmpidx);
+  for (i = 0; i < n; ++i) {
+    const struct cdb_delta *d = refs[i].d;
+    if (d->val && _cdb_make_add(cdbmp, refs[i].hval,
+                                d->key, d->klen, d->val, d->vlen) < 0)
+      goto err;
+  }
+
+  free(refs);
+  free(drops);
+  return 0;
+
+err:
+  free(refs);
+  free(drops);
+  return -1;
+}
@@ -0,0 +1,208 @@
+/* cdb_overlay.c: overlay database routines
+ *
+ * An overlay is a stack of ordinary cdb files, a large base and small
+ * layers (deltas) published on top of it, listed oldest first in a
+ * manifest like that of a sharded database:
+ *
+ *   cdb-overlay N
+ *   base
+ *   delta1
+ *   ...
+ *
+ * A key is looked up in the newest layer first.  The first layer which
+ * has records of the key answers; if all of them are tombstones (see
+ * cdb_make_delete()), the key is deleted, and older layers are not
+ * consulted.  A layer may have a CDB_EXT_OVLY record: header length,
+ * number of tombstones, number of filter blocks and bits set per key,
+ * 4-byte integers, then the positions of the tombstone records in
+ * ascending order and the membership filter.  The filter tells most
+ * keys absent from a layer by looking at one 64-byte block of it,
+ * without touching the hash tables.
+ *
+ * This file is a part of tinycdb package by Michael Tokarev, mjt@corpit.ru.
+ * Public domain.
+ */
+
+#include <stdlib.h>
+#include "cdb_int.h"
+
+/* Bits of a key with hash value hval: the block is picked by the low
+ * half of the mixed value, and k bits in it by double hashing of the
+ * high half. */
+#define FMIX(x) ((x) *= 0x9e3779b97f4a7c15ULL, (x) ^= (x) >> 32, \
+  (x) *= 0xff51afd7ed558ccdULL, (x) ^= (x) >> 29)
+#define FBLOCK(x, nblocks) \
+  ((unsigned)((((x) & 0xffffffffULL) * (nblocks)) >> 32))
+
+void internal_function
+_cdb_filter_add(unsigned char *f, unsigned nblocks, unsigned k, unsigned hval)
+{
+  unsigned long long x = hval;
+  unsigned h1, h2, b;
+  FMIX(x);
+  f += FBLOCK(x, nblocks) * CDB_FBLOCK;
+  h1 = (unsigned)(x >> 32);
+  h2 = (h1 >> 9) | 1;
+  while(k--) {
+    b = h1 & (CDB_FBLOCK * 8 - 1);
+    f[b >> 3] |= 1 << (b & 7);
+    h1 += h2;
+  }
+}
+
+/* 0 if the key with hash value hval is surely not in the layer */
+int internal_function
+_cdb_filter_test(const struct cdb *cdbp, const struct cdb_layer *lp,
+                 unsigned hval)
+{
+  unsigned long long x = hval;
+  unsigned h1, h2, b, k = lp->cdb_fk;
+  const unsigned char *f;
+  FMIX(x);
+  f = (const unsigned char*)_cdb_get(cdbp, CDB_FBLOCK, lp->cdb_filter +
+                                     FBLOCK(x, lp->cdb_fblocks) * CDB_FBLOCK,
+                                     cdb_buf_htab);
+  if (!f)
+    return 1;  /* let the lookup find the error */
+  h1 = (unsigned)(x >> 32);
+  h2 = (h1 >> 9) | 1;
+  while(k--) {
+    b = h1 & (CDB_FBLOCK * 8 - 1);
+    if (!(f[b >> 3] & (1 << (b & 7))))
+      return 0;
+    h1 += h2;
+  }
+  return 1;
+}
+
+/* set up *lp from the CDB_EXT_OVLY record of cdbp, return 1 if there
+ * is one, 0 if cdbp is not a layer */
+int
+cdb_layer_init(const struct cdb *cdbp, struct cdb_layer *lp)
+{
+  unsigned len, hlen, n, nblocks, k;
+  unsigned pos = _cdb_ext_find(cdbp, CDB_EXT_OVLY, &len);
+  const unsigned char *p;
+
+  memset(lp, 0, sizeof(*lp));
+  if (!pos)
+    return 0;
+  if (len < 16 ||
+      !(p = (const unsigned char*)_cdb_get(cdbp, 16, pos, cdb_buf_default)))
+    return errno = EPROTO, -1;
+  hlen = cdb_unpack(p);
+  n = cdb_unpack(p + 4);
+  nblocks = cdb_unpack(p + 8);
+  k = cdb_unpack(p + 12);
+  if (hlen < 16 || (hlen & 3) || hlen > len || n > (len - hlen) >> 2 ||
+      (unsigned long long)nblocks * CDB_FBLOCK != len - hlen - (n << 2) ||
+      (nblocks && (k < 1 || k > 16)))
+    return errno = EPROTO, -1;
+  lp->cdb_tomb = pos + hlen;
+  lp->cdb_ntomb = n;
+  if (nblocks) {
+    lp->cdb_filter = pos + hlen + (n << 2);
+    lp->cdb_fblocks = nblocks;
+    lp->cdb_fk = k;
+  }
+  return 1;
+}
+
+/* is the record at rpos a tombstone */
+int internal_function
+_cdb_layer_tomb(const struct cdb *cdbp, const struct cdb_layer *lp,
+                unsigned rpos)
+{
+  unsigned lo = 0, hi = lp->cdb_ntomb, m, t;
+  while(lo < hi) {
+    m = lo + ((hi - lo) >> 1);
+    t = _cdb_unpack(cdbp, lp->cdb_tomb + (m << 2), cdb_buf_default);
+    if (t == rpos)
+      return 1;
+    if (t < rpos)
+      lo = m + 1;
+    else
+      hi = m;
+  }
+  return 0;
+}
+
+int
+cdb_overlay_init(struct cdb_overlay *cdbop, const char *manifest)
+{
+  unsigned n, i;
+  struct cdb *layers = _cdb_manifest_open(manifest, CDB_OVERLAY_MAGIC, &n);
+  struct cdb_layer *linfo;
+
+  if (!layers)
+    return -1;
+  if (!(linfo = (struct cdb_layer*)malloc(n * sizeof(*linfo)))) {
+    _cdb_manifest_free(layers, n);
+    return errno = ENOMEM, -1;
+  }
+  for (i = 0; i < n; ++i)
+    if (cdb_layer_init(&layers[i], &linfo[i]) < 0) {
+      free(linfo);
+      _cdb_manifest_free(layers, n);
+      return -1;
+    }
+  cdbop->cdb_nlayers = n;
+  cdbop->cdb_layers = layers;
+  cdbop->cdb_linfo = linfo;
+  return 0;
+}
+
+void
+cdb_overlay_free(struct cdb_overlay *cdbop)
+{
+  _cdb_manifest_free(cdbop->cdb_layers, cdbop->cdb_nlayers);
+  free(cdbop->cdb_linfo);
+  cdbop->cdb_layers = NULL;
+  cdbop->cdb_linfo = NULL;
+  cdbop->cdb_nlayers = 0;
+}
+
+/* Find the first visible record of a key, newest layer first.  Return
+ * 1 and set *cdbpp to the layer it is in, with the record current in
+ * it; 0 if the key is not there or is deleted; -1 on error.  The key
+ * is hashed again only for a layer which hashes keys differently from
+ * the one above it. */
+int
+cdb_overlay_find(struct cdb_overlay *cdbop, const void *key, unsigned klen,
+                 struct cdb **cdbpp)
+{
+  struct cdb *cdbp, *hcdbp = NULL;
+  const struct cdb_layer *lp;
+  struct cdb_find cdbf;
+  unsigned i = cdbop->cdb_nlayers, hval = 0, hlen;
+  int r, tomb;
+
+  *cdbpp = NULL;
+  while(i--) {
+    cdbp = &cdbop->cdb_layers[i];
+    lp = &cdbop->cdb_linfo[i];
+    if (!hcdbp || !_cdb_samehash(cdbp, hcdbp)) {
+      hval = _cdb_hashkey(cdbp, key, klen);
+      hcdbp = cdbp;
+    }
+    if (lp->cdb_fblocks && !_cdb_filter_test(cdbp, lp, hval))
+      continue;
+    if ((r = _cdb_findinit(&cdbf, cdbp, key, klen, hval)) < 0)
+      return -1;
+    hlen = _cdb_rhdr(cdbp->cdb_fmt);
+    tomb = 0;
+    while(r && (r = cdb_findnext(&cdbf)) > 0) {
+      if (!lp->cdb_ntomb ||
+          !_cdb_layer_tomb(cdbp, lp, cdb_keypos(cdbp) - hlen)) {
+        *cdbpp = cdbp;
+        return 1;
+      }
+      tomb = 1;
+    }
+    if (r < 0)
+      return -1;
+    if (tomb)
+      return 0;
+  }
+  return 0;
+}
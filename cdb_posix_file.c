@@ -1,3 +1,4 @@
+#define _GNU_SOURCE  /* for copy_file_range() */
 #include "cdb_int.h"
 #include <sys/stat.h>
 #include <stdlib.h>
@@ -7,11 +8,17 @@
 # include <windows.h>
 #else
 # include <sys/mman.h>
+# include <sys/uio.h>
 # ifndef MAP_FAILED
 #  define MAP_FAILED ((void*)-1)
 # endif
 #endif
 
+#if defined(__linux__) && defined(__GLIBC__) && \
+    (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 27))
+# define HAVE_COPY_FILE_RANGE
+#endif
+
 static int
 _cdb_posix_file_open(struct cdb_file *cdbfp);
 static int
@@ -28,6 +35,12 @@ static int
 _cdb_posix_file_write(struct cdb_file *cdbfp, const unsigned char *buf, unsigned len);
 static void
 _cdb_posix_file_close(struct cdb_file *cdbfp);
+#ifndef _WIN32
+static int
+_cdb_posix_file_writev(struct cdb_file *cdbfp, const struct iovec *iov, int iovcnt);
+#endif
+static int
+_cdb_posix_file_copy(struct cdb_file *cdbfp, int fd, unsigned long long pos, unsigned len);
 
 struct cdb_posix_file_opaque {
   int fd;
@@ -45,6 +58,13 @@ static const struct cdb_file _cdb_posix_file = {
   _cdb_posix_file_write,
   _cdb_posix_file_close,
   NULL,
+  0,
+#ifndef _WIN32
+  _cdb_posix_file_writev,
+#else
+  NULL,
+#endif
+  _cdb_posix_file_copy,
 };
 
 struct cdb_file *
@@ -114,6 +134,15 @@ _cdb_posix_file_open(struct cdb_file *cdbfp)
   return 0;
 }
 
+int
+_cdb_posix_file_fd(const struct cdb_file *file)
+{
+  const struct cdb_posix_file_opaque *opaque = file->opaque;
+  if (file->open != _cdb_posix_file_open || !opaque)
+    return -1;
+  return opaque->fd;
+}
+
 int _cdb_posix_file_mlock(struct cdb_file *file) {
   struct cdb_posix_file_opaque *opaque = file->opaque;
 #ifdef _WIN32
@@ -146,17 +175,45 @@ int
 _cdb_posix_file_read(struct cdb_file *cdbfp, void *buf, unsigned len)
 {
   struct cdb_posix_file_opaque *opaque = cdbfp->opaque;
-  const void *data = _cdb_posix_file_get(cdbfp, len, opaque->offset, cdb_buf_default);
+  const void *data;
+  int rc;
+  if (!opaque->cdb_mem) {
+    /* file being created is not mapped */
+    rc = read(opaque->fd, buf, len);
+    if (rc > 0)
+      opaque->offset += rc;
+    return rc;
+  }
+  data = _cdb_posix_file_get(cdbfp, len, opaque->offset, cdb_buf_default);
   if (!data) return -1;
   memcpy(buf, data, len);
   opaque->offset += len;
-  return 0;
+  return len;
 }
 
 int
 _cdb_posix_file_pread(struct cdb_file *cdbfp, void *buf, unsigned len, unsigned pos)
 {
-  const void *data = _cdb_posix_file_get(cdbfp, len, pos, cdb_buf_default);
+  struct cdb_posix_file_opaque *opaque = cdbfp->opaque;
+  const void *data;
+  if (!opaque->cdb_mem) {
+    int rc;
+    while(len) {
+      rc = pread(opaque->fd, buf, len, pos);
+      if (rc <= 0) {
+        if (!rc)
+          errno = EIO;
+        else if (errno == EINTR)
+          continue;
+        return -1;
+      }
+      buf = (char*)buf + rc;
+      pos += rc;
+      len -= rc;
+    }
+    return 0;
+  }
+  data = _cdb_posix_file_get(cdbfp, len, pos, cdb_buf_default);
   if (!data) return -1;
   memcpy(buf, data, len);
   return 0;
@@ -186,7 +243,7 @@ _cdb_posix_file_seek(struct cdb_file *cdbfp, unsigned pos)
 {
   struct cdb_posix_file_opaque *opaque = cdbfp->opaque;
   opaque->offset = pos;
-  return lseek(opaque->fd, pos, SEEK_SET);
+  return lseek(opaque->fd, pos, SEEK_SET) < 0 ? -1 : 0;
 }
 
 int
@@ -199,3 +256,46 @@ _cdb_posix_file_write(struct cdb_file *cdbfp, const unsigned char *buf, unsigned
   }
   return rc;
 }
+
+#ifndef _WIN32
+int
+_cdb_posix_file_writev(struct cdb_file *cdbfp, const struct iovec *iov, int iovcnt)
+{
+  struct cdb_posix_file_opaque *opaque = cdbfp->opaque;
+  int rc = writev(opaque->fd, iov, iovcnt);
+  if (rc > 0) {
+    opaque->offset += rc;
+  }
+  return rc;
+}
+#endif
+
+int
+_cdb_posix_file_copy(struct cdb_file *cdbfp, int fd, unsigned long long pos, unsigned len)
+{
+  struct cdb_posix_file_opaque *opaque = cdbfp->opaque;
+  unsigned char buf[65536];
+  int rc;
+#ifdef HAVE_COPY_FILE_RANGE
+  loff_t off = pos;
+  if (len > 0x40000000)
+    len = 0x40000000;
+  rc = copy_file_range(fd, &off, opaque->fd, NULL, len, 0);
+  if (rc >= 0 || (errno != EXDEV && errno != ENOSYS &&
+                  errno != EINVAL && errno != EOPNOTSUPP))
+    goto done;
+#endif
+  /* plain read+write fallback */
+  if (len > sizeof(buf))
+    len = sizeof(buf);
+  rc = pread(fd, buf, len, pos);
+  if (rc > 0)
+    rc = write(opaque->fd, buf, rc);
+#ifdef HAVE_COPY_FILE_RANGE
+done:
+#endif
+  if (rc > 0) {
+    opaque->offset += rc;
+  }
+  return rc;
+}
@@ -10,6 +10,9 @@
 #ifndef SEEK_SET
 # define SEEK_SET 0
 #endif
+#ifndef SEEK_END
+# define SEEK_END 2
+#endif
 
 /* read a chunk from file, ignoring interrupts (EINTR) */
 
@@ -31,6 +34,61 @@ cdb_bread(int fd, void *buf, int len)
   return 0;
 }
 
+/* find toc of a streamed file or of a file in another format in the
+   extension section at its end.  Return 1 and set *tocp and the format
+   members of *fmtp (all zeros for a streamed file) if found, 0 if not,
+   -1 on error. */
+
+static int
+cdb_exttoc(int fd, unsigned *tocp, struct cdb *fmtp)
+{
+  unsigned char rbuf[44];
+  unsigned pos, len, l, hlen;
+  off_t end;
+
+  if ((end = lseek(fd, 0, SEEK_END)) < 0)
+    return -1;
+  if (end < 2048 + CDB_EXT_FOOTER || end > 0xffffffff)
+    return 0;
+  end -= CDB_EXT_FOOTER;
+  if (lseek(fd, end, SEEK_SET) < 0 || cdb_bread(fd, rbuf, CDB_EXT_FOOTER) < 0)
+    return -1;
+  if (memcmp(rbuf + 8, CDB_EXT_MAGIC, 8) != 0)
+    return 0;
+  pos = cdb_unpack(rbuf);
+  len = cdb_unpack(rbuf + 4);
+  if (pos < 2048 || pos > end || len != end - pos)
+    return 0;
+  while(len >= 8) {
+    if (lseek(fd, pos, SEEK_SET) < 0 || cdb_bread(fd, rbuf, 8) < 0)
+      return -1;
+    l = cdb_unpack(rbuf + 4);
+    if (l > len - 8)
+      return 0;
+    if (memcmp(rbuf, CDB_EXT_TOC, 4) == 0 && l == 2048) {
+      *tocp = pos + 8;
+      return 1;
+    }
+    if (memcmp(rbuf, CDB_EXT_FMT, 4) == 0 && l >= 12) {
+      if (cdb_bread(fd, rbuf, 4) < 0)
+        return -1;
+      hlen = cdb_unpack(rbuf);
+      if (hlen < 12 || hlen > l)
+        return errno = EPROTO, -1;
+      if (cdb_bread(fd, rbuf + 4, _cdb_fmthdr(hlen) - 4) < 0 ||
+          _cdb_fmt_decode(fmtp, rbuf, hlen) < 0)
+        return -1;
+      if (l - hlen != _cdb_toclen(fmtp))
+        return errno = EPROTO, -1;
+      *tocp = pos + 8 + hlen;
+      return 1;
+    }
+    pos += 8 + l;
+    len -= 8 + l;
+  }
+  return 0;
+}
+
 /* find a given key in cdb file, seek a file pointer to it's value and
    place data length to *dlenp. */
 
@@ -43,6 +101,9 @@ cdb_seek(int fd, const void *key, unsigned klen, unsigned *dlenp)
   unsigned hti;      /* hash table index */
   unsigned pos;      /* position in a file */
   unsigned hval;      /* key's hash value */
+  struct cdb fmt = CDB_STATIC_INIT;  /* format of a non-classic file */
+  unsigned ss = 8;    /* hash table slot size */
+  int hit;      /* hash value matched */
   unsigned char rbuf[64];  /* read buffer */
   int needseek = 1;    /* if we should seek to a hash slot */
 
@@ -51,24 +112,61 @@ cdb_seek(int fd, const void *key, unsigned klen, unsigned *dlenp)
   /* read the hash table parameters */
   if (lseek(fd, pos, SEEK_SET) < 0 || cdb_bread(fd, rbuf, 8) < 0)
     return -1;
+  if (!cdb_unpack(rbuf)) { /* toc is at the end */
+    unsigned toc;
+    int r = cdb_exttoc(fd, &toc, &fmt);
+    if (r <= 0)
+      return r;
+    if ((fmt.cdb_fmt & CDB_FMT_FIXKEY) && klen != fmt.cdb_fklen)
+      return 0;
+    if (fmt.cdb_fmt) {
+      hval = _cdb_hashkey(&fmt, key, klen);
+      pos = _cdb_tocent(&fmt, hval);
+    }
+    if (fmt.cdb_fmt & CDB_FMT_DENSE)
+      ss = 4;
+    if (lseek(fd, toc + pos, SEEK_SET) < 0 || cdb_bread(fd, rbuf, 8) < 0)
+      return -1;
+  }
   if ((htsize = cdb_unpack(rbuf + 4)) == 0)
     return 0;
-  hti = (hval >> 8) % htsize;  /* start position in hash table */
+  hti = _cdb_hstart(&fmt, hval, htsize);  /* start position in hash table */
   httodo = htsize;
   htstart = cdb_unpack(rbuf);
 
   for(;;) {
-    if (needseek && lseek(fd, htstart + (hti << 3), SEEK_SET) < 0)
+    if (needseek && lseek(fd, htstart + hti * ss, SEEK_SET) < 0)
       return -1;
-    if (cdb_bread(fd, rbuf, 8) < 0)
+    if (cdb_bread(fd, rbuf, ss) < 0)
       return -1;
-    if ((pos = cdb_unpack(rbuf + 4)) == 0) /* not found */
-      return 0;
+    if (ss == 4) { /* hash value bits and record number */
+      unsigned mask = _cdb_imask(&fmt);
+      if ((pos = cdb_unpack(rbuf)) == 0) /* not found */
+        return 0;
+      hit = !((pos ^ hval) & ~mask);
+      pos = 2048 + ((pos & mask) - 1) * (fmt.cdb_fklen + fmt.cdb_fvlen);
+    }
+    else {
+      if ((pos = cdb_unpack(rbuf + 4)) == 0) /* not found */
+        return 0;
+      hit = cdb_unpack(rbuf) == hval;
+    }
 
-    if (cdb_unpack(rbuf) != hval) /* hash value not matched */
+    if (!hit) /* hash value not matched */
       needseek = 0;
     else { /* hash value matched */
-      if (lseek(fd, pos, SEEK_SET) < 0 || cdb_bread(fd, rbuf, 8) < 0)
+      if (ss == 4) { /* no record header */
+  if (lseek(fd, pos, SEEK_SET) < 0)
+    return -1;
+  cdb_pack(klen, rbuf);
+  cdb_pack(fmt.cdb_fvlen, rbuf + 4);
+      }
+      else if (fmt.cdb_fmt & CDB_FMT_FIXKEY) { /* value length only */
+  if (lseek(fd, pos, SEEK_SET) < 0 || cdb_bread(fd, rbuf + 4, 4) < 0)
+    return -1;
+  cdb_pack(klen, rbuf);
+      }
+      else if (lseek(fd, pos, SEEK_SET) < 0 || cdb_bread(fd, rbuf, 8) < 0)
   return -1;
       if (cdb_unpack(rbuf) == klen) { /* key length matches */
   /* read the key from file and compare with wanted */
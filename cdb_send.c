@@ -0,0 +1,88 @@
+/* cdb_send.c: cdb_send routine
+ *
+ * This file is a part of tinycdb package by Michael Tokarev, mjt@corpit.ru.
+ * Public domain.
+ */
+
+#define _GNU_SOURCE  /* for splice() */
+#include <sys/types.h>
+#include <unistd.h>
+#ifdef __linux__
+# include <fcntl.h>
+# include <sys/sendfile.h>
+#endif
+#include "cdb_int.h"
+
+#define SENDCHUNK 65536  /* for the read+write fallback */
+
+static int
+_cdb_fullwrite(int fd, const char *buf, unsigned len)
+{
+  int l;
+  while(len) {
+    l = write(fd, buf, len);
+    if (l > 0) {
+      len -= l;
+      buf += l;
+    }
+    else if (!l)
+      return errno = EIO, -1;
+    else if (errno != EINTR)
+      return -1;
+  }
+  return 0;
+}
+
+/* Write len bytes of the database at pos to fd.  With a posix file
+ * the bytes go from the page cache to fd by the kernel: sendfile()
+ * works for sockets and regular files, splice() for pipes.  Other
+ * descriptors and custom file implementations get the data copied
+ * through the library in SENDCHUNK pieces. */
+int
+cdb_send(const struct cdb *cdbp, int fd, unsigned len, unsigned pos)
+{
+  const void *p;
+  unsigned l;
+#ifdef __linux__
+  int in = _cdb_posix_file_fd(cdbp->file);
+  loff_t off = pos;
+  ssize_t r;
+  int spl = 0;
+#endif
+
+  if (pos > cdbp->file->fsize || cdbp->file->fsize - pos < len)
+    return errno = EPROTO, -1;
+  CDB_STAT(cdbp, bytes[cdb_buf_default] += len);
+
+#ifdef __linux__
+  while(in >= 0 && len) {
+    l = len > 0x40000000 ? 0x40000000 : len;
+    r = spl ? splice(in, &off, fd, NULL, l, SPLICE_F_MORE)
+            : sendfile(fd, in, &off, l);
+    if (r > 0) {
+      len -= r;
+      pos += r;
+    }
+    else if (!r)
+      return errno = EIO, -1;
+    else if (errno == EINTR)
+      continue;
+    else if ((errno == EINVAL || errno == ENOSYS) && !spl)
+      spl = 1;
+    else if (errno == EINVAL || errno == ENOSYS)
+      break;
+    else
+      return -1;
+  }
+#endif
+
+  while(len) {
+    l = len > SENDCHUNK ? SENDCHUNK : len;
+    if (!(p = cdbp->file->get(cdbp->file, l, pos, cdb_buf_data)) ||
+        _cdb_fullwrite(fd, p, l) < 0)
+      return -1;
+    pos += l;
+    len -= l;
+  }
+  return 0;
+}
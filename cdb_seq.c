@@ -11,11 +11,12 @@ cdb_seqnext(unsigned *cptr, struct cdb *cdbp) {
   unsigned klen, vlen;
   unsigned pos = *cptr;
   unsigned dend = cdbp->cdb_dend;
-  if (pos > dend - 8)
+  unsigned hlen = _cdb_rhdr(cdbp->cdb_fmt);
+  if (pos >= dend || pos > dend - hlen)
     return 0;
-  klen = _cdb_unpack(cdbp, pos, cdb_buf_data);
-  vlen = _cdb_unpack(cdbp, pos + 4, cdb_buf_data);
-  pos += 8;
+  klen = _cdb_rklen(cdbp, hlen, pos);
+  vlen = _cdb_rvlen(cdbp, hlen, pos);
+  pos += hlen;
   if (dend - klen < pos || dend - vlen < pos + klen)
     return errno = EPROTO, -1;
   cdbp->cdb_kpos = pos;
@@ -23,5 +24,6 @@ cdb_seqnext(unsigned *cptr, struct cdb *cdbp) {
   cdbp->cdb_vpos = pos + klen;
   cdbp->cdb_vlen = vlen;
   *cptr = pos + klen + vlen;
+  CDB_STAT(cdbp, seqs++);
   return 1;
 }
@@ -0,0 +1,176 @@
+/* cdb_sharded.c: sharded database routines
+ *
+ * A sharded database is a set of ordinary cdb files, with records
+ * distributed among them by cdb_shardof() of the key hash value, plus
+ * a small text manifest:
+ *
+ *   cdb-shards N
+ *   name0
+ *   ...
+ *
+ * listing the N shard files, relative to the directory of the manifest
+ * unless absolute.  The key is hashed once; the same value selects the
+ * shard and is used for the lookup within it.
+ *
+ * This file is a part of tinycdb package by Michael Tokarev, mjt@corpit.ru.
+ * Public domain.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "cdb_int.h"
+
+#define MAXMANIFEST (1 << 20)
+
+void internal_function
+_cdb_manifest_free(struct cdb *cdbs, unsigned n)
+{
+  while(n--) {
+    int fd = cdb_fileno(&cdbs[n]);
+    cdb_free(&cdbs[n]);
+    close(fd);
+  }
+  free(cdbs);
+}
+
+/* read the whole manifest into a nul-terminated buffer */
+static char *
+readmanifest(const char *manifest)
+{
+  struct stat st;
+  char *buf;
+  ssize_t l, len = 0;
+  int fd = open(manifest, O_RDONLY);
+  if (fd < 0)
+    return NULL;
+  if (fstat(fd, &st) < 0) {
+    close(fd);
+    return NULL;
+  }
+  if (st.st_size > MAXMANIFEST) {
+    close(fd);
+    return errno = EPROTO, NULL;
+  }
+  if (!(buf = (char*)malloc(st.st_size + 1))) {
+    close(fd);
+    return errno = ENOMEM, NULL;
+  }
+  while(len < st.st_size &&
+        ((l = read(fd, buf + len, st.st_size - len)) > 0 ||
+         (l < 0 && errno == EINTR)))
+    if (l > 0)
+      len += l;
+  close(fd);
+  buf[len] = '\0';
+  return buf;
+}
+
+/* Open all files listed in a manifest starting with magic.  Return
+ * the array of them and set *np to their number, or return NULL. */
+struct cdb *
+_cdb_manifest_open(const char *manifest, const char *magic, unsigned *np)
+{
+  char *buf, *p, *e, *path;
+  const char *slash = strrchr(manifest, '/');
+  unsigned dlen = slash ? slash + 1 - manifest : 0;
+  unsigned mlen = strlen(magic);
+  unsigned n, i;
+  struct cdb *cdbs;
+  int fd;
+
+  if (!(buf = readmanifest(manifest)))
+    return NULL;
+  if (strncmp(buf, magic, mlen) != 0 || buf[mlen] != ' ' ||
+      (n = strtoul(buf + mlen + 1, &p, 10)) == 0 ||
+      n > MAXMANIFEST / 2 || *p++ != '\n') {
+    free(buf);
+    return errno = EPROTO, NULL;
+  }
+  cdbs = (struct cdb*)malloc(n * sizeof(*cdbs));
+  path = (char*)malloc(dlen + (strlen(p) + 1));
+  if (!cdbs || !path) {
+    free(cdbs);
+    free(path);
+    free(buf);
+    return errno = ENOMEM, NULL;
+  }
+  memcpy(path, manifest, dlen);
+
+  for (i = 0; i < n; ++i) {
+    if (!(e = strchr(p, '\n')) || e == p) {
+      errno = EPROTO;
+      break;
+    }
+    *e = '\0';
+    if (*p == '/')
+      strcpy(path, p);
+    else
+      strcpy(path + dlen, p);
+    p = e + 1;
+    if ((fd = open(path, O_RDONLY)) < 0)
+      break;
+    if (cdb_init(&cdbs[i], fd) != 0) {
+      close(fd);
+      break;
+    }
+  }
+  free(path);
+  free(buf);
+  if (i < n) {
+    _cdb_manifest_free(cdbs, i);
+    return NULL;
+  }
+  *np = n;
+  return cdbs;
+}
+
+int
+cdb_sharded_init(struct cdb_sharded *cdbsp, const char *manifest)
+{
+  unsigned n, i;
+  struct cdb *shards = _cdb_manifest_open(manifest, CDB_SHARDS_MAGIC, &n);
+
+  if (!shards)
+    return -1;
+  /* keys are hashed once, in the format of the first shard */
+  for (i = 1; i < n; ++i)
+    if (!_cdb_samehash(&shards[i], &shards[0])) {
+      _cdb_manifest_free(shards, n);
+      return errno = EPROTO, -1;
+    }
+  cdbsp->cdb_nshards = n;
+  cdbsp->cdb_shards = shards;
+  return 0;
+}
+
+void
+cdb_sharded_free(struct cdb_sharded *cdbsp)
+{
+  _cdb_manifest_free(cdbsp->cdb_shards, cdbsp->cdb_nshards);
+  cdbsp->cdb_shards = NULL;
+  cdbsp->cdb_nshards = 0;
+}
+
+int
+cdb_sharded_find(struct cdb_sharded *cdbsp, const void *key, unsigned klen,
+                 struct cdb **cdbpp)
+{
+  unsigned hval = _cdb_hashkey(cdbsp->cdb_shards, key, klen);
+  struct cdb *cdbp = &cdbsp->cdb_shards[cdb_shardof(hval, cdbsp->cdb_nshards)];
+  *cdbpp = cdbp;
+  return _cdb_find(cdbp, key, klen, hval);
+}
+
+int
+cdb_sharded_findinit(struct cdb_find *cdbfp, struct cdb_sharded *cdbsp,
+                     const void *key, unsigned klen)
+{
+  unsigned hval = _cdb_hashkey(cdbsp->cdb_shards, key, klen);
+  return _cdb_findinit(cdbfp,
+                       &cdbsp->cdb_shards[cdb_shardof(hval, cdbsp->cdb_nshards)],
+                       key, klen, hval);
+}
@@ -0,0 +1,63 @@
+/* cdb_stats.c: lookup statistics
+ *
+ * Counters are kept in a struct cdb_stats attached to a cdb handle.
+ * A handle is never used by several threads at once, so every thread
+ * counts into its own block with plain increments, and blocks are
+ * summed up by cdb_stats_add() when needed.  Unless the library is
+ * compiled with CDB_STATS, counting code is not there at all.
+ *
+ * This file is a part of tinycdb package by Michael Tokarev, mjt@corpit.ru.
+ * Public domain.
+ */
+
+#include "cdb_int.h"
+
+int
+cdb_stats_attach(struct cdb *cdbp, struct cdb_stats *stats)
+{
+#ifdef CDB_STATS
+  if (stats)
+    stats->pmark = stats->probes;
+  cdbp->cdb_stats = stats;
+  return 0;
+#else
+  cdbp->cdb_stats = NULL;
+  return stats ? (errno = ENOSYS, -1) : 0;
+#endif
+}
+
+void
+cdb_stats_add(struct cdb_stats *sum, const struct cdb_stats *stats)
+{
+  unsigned i;
+  sum->lookups += stats->lookups;
+  sum->hits += stats->hits;
+  sum->misses += stats->misses;
+  sum->errors += stats->errors;
+  sum->probes += stats->probes;
+  sum->collisions += stats->collisions;
+  sum->seqs += stats->seqs;
+  for (i = 0; i < 3; ++i)
+    sum->bytes[i] += stats->bytes[i];
+  for (i = 0; i < CDB_STATS_NPROBE; ++i)
+    sum->probehist[i] += stats->probehist[i];
+  sum->pmark = sum->probes;
+}
+
+#ifdef CDB_STATS
+/* account one lookup, which examined all slots since the previous one */
+void internal_function
+_cdb_stat_find(struct cdb_stats *stats, int r)
+{
+  unsigned long long n = stats->probes - stats->pmark;
+  stats->pmark = stats->probes;
+  ++stats->lookups;
+  if (r > 0)
+    ++stats->hits;
+  else if (!r)
+    ++stats->misses;
+  else
+    ++stats->errors;
+  ++stats->probehist[n < CDB_STATS_NPROBE ? n : CDB_STATS_NPROBE - 1];
+}
+#endif
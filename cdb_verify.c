@@ -0,0 +1,55 @@
+/* cdb_verify.c: cdb_verify routine
+ *
+ * Checksums are kept in the extension section, in a record tagged
+ * CDB_EXT_CRC: chunk size, CRC-32C of the toc, and CRC-32C of every
+ * chunk of the file from the end of the toc to the extension section,
+ * that is, of records and hash tables.  The last chunk may be shorter.
+ * The toc is checksummed wherever it is, so the same record is valid
+ * for a classic and for a streamed file.
+ *
+ * Chunks are independent, and the work can be split among threads,
+ * every one verifying its own part.
+ *
+ * This file is a part of tinycdb package by Michael Tokarev, mjt@corpit.ru.
+ * Public domain.
+ */
+
+#include "cdb_int.h"
+
+int
+cdb_verify(const struct cdb *cdbp, unsigned part, unsigned nparts)
+{
+  unsigned len, crc = _cdb_ext_find(cdbp, CDB_EXT_CRC, &len);
+  unsigned end = cdbp->cdb_ext, chunk, n, i, last, pos, l;
+  const unsigned char *p, *d;
+
+  if (part >= nparts)
+    return errno = EINVAL, -1;
+  if (!crc)
+    return 0;
+  if (len < 8 || (len & 3) ||
+      !(p = (const unsigned char*)_cdb_get(cdbp, len, crc, cdb_buf_default)))
+    return errno = EPROTO, -1;
+  chunk = cdb_unpack(p);
+  n = (len - 8) >> 2;
+  if (!chunk || end < 2048 ||
+      n != (end - 2048) / chunk + ((end - 2048) % chunk != 0))
+    return errno = EPROTO, -1;
+
+  if (!part) {
+    d = (const unsigned char*)_cdb_get(cdbp, _cdb_toclen(cdbp), cdbp->cdb_toc,
+                                       cdb_buf_default);
+    if (!d || cdb_crc32c(0, d, _cdb_toclen(cdbp)) != cdb_unpack(p + 4))
+      return errno = EPROTO, -1;
+  }
+  i = (unsigned)((unsigned long long)n * part / nparts);
+  last = (unsigned)((unsigned long long)n * (part + 1) / nparts);
+  for (; i < last; ++i) {
+    pos = 2048 + i * chunk;
+    l = end - pos < chunk ? end - pos : chunk;
+    d = (const unsigned char*)_cdb_get(cdbp, l, pos, cdb_buf_data);
+    if (!d || cdb_crc32c(0, d, l) != cdb_unpack(p + 8 + (i << 2)))
+      return errno = EPROTO, -1;
+  }
+  return 1;
+}
@@ -0,0 +1,167 @@
+/* maptok.c: map format tokenizer
+ *
+ * Input is classified 64 bytes at a time into bitmasks of newlines and
+ * blanks (space or tab), using SSE2 or AVX2 when the compiler targets
+ * them, and lines are split by walking the masks, so every input byte
+ * is looked at just once.  Without SIMD (or with -DCDB_NO_SIMD), 8
+ * bytes are compared at a time in a 64bit word.
+ *
+ * This file is a part of tinycdb package by Michael Tokarev, mjt@corpit.ru.
+ * Public domain.
+ */
+
+#include <string.h>
+#include "maptok.h"
+
+#ifdef __GNUC__
+# define ctz64(x) __builtin_ctzll(x)
+#else
+static int ctz64(unsigned long long x) {
+  int n = 0;
+  while(!(x & 1)) x >>= 1, ++n;
+  return n;
+}
+#endif
+
+#if defined(__AVX2__) && !defined(CDB_NO_SIMD)
+# define MS_AVX2
+# include <immintrin.h>
+const char maptok_impl[] = "avx2";
+#elif defined(__SSE2__) && !defined(CDB_NO_SIMD)
+# define MS_SSE2
+# include <emmintrin.h>
+const char maptok_impl[] = "sse2";
+#elif defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+# define MS_SWAR
+const char maptok_impl[] = "swar";
+#else
+const char maptok_impl[] = "bytewise";
+#endif
+
+struct mscan {
+  const unsigned char *p;
+  size_t len;
+  size_t base;            /* offset of the classified chunk */
+  unsigned long long nl;  /* newlines in the chunk */
+  unsigned long long ws;  /* blanks in the chunk */
+};
+
+#define MS_NL  0  /* find newline */
+#define MS_NB  1  /* find non-blank (a newline is non-blank) */
+#define MS_SEP 2  /* find blank or newline */
+
+static void
+mclassify(struct mscan *s, size_t base)
+{
+  const unsigned char *p = s->p + base;
+  unsigned char tail[64];
+  if (s->len - base < 64) {
+    memset(tail, 0, sizeof(tail));
+    memcpy(tail, p, s->len - base);
+    p = tail;
+  }
+  s->base = base;
+  {
+#if defined(MS_AVX2)
+  const __m256i nl = _mm256_set1_epi8('\n');
+  const __m256i sp = _mm256_set1_epi8(' '), tb = _mm256_set1_epi8('\t');
+  __m256i a = _mm256_loadu_si256((const __m256i*)p);
+  __m256i b = _mm256_loadu_si256((const __m256i*)(p + 32));
+  s->nl = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(a, nl)) |
+    (unsigned long long)(unsigned)
+      _mm256_movemask_epi8(_mm256_cmpeq_epi8(b, nl)) << 32;
+  s->ws = (unsigned)_mm256_movemask_epi8(
+      _mm256_or_si256(_mm256_cmpeq_epi8(a, sp), _mm256_cmpeq_epi8(a, tb))) |
+    (unsigned long long)(unsigned)_mm256_movemask_epi8(
+      _mm256_or_si256(_mm256_cmpeq_epi8(b, sp), _mm256_cmpeq_epi8(b, tb)))
+      << 32;
+#elif defined(MS_SSE2)
+  const __m128i nl = _mm_set1_epi8('\n');
+  const __m128i sp = _mm_set1_epi8(' '), tb = _mm_set1_epi8('\t');
+  int i;
+  s->nl = s->ws = 0;
+  for (i = 0; i < 64; i += 16) {
+    __m128i a = _mm_loadu_si128((const __m128i*)(p + i));
+    s->nl |= (unsigned long long)(unsigned)
+      _mm_movemask_epi8(_mm_cmpeq_epi8(a, nl)) << i;
+    s->ws |= (unsigned long long)(unsigned)_mm_movemask_epi8(
+      _mm_or_si128(_mm_cmpeq_epi8(a, sp), _mm_cmpeq_epi8(a, tb))) << i;
+  }
+#elif defined(MS_SWAR)
+  /* 8 bytes at a time: 0x80 in every byte equal to c, then gather
+   * the high bits of all bytes into the low byte */
+# define L1 0x0101010101010101ull
+# define L7 0x7f7f7f7f7f7f7f7full
+# define EQ(x,c) (~(((((x) ^ L1 * (c)) & L7) + L7) | ((x) ^ L1 * (c)) | L7))
+# define GATHER(t) (((t) >> 7) * 0x0102040810204080ull >> 56)
+  unsigned long long x;
+  int i;
+  s->nl = s->ws = 0;
+  for (i = 0; i < 64; i += 8) {
+    memcpy(&x, p + i, 8);
+    s->nl |= GATHER(EQ(x, '\n')) << i;
+    s->ws |= GATHER(EQ(x, ' ') | EQ(x, '\t')) << i;
+  }
+# undef L1
+# undef L7
+# undef EQ
+# undef GATHER
+#else
+  int i;
+  s->nl = s->ws = 0;
+  for (i = 0; i < 64; ++i) {
+    s->nl |= (unsigned long long)(p[i] == '\n') << i;
+    s->ws |= (unsigned long long)(p[i] == ' ' || p[i] == '\t') << i;
+  }
+#endif
+  }
+}
+
+/* position of the first byte at or after pos of the given kind, or len */
+static size_t
+mnext(struct mscan *s, size_t pos, int what)
+{
+  unsigned long long m;
+  while(pos < s->len) {
+    if ((pos & ~(size_t)63) != s->base)
+      mclassify(s, pos & ~(size_t)63);
+    m = what == MS_NL ? s->nl : what == MS_NB ? ~s->ws : s->ws | s->nl;
+    m &= ~0ull << (pos & 63);
+    if (m) {
+      pos = s->base + ctz64(m);
+      return pos < s->len ? pos : s->len;
+    }
+    pos = s->base + 64;
+  }
+  return s->len;
+}
+
+size_t
+maptok(const unsigned char *p, size_t len, int final,
+       maprec_fn *fn, void *arg)
+{
+  struct mscan s;
+  size_t pos = 0, k, ke, v, e;
+  s.p = p;
+  s.len = len;
+  s.base = (size_t)-1;
+  while(pos < len) {
+    k = mnext(&s, pos, MS_NB);
+    if (k == len || p[k] == '\n')  /* empty line */
+      e = k;
+    else if (k < len && p[k] == '#')
+      e = mnext(&s, k, MS_NL);
+    else {
+      ke = mnext(&s, k, MS_SEP);
+      v = ke < len && p[ke] != '\n' ? mnext(&s, ke, MS_NB) : ke;
+      e = v < len && p[v] != '\n' ? mnext(&s, v, MS_NL) : v;
+      if (e == len && !final)
+        break;
+      fn(arg, p + k, ke - k, p + v, e - v);
+    }
+    if (e == len && !final)
+      break;
+    pos = e + 1;
+  }
+  return pos < len ? pos : len;
+}
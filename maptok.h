@@ -0,0 +1,22 @@
+/* maptok.h: map format tokenizer, used by cdb and cdb-bench
+ *
+ * This file is a part of tinycdb package by Michael Tokarev, mjt@corpit.ru.
+ * Public domain.
+ */
+
+#include <stddef.h>
+
+typedef void maprec_fn(void *arg,
+                       const unsigned char *key, unsigned klen,
+                       const unsigned char *val, unsigned vlen);
+
+/* Split p[0..len) into map records, calling fn for each; returns the
+ * length of the complete lines processed.  If final is set, a last line
+ * without trailing newline is processed too.  Lines are "key value",
+ * split at the first run of blanks; blank lines and lines starting
+ * with # are skipped. */
+size_t maptok(const unsigned char *p, size_t len, int final,
+              maprec_fn *fn, void *arg);
+
+/* which variant is compiled in: avx2, sse2, swar or bytewise */
+extern const char maptok_impl[];
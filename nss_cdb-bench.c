@@ -0,0 +1,465 @@
+/* nss_cdb-bench.c: nss_cdb test and benchmark program
+ *
+ * The nss_cdb module is built into this program to read passwd.cdb and
+ * group.cdb in the current directory (or the one given with -d).  Given
+ * a query and keys, it looks them up and prints the entries found, for
+ * tests.  With -n, it makes databases of that many synthetic users
+ * itself, in the current layout (that of cdb --nss) and in the old one,
+ * where an ":id" record has just the name, to be looked up again, and
+ * group.cdb has no ":@user" index, so initgroups scans all groups, and
+ * measures lookups with both.  Results are printed as by cdb-bench,
+ *   name<TAB>value<TAB>unit
+ * after a few comment lines (starting with #) describing the run.
+ *
+ * This file is a part of tinycdb package by Michael Tokarev, mjt@corpit.ru.
+ * Public domain.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <nss.h>
+#include <pwd.h>
+#include <grp.h>
+#include "cdb.h"
+
+enum nss_status
+_nss_cdb_getpwnam_r(const char *name, struct passwd *result,
+                    char *buf, size_t bufl, int *errnop);
+enum nss_status
+_nss_cdb_getpwuid_r(uid_t uid, struct passwd *result,
+                    char *buf, size_t bufl, int *errnop);
+enum nss_status
+_nss_cdb_getgrnam_r(const char *name, struct group *result,
+                    char *buf, size_t bufl, int *errnop);
+enum nss_status
+_nss_cdb_getgrgid_r(gid_t gid, struct group *result,
+                    char *buf, size_t bufl, int *errnop);
+enum nss_status
+_nss_cdb_initgroups_dyn(const char *user, gid_t group, long int *start,
+                        long int *size, gid_t **groupsp, long int limit,
+                        int *errnop);
+
+static const char *progname = "nss_cdb-bench";
+static unsigned long long seed = 1;
+static unsigned nusers, ngroups = 0, nmembers = 5, nq = 1000000, ni = 100;
+static const char *dir;
+
+static void
+#ifdef __GNUC__
+__attribute__((noreturn,format(printf,2,3)))
+#endif
+error(int errnum, const char *fmt, ...)
+{
+  va_list ap;
+  fprintf(stderr, "%s: ", progname);
+  va_start(ap, fmt);
+  vfprintf(stderr, fmt, ap);
+  va_end(ap);
+  if (errnum)
+    fprintf(stderr, ": %s", strerror(errnum));
+  putc('\n', stderr);
+  exit(errnum ? 111 : 2);
+}
+
+static double
+now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void
+result(const char *name, double value, const char *unit)
+{
+  printf("%s\t%.*f\t%s\n", name, value < 100 ? 2 : 0, value, unit);
+  fflush(stdout);
+}
+
+/* splitmix64 */
+static unsigned long long
+rnd(unsigned long long *s)
+{
+  unsigned long long z = (*s += 0x9e3779b97f4a7c15ULL);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+static unsigned long
+getnum(const char *arg, const char *what, unsigned long min, unsigned long max)
+{
+  char *ep;
+  unsigned long v = strtoul(arg, &ep, 0);
+  if (*ep || v < min || v > max)
+    error(0, "invalid %s `%s'", what, arg);
+  return v;
+}
+
+static char buf[65536];
+
+static void
+printpw(const struct passwd *p)
+{
+  printf("%s:%s:%u:%u:%s:%s:%s\n", p->pw_name, p->pw_passwd,
+         (unsigned)p->pw_uid, (unsigned)p->pw_gid,
+         p->pw_gecos, p->pw_dir, p->pw_shell);
+}
+
+static void
+printgr(const struct group *g)
+{
+  char **m;
+  printf("%s:%s:%u:", g->gr_name, g->gr_passwd, (unsigned)g->gr_gid);
+  for (m = g->gr_mem; *m; ++m)
+    printf(m == g->gr_mem ? "%s" : ",%s", *m);
+  putchar('\n');
+}
+
+/* supplementary groups of user "user" or "user:gid", the latter with
+ * primary group gid, which is left out */
+static enum nss_status
+usergroups(const char *key, gid_t **groupsp, long int *np, int *errp)
+{
+  const char *c = strchr(key, ':');
+  long int size = 0;
+  char user[256];
+  gid_t g = (gid_t)-1;
+
+  if (c && (size_t)(c - key) < sizeof(user)) {
+    memcpy(user, key, c - key);
+    user[c - key] = '\0';
+    g = getnum(c + 1, "gid", 0, 0xffffffff);
+    key = user;
+  }
+  *np = 0;
+  return _nss_cdb_initgroups_dyn(key, g, np, &size, groupsp, 0, errp);
+}
+
+/* look key up with query q, print the entry */
+static void
+lookup(const char *q, const char *key)
+{
+  struct passwd pw;
+  struct group gr;
+  enum nss_status r;
+  gid_t *groups = NULL;
+  long int n, i;
+  int err = 0;
+
+  if (strcmp(q, "initgroups") == 0) {
+    if ((r = usergroups(key, &groups, &n, &err)) != NSS_STATUS_SUCCESS)
+      error(err, "%s %s", q, key);
+    printf("%s %s:", q, key);
+    for (i = 0; i < n; ++i)
+      printf(" %u", (unsigned)groups[i]);
+    putchar('\n');
+    free(groups);
+    return;
+  }
+  if (strcmp(q, "pwnam") == 0)
+    r = _nss_cdb_getpwnam_r(key, &pw, buf, sizeof(buf), &err);
+  else if (strcmp(q, "pwuid") == 0)
+    r = _nss_cdb_getpwuid_r(getnum(key, "uid", 0, 0xffffffff),
+                            &pw, buf, sizeof(buf), &err);
+  else if (strcmp(q, "grnam") == 0)
+    r = _nss_cdb_getgrnam_r(key, &gr, buf, sizeof(buf), &err);
+  else if (strcmp(q, "grgid") == 0)
+    r = _nss_cdb_getgrgid_r(getnum(key, "gid", 0, 0xffffffff),
+                            &gr, buf, sizeof(buf), &err);
+  else
+    error(0, "unknown query `%s'", q);
+  if (r == NSS_STATUS_NOTFOUND)
+    printf("%s %s: not found\n", q, key);
+  else if (r != NSS_STATUS_SUCCESS)
+    error(err, "%s %s", q, key);
+  else if (q[0] == 'p')
+    printpw(&pw);
+  else
+    printgr(&gr);
+}
+
+/* The synthetic databases: user u is "u<u>" with uid u, in group
+ * u % ngroups, and every group "g<g>" has nmembers random users. */
+
+#define MAXMEMBERS 64
+static unsigned *members;   /* nmembers per group */
+
+static void
+gendata(void)
+{
+  unsigned long long s = seed;
+  unsigned i;
+  members = (unsigned*)malloc((size_t)ngroups * nmembers * sizeof(*members));
+  if (!members)
+    error(ENOMEM, "unable to allocate memory");
+  for (i = 0; i < ngroups * nmembers; ++i)
+    members[i] = rnd(&s) % nusers;
+}
+
+static void
+add(struct cdb_make *cdbmp, const char *key, unsigned klen,
+    const char *val, unsigned vlen)
+{
+  if (cdb_make_add(cdbmp, key, klen, val, vlen) != 0)
+    error(errno, "cdb_make_add");
+}
+
+/* Write passwd.cdb and group.cdb in the current directory, in the
+ * layout of cdb --nss, or in the old one, where ":id" records have just
+ * the name and there is no ":@user" index.  Returns the size of
+ * passwd.cdb. */
+static unsigned
+mkdbs(int old)
+{
+  struct cdb_make cdbm;
+  char key[32], ent[64 + MAXMEMBERS * 12], *idx = NULL;
+  unsigned u, g, j, nlen, len;
+  struct stat st;
+  int fd;
+
+  if ((fd = open("passwd.cdb", O_RDWR|O_CREAT|O_TRUNC, 0644)) < 0)
+    error(errno, "unable to create passwd.cdb");
+  cdb_make_start(&cdbm, fd);
+  for (u = 0; u < nusers; ++u) {
+    len = sprintf(ent, "u%u:x:%u:%u:User %u:/home/u%u:/bin/sh",
+                  u, u, u % ngroups, u, u);
+    nlen = strchr(ent, ':') - ent;
+    add(&cdbm, ent, nlen, ent, len);
+    add(&cdbm, key, sprintf(key, ":%u", u), ent, old ? nlen : len);
+  }
+  if (cdb_make_finish(&cdbm) != 0 || fstat(fd, &st) != 0 || close(fd) != 0)
+    error(errno, "unable to write passwd.cdb");
+
+  if ((fd = open("group.cdb", O_RDWR|O_CREAT|O_TRUNC, 0644)) < 0)
+    error(errno, "unable to create group.cdb");
+  cdb_make_start(&cdbm, fd);
+  for (g = 0; g < ngroups; ++g) {
+    len = sprintf(ent, "g%u:x:%u:", g, g);
+    for (j = 0; j < nmembers; ++j)
+      len += sprintf(ent + len, j ? ",u%u" : "u%u", members[g * nmembers + j]);
+    nlen = strchr(ent, ':') - ent;
+    add(&cdbm, ent, nlen, ent, len);
+    add(&cdbm, key, sprintf(key, ":%u", g), ent, old ? nlen : len);
+  }
+  if (!old) {
+    /* ":@user" records with gids of the groups of every user, in
+     * ascending order: memberships are bucketed by user, filling the
+     * buckets from the end, after which first[u] is where u's begin */
+    unsigned m = ngroups * nmembers, *ug, *first, i, k;
+    add(&cdbm, ":@", 2, "", 0);
+    first = (unsigned*)calloc(nusers, sizeof(*first));
+    ug = (unsigned*)malloc((m ? m : 1) * sizeof(*ug));
+    if (!first || !ug)
+      error(ENOMEM, "unable to allocate memory");
+    for (i = 0; i < m; ++i)
+      ++first[members[i]];
+    for (u = 1; u < nusers; ++u)
+      first[u] += first[u - 1];
+    for (i = m; i-- > 0; )
+      ug[--first[members[i]]] = i / nmembers;
+    for (u = 0, i = 0; u < nusers; ++u, i = k) {
+      k = u + 1 < nusers ? first[u + 1] : m;
+      if (i == k)
+        continue;
+      if (!(idx = (char*)realloc(idx, (k - i) * 11)))
+        error(ENOMEM, "unable to allocate memory");
+      for (len = 0, j = i; j < k; ++j)
+        len += sprintf(idx + len, j > i ? ",%u" : "%u", ug[j]);
+      add(&cdbm, key, sprintf(key, ":@u%u", u), idx, len);
+    }
+    free(idx);
+    free(ug);
+    free(first);
+  }
+  if (cdb_make_finish(&cdbm) != 0 || close(fd) != 0)
+    error(errno, "unable to write group.cdb");
+  return st.st_size;
+}
+
+/* nq lookups of random ids with getpwuid_r() or getgrgid_r(), best of
+ * a few rounds, as the first one also maps the files */
+static void
+bench_byid(const char *name, int grp)
+{
+  unsigned long long s = seed;
+  unsigned *ids = (unsigned*)malloc(nq * sizeof(*ids));
+  unsigned i, round;
+  struct passwd pw;
+  struct group gr;
+  enum nss_status r;
+  double t, best = 0;
+  int err;
+
+  if (!ids)
+    error(ENOMEM, "unable to allocate memory");
+  for (i = 0; i < nq; ++i)
+    ids[i] = rnd(&s) % (grp ? ngroups : nusers);
+  for (round = 0; round < 3; ++round) {
+    t = now();
+    for (i = 0; i < nq; ++i) {
+      r = grp ?
+        _nss_cdb_getgrgid_r(ids[i], &gr, buf, sizeof(buf), &err) :
+        _nss_cdb_getpwuid_r(ids[i], &pw, buf, sizeof(buf), &err);
+      if (r != NSS_STATUS_SUCCESS)
+        error(err, "%s %u", name, ids[i]);
+    }
+    t = now() - t;
+    if (!round || t < best)
+      best = t;
+  }
+  result(name, best * 1e9 / nq, "ns");
+  free(ids);
+}
+
+/* ni initgroups of random users, best of a few rounds too */
+static void
+bench_initgroups(const char *name)
+{
+  unsigned long long s = seed;
+  unsigned i, round;
+  char user[16];
+  gid_t *groups = NULL;
+  long int n, size = 0;
+  double t, best = 0;
+  int err;
+
+  for (round = 0; round < 3; ++round) {
+    s = seed;
+    t = now();
+    for (i = 0; i < ni; ++i) {
+      sprintf(user, "u%u", (unsigned)(rnd(&s) % nusers));
+      n = 0;
+      if (_nss_cdb_initgroups_dyn(user, (gid_t)-1, &n, &size, &groups, 0,
+                                  &err) != NSS_STATUS_SUCCESS)
+        error(err, "%s %s", name, user);
+    }
+    t = now() - t;
+    if (!round || t < best)
+      best = t;
+  }
+  result(name, best * 1e6 / ni, "us");
+  free(groups);
+}
+
+/* make the databases in subdirectory layout of dir, and measure
+ * lookups in a child process, which maps them afresh */
+static void
+bench(const char *layout)
+{
+  char name[64];
+  int status;
+  pid_t pid;
+
+  sprintf(name, "%s/%s", dir, layout);
+  if (mkdir(name, 0755) != 0 && errno != EEXIST)
+    error(errno, "unable to create %s", name);
+  if ((pid = fork()) < 0)
+    error(errno, "fork");
+  if (!pid) {
+    if (chdir(name) != 0)
+      error(errno, "%s", name);
+    sprintf(name, "passwd.%s.size", layout);
+    result(name, mkdbs(strcmp(layout, "old") == 0) / 1048576., "MB");
+    sprintf(name, "pwuid.%s", layout);
+    bench_byid(name, 0);
+    sprintf(name, "grgid.%s", layout);
+    bench_byid(name, 1);
+    sprintf(name, "initgroups.%s", layout);
+    bench_initgroups(name);
+    exit(0);
+  }
+  if (waitpid(pid, &status, 0) != pid || status != 0)
+    exit(111);
+}
+
+static void
+rmdbs(const char *layout)
+{
+  char name[256];
+  snprintf(name, sizeof(name), "%s/%s/passwd.cdb", dir, layout);
+  unlink(name);
+  snprintf(name, sizeof(name), "%s/%s/group.cdb", dir, layout);
+  unlink(name);
+  snprintf(name, sizeof(name), "%s/%s", dir, layout);
+  rmdir(name);
+}
+
+int main(int argc, char **argv)
+{
+  int keep = 0;
+  int opt;
+
+  while((opt = getopt(argc, argv, "d:n:g:m:q:i:s:Kh")) != EOF)
+    switch(opt) {
+    case 'd': dir = optarg; break;
+    case 'n': nusers = getnum(optarg, "number of users", 1, 0x7fffffff); break;
+    case 'g': ngroups = getnum(optarg, "number of groups", 1, 0x7fffffff); break;
+    case 'm': nmembers = getnum(optarg, "number of members", 0, MAXMEMBERS); break;
+    case 'q': nq = getnum(optarg, "number of queries", 1, 0x7fffffff); break;
+    case 'i': ni = getnum(optarg, "number of queries", 1, 0x7fffffff); break;
+    case 's': seed = getnum(optarg, "seed", 0, 0xffffffff); break;
+    case 'K': keep = 1; break;
+    case 'h':
+      printf("\
+%s: nss_cdb test and benchmark program version %g.  Usage is:\n\
+ %s [-d dir] query key...\n\
+ %s -n users [-g groups] [-m members] [-q queries] [-i queries]\n\
+   [-s seed] [-d dir] [-K]\n\
+ where query is pwnam, pwuid, grnam, grgid or initgroups (of user\n\
+ or user:gid, with primary group gid)\n\
+ (-d: directory of passwd.cdb and group.cdb, default . for queries\n\
+   and nss_cdb-bench.d for -n, -n: make databases of that many users,\n\
+   in the current and the old layout, and measure lookups with both,\n\
+  -g: number of groups, default users/4, -m: members of a group,\n\
+  -q: lookups by id, -i: initgroups,\n\
+  -K: keep the databases)\n",
+             progname, TINYCDB_VERSION, progname, progname);
+      return 0;
+    default:
+      fprintf(stderr, "%s: try `%s -h' for help\n", progname, progname);
+      return 2;
+    }
+  argv += optind;
+
+  if (!nusers) {
+    if (!argv[0] || !argv[1])
+      error(0, "query and keys expected");
+    if (dir && chdir(dir) != 0)
+      error(errno, "%s", dir);
+    for (opt = 1; argv[opt]; ++opt)
+      lookup(argv[0], argv[opt]);
+    return 0;
+  }
+
+  if (!dir)
+    dir = "nss_cdb-bench.d";
+  if (!ngroups)
+    ngroups = nusers / 4 ? nusers / 4 : 1;
+  if (mkdir(dir, 0755) != 0 && errno != EEXIST)
+    error(errno, "unable to create %s", dir);
+  printf("# nss_cdb-bench version %g\n", TINYCDB_VERSION);
+  printf("# options -n %u -g %u -m %u -q %u -i %u -s %llu\n",
+         nusers, ngroups, nmembers, nq, ni, seed);
+  printf("# new: id records have the whole entry, and there is\n"
+         "# a :@user index, old: just the name, and no index\n");
+  fflush(stdout);
+  gendata();
+  bench("new");
+  bench("old");
+  if (!keep) {
+    rmdbs("new");
+    rmdbs("old");
+    rmdir(dir);
+  }
+  return 0;
+}
@@ -8,11 +8,158 @@
 #include <grp.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 
 nss_common(group, struct group, grent);
 nss_getbyname(getgrnam, struct group);
 nss_getbyid(getgrgid, struct group, gid_t);
 
+/* Supplementary groups of every user are listed in records keyed by
+ * ":@user", as comma-separated gids.  An empty ":@" record tells this
+ * index is there; in files without it, all groups are scanned. */
+
+struct initgroups {
+  const char *user;
+  unsigned ulen;
+  gid_t group;          /* primary group, not to be added */
+  long int *start, *size, limit;
+  gid_t **groupsp;
+};
+
+/* add g to the list, return 0 if it is full, -1 on error */
+static int
+addgroup(struct initgroups *ig, gid_t g) {
+  gid_t *groups = *ig->groupsp;
+  long int i, newsize;
+  if (g == ig->group)
+    return 1;
+  for (i = 0; i < *ig->start; ++i)
+    if (groups[i] == g)
+      return 1;
+  if (*ig->start == *ig->size) {
+    if (ig->limit > 0 && *ig->size >= ig->limit)
+      return 0;
+    newsize = *ig->size ? 2 * *ig->size : 16;
+    if (ig->limit > 0 && newsize > ig->limit)
+      newsize = ig->limit;
+    if (!(groups = (gid_t*)realloc(groups, newsize * sizeof(*groups))))
+      return -1;
+    *ig->groupsp = groups;
+    *ig->size = newsize;
+  }
+  groups[(*ig->start)++] = g;
+  return 1;
+}
+
+/* gid from the comma-separated list in [p,e), advancing p */
+static int
+nextgid(const char **pp, const char *e, gid_t *gp) {
+  const char *p = *pp;
+  unsigned long g = 0;
+  while(p < e && *p == ',') ++p;
+  if (p >= e || *p < '0' || *p > '9')
+    return 0;
+  while(p < e && *p >= '0' && *p <= '9')
+    g = g * 10 + (*p++ - '0');
+  *pp = p;
+  *gp = (gid_t)g;
+  return 1;
+}
+
+/* is the user in the member list [p,e) */
+static int
+ismember(const struct initgroups *ig, const char *p, const char *e) {
+  const char *m;
+  while(p < e) {
+    for (m = p; p < e && *p != ','; ++p)
+      ;
+    if ((unsigned)(p - m) == ig->ulen && memcmp(m, ig->user, ig->ulen) == 0)
+      return 1;
+    ++p;
+  }
+  return 0;
+}
+
+/* old files: look at every group entry */
+static enum nss_status
+scangroups(struct cdb *cdbp, struct initgroups *ig, int *errnop) {
+  unsigned cpos, len, n;
+  const char *p, *e, *gid;
+  gid_t g;
+  int r;
+
+  cdb_seqinit(&cpos, cdbp);
+  while((r = cdb_seqnext(&cpos, cdbp)) > 0) {
+    if (cdb_keylen(cdbp) < 1 || *(const char*)cdb_getkey(cdbp) == ':')
+      continue;
+    len = cdb_datalen(cdbp);
+    if (!(p = (const char*)cdb_getdata(cdbp)))
+      return *errnop = errno, NSS_STATUS_UNAVAIL;
+    e = p + len;
+    /* name:passwd:gid:members */
+    for (n = 0, gid = NULL; p < e && n < 3; ++p)
+      if (*p == ':' && ++n == 2)
+        gid = p + 1;
+    if (n < 3 || !ismember(ig, p, e) || !nextgid(&gid, p, &g))
+      continue;
+    if ((r = addgroup(ig, g)) < 0)
+      return *errnop = ENOMEM, NSS_STATUS_TRYAGAIN;
+    if (!r)
+      return NSS_STATUS_SUCCESS;
+  }
+  if (r < 0)
+    return *errnop = errno, NSS_STATUS_UNAVAIL;
+  return NSS_STATUS_SUCCESS;
+}
+
+static enum nss_status
+doinitgroups(struct cdb *cdbp, void *arg, int *errnop) {
+  struct initgroups *ig = (struct initgroups*)arg;
+  char key[256];
+  const char *p, *e;
+  gid_t g;
+  int r;
+
+  if (ig->ulen + 2 > sizeof(key))
+    return *errnop = ENOENT, NSS_STATUS_NOTFOUND;
+  key[0] = ':'; key[1] = '@';
+  memcpy(key + 2, ig->user, ig->ulen);
+  if ((r = cdb_find(cdbp, key, ig->ulen + 2)) < 0)
+    return *errnop = errno, NSS_STATUS_UNAVAIL;
+  if (!r) {
+    if ((r = cdb_find(cdbp, key, 2)) < 0)
+      return *errnop = errno, NSS_STATUS_UNAVAIL;
+    if (!r)
+      return scangroups(cdbp, ig, errnop);
+    return NSS_STATUS_SUCCESS;  /* no supplementary groups */
+  }
+  if (!(p = (const char*)cdb_getdata(cdbp)))
+    return *errnop = errno, NSS_STATUS_UNAVAIL;
+  e = p + cdb_datalen(cdbp);
+  while(nextgid(&p, e, &g))
+    if ((r = addgroup(ig, g)) <= 0) {
+      if (r < 0)
+        return *errnop = ENOMEM, NSS_STATUS_TRYAGAIN;
+      break;
+    }
+  return NSS_STATUS_SUCCESS;
+}
+
+enum nss_status
+_nss_cdb_initgroups_dyn(const char *user, gid_t group, long int *start,
+                        long int *size, gid_t **groupsp, long int limit,
+                        int *errnop) {
+  struct initgroups ig;
+  ig.user = user;
+  ig.ulen = strlen(user);
+  ig.group = group;
+  ig.start = start;
+  ig.size = size;
+  ig.limit = limit;
+  ig.groupsp = groupsp;
+  return __nss_cdb_withmap(&db, doinitgroups, &ig, errnop);
+}
+
 static char *getmember(char **bp) {
   char *b, *m;
   b = *bp;
@@ -41,7 +188,7 @@ nss_group_parse(struct group *result, char *buf, size_t bufl) {
   int n;
 
   bufend = buf + strlen(buf) + 1;
-  n = (unsigned)bufend % sizeof(char*);
+  n = (size_t)bufend % sizeof(char*);
   if (n)
     bufend += sizeof(char*) - n;
   result->gr_mem = mem = (char**)bufend;
@@ -6,11 +6,14 @@
 
 #include "nss_cdb.h"
 #include "cdb_int.h"  /* for internal_function */
+#include <sys/stat.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <stdio.h>
+#include <time.h>
+#include <sched.h>
 
 #if __GLIBC__ /* XXX this is in fact not a right condition */
 /* XXX on glibc, this stuff works due to linker/libpthreads stubs/tricks.
@@ -27,7 +30,7 @@
 
 #else /* !__GNU_LIBRARY__ */
 
-# define lock_define_initialized(class,name)
+# define lock_define(class,name)
 # define lock_lock(name)
 # define lock_unlock(name)
 
@@ -35,6 +38,10 @@
 
 lock_define(static, lock)
 
+#define aload(p) __atomic_load_n(p, __ATOMIC_SEQ_CST)
+#define astore(p,v) __atomic_store_n(p, v, __ATOMIC_SEQ_CST)
+#define aadd(p,v) __atomic_add_fetch(p, v, __ATOMIC_SEQ_CST)
+
 /* General principle: we skip invalid/unparseable entries completely,
  * as if there was no such entry at all (returning NOTFOUND).
  * In case of data read error (e.g. invalid .cdb structure), we
@@ -66,6 +73,110 @@ __nss_cdb_doendent(struct nss_cdb *dbp) {
   dbp->keepopen = 0;
 }
 
+/* Lookups by name and by id use a mapping of the file which stays
+ * between calls, shared by all threads.  A lookup takes no lock: it
+ * registers as a reader in the current epoch, and uses a private copy
+ * of the handle.  When the file is replaced, the new mapping is
+ * published, the epoch is advanced, and the old mapping is unmapped
+ * as soon as all readers of the previous epoch are gone.  The file is
+ * checked for changes at most once a second. */
+
+struct nss_cdb_map {
+  struct cdb cdb;
+  dev_t dev;
+  ino_t ino;
+  off_t size;
+  time_t mtime;
+};
+
+#define samefile(m,st) \
+  ((m)->dev == (st).st_dev && (m)->ino == (st).st_ino && \
+   (m)->size == (st).st_size && (m)->mtime == (st).st_mtime)
+
+static struct nss_cdb_map *
+__nss_cdb_mapopen(const char *dbname) {
+  struct nss_cdb_map *m;
+  struct stat st;
+  int fd = open(dbname, O_RDONLY);
+  if (fd < 0)
+    return NULL;
+  if (fstat(fd, &st) != 0 || !(m = (struct nss_cdb_map*)malloc(sizeof(*m)))) {
+    close(fd);
+    return NULL;
+  }
+  if (cdb_init(&m->cdb, fd) != 0) {
+    free(m);
+    close(fd);
+    return NULL;
+  }
+  close(fd);
+  m->dev = st.st_dev;
+  m->ino = st.st_ino;
+  m->size = st.st_size;
+  m->mtime = st.st_mtime;
+  return m;
+}
+
+/* replace the shared mapping, with the lock held */
+static void
+__nss_cdb_mappublish(struct nss_cdb *dbp, struct nss_cdb_map *m) {
+  struct nss_cdb_map *old = dbp->map;
+  unsigned e = dbp->epoch;
+  astore(&dbp->map, m);
+  astore(&dbp->epoch, e + 1);
+  /* readers of the previous epoch may still use the old mapping */
+  while(aload(&dbp->readers[e & 1]))
+    sched_yield();
+  if (old) {
+    cdb_free(&old->cdb);
+    free(old);
+  }
+}
+
+static void
+__nss_cdb_mapcheck(struct nss_cdb *dbp) {
+  time_t now = time(NULL), last = aload(&dbp->checked);
+  struct nss_cdb_map *m;
+  struct stat st;
+  int r;
+
+  if (aload(&dbp->map) &&
+      (now == last || !__atomic_compare_exchange_n(&dbp->checked, &last, now,
+                          0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)))
+    return;  /* checked recently, or being checked by another thread */
+  r = stat(dbp->dbname, &st);
+  m = aload(&dbp->map);
+  if (r == 0 ? m && samefile(m, st) : !m)
+    return;
+  lock_lock(lock);
+  m = dbp->map;  /* another thread might have done it already */
+  if (r != 0)
+    m = NULL;
+  else if (!m || !samefile(m, st))
+    m = __nss_cdb_mapopen(dbp->dbname);
+  if (m != dbp->map)
+    __nss_cdb_mappublish(dbp, m);
+  astore(&dbp->checked, now);
+  lock_unlock(lock);
+}
+
+static struct nss_cdb_map *
+__nss_cdb_mapenter(struct nss_cdb *dbp, unsigned *ep) {
+  unsigned e;
+  __nss_cdb_mapcheck(dbp);
+  for(;;) {
+    e = aload(&dbp->epoch);
+    aadd(&dbp->readers[e & 1], 1);
+    if (aload(&dbp->epoch) == e)
+      break;
+    aadd(&dbp->readers[e & 1], -1);  /* raced with a reload, retry */
+  }
+  *ep = e;
+  return aload(&dbp->map);
+}
+
+#define __nss_cdb_mapleave(dbp,e) aadd(&(dbp)->readers[(e) & 1], -1)
+
 enum nss_status internal_function
 __nss_cdb_setent(struct nss_cdb *dbp, int stayopen) {
   enum nss_status r;
@@ -87,19 +198,16 @@ __nss_cdb_endent(struct nss_cdb *dbp) {
   return NSS_STATUS_SUCCESS;
 }
 
+/* parse the value of the record just found */
 static enum nss_status
-__nss_cdb_dobyname(struct nss_cdb *dbp, const char *key, unsigned len,
+__nss_cdb_dorecord(struct nss_cdb *dbp, struct cdb *cdbp,
                    void *result, char *buf, size_t bufl, int *errnop) {
+  unsigned len = cdb_datalen(cdbp);
   int r;
 
-  if ((r = cdb_find(&dbp->cdb, key, len)) < 0)
-    return *errnop = errno, NSS_STATUS_UNAVAIL;
-  len = cdb_datalen(&dbp->cdb);
-  if (!r || len < 2)
-    return *errnop = ENOENT, NSS_STATUS_NOTFOUND;
   if (len >= bufl)
     return *errnop = ERANGE, NSS_STATUS_TRYAGAIN;
-  if (cdb_read(&dbp->cdb, buf, len, cdb_datapos(&dbp->cdb)) != 0)
+  if (cdb_read(cdbp, buf, len, cdb_datapos(cdbp)) != 0)
     return *errnop = errno, NSS_STATUS_UNAVAIL;
   buf[len] = '\0';
   if ((r = dbp->parsefn(result, buf, bufl)) < 0)
@@ -110,57 +218,95 @@ __nss_cdb_dobyname(struct nss_cdb *dbp, const char *key, unsigned len,
   return NSS_STATUS_SUCCESS;
 }
 
+static enum nss_status
+__nss_cdb_dobyname(struct nss_cdb *dbp, struct cdb *cdbp,
+                   const char *key, unsigned len,
+                   void *result, char *buf, size_t bufl, int *errnop) {
+  int r;
+
+  if ((r = cdb_find(cdbp, key, len)) < 0)
+    return *errnop = errno, NSS_STATUS_UNAVAIL;
+  if (!r || cdb_datalen(cdbp) < 2)
+    return *errnop = ENOENT, NSS_STATUS_NOTFOUND;
+  return __nss_cdb_dorecord(dbp, cdbp, result, buf, bufl, errnop);
+}
+
 enum nss_status internal_function
 __nss_cdb_byname(struct nss_cdb *dbp, const char *name,
                  void *result, char *buf, size_t bufl, int *errnop) {
   enum nss_status r;
+  struct nss_cdb_map *m;
+  struct cdb c;
+  unsigned e;
   if (*name == ':')
     return *errnop = ENOENT, NSS_STATUS_NOTFOUND;
-  lock_lock(lock);
-  if (!isopen(dbp) && !__nss_cdb_dosetent(dbp))
-    *errnop = errno, r = NSS_STATUS_UNAVAIL;
+  if (!(m = __nss_cdb_mapenter(dbp, &e)))
+    *errnop = ENOENT, r = NSS_STATUS_UNAVAIL;
   else {
-    r = __nss_cdb_dobyname(dbp, name, strlen(name), result, buf, bufl, errnop);
-    if (!dbp->keepopen)
-      __nss_cdb_doendent(dbp);
+    c = m->cdb;
+    r = __nss_cdb_dobyname(dbp, &c, name, strlen(name),
+                           result, buf, bufl, errnop);
   }
-  lock_unlock(lock);
+  __nss_cdb_mapleave(dbp, e);
   return r;
 }
 
 static enum nss_status
-__nss_cdb_dobyid(struct nss_cdb *dbp, unsigned long id,
+__nss_cdb_dobyid(struct nss_cdb *dbp, struct cdb *cdbp, unsigned long id,
                  void *result, char *buf, size_t bufl, int *errnop) {
   int r;
   unsigned len;
   const char *data;
 
-  if ((r = cdb_find(&dbp->cdb, buf, sprintf(buf, ":%lu", id))) < 0)
+  if ((r = cdb_find(cdbp, buf, sprintf(buf, ":%lu", id))) < 0)
     return *errnop = errno, NSS_STATUS_UNAVAIL;
-  len = cdb_datalen(&dbp->cdb);
+  len = cdb_datalen(cdbp);
   if (!r || len < 2)
     return *errnop = ENOENT, NSS_STATUS_NOTFOUND;
-  if (!(data = (const char*)cdb_get(&dbp->cdb, len, cdb_datapos(&dbp->cdb))))
+  if (!(data = (const char*)cdb_get(cdbp, len, cdb_datapos(cdbp))))
     return *errnop = errno, NSS_STATUS_UNAVAIL;
 
-  return __nss_cdb_dobyname(dbp, data, len, result, buf, bufl, errnop);
+  /* The value of an id record is the whole entry, or, in files made by
+   * older versions, just the name, to be looked up again.  Names can
+   * not have colons in them, and entries always do. */
+  if (memchr(data, ':', len))
+    return __nss_cdb_dorecord(dbp, cdbp, result, buf, bufl, errnop);
+  return __nss_cdb_dobyname(dbp, cdbp, data, len, result, buf, bufl, errnop);
 }
 
 enum nss_status internal_function
 __nss_cdb_byid(struct nss_cdb *dbp, unsigned long id,
                void *result, char *buf, size_t bufl, int *errnop) {
   enum nss_status r;
+  struct nss_cdb_map *m;
+  struct cdb c;
+  unsigned e;
   if (bufl < 30)
     return *errnop = ERANGE, NSS_STATUS_TRYAGAIN;
-  lock_lock(lock);
-  if (!isopen(dbp) && !__nss_cdb_dosetent(dbp))
-    *errnop = errno, r = NSS_STATUS_UNAVAIL;
+  if (!(m = __nss_cdb_mapenter(dbp, &e)))
+    *errnop = ENOENT, r = NSS_STATUS_UNAVAIL;
   else {
-    r = __nss_cdb_dobyid(dbp, id, result, buf, bufl, errnop);
-    if (!dbp->keepopen)
-      __nss_cdb_doendent(dbp);
+    c = m->cdb;
+    r = __nss_cdb_dobyid(dbp, &c, id, result, buf, bufl, errnop);
   }
-  lock_unlock(lock);
+  __nss_cdb_mapleave(dbp, e);
+  return r;
+}
+
+enum nss_status internal_function
+__nss_cdb_withmap(struct nss_cdb *dbp, nss_map_fn *fn, void *arg,
+                  int *errnop) {
+  enum nss_status r;
+  struct nss_cdb_map *m;
+  struct cdb c;
+  unsigned e;
+  if (!(m = __nss_cdb_mapenter(dbp, &e)))
+    *errnop = ENOENT, r = NSS_STATUS_UNAVAIL;
+  else {
+    c = m->cdb;
+    r = fn(&c, arg, errnop);
+  }
+  __nss_cdb_mapleave(dbp, e);
   return r;
 }
 
@@ -18,13 +18,21 @@
 #endif
 
 typedef int (nss_parse_fn)(void *result, char *buf, size_t bufl);
+typedef enum nss_status (nss_map_fn)(struct cdb *cdbp, void *arg, int *errnop);
+
+struct nss_cdb_map;
 
 struct nss_cdb {
   nss_parse_fn *parsefn;
   const char *dbname;
   int keepopen;
   unsigned lastpos;
-  struct cdb cdb;
+  struct cdb cdb;     /* for get*ent() enumeration, under the lock */
+  /* shared by lookups by name and by id, which take no lock */
+  struct nss_cdb_map *map;
+  time_t checked;     /* when the file was last checked for changes */
+  unsigned epoch;
+  unsigned readers[2];  /* lookups running, per epoch parity */
 };
 
 enum nss_status
@@ -40,6 +48,10 @@ __nss_cdb_byname(struct nss_cdb *dbp, const char *name,
 enum nss_status
 __nss_cdb_byid(struct nss_cdb *dbp, unsigned long id,
          void *result, char *buf, size_t bufl, int *errnop);
+/* call fn with a private handle of the shared lookup mapping */
+enum nss_status
+__nss_cdb_withmap(struct nss_cdb *dbp, nss_map_fn *fn, void *arg,
+         int *errnop);
 
 #define nss_common(dbname,structname,entname) \
 static int \
@@ -1,8 +1,10 @@
 #! /bin/sh
 
 # tests.sh: This script will run tests for cdb.
-# Execute with ./tests.sh ./cdb
-# (first arg if present gives path to cdb tool to use, default is `cdb').
+# Execute with ./tests.sh ./cdb ./cdb-bench ./nss_cdb-bench
+# (first arg if present gives path to cdb tool to use, default is `cdb',
+# second gives path to cdb-bench, default is `cdb-bench', third gives
+# path to nss_cdb-bench, default is `nss_cdb-bench').
 #
 # This file is a part of tinycdb package by Michael Tokarev, mjt@corpit.ru.
 # Public domain.
@@ -11,13 +13,15 @@ case "$1" in
   "") cdb=cdb ;;
   *) cdb="$1" ;;
 esac
+bench="${2:-cdb-bench}"
+nss="${3:-nss_cdb-bench}"
 
 do_csum() {
   echo checksum may fail if no md5sum program
   md5sum $1 | sed -e 's|[ 	].*||' -e 'y|[ABCDEF]|[abcdef]|'
 }
 
-rm -f 1.cdb 1a.cdb
+rm -f 1.cdb 1a.cdb 2.cdb s.cdb s.cdb.[012]
 
 echo Create simple db
 echo "+3,4:one->here
@@ -36,6 +40,12 @@ echo $?
 echo Stats for simple db
 $cdb -s 1.cdb
 echo $?
+$cdb -s --json 1.cdb
+echo $?
+printf '+1,0:a->\n+2,3:bb->ccc\n\n' | $cdb -c 2.cdb
+$cdb -s --json 2.cdb | grep -e '"key"' -e '"value"'
+echo | $cdb -c 2.cdb
+$cdb -s --json 2.cdb | grep -e '"key"' -e '"value"' -e '"min"'
 
 echo "Query simple db (two records match)"
 $cdb -q 1.cdb one
@@ -46,6 +56,32 @@ echo Query for non-existed key
 $cdb -q 1.cdb none
 echo $?
 
+echo Query with sendfile
+$cdb -q -m --sendfile 1.cdb one
+echo $?
+$cdb -q -n 2 --sendfile 1.cdb one | cat
+echo "
+$?"
+$cdb -q --sendfile 1.cdb one > s.out
+echo $?
+cat s.out
+echo
+$cdb -q -b --sendfile 1.cdb 2>&1 | head -1
+awk 'BEGIN { v = "0123456789abcdef"; while (length(v) < 300000) v = v v;
+  printf "+1,%d:k->%s\n\n", length(v), v }' | $cdb -c 1a.cdb
+$cdb -q 1a.cdb k > s.out
+$cdb -q --sendfile 1a.cdb k | cmp - s.out && echo pipe ok
+$cdb -q --sendfile 1a.cdb k > s1.out; cmp s1.out s.out && echo file ok
+rm -f s.out s1.out 1a.cdb
+
+echo Batch query
+printf '3:one,4:none,\n1:b,+1:a\n' | $cdb -q -b 1.cdb
+echo $?
+printf 'a\nb\n' | $cdb -q -b -m --prefetch 1.cdb
+echo $?
+printf 'one\n' | $cdb -q -b -m -n 2 1.cdb -
+echo $?
+
 echo Doing 600 repeated records
 (
  for i in 0 1 2 3 4 5 ; do
@@ -90,6 +126,63 @@ echo "Handling invalid input format (short file)"
 echo "+10,10:" | $cdb -c 1.cdb
 echo $?
 
+echo Creating db with large values
+(
+ printf '+3,70000:big->'
+ dd if=/dev/zero bs=1000 count=70 2>/dev/null | tr '\000' a
+ printf '\n+1,1:a->b\n+5,200000:large->'
+ dd if=/dev/zero bs=1000 count=200 2>/dev/null | tr '\000' b
+ printf '\n\n'
+) > big.in
+cat big.in | $cdb -c 1.cdb
+echo $?
+$cdb -c 1a.cdb big.in
+echo $?
+cmp 1.cdb 1a.cdb && echo same
+$cdb -d 1a.cdb | cmp - big.in && echo same
+$cdb -c --stream - big.in | cat > 2.cdb
+cat big.in | $cdb -c --stream 1a.cdb
+cmp 1a.cdb 2.cdb && echo same
+$cdb -c --checksum 1a.cdb big.in
+cat big.in | $cdb -c --checksum 2.cdb
+cmp 1a.cdb 2.cdb && echo same
+$cdb -V 1a.cdb
+echo $?
+$cdb -c --shards 2 s.cdb big.in
+echo $?
+$cdb -c --fixkey 8 1a.cdb big.in 2>&1
+echo $?
+$cdb -q 1a.cdb big > big.out
+$cdb -q 1a.cdb large >> big.out
+($cdb -q s.cdb big; $cdb -q s.cdb large) | cmp - big.out && echo same
+rm -f big.in big.out
+$bench -n 300 -p 100 -q 1000 -v 0:70000 -t 2 -f 2.cdb -K > /dev/null
+echo $?
+$cdb -s 2.cdb | sed -n 1,3p
+
+echo Map format input
+printf '  # comment\n\none 1\n\t \ntwo\t2\nthree \t 3 3\t\n#four 4\nfive\n six  6\nseven 7' |
+ $cdb -c -m 1.cdb
+echo $?
+$cdb -d -m 1.cdb | sed -n l
+printf 'one 1\r\ntwo\r\n' | $cdb -c -m 1.cdb
+$cdb -d -m 1.cdb | sed -n l
+# lines ending around and crossing the 1Mb input block boundary
+for n in 1048570 1048571 1048572 1048573 1048574 1572864 ; do
+ (
+  printf 'a '
+  dd if=/dev/zero bs=$n count=1 2>/dev/null | tr '\000' v
+  printf '\nbb 2\ncc 3\n'
+ ) > map.in
+ $cdb -c -m 1.cdb map.in
+ $cdb -d -m 1.cdb | cmp - map.in && echo $n same
+done
+$cdb -c -m -j 2 1a.cdb map.in
+cmp 1.cdb 1a.cdb && echo same
+rm -f map.in
+$bench -m -n 1000 -q 10 > /dev/null
+echo $?
+
 echo Creating db with eol in key and value
 echo "+2,2:a
 ->b
@@ -103,6 +196,366 @@ $cdb -q 1.cdb "a
 "
 echo $?
 
+echo Creating db with duplicate keys replaced
+echo "+1,1:a->b
++3,4:one->here
++1,1:a->c
+
+" | $cdb -c -r 1.cdb
+echo $?
+$cdb -d 1.cdb
+
+echo Creating db in parallel
+echo "+1,1:a->b
++3,4:one->here
++1,1:a->c
+
+" | $cdb -c -r -j 2 2.cdb
+echo $?
+cmp 1.cdb 2.cdb && echo same
+echo "a b
+ # comment
+one  two three" | $cdb -c -m -j 2 2.cdb
+$cdb -d 2.cdb
+echo "+1,1:a->b" | $cdb -c -j 2 2.cdb
+echo $?
+
+echo Merging dbs
+echo "+3,3:one->bar
++3,3:two->baz
+
+" | $cdb -c 1a.cdb
+$cdb -M 2.cdb 1.cdb 1a.cdb
+echo $?
+$cdb -d 2.cdb
+$cdb -M -u 2.cdb 1.cdb 1a.cdb
+echo $?
+$cdb -d 2.cdb
+$cdb -M -r 2.cdb 1.cdb 1a.cdb
+echo $?
+$cdb -d 2.cdb
+$cdb -M -e 2.cdb 1.cdb 1a.cdb
+echo $?
+
+echo Creating sharded db
+echo "+3,4:one->here
++1,1:a->b
++1,3:b->abc
++1,1:a->c
+
+" | $cdb -c --shards 3 s.cdb
+echo $?
+cat s.cdb
+$cdb -q s.cdb a
+echo $?
+$cdb -q -n 2 s.cdb a
+echo $?
+$cdb -q s.cdb b
+echo $?
+$cdb -q s.cdb c
+echo $?
+
+echo Incremental update
+$cdb -M 2.cdb 1.cdb 1a.cdb
+echo "+3,3:two->new
+-3:one
++1,1:b->x
+-1:b
+
+" | $cdb -c -i 2.cdb 2.cdb
+echo $?
+$cdb -d 2.cdb
+echo "a z
+c y" | $cdb -c -m -i 2.cdb 2.cdb
+$cdb -d 2.cdb
+$cdb -c -r -i 2.cdb 2.cdb </dev/null 2>/dev/null
+echo $?
+
+echo Creating streamed db
+echo "+3,4:one->here
++1,1:a->b
++1,3:b->abc
++3,4:one->also
+
+" | $cdb -c --stream - | cat > 2.cdb
+echo $?
+$cdb -q -n 2 2.cdb one
+echo "
+$?"
+$cdb -d 2.cdb
+$cdb --convert 1a.cdb 2.cdb
+echo $?
+do_csum 1a.cdb
+$cdb --convert --stream - 1a.cdb | cmp - 2.cdb && echo same
+cat 2.cdb | $cdb --convert - - > 1a.cdb
+echo $?
+do_csum 1a.cdb
+
+echo Checksums
+echo "+3,4:one->here
++1,1:a->b
+
+" | $cdb -c --checksum 1.cdb
+echo $?
+do_csum 1.cdb
+$cdb -V -j 2 1.cdb
+echo $?
+$cdb --convert --stream 2.cdb 1.cdb
+$cdb -V 2.cdb
+echo $?
+cat 2.cdb | $cdb --convert - - > 1a.cdb
+cmp 1.cdb 1a.cdb && echo same
+printf x | dd of=1a.cdb bs=1 seek=2050 conv=notrunc 2>/dev/null
+$cdb -V 1a.cdb 2>&1
+echo $?
+$cdb -M 1a.cdb 1.cdb
+$cdb -V 1a.cdb 2>&1
+echo $?
+$cdb -d 1.cdb | $cdb -c --stream --checksum - | cat > 2.cdb
+echo $?
+$cdb -V 2.cdb
+echo $?
+$cdb -d 1.cdb | $cdb -c --checksum - > 2.cdb
+echo $?
+cmp 1.cdb 2.cdb && echo same
+$cdb -M --stream --checksum - 1.cdb 1.cdb | cat > 2.cdb
+$cdb -V 2.cdb
+echo $?
+
+echo NSS databases
+rm -rf nss.d; mkdir nss.d
+echo "root:x:0:0:root:/root:/bin/sh
+# comment
+bad:line
+joe:x:1000:100:Joe:/home/joe:/bin/sh" > nss.d/passwd
+echo "wheel:x:10:root,joe
+users:x:100:joe" > nss.d/group
+$cdb --nss nss.d
+echo $?
+$cdb -d nss.d/passwd.cdb
+$cdb -d nss.d/group.cdb
+$cdb --nss nss.d
+echo $?
+$cdb --nss nss.d/none 2>&1
+echo $?
+
+echo NSS lookups by id, whole entry and old name-only records
+$nss -d nss.d pwuid 0 1000 5
+$nss -d nss.d grgid 10 100 5
+awk -F: 'NF == 7 { print $1" "$0; print ":"$3" "$1 }' nss.d/passwd |
+ $cdb -c -m nss.d/passwd.cdb
+awk -F: 'NF == 4 { print $1" "$0; print ":"$3" "$1 }' nss.d/group |
+ $cdb -c -m nss.d/group.cdb
+$cdb -q nss.d/passwd.cdb :1000; echo
+$nss -d nss.d pwuid 0 1000 5
+$nss -d nss.d grgid 10 100 5
+$nss -d nss.d pwnam joe :1000
+
+echo NSS initgroups, with the :@user index, without it, and with no user entry
+echo "wheel:x:10:root,joe
+users:x:100:joe
+staff:x:50:ann,joe,root
+empty:x:60:" > nss.d/group
+rm -f nss.d/group.cdb
+$cdb --nss nss.d
+$cdb -q nss.d/group.cdb :@joe; echo
+$cdb -q nss.d/group.cdb :@; echo $?
+$nss -d nss.d initgroups joe joe:100 root ann nobody
+awk -F: 'NF == 4 { print $1" "$0; print ":"$3" "$1 }' nss.d/group |
+ $cdb -c -m nss.d/group.cdb
+$cdb -q nss.d/group.cdb :@; echo $?
+$nss -d nss.d initgroups joe joe:100 root ann nobody
+(awk -F: 'NF == 4 { print $1" "$0; print ":"$3" "$1 }' nss.d/group; echo :@) |
+ $cdb -c -m nss.d/group.cdb
+$nss -d nss.d initgroups joe
+
+echo Fixed-length keys
+echo "+4,3:k001->one
++4,3:k002->two
++4,5:k001->three
+
+" | $cdb -c --fixkey 4 1.cdb
+echo $?
+do_csum 1.cdb
+$cdb -q -n 2 1.cdb k001
+echo "
+$?"
+$cdb -q 1.cdb k01
+echo $?
+$cdb -d 1.cdb
+$cdb -s 1.cdb | head -2
+echo "k002 new" | $cdb -c -m -i 1.cdb 1a.cdb
+$cdb -d 1a.cdb
+$cdb -M -r 2.cdb 1.cdb
+$cdb -d 2.cdb
+echo "+3,1:k01->x" | $cdb -c --fixkey 4 1.cdb 2>&1
+echo $?
+
+echo Dense records
+echo "+4,3:k001->one
++4,3:k002->two
++4,3:k001->uno
++4,3:k003->six
+
+" | $cdb -c -r --compact --checksum 1.cdb
+echo $?
+$cdb -V 1.cdb
+echo $?
+$cdb -q 1.cdb k001
+echo "
+$?"
+$cdb -q 1.cdb k003
+echo "
+$?"
+$cdb -d 1.cdb
+$cdb -s 1.cdb | head -2
+echo "k002 new" | $cdb -c -m -i 1.cdb 1a.cdb
+$cdb -d 1a.cdb
+$cdb -s 1a.cdb | head -1
+echo "k002 newer" | $cdb -c -m -i 1.cdb 1a.cdb 2>&1
+echo $?
+$cdb -M --compact 2.cdb 1.cdb 1.cdb
+$cdb -s 2.cdb | head -2
+echo "+4,3:k001->one
++4,5:k002->three
+
+" | $cdb -c --compact 1.cdb
+$cdb -s 1.cdb | head -1
+echo "+3,3:k01->one
+
+" | $cdb -c --compact 1.cdb
+$cdb -s 1.cdb | head -1
+
+echo Hash functions
+echo "+3,3:one->uno
++3,3:two->dos
++5,4:three->tres
++3,4:one->eins
+
+" | $cdb -c --hash siphash:000102030405060708090a0b0c0d0e0f 1.cdb
+echo $?
+do_csum 1.cdb
+$cdb -q -n 2 1.cdb one
+echo "
+$?"
+$cdb -q 1.cdb four
+echo $?
+$cdb -s 1.cdb | head -2
+$cdb -s --json 1.cdb | head -3
+echo "four 4" | $cdb -c -m -i 1.cdb 1a.cdb
+$cdb -q 1a.cdb four
+echo "
+$?"
+$cdb -s 1a.cdb | head -1
+$cdb -M --hash xxh64 2.cdb 1.cdb
+$cdb -d 2.cdb
+$cdb -s 2.cdb | head -1
+echo "+4,3:k001->one
++4,3:k002->two
+
+" | $cdb -c --hash halfsiphash --fixkey 4 1.cdb
+$cdb -q 1.cdb k002
+echo "
+$?"
+$cdb -s 1.cdb | head -2
+$cdb --convert 1a.cdb 2.cdb 2>&1
+echo $?
+$cdb -c --hash md5 1.cdb < /dev/null 2>&1 | head -1
+echo Hash table layout
+echo "+3,3:one->uno
++3,3:two->dos
++5,4:three->tres
++3,4:one->eins
+
+" | $cdb -c --tables 16 --load 80 --checksum 1.cdb
+echo $?
+$cdb -V 1.cdb
+echo $?
+$cdb -q -n 2 1.cdb one
+echo "
+$?"
+$cdb -q 1.cdb four
+echo $?
+$cdb -s 1.cdb | head -3
+$cdb -s --json 1.cdb | sed -n 2,3p
+echo "four 4" | $cdb -c -m -i 1.cdb 1a.cdb
+$cdb -q 1a.cdb four
+echo "
+$?"
+$cdb -s 1a.cdb | head -1
+$cdb -M --tables 65536 --stream 2.cdb 1.cdb
+$cdb -d 2.cdb
+$cdb -s 2.cdb | sed -n 1,3p
+$cdb --convert 1a.cdb 2.cdb 2>&1
+echo $?
+$cdb -d 1.cdb | $cdb -c --load 100 2.cdb
+$cdb -s 2.cdb | sed -n 4,5p
+$cdb -c --tables 3 1.cdb < /dev/null 2>&1 | head -1
+$cdb -c --load 0 1.cdb < /dev/null 2>&1 | head -1
+echo Overlays
+echo "+3,3:one->uno
++3,3:two->dos
++5,4:three->tres
+
+" | $cdb -c 1.cdb
+echo "+3,4:two->zwei
+-5:three
++4,4:four->vier
+
+" | $cdb -c --layer --hash xxh64 1a.cdb
+echo $?
+$cdb -d 1a.cdb
+$cdb -s 1a.cdb | sed -n 2,3p
+$cdb -s --json 1a.cdb | sed -n 4p
+printf 'cdb-overlay 2\n1.cdb\n1a.cdb\n' > o.cdb
+for k in one two three four five ; do
+ $cdb -q -m o.cdb $k
+ echo $?
+done
+$cdb --overlay 2.cdb o.cdb
+$cdb -d 2.cdb
+$cdb -s 2.cdb | sed -n 1p
+echo "-3:two
+
+" | $cdb -c --layer --filter 0 --fixkey 4 3.cdb 2>&1
+echo "-3:one
+
+" | $cdb -c --layer --filter 0 3.cdb
+$cdb -s 3.cdb | sed -n 1p
+printf 'cdb-overlay 3\n1.cdb\n1a.cdb\n3.cdb\n' > o.cdb
+$cdb -q o.cdb one
+echo $?
+$cdb --overlay -n 2 --compact 2.cdb o.cdb
+$cdb -d 2.cdb
+$cdb -q -b o.cdb 2>&1 | head -1
+$cdb --overlay -n 4 2.cdb o.cdb 2>&1 | head -1
+$cdb -c --layer -i 1.cdb 2.cdb < /dev/null 2>&1 | head -1
+$cdb -c --filter 33 1.cdb < /dev/null 2>&1 | head -1
+rm -f o.cdb 3.cdb
+echo Server
+echo "+3,4:one->here
++3,3:two->zwo
++1,0:e->
+
+" | $cdb -c 1.cdb
+rm -f s.sock
+$cdb -S s.sock -j 2 1.cdb &
+spid=$!
+printf '\315\003\000\000\000one\315\004\000\000\000none\315\001\000\000\000e' |
+ $bench -S s.sock -r | od -An -c
+printf 'get one two none\r\ngets one\r\nget\r\ngets  \r\nversion\r\nbogus\r\n' |
+ $bench -S s.sock -r | sed -n l
+printf 'get e\nget one\r\n\315\003\000\000\000two' | $bench -S s.sock -r | sed -n l
+echo "+3,5:one->there
+
+" | $cdb -c 1.cdb
+sleep 2   # the server checks for a new file once a second
+printf 'gets one two\r\n' | $bench -S s.sock -r | sed -n l
+printf 'quit\r\nget one\r\n' | $bench -S s.sock -r
+echo $?
+kill $spid
+wait $spid 2>/dev/null
+rm -f s.sock
 echo Handling file size limits
 (
  ulimit -f 4
@@ -118,7 +571,7 @@ echo Handling file size limits
   echo
  ) | $cdb -c 1.cdb
  echo $?
-)
+) 2>&1 | cat   # the limit should not apply to our own output
 
 if false ; then # does not work for now, bugs in libc
 echo Handling oom condition
@@ -139,5 +592,5 @@ echo Handling oom condition
 echo $?
 fi
 
-rm -rf 1.cdb 1a.cdb 1.cdb.tmp
+rm -rf 1.cdb 1a.cdb 2.cdb 1.cdb.tmp 1a.cdb.tmp 2.cdb.tmp s.cdb s.cdb.[012] nss.d
 exit 0
@@ -5,7 +5,7 @@
 
 Summary: A package for maintenance of constant databases
 Name: tinycdb
-Version: 0.78
+Version: 0.79
 Release: 1
 Source: ftp://ftp.corpit.ru/pub/tinycdb/tinycdb_%version.tar.gz
 License: Public Domain